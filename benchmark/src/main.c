@@ -612,6 +612,46 @@ static void print_pure_call_table(const patch_scheme_t *schemes,
     console_puts("[note] delta = avg_patch - avg_base. overhead% = delta / avg_base.\r\n");
 }
 
+static uint32_t measure_rapid_site_window(bool guarded) {
+    volatile int sink = 0;
+
+    if (!cycle_counter_reset()) {
+        return 0xFFFFFFFFu;
+    }
+
+    for (uint32_t i = 0; i < BENCHMARK_PATCHED_CALLS; ++i) {
+        if (guarded) {
+            sink = rapid_fixed_patch_point_guard(g_demo_uxQueueLength, g_demo_uxItemSize, 0u, 0u);
+        } else {
+            sink = rapid_fixed_patch_point_invoke(g_demo_uxQueueLength, g_demo_uxItemSize, 0u, 0u);
+        }
+    }
+    (void)sink;
+
+    return cycle_counter_read();
+}
+
+static void print_site_guard_table(void) {
+    uint32_t call_cycles = 0xFFFFFFFFu;
+    uint32_t guard_cycles = 0xFFFFFFFFu;
+    char call_buf[16];
+    char guard_buf[16];
+    char delta_buf[16];
+
+    prepare_scheme_baseline(PATCH_SCHEME_RAPID);
+    call_cycles = measure_rapid_site_window(false);
+    guard_cycles = measure_rapid_site_window(true);
+
+    format_avg_window_cycles(call_buf, sizeof(call_buf), call_cycles, BENCHMARK_PATCHED_CALLS);
+    format_avg_window_cycles(guard_buf, sizeof(guard_buf), guard_cycles, BENCHMARK_PATCHED_CALLS);
+    format_avg_delta_cycles(delta_buf, sizeof(delta_buf), call_cycles, guard_cycles, BENCHMARK_PATCHED_CALLS);
+
+    console_puts("\r\n=== Table 1D: Unpatched Site Overhead (rapid) ===\r\n");
+    console_puts("site          avg_call     avg_guard    delta\r\n");
+    SEGGER_RTT_printf(0, "%-13s %-12s %-12s %-12s\r\n", "fixed_point", call_buf, guard_buf, delta_buf);
+    console_puts("[note] avg_call always calls the handler (before). avg_guard checks the per-site enable byte inline (after).\r\n");
+}
+
 static void print_deployment_table(const patch_scheme_t *schemes, size_t count) {
     console_puts("\r\n=== Table 2: Deployment Cost ===\r\n");
     console_puts("scheme     offline_compile  online_hot_toggle  pristine_flash\r\n");
@@ -640,6 +680,9 @@ static void print_single_scheme_benchmark(patch_scheme_t scheme, const patch_txn
     print_first_hit_table(&scheme, result, 1u);
     print_steady_state_table(&scheme, result, 1u);
     print_pure_call_table(&scheme, result, 1u);
+    if (scheme == PATCH_SCHEME_RAPID) {
+        print_site_guard_table();
+    }
     print_deployment_table(&scheme, 1u);
 }
 
@@ -660,6 +703,7 @@ static void run_compare(void) {
     print_first_hit_table(g_compare_order, results, sizeof(results) / sizeof(results[0]));
     print_steady_state_table(g_compare_order, results, sizeof(results) / sizeof(results[0]));
     print_pure_call_table(g_compare_order, results, sizeof(results) / sizeof(results[0]));
+    print_site_guard_table();
     print_deployment_table(g_compare_order, sizeof(results) / sizeof(results[0]));
 }
 
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "rapidpatch_vm.h"
+
 typedef enum {
     PATCH_SCHEME_LEGACY = 0,
     PATCH_SCHEME_RAPID = 1,
@@ -28,6 +30,19 @@ void print_all_patch_status(void);
 uintptr_t patch_slot_addr(void);
 uint16_t read_patch_halfword(void);
 int rapid_fixed_patch_point_invoke(uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3);
+
+/*
+ * Per-site enable byte of rapid_vuln_target. The site checks it inline and only
+ * calls rapid_fixed_patch_point_invoke() when a patch is installed.
+ */
+extern volatile uint8_t rapid_site_enable;
+
+static inline int rapid_fixed_patch_point_guard(uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3) {
+    if (__builtin_expect(rapid_site_enable == 0u, 1)) {
+        return (int)RAPIDPATCH_FIXED_OP_PASS;
+    }
+    return rapid_fixed_patch_point_invoke(r0, r1, r2, r3);
+}
 uint32_t rapid_patch_install_addr(void);
 uint16_t rapid_patch_code_size(void);
 const uint8_t *rapid_patch_code_bytes(void);
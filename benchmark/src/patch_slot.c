@@ -21,6 +21,7 @@ typedef struct {
 } rapidpatch_context_t;
 
 static rapidpatch_context_t g_rapid_ctx = {0};
+volatile uint8_t rapid_site_enable = 0u;
 
 const char *patch_scheme_name(patch_scheme_t scheme) {
     if (scheme == PATCH_SCHEME_RAPID) {
@@ -185,10 +186,14 @@ static bool rapid_patch_install(void) {
     g_rapid_ctx.install_addr = rapid_patch_install_addr();
     g_rapid_ctx.code_len = code_len;
     g_rapid_ctx.active = true;
+    __DSB();
+    rapid_site_enable = 1u;
     return true;
 }
 
 static void rapid_patch_unapply(void) {
+    rapid_site_enable = 0u;
+    __DSB();
     memset(&g_rapid_ctx, 0, sizeof(g_rapid_ctx));
 }
 
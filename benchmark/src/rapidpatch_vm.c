@@ -2,6 +2,9 @@
 
 #include <limits.h>
 
+/* Backward jumps a filter may take; straight-line code is not metered. */
+#define RAPIDPATCH_MAX_BACK_EDGES 0x8000u
+
 typedef struct {
     uint8_t opcode;
     uint8_t regs;
@@ -64,6 +67,7 @@ uint64_t rapidpatch_vm_exec(const rapidpatch_vm_t *vm, void *ctx, size_t ctx_len
     const rapidpatch_inst_t *insts;
     size_t inst_count;
     size_t pc = 0u;
+    uint32_t fuel = RAPIDPATCH_MAX_BACK_EDGES;
 
     if (vm == NULL || vm->code == NULL || vm->code_len == 0u || ctx == NULL) {
         return UINT64_MAX;
@@ -101,6 +105,9 @@ uint64_t rapidpatch_vm_exec(const rapidpatch_vm_t *vm, void *ctx, size_t ctx_len
 
         case RAPIDPATCH_OP_JEQ_IMM:
             if (regs[dst] == (uint64_t)(uint32_t)inst->imm) {
+                if (inst->offset < 0 && --fuel == 0u) {
+                    return UINT64_MAX;
+                }
                 pc = (size_t)((int32_t)pc + (int32_t)inst->offset);
             }
             break;
@@ -44,7 +44,7 @@ int fun1(void) {
 
 int rapid_vuln_target(UBaseType_t uxQueueLength, UBaseType_t uxItemSize) {
     bool verbose = app_exec_mode_is_verbose();
-    int ret_code = rapid_fixed_patch_point_invoke(
+    int ret_code = rapid_fixed_patch_point_guard(
         (uint32_t)uxQueueLength,
         (uint32_t)uxItemSize,
         0u,
@@ -1,5 +1,6 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
 
 // customer memory manager
 void* ebpf_malloc(size_t n);
@@ -9,4 +10,44 @@ void ebpf_free(void* rmem);
 
 int get_ebpf_alloc_size();
 
-// heap memory manager
\ No newline at end of file
+/*
+Size class pools, backed by static arenas. Requests larger than the biggest
+class, or made when a class is exhausted, fall back to the os heap.
+Sized for patch descriptors, auto_patch, VM structs and arraymap storage.
+*/
+#define EBPF_POOL_CLASS_NUM 6
+// number of blocks of 16, 32, 64, 128, 256, 512 bytes
+#ifndef EBPF_POOL_N16
+#define EBPF_POOL_N16 32 // auto_patch, small arraymap storage
+#endif
+#ifndef EBPF_POOL_N32
+#define EBPF_POOL_N32 32 // patch_desc, arraymap
+#endif
+#ifndef EBPF_POOL_N64
+#define EBPF_POOL_N64 16 // ebpf_vm, helper env
+#endif
+#ifndef EBPF_POOL_N128
+#define EBPF_POOL_N128 8
+#endif
+#ifndef EBPF_POOL_N256
+#define EBPF_POOL_N256 4
+#endif
+#ifndef EBPF_POOL_N512
+#define EBPF_POOL_N512 2
+#endif
+
+typedef struct ebpf_pool_stat {
+	uint16_t block_size;
+	uint16_t blocks;
+	uint16_t in_use;
+	uint16_t high_water;
+	uint32_t req_bytes; // requested bytes of the blocks in use
+	uint32_t allocs;
+	uint32_t fallbacks; // class was full, served by the os heap
+} ebpf_pool_stat;
+
+void ebpf_pool_get_stat(int cls, ebpf_pool_stat *stat);
+int ebpf_pool_os_bytes(); // total bytes ever served by the os heap
+void ebpf_pool_dump(void);
+
+// heap memory manager
@@ -29,7 +29,9 @@ inline uint64_t set_return(uint64_t op, uint64_t ret_code) {
 // ebpf helpers (must use static)
 //static void (*print_log)(char *str) = (void *) 1;
 //static void (*c_call)(uint32_t addr, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3) = (void *) 2;
-//static void (*map_save_val) (void *mp, uint64_t key, uint64_t val) = (void *) 3;
-//static uint64_t (*map_get_val) (void *mp, uint64_t key) = (void *) 4;
+//static void (*map_save_val) (uint32_t map_id, uint32_t key, uint32_t val) = (void *) 3;
+//static uint32_t (*map_get_val) (uint32_t map_id, uint32_t key) = (void *) 4;
+//static uint32_t (*map_inc) (uint32_t map_id, uint32_t key) = (void *) 5;
+//static void *(*map_lookup) (uint32_t map_id, uint32_t key) = (void *) 6;
 
 // 
@@ -2,11 +2,10 @@
 #define EBPF_HELPER_IMPL_H_
 #include "utils.h"
 #include "hashmap.h"
+#include "ebpf_map.h"
+#include "ebpf_vm.h"
 
-struct ebpf_vm;
-
-typedef uint32_t (*c_func)(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3);
-extern int ebpf_register(struct ebpf_vm *vm, unsigned int idx, const char *name, void *fn);
+typedef uint32_t (*c_func)(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3);
 
 void set_default_helpers(struct ebpf_vm *vm);
 
@@ -17,9 +16,9 @@ static void iot_print_log(char *str) {
 
 //
 // push {arg4, arg5, arg6}
-static void iot_call_C_func_noret(uint64_t func_addr, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3) {
+static void iot_call_C_func_noret(uint32_t func_addr, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
 	// typedef 
-	c_func func = (c_func) (u32) func_addr;
+	c_func func = (c_func) func_addr;
 	func(arg0, arg1, arg2, arg3);
 	// fp 
 	// DEBUG_LOG("%d %d %d %d\n", (u32) arg0, (u32) arg1, (u32) arg2, (u32) arg3);
@@ -30,28 +29,41 @@ static void iot_call_C_func2_noret(void *arg1, void *arg2) {
 
 }
 
-// static 
-static arraymap *amap;
-static void tmp_map_save_val(void *mp, uint64_t key, uint64_t val) {
-	if (mp == NULL) {
-		if (amap == NULL) {
-			amap = arraymap_new(5);
-		}
-		mp = amap;
+// maps are preallocated at patch load time, the first argument is the map id
+static void iot_map_set(uint32_t id, uint32_t key, uint32_t val) {
+	ebpf_map *map = ebpf_map_get(id);
+	uint32_t *slot = map != NULL ? ebpf_map_lookup_or_insert(map, key) : NULL;
+	if (slot != NULL) {
+		*slot = val;
 	}
-	arraymap_set(mp, key, val);
 }
 
-static uint64_t tmp_map_get_val(void *mp, uint64_t key) {
-	return arraymap_get(mp, key);
+static uint32_t iot_map_get(uint32_t id, uint32_t key) {
+	ebpf_map *map = ebpf_map_get(id);
+	uint32_t *slot = map != NULL ? ebpf_map_lookup(map, key) : NULL;
+	return slot != NULL ? *slot : 0;
+}
+
+static uint32_t iot_map_inc(uint32_t id, uint32_t key) {
+	ebpf_map *map = ebpf_map_get(id);
+	return map != NULL ? ebpf_map_inc(map, key) : 0;
+}
+
+// address of the value, for values wider than 4 bytes
+static uint32_t iot_map_lookup(uint32_t id, uint32_t key) {
+	ebpf_map *map = ebpf_map_get(id);
+	return map != NULL ? (uint32_t) ebpf_map_lookup(map, key) : 0;
 }
 
 void set_default_helpers(struct ebpf_vm *vm) {
-	ebpf_register(vm, 1, "print_log", iot_print_log);
-	ebpf_register(vm, 2, "call_c_func", iot_call_C_func_noret);
+	// all default helpers take 32 bit arguments
+	ebpf_register_typed(vm, 1, "print_log", iot_print_log, (ebpf_helper_desc) {1, 0, false});
+	ebpf_register_typed(vm, 2, "call_c_func", iot_call_C_func_noret, (ebpf_helper_desc) {5, 0, false});
 	// DEBUG_LOG("func 2: 0x%08x\n", iot_call_C_func_noret);
-	ebpf_register(vm, 3, "map_set", tmp_map_save_val);
-	ebpf_register(vm, 4, "map_get", tmp_map_get_val);
+	ebpf_register_typed(vm, 3, "map_set", iot_map_set, (ebpf_helper_desc) {3, 0, false});
+	ebpf_register_typed(vm, 4, "map_get", iot_map_get, (ebpf_helper_desc) {2, 0, false});
+	ebpf_register_typed(vm, 5, "map_inc", iot_map_inc, (ebpf_helper_desc) {2, 0, false});
+	ebpf_register_typed(vm, 6, "map_lookup", iot_map_lookup, (ebpf_helper_desc) {2, 0, false});
 }
 // #else
 //void set_default_helpers(struct ebpf_vm *vm) {
@@ -0,0 +1,66 @@
+#ifndef EBPF_MAP_H_
+#define EBPF_MAP_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+Preallocated maps for stateful patches.
+
+Maps are declared in the patch packet (map_num definitions at the offset
+patch_desc->maps) and created with all their memory when the patch is loaded,
+lookup and update never allocate.
+Patches refer to a map by its id, patches declaring the same id and definition
+share the map, it is freed when the last of them is removed. Map 0 is the
+default map used by the legacy map_set/map_get.
+*/
+
+#define EBPF_MAX_MAPS 8
+#define EBPF_DEFAULT_MAP 0
+#define EBPF_DEFAULT_MAP_SIZE 16
+
+typedef enum ebpf_map_type {
+	EBPF_MAP_ARRAY = 1, // key is the index, [0, max_entries)
+	EBPF_MAP_HASH, // any u32 key, open addressing with linear probing
+	EBPF_MAP_SITE_COUNTER, // u32 counter per patch site id
+} ebpf_map_type;
+
+typedef struct ebpf_map_def {
+	uint8_t id; // [0, EBPF_MAX_MAPS)
+	uint8_t type;
+	uint16_t value_size; // bytes, rounded up to 4 (always 4 for counters)
+	uint16_t max_entries; // 0 means MAX_FIXED_SITES for counters
+} ebpf_map_def;
+
+typedef struct ebpf_map {
+	ebpf_map_def def;
+	uint16_t cur_size; // used entries of a hash map
+	uint8_t bits; // log2 of hash table size
+	uint8_t refcnt; // patches using the map
+	uint32_t *keys; // hash only
+	uint8_t *used; // hash only
+	uint8_t *vals;
+} ebpf_map;
+
+// create the maps of a patch at load time, 0 on success
+int ebpf_maps_setup(const ebpf_map_def *defs, int num);
+// drop the references of a removed patch, after no reader runs it; a map is freed with its last one
+void ebpf_maps_release(const ebpf_map_def *defs, int num);
+void ebpf_maps_init(void);
+void ebpf_maps_destroy(void);
+
+// pointer to the value or NULL
+void *ebpf_map_lookup(ebpf_map *map, uint32_t key);
+// pointer to the value, a missing hash entry is inserted zeroed, NULL if full
+void *ebpf_map_lookup_or_insert(ebpf_map *map, uint32_t key);
+int ebpf_map_update(ebpf_map *map, uint32_t key, const void *val);
+int ebpf_map_delete(ebpf_map *map, uint32_t key);
+// add one to a counter and return the new value
+uint32_t ebpf_map_inc(ebpf_map *map, uint32_t key);
+
+extern ebpf_map *ebpf_map_table[EBPF_MAX_MAPS];
+
+static inline ebpf_map *ebpf_map_get(uint32_t id) {
+	return id < EBPF_MAX_MAPS ? ebpf_map_table[id] : NULL;
+}
+
+#endif
@@ -40,6 +40,22 @@ endian
 // #define my_os_free free
 //#endif // NRF52_NO_OS
 
+#if defined(LINUX_TEST)
+// host tools (tools/jit_cross), single threaded
+#include <stdlib.h>
+#define my_os_malloc malloc
+#define my_os_calloc calloc
+#define my_os_free free
+
+static inline unsigned int irq_lock(void) {
+	return 0;
+}
+
+static inline void irq_unlock(unsigned int key) {
+	(void) key;
+}
+
+#else
 //#if defined(ZEPHYR_OS)
 // #include <zephyr.h>
 #include <zephyr/zephyr.h>
@@ -66,6 +82,7 @@ static void* k_realloc(void *rmem, size_t newsize) {
 // #define my_os_realloc k_realloc
 #define my_os_free k_free
 
+#endif // end LINUX_TEST
 //#endif // end ZEPHYR_OS
 
 // #ifdef STM32L475_NO_OS
@@ -0,0 +1,620 @@
+#include "ebpf_verifier.h"
+#include "ebpf_allocator.h"
+#include "ebpf_helper_impl.h"
+#include "ebpf_map.h"
+#include <string.h>
+
+/*
+Abstract interpretation over the registers. The state is kept at the jump targets
+only, the code is walked in order and every jump joins its state into the state
+of the target, until a whole pass changes nothing. A target joined more than
+VERIFY_WIDEN times gets its growing bounds widened to the limits, so loops
+converge. The narrowing passes then rebuild the target states from the edges
+alone, which gives back the bound a loop counter gets from its exit test.
+
+Ranges are over the signed 64 bit value. An operation that could overflow gives
+an unknown scalar, pointers keep their type with an unbounded offset.
+*/
+
+#define VERIFY_REGS 11
+#define VERIFY_WIDEN 16
+#define VERIFY_MAX_PASSES 255
+#define VERIFY_NARROW_PASSES 2
+#define NO_TARGET 0xffff
+
+#define RANGE_MIN INT64_MIN
+#define RANGE_MAX INT64_MAX
+#define RANGE_U32 0xffffffffLL
+
+enum reg_type {
+	REG_SCALAR,
+	REG_PTR_CTX,
+	REG_PTR_STACK, // offset from the frame pointer
+	REG_PTR_MAP_VALUE,
+	REG_PTR_MAP_VALUE_OR_NULL, // map_lookup result before the NULL check
+};
+
+typedef struct reg_range {
+	u8 type;
+	u16 size; // bytes of a map value
+	s64 min; // value of a scalar, offset of a pointer
+	s64 max;
+} reg_range;
+
+typedef struct verifier_state {
+	const struct ebpf_vm *vm;
+	u16 ctx_size;
+	u16 *slot; // state index of each jump target, NO_TARGET otherwise
+	reg_range (*in)[VERIFY_REGS];
+	u8 *joins; // 0 until a jump reaches the target
+	bool changed;
+	bool narrowing; // the edges are joined into out, in stays as it is
+	reg_range (*out)[VERIFY_REGS];
+	u8 *reached;
+} verifier_state;
+
+static void set_scalar(reg_range *r, s64 min, s64 max) {
+	r->type = REG_SCALAR;
+	r->size = 0;
+	r->min = min;
+	r->max = max;
+}
+
+static void set_unknown(reg_range *r) {
+	set_scalar(r, RANGE_MIN, RANGE_MAX);
+}
+
+static bool is_unknown(const reg_range *r) {
+	return r->type == REG_SCALAR && r->min == RANGE_MIN && r->max == RANGE_MAX;
+}
+
+static bool is_ptr(const reg_range *r) {
+	return r->type == REG_PTR_CTX || r->type == REG_PTR_STACK || r->type == REG_PTR_MAP_VALUE;
+}
+
+// intersect with [min, max], false if nothing is left
+static bool narrow(reg_range *r, s64 min, s64 max) {
+	if (min > r->min) {
+		r->min = min;
+	}
+	if (max < r->max) {
+		r->max = max;
+	}
+	return r->min <= r->max;
+}
+
+// a 32 bit operation, the result is zero extended
+static void trunc32(reg_range *r) {
+	if (r->type != REG_SCALAR || r->min < 0 || r->max > RANGE_U32) {
+		set_scalar(r, 0, RANGE_U32);
+	}
+}
+
+static void range_add(reg_range *dst, s64 min, s64 max) {
+	if (__builtin_add_overflow(dst->min, min, &dst->min) || __builtin_add_overflow(dst->max, max, &dst->max)) {
+		dst->min = RANGE_MIN;
+		dst->max = RANGE_MAX;
+	}
+}
+
+static void range_sub(reg_range *dst, s64 min, s64 max) {
+	if (__builtin_sub_overflow(dst->min, max, &dst->min) || __builtin_sub_overflow(dst->max, min, &dst->max)) {
+		dst->min = RANGE_MIN;
+		dst->max = RANGE_MAX;
+	}
+}
+
+static void alu_add(reg_range *dst, const reg_range *val) {
+	if (dst->type == REG_SCALAR && is_ptr(val)) {
+		reg_range sum = *val;
+		range_add(&sum, dst->min, dst->max);
+		*dst = sum;
+	} else if ((dst->type == REG_SCALAR || is_ptr(dst)) && val->type == REG_SCALAR) {
+		range_add(dst, val->min, val->max);
+	} else {
+		set_unknown(dst);
+	}
+}
+
+static void alu_sub(reg_range *dst, const reg_range *val) {
+	if ((dst->type == REG_SCALAR || is_ptr(dst)) && val->type == REG_SCALAR) {
+		range_sub(dst, val->min, val->max);
+	} else {
+		set_unknown(dst);
+	}
+}
+
+static void alu(reg_range *regs, const struct ebpf_inst *inst) {
+	reg_range *dst = &regs[inst->dst];
+	reg_range val = regs[inst->src];
+	bool is64 = (inst->opcode & EBPF_CLS_MASK) == EBPF_CLS_ALU64;
+	bool use_imm = BPF_SRC(inst->opcode) == EBPF_SRC_IMM;
+	s64 k = inst->imm;
+	s64 res;
+	if (use_imm) {
+		set_scalar(&val, k, k);
+	}
+	if (!is64 && use_imm) { // 32 bit operations use (u32)IMM
+		k = (u32) inst->imm;
+	}
+	bool scalar = dst->type == REG_SCALAR;
+	switch (BPF_OP(inst->opcode)) {
+	case EBPF_ALU_ADD:
+		alu_add(dst, &val);
+		break;
+	case EBPF_ALU_SUB:
+		alu_sub(dst, &val);
+		break;
+	case 0xb0: // mov
+		if (!is64 && use_imm) {
+			set_scalar(dst, k, k);
+		} else {
+			*dst = val;
+		}
+		break;
+	case EBPF_ALU_MUL:
+		if (scalar && use_imm && k >= 0 && !__builtin_mul_overflow(dst->min, k, &res)) {
+			dst->min = res;
+			if (__builtin_mul_overflow(dst->max, k, &dst->max)) {
+				set_unknown(dst);
+			}
+		} else {
+			set_unknown(dst);
+		}
+		break;
+	case EBPF_ALU_DIV:
+		if (scalar && use_imm && k > 0 && dst->min >= 0 && (is64 || dst->max <= RANGE_U32)) {
+			set_scalar(dst, dst->min / k, dst->max / k);
+		} else if (!is64 && use_imm && k > 0) {
+			set_scalar(dst, 0, RANGE_U32 / k);
+		} else {
+			set_unknown(dst);
+		}
+		break;
+	case 0x90: // mod
+		if (use_imm && k > 0) {
+			set_scalar(dst, 0, k - 1);
+		} else {
+			set_unknown(dst);
+		}
+		break;
+	case EBPF_ALU_AND:
+		if (val.type == REG_SCALAR && val.min >= 0) {
+			s64 max = val.max;
+			if (scalar && dst->min >= 0 && dst->max < max) {
+				max = dst->max;
+			}
+			set_scalar(dst, 0, max);
+		} else if (scalar && dst->min >= 0) {
+			set_scalar(dst, 0, dst->max);
+		} else {
+			set_unknown(dst);
+		}
+		break;
+	case EBPF_ALU_RSH:
+		if (!use_imm || k <= 0 || k >= (is64 ? 64 : 32)) {
+			set_unknown(dst);
+		} else if (scalar && dst->min >= 0 && (is64 || dst->max <= RANGE_U32)) {
+			set_scalar(dst, dst->min >> k, dst->max >> k);
+		} else {
+			set_scalar(dst, 0, (is64 ? (s64) (~0ULL >> k) : RANGE_U32 >> k));
+		}
+		break;
+	case EBPF_ALU_LSH:
+		if (scalar && use_imm && k >= 0 && k < 63 && dst->min >= 0 && dst->max <= (RANGE_MAX >> k)) {
+			set_scalar(dst, dst->min << k, dst->max << k);
+		} else {
+			set_unknown(dst);
+		}
+		break;
+	case 0xc0: // arsh
+		if (is64 && scalar && use_imm && k >= 0 && k < 64) {
+			set_scalar(dst, dst->min >> k, dst->max >> k);
+		} else {
+			set_unknown(dst);
+		}
+		break;
+	case EBPF_ALU_NEG:
+		if (scalar && dst->min != RANGE_MIN) {
+			set_scalar(dst, -dst->max, -dst->min);
+		} else {
+			set_unknown(dst);
+		}
+		break;
+	case 0xd0: // le, be: the width is the immediate, not the class
+		set_unknown(dst);
+		return;
+	default:
+		set_unknown(dst);
+		break;
+	}
+	if (!is64) {
+		trunc32(dst);
+	}
+}
+
+static void load_result(reg_range *dst, u8 opcode) {
+	switch (BPF_SIZE(opcode)) {
+	case EBPF_SIZE_B:
+		set_scalar(dst, 0, 0xff);
+		break;
+	case EBPF_SIZE_H:
+		set_scalar(dst, 0, 0xffff);
+		break;
+	case EBPF_SIZE_W:
+		set_scalar(dst, 0, RANGE_U32);
+		break;
+	default:
+		set_unknown(dst);
+		break;
+	}
+}
+
+static bool is_map_lookup(const struct ebpf_vm *vm, s32 idx) {
+	return idx >= 0 && idx < MAX_EXT_FUNCS && vm->helper_func != NULL
+		&& vm->helper_func->ext_funcs[idx] == (ext_func) iot_map_lookup;
+}
+
+// helpers clobber r1-r5, map_lookup on a constant map id returns a value pointer or NULL
+static void call(const verifier_state *v, reg_range *regs, const struct ebpf_inst *inst) {
+	const reg_range *id = &regs[1];
+	reg_range ret;
+	set_unknown(&ret);
+	if (is_map_lookup(v->vm, inst->imm) && id->type == REG_SCALAR && id->min == id->max
+		&& id->min >= 0 && id->min < EBPF_MAX_MAPS) {
+		ebpf_map *map = ebpf_map_get((u32) id->min);
+		if (map != NULL) {
+			ret.type = REG_PTR_MAP_VALUE_OR_NULL;
+			ret.size = map->def.value_size;
+			ret.min = ret.max = 0;
+		}
+	}
+	for (int i = 1; i <= 5; i++) {
+		set_unknown(&regs[i]);
+	}
+	regs[0] = ret;
+}
+
+// unsigned x >= c, c in [0, 2^32]
+static bool narrow_uge(reg_range *r, s64 c) {
+	if (r->min >= 0) {
+		return narrow(r, c, RANGE_MAX);
+	}
+	return true; // negative values are large unsigned ones, not a range
+}
+
+// unsigned x <= c
+static bool narrow_ule(reg_range *r, s64 c) {
+	return narrow(r, 0, c);
+}
+
+/*
+Refine the compared register on both edges of a conditional jump, only compares
+with an immediate are followed. The edge flags are cleared for an edge that
+cannot be taken.
+*/
+static void branch(const struct ebpf_inst *inst, reg_range *taken, reg_range *fall, bool *t, bool *f) {
+	reg_range *rt = &taken[inst->dst];
+	reg_range *rf = &fall[inst->dst];
+	s64 s = inst->imm; // signed compares
+	s64 c = (u32) inst->imm; // unsigned compares
+	*t = *f = true;
+	if (BPF_SRC(inst->opcode) != EBPF_SRC_IMM) {
+		return;
+	}
+	if (rt->type == REG_PTR_MAP_VALUE_OR_NULL && s == 0) {
+		if (inst->opcode == EBPF_OP_JEQ_IMM) {
+			set_scalar(rt, 0, 0);
+			rf->type = REG_PTR_MAP_VALUE;
+		} else if (inst->opcode == EBPF_OP_JNE_IMM) {
+			rt->type = REG_PTR_MAP_VALUE;
+			set_scalar(rf, 0, 0);
+		}
+		return;
+	}
+	if (rt->type != REG_SCALAR) {
+		return;
+	}
+	switch (inst->opcode) {
+	case EBPF_OP_JEQ_IMM:
+		*t = narrow(rt, s, s);
+		break;
+	case EBPF_OP_JNE_IMM:
+		*f = narrow(rf, s, s);
+		break;
+	case EBPF_OP_JGT_IMM:
+		*t = narrow_uge(rt, c + 1);
+		*f = narrow_ule(rf, c);
+		break;
+	case EBPF_OP_JGE_IMM:
+		*t = narrow_uge(rt, c);
+		*f = c > 0 && narrow_ule(rf, c - 1);
+		break;
+	case EBPF_OP_JLT_IMM:
+		*t = c > 0 && narrow_ule(rt, c - 1);
+		*f = narrow_uge(rf, c);
+		break;
+	case EBPF_OP_JLE_IMM:
+		*t = narrow_ule(rt, c);
+		*f = narrow_uge(rf, c + 1);
+		break;
+	case EBPF_OP_JSGT_IMM:
+		*t = narrow(rt, s + 1, RANGE_MAX);
+		*f = narrow(rf, RANGE_MIN, s);
+		break;
+	case EBPF_OP_JSGE_IMM:
+		*t = narrow(rt, s, RANGE_MAX);
+		*f = narrow(rf, RANGE_MIN, s - 1);
+		break;
+	case EBPF_OP_JSLT_IMM:
+		*t = narrow(rt, RANGE_MIN, s - 1);
+		*f = narrow(rf, s, RANGE_MAX);
+		break;
+	case EBPF_OP_JSLE_IMM:
+		*t = narrow(rt, RANGE_MIN, s);
+		*f = narrow(rf, s + 1, RANGE_MAX);
+		break;
+	}
+}
+
+static bool reg_join(reg_range *dst, const reg_range *src) {
+	if (dst->type == src->type && dst->size == src->size) {
+		bool grew = src->min < dst->min || src->max > dst->max;
+		if (src->min < dst->min) {
+			dst->min = src->min;
+		}
+		if (src->max > dst->max) {
+			dst->max = src->max;
+		}
+		return grew;
+	}
+	if (dst->size == src->size && (dst->type == REG_PTR_MAP_VALUE || dst->type == REG_PTR_MAP_VALUE_OR_NULL)
+		&& (src->type == REG_PTR_MAP_VALUE || src->type == REG_PTR_MAP_VALUE_OR_NULL)) {
+		bool grew = dst->type != REG_PTR_MAP_VALUE_OR_NULL;
+		dst->type = REG_PTR_MAP_VALUE_OR_NULL;
+		return reg_join(dst, &(reg_range) {REG_PTR_MAP_VALUE_OR_NULL, src->size, src->min, src->max}) || grew;
+	}
+	if (is_unknown(dst)) {
+		return false;
+	}
+	set_unknown(dst);
+	return true;
+}
+
+static void state_join(verifier_state *v, int pc, const reg_range *regs) {
+	u16 slot = v->slot[pc];
+	reg_range *in = v->in[slot];
+	if (v->narrowing) {
+		if (!v->reached[slot]) {
+			memcpy(v->out[slot], regs, sizeof(reg_range) * VERIFY_REGS);
+			v->reached[slot] = true;
+		} else {
+			for (int i = 0; i < VERIFY_REGS; i++) {
+				reg_join(&v->out[slot][i], &regs[i]);
+			}
+		}
+		return;
+	}
+	if (v->joins[slot] == 0) {
+		memcpy(in, regs, sizeof(reg_range) * VERIFY_REGS);
+		v->joins[slot] = 1;
+		v->changed = true;
+		return;
+	}
+	bool widen = v->joins[slot] > VERIFY_WIDEN;
+	bool grew = false;
+	for (int i = 0; i < VERIFY_REGS; i++) {
+		reg_range old = in[i];
+		if (!reg_join(&in[i], &regs[i])) {
+			continue;
+		}
+		grew = true;
+		if (widen && in[i].type == old.type) {
+			if (in[i].min < old.min) {
+				in[i].min = RANGE_MIN;
+			}
+			if (in[i].max > old.max) {
+				in[i].max = RANGE_MAX;
+			}
+		}
+	}
+	if (grew) {
+		v->changed = true;
+		if (v->joins[slot] < 0xff) {
+			v->joins[slot]++;
+		}
+	}
+}
+
+static bool access_in_bounds(const verifier_state *v, const reg_range *base, s16 off, int size) {
+	s64 lo, hi;
+	switch (base->type) {
+	case REG_PTR_CTX:
+		lo = 0;
+		hi = v->ctx_size;
+		break;
+	case REG_PTR_STACK:
+		lo = -STACK_SIZE;
+		hi = 0;
+		break;
+	case REG_PTR_MAP_VALUE:
+		lo = 0;
+		hi = base->size;
+		break;
+	default:
+		return false;
+	}
+	return base->min >= lo - off && base->max <= hi - off - size;
+}
+
+static bool is_mem_access(u8 opcode) {
+	u8 cls = opcode & EBPF_CLS_MASK;
+	return cls == EBPF_CLS_LDX || cls == EBPF_CLS_ST || cls == EBPF_CLS_STX;
+}
+
+// one pass over the code, mem_safe is filled in on the last pass
+static void walk(verifier_state *v, u8 *mem_safe) {
+	const struct ebpf_vm *vm = v->vm;
+	reg_range regs[VERIFY_REGS];
+	reg_range taken[VERIFY_REGS];
+	bool live = true;
+	for (int i = 0; i < VERIFY_REGS; i++) {
+		set_unknown(&regs[i]);
+	}
+	regs[1] = (reg_range) {REG_PTR_CTX, 0, 0, 0};
+	regs[10] = (reg_range) {REG_PTR_STACK, 0, 0, 0};
+
+	for (int pc = 0; pc < vm->num_insts; pc++) {
+		const struct ebpf_inst *inst = &vm->insts[pc];
+		if (v->slot[pc] != NO_TARGET) {
+			if (live) {
+				state_join(v, pc, regs);
+			}
+			live = v->joins[v->slot[pc]] != 0;
+			if (live) {
+				memcpy(regs, v->in[v->slot[pc]], sizeof(regs));
+			}
+		}
+		if (!live) {
+			if (inst->opcode == EBPF_OP_LDDW) {
+				pc++;
+			}
+			continue;
+		}
+		u8 cls = inst->opcode & EBPF_CLS_MASK;
+		if (is_mem_access(inst->opcode)) {
+			const reg_range *base = &regs[cls == EBPF_CLS_LDX ? inst->src : inst->dst];
+			if (mem_safe != NULL && access_in_bounds(v, base, inst->offset, ebpf_access_size(inst->opcode))) {
+				mem_safe[pc >> 3] |= 1 << (pc & 7);
+			}
+			if (cls == EBPF_CLS_LDX) {
+				load_result(&regs[inst->dst], inst->opcode);
+			}
+			continue;
+		}
+		switch (cls) {
+		case EBPF_CLS_LD:
+			if (inst->opcode == EBPF_OP_LDDW) {
+				s64 val = (s64) ((u64) (u32) inst->imm | ((u64) (u32) inst[1].imm << 32));
+				set_scalar(&regs[inst->dst], val, val);
+				pc++;
+			}
+			break;
+		case EBPF_CLS_ALU:
+		case EBPF_CLS_ALU64:
+			alu(regs, inst);
+			break;
+		case EBPF_CLS_JMP:
+			if (inst->opcode == EBPF_OP_CALL) {
+				call(v, regs, inst);
+			} else if (inst->opcode == EBPF_OP_EXIT) {
+				live = false;
+			} else if (inst->opcode == EBPF_OP_JA) {
+				state_join(v, pc + 1 + inst->offset, regs);
+				live = false;
+			} else {
+				bool t, f;
+				memcpy(taken, regs, sizeof(regs));
+				branch(inst, taken, regs, &t, &f);
+				if (t) {
+					state_join(v, pc + 1 + inst->offset, taken);
+				}
+				live = f;
+			}
+			break;
+		}
+	}
+}
+
+int ebpf_verify(struct ebpf_vm *vm, u16 ctx_size) {
+	ebpf_verifier_release(vm);
+	vm->ctx_size = ctx_size;
+	vm->mem_accesses = 0;
+	vm->mem_proven = 0;
+	if (!vm->jumps_checked) {
+		return -1;
+	}
+	int n = vm->num_insts;
+	verifier_state v;
+	memset(&v, 0, sizeof(v));
+	v.vm = vm;
+	v.ctx_size = ctx_size;
+	v.slot = ebpf_malloc(n * sizeof(u16));
+	u8 *mem_safe = ebpf_calloc((n + 7) / 8, 1);
+	if (v.slot == NULL || mem_safe == NULL) {
+		goto fail;
+	}
+	// jump targets, check_jumps made sure they are inside the code
+	memset(v.slot, 0xff, n * sizeof(u16));
+	int targets = 0;
+	for (int pc = 0; pc < n; pc++) {
+		const struct ebpf_inst *inst = &vm->insts[pc];
+		if (is_mem_access(inst->opcode)) {
+			vm->mem_accesses++;
+		}
+		if (inst->opcode == EBPF_OP_LDDW) {
+			pc++;
+			continue;
+		}
+		if ((inst->opcode & EBPF_CLS_MASK) != EBPF_CLS_JMP || inst->opcode == EBPF_OP_CALL || inst->opcode == EBPF_OP_EXIT) {
+			continue;
+		}
+		int target = pc + 1 + inst->offset;
+		if (v.slot[target] == NO_TARGET) {
+			v.slot[target] = targets++;
+		}
+	}
+	v.in = ebpf_malloc(targets * sizeof(*v.in) + 1);
+	v.joins = ebpf_calloc(targets + 1, 1);
+	v.out = ebpf_malloc(targets * sizeof(*v.out) + 1);
+	v.reached = ebpf_malloc(targets + 1);
+	if (v.in == NULL || v.joins == NULL || v.out == NULL || v.reached == NULL) {
+		goto fail;
+	}
+	v.changed = true;
+	for (int pass = 0; v.changed && pass < VERIFY_MAX_PASSES; pass++) {
+		v.changed = false;
+		walk(&v, NULL);
+	}
+	if (!v.changed) { // fixed point, nothing is proven otherwise
+		v.narrowing = true;
+		for (int pass = 0; pass < VERIFY_NARROW_PASSES; pass++) {
+			memset(v.reached, 0, targets + 1);
+			walk(&v, NULL);
+			for (int i = 0; i < targets; i++) {
+				memcpy(v.in[i], v.out[i], sizeof(*v.in));
+				v.joins[i] = v.reached[i];
+			}
+		}
+		walk(&v, mem_safe);
+	}
+	for (int pc = 0; pc < n; pc++) {
+		if (ebpf_access_proven(mem_safe, pc)) {
+			vm->mem_proven++;
+		}
+	}
+	vm->mem_safe = mem_safe;
+	ebpf_free(v.slot);
+	ebpf_free(v.in);
+	ebpf_free(v.joins);
+	ebpf_free(v.out);
+	ebpf_free(v.reached);
+	return 0;
+
+fail:
+	DEBUG_LOG("verifier: out of memory, every access is checked\n");
+	ebpf_free(v.slot);
+	ebpf_free(v.in);
+	ebpf_free(v.joins);
+	ebpf_free(v.out);
+	ebpf_free(v.reached);
+	ebpf_free(mem_safe);
+	return -1;
+}
+
+void ebpf_verifier_release(struct ebpf_vm *vm) {
+	if (vm->mem_safe != NULL) {
+		ebpf_free(vm->mem_safe);
+		vm->mem_safe = NULL;
+	}
+}
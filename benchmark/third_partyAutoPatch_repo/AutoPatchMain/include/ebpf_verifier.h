@@ -0,0 +1,40 @@
+#ifndef EBPF_VERIFIER_H_
+#define EBPF_VERIFIER_H_
+#include "ebpf_vm.h"
+
+/*
+Range analysis of the pointer registers, run once at load time.
+
+Every register is tracked as a scalar or a pointer into the ctx, the stack or a
+map value, with the range of its value (the offset for pointers). A load or store
+whose whole range stays inside its region is proven, the interpreter and the JIT
+only check the accesses that are not. Anything the analysis does not follow
+(pointers loaded from memory, spilled registers, helper results) is not proven.
+*/
+
+// exception stack frame handed to the filters: r0-r3, r12, lr, pc, xpsr
+#define EBPF_CTX_SIZE 32
+
+// 0 when the code was analysed, nothing is proven if it could not be
+int ebpf_verify(struct ebpf_vm *vm, u16 ctx_size);
+void ebpf_verifier_release(struct ebpf_vm *vm);
+
+// bytes of a load or store
+static inline int ebpf_access_size(u8 opcode) {
+	switch (opcode & 0x18) {
+	case EBPF_SIZE_B:
+		return 1;
+	case EBPF_SIZE_H:
+		return 2;
+	case EBPF_SIZE_DW:
+		return 8;
+	default:
+		return 4;
+	}
+}
+
+static inline bool ebpf_access_proven(const u8 *mem_safe, int pc) {
+	return mem_safe != NULL && ((mem_safe[pc >> 3] >> (pc & 7)) & 1);
+}
+
+#endif
@@ -6,24 +6,37 @@
 #include "ebpf.h"
 #include "utils.h"
 #include "ebpf_helper_impl.h"
+#include "ebpf_verifier.c"
 
 static ebpf_helper_env *g_helper_func = NULL;
 static ebpf_helper_env* use_default_helper_func();
 
+/*
+Fuel is charged on backward jumps only. The loader checks that every jump lands
+inside the program and that it cannot fall off the end, so code between two
+back-edges runs at most num_insts instructions and execution still terminates.
+Define EBPF_METER_EVERY_INST to charge every instruction as before (comparison).
+*/
 #define MAX_ITERS 0x8000
+// #define EBPF_METER_EVERY_INST
 
+#ifdef EBPF_METER_EVERY_INST
 static bool iters_check(int pc);
+#endif
+static int check_jumps(struct ebpf_vm *vm);
+static u64 call_helper(const ebpf_helper_env *env, int idx, const u64 *reg);
 static bool bounds_check(const struct ebpf_vm *vm, void *addr, int size, const char *type, u16 cur_pc, void *mem, size_t mem_len, void *stack);
 
 ebpf_vm *init_ebpf_vm(const uint8_t *code, uint32_t code_len) {
-	ebpf_vm *vm = (ebpf_vm *) ebpf_malloc(sizeof(ebpf_vm));
+	ebpf_vm *vm = (ebpf_vm *) ebpf_calloc(1, sizeof(ebpf_vm));
 	if (vm == NULL) {
 		return NULL;
 	}
-	// vm->helper_func = NULL;
 	vm->insts = (struct ebpf_inst *) code;
 	vm->num_insts = (u16) code_len / sizeof(vm->insts[0]);
 	init_iot_ebpf_helpers(vm);
+	check_jumps(vm);
+	ebpf_verify(vm, EBPF_CTX_SIZE);
 	return vm;
 }
 
@@ -38,10 +51,13 @@ struct ebpf_vm *ebpf_create(void) {
 }
 
 void ebpf_vm_set_inst(struct ebpf_vm *vm, const uint8_t *code, uint32_t code_len) {
+	ebpf_verifier_release(vm);
 	memset(vm, 0, sizeof(struct ebpf_vm));
 	vm->insts = (struct ebpf_inst *) code;
 	vm->num_insts = (u16) code_len / sizeof(vm->insts[0]);
 	init_iot_ebpf_helpers(vm);
+	check_jumps(vm);
+	ebpf_verify(vm, EBPF_CTX_SIZE);
 }
 
 int ebpf_vm_load(struct ebpf_vm *vm, const void *code, u32 code_len) {
@@ -56,6 +72,53 @@ int ebpf_vm_load(struct ebpf_vm *vm, const void *code, u32 code_len) {
 
 	memcpy(vm->insts, code, code_len);
 	vm->num_insts = (u16) code_len / sizeof(vm->insts[0]);
+	if (check_jumps(vm) != 0) {
+		return -1;
+	}
+	// on failure nothing is proven and every access is checked
+	ebpf_verify(vm, EBPF_CTX_SIZE);
+	return 0;
+}
+
+/*
+Run once at load time: every jump target is inside the program and not the
+second half of a LDDW, the last instruction does not fall through, and count
+the back-edges (jumps to an earlier or the same instruction).
+*/
+static int check_jumps(struct ebpf_vm *vm) {
+	const struct ebpf_inst *insts = vm->insts;
+	int n = vm->num_insts;
+	vm->jumps_checked = false;
+	vm->back_edges = 0;
+	if (insts == NULL || n == 0) {
+		return -1;
+	}
+	for (int pc = 0; pc < n; pc++) {
+		const struct ebpf_inst *inst = &insts[pc];
+		if (inst->opcode == EBPF_OP_LDDW) {
+			pc++; // the second slot is data, not an instruction
+			if (pc >= n) {
+				return -1;
+			}
+			continue;
+		}
+		if ((inst->opcode & EBPF_CLS_MASK) != EBPF_CLS_JMP || inst->opcode == EBPF_OP_CALL || inst->opcode == EBPF_OP_EXIT) {
+			continue;
+		}
+		int target = pc + 1 + inst->offset;
+		if (target < 0 || target >= n || (target > 0 && insts[target - 1].opcode == EBPF_OP_LDDW)) {
+			DEBUG_LOG("invalid jump target %d at pc %d\n", target, pc);
+			return -1;
+		}
+		if (target <= pc) {
+			vm->back_edges++;
+		}
+	}
+	u8 last = insts[n - 1].opcode;
+	if (last != EBPF_OP_EXIT && last != EBPF_OP_JA) {
+		return -1;
+	}
+	vm->jumps_checked = true;
 	return 0;
 }
 
@@ -70,15 +133,25 @@ int ebpf_register(struct ebpf_vm *vm, unsigned int idx, const char *name, void *
 	}
 
 	vm->helper_func->ext_funcs[idx] = (ext_func)fn;
+	vm->helper_func->ext_descs[idx] = (ebpf_helper_desc) EBPF_HELPER_DESC_U64;
 	// DEBUG_LOG("ebpf_register: 0x%08x 0x%08x\n", vm->helper_func->ext_funcs, fn);
 	// vm->helper_func->ext_func_names[idx] = name;
 	return 0;
 }
 
+int ebpf_register_typed(struct ebpf_vm *vm, unsigned int idx, const char *name, void *fn, ebpf_helper_desc desc) {
+	if (desc.nargs > 5 || ebpf_register(vm, idx, name, fn) != 0) {
+		return -1;
+	}
+	vm->helper_func->ext_descs[idx] = desc;
+	return 0;
+}
+
 static ebpf_helper_env* use_default_helper_func() {
 	if (g_helper_func == NULL) {
 		g_helper_func = ebpf_calloc(1, sizeof(ebpf_helper_env));
 		g_helper_func->ext_funcs = ebpf_calloc(MAX_EXT_FUNCS, sizeof(ext_func));
+		g_helper_func->ext_descs = ebpf_calloc(MAX_EXT_FUNCS, sizeof(ebpf_helper_desc));
 		// g_helper_func->refcnt = 0;
 	}
 	g_helper_func->refcnt++;
@@ -98,40 +171,61 @@ void ebpf_vm_destroy(struct ebpf_vm *vm) {
 		g_helper_func->refcnt--;
 		if (g_helper_func->refcnt == 0) {
 			ebpf_free(g_helper_func->ext_funcs);
+			ebpf_free(g_helper_func->ext_descs);
 			ebpf_free(g_helper_func);
 			g_helper_func = NULL;
 		}
 	}
 	// ebpf_free(vm->insts);
+	ebpf_verifier_release(vm);
 	ebpf_free(vm);
 }
 
 u64 ebpf_vm_exec(const struct ebpf_vm *vm, void *mem, u32 mem_len) {
-	u64 ret = 0;
 	u16 pc = 0;
 	const struct ebpf_inst *insts = vm->insts;
 	u64 reg[MAX_BPF_EXT_REG];
 	u64 stack[(STACK_SIZE + 7) / 8];
 	reg[1] = (uintptr) mem;
 	reg[10] = (uintptr) stack + sizeof(stack);
+	u32 fuel = MAX_ITERS;
+	// the proofs assume ctx_size bytes of ctx
+	const u8 *mem_safe = mem_len >= vm->ctx_size ? vm->mem_safe : NULL;
+#ifdef EBPF_METER_EVERY_INST
 	int tick = 0;
+#endif
+
+	if (!vm->jumps_checked) {
+		return -1;
+	}
 
 #define DST reg[inst->dst]
 #define SRC reg[inst->src]
 #define IMM inst->imm
 #define AX	reg[MAX_BPF_EXT_REG - 1]
+// accesses the verifier proved in bounds are not checked
 #define BOUNDS_CHECK_LOAD(size) \
 	do { \
-		if (!bounds_check(vm, reg[inst->src] + inst->offset, size, "load", cur_pc, mem, mem_len, stack)) { \
+		if (vm->bounds_check_enabled && !ebpf_access_proven(mem_safe, cur_pc) \
+			&& !bounds_check(vm, (void *) (uintptr) (reg[inst->src] + inst->offset), size, "load", cur_pc, mem, mem_len, stack)) { \
 			return -1; \
 		} \
 	} while(0)
 #define BOUNDS_CHECK_STORE(size) \
 	do { \
-		if (!bounds_check(vm, reg[inst->src] + inst->offset, size, "store", cur_pc, mem, mem_len, stack)) { \
+		if (vm->bounds_check_enabled && !ebpf_access_proven(mem_safe, cur_pc) \
+			&& !bounds_check(vm, (void *) (uintptr) (reg[inst->dst] + inst->offset), size, "store", cur_pc, mem, mem_len, stack)) { \
 			return -1; \
 		} \
 	} while(0)
+// taken jump, a back-edge costs one unit of fuel
+#define JUMP() \
+	do { \
+		if (inst->offset < 0 && --fuel == 0) { \
+			goto out_of_fuel; \
+		} \
+		pc += inst->offset; \
+	} while(0)
 
 	while (true) {
 		const u16 cur_pc = pc;
@@ -339,7 +433,7 @@ u64 ebpf_vm_exec(const struct ebpf_vm *vm, void *mem, u32 mem_len) {
 			DST = *(u64*)(uintptr)(SRC + inst->offset);
 			break;
 		case EBPF_OP_LDXW:
-			//BOUNDS_CHECK_LOAD(4);
+			BOUNDS_CHECK_LOAD(4);
 			//ptr = ;
 			//DEBUG_LOG("EBPF_OP_LDXW\n");
 			DST = *(u32*)(uintptr)(SRC + inst->offset);
@@ -394,76 +488,76 @@ u64 ebpf_vm_exec(const struct ebpf_vm *vm, void *mem, u32 mem_len) {
 			// op jump
 			// 32
 		case EBPF_OP_JA:
-			pc += inst->offset;
+			JUMP();
 			break;
 		case EBPF_OP_JEQ_REG:
 			if (DST == SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JEQ_IMM:
 			if (DST == IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JGT_IMM:
 			if (DST > (u32)IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JGT_REG:
 			if (DST > SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JGE_IMM:
 			if (DST >= (u32)IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JGE_REG:
 			if (DST >= SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JLT_IMM:
 			if (DST < (u32)IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JLT_REG:
 			if (DST < SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JLE_IMM:
 			if (DST <= (u32)IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JLE_REG:
 			if (DST <= SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JSET_IMM:
 			if (DST & IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JSET_REG:
 			if (DST & SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JNE_IMM:
 			if (DST != IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JNE_REG:
 			if (DST != SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 
@@ -471,79 +565,99 @@ u64 ebpf_vm_exec(const struct ebpf_vm *vm, void *mem, u32 mem_len) {
 		case EBPF_OP_JSGT_IMM:
 			// DEBUG_LOG("EBPF_OP_JSGT_REG %d %d\n", (s64) DST, (s64) IMM);
 			if ((s64)DST > (s64) IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JSGT_REG:
 			if ((s64)DST > (s64)SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JSGE_IMM:
 			if ((s64)DST >= (s64) IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JSGE_REG:
 			if ((s64)DST >= (s64)SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break; 
 		case EBPF_OP_JSLT_IMM:
 			if ((s64)DST < (s64) IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JSLT_REG:
 			if ((s64)DST < (s64)SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JSLE_IMM:
 			if ((s64)DST <= (s64) IMM) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_JSLE_REG:
 			if ((s64)DST <= (s64)SRC) {
-				pc += inst->offset;
+				JUMP();
 			}
 			break;
 		case EBPF_OP_CALL:
 			// DEBUG_LOG("VM call func: %d at: 0x%08x a1:%d a2:%d a3:%d a4:%d\n", inst->imm, (u32)reg[1], (u32)reg[2], (u32)reg[3], (u32)reg[4], (u32)reg[5]);
 			// DEBUG_LOG("%d %d %d %d %d\n", (u32)reg[1], (u32)reg[2], (u32)reg[3], (u32)reg[4], (u32)reg[5]);
 			// ctypes
-			reg[0] = vm->helper_func->ext_funcs[inst->imm](reg[1], reg[2], reg[3], reg[4], reg[5]);
+			reg[0] = call_helper(vm->helper_func, inst->imm, reg);
 			break;
 		case EBPF_OP_EXIT:
 			return reg[0];
 		}
 
+#ifdef EBPF_METER_EVERY_INST
 		if (!iters_check(tick++)) {
-			// FILTER_DROP
-			DEBUG_LOG("SFI: Exceed the max iteration number: %d > %d!\n", tick, MAX_ITERS);
-			return 1 << 32;
+			goto out_of_fuel;
 		}
+#endif
 	}
 
-	return ret;
+out_of_fuel:
+	// FILTER_DROP
+	DEBUG_LOG("SFI: Exceed the max iteration number: %d!\n", MAX_ITERS);
+	return (u64) 1 << 32;
+}
+
+/*
+32 bit helpers get one word per argument (r0-r3 and one stack word),
+legacy helpers get five u64 (r0-r3 and six stack words).
+*/
+static u64 call_helper(const ebpf_helper_env *env, int idx, const u64 *reg) {
+	const ebpf_helper_desc *desc = &env->ext_descs[idx];
+	if (!ebpf_helper_is_abi32(desc)) {
+		return env->ext_funcs[idx](reg[1], reg[2], reg[3], reg[4], reg[5]);
+	}
+	if (desc->ret64) {
+		return ((ext_func32_ret64) env->ext_funcs[idx])((u32) reg[1], (u32) reg[2], (u32) reg[3], (u32) reg[4], (u32) reg[5]);
+	}
+	return ((ext_func32) env->ext_funcs[idx])((u32) reg[1], (u32) reg[2], (u32) reg[3], (u32) reg[4], (u32) reg[5]);
 }
 
+#ifdef EBPF_METER_EVERY_INST
 bool iters_check(int tick) {
 	if (tick > MAX_ITERS) {
 		return false;
 	}
 	return true;
 }
+#endif
 
 bool bounds_check(const struct ebpf_vm *vm, void *addr, int size, const char *type, u16 cur_pc, void *mem, size_t mem_len, void *stack) {
 	if (!vm->bounds_check_enabled) {
 		return true;
 	}
-	if (mem && (addr >= mem && ((u32*)addr + size) <= ((u32*)mem + mem_len))) {
+	if (mem && (addr >= mem && ((u8*)addr + size) <= ((u8*)mem + mem_len))) {
 		return true;
 	}
-	else if (addr >= stack && ((u32*)addr + size) <= ((u32*)stack + STACK_SIZE)) {
+	else if (addr >= stack && ((u8*)addr + size) <= ((u8*)stack + STACK_SIZE)) {
 		return true;
 	}
 	else {
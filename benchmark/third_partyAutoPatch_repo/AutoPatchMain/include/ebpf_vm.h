@@ -12,11 +12,34 @@
 #define MAX_EXT_FUNCS 12
 
 typedef u64 (*ext_func)(u64 arg0, u64 arg1, u64 arg2, u64 arg3, u64 arg4);
+// 32 bit helper ABI, arguments are passed in r0-r3 (and one stack word)
+typedef u32 (*ext_func32)(u32 arg0, u32 arg1, u32 arg2, u32 arg3, u32 arg4);
+typedef u64 (*ext_func32_ret64)(u32 arg0, u32 arg1, u32 arg2, u32 arg3, u32 arg4);
 
-typedef uint64_t (*ebpf_jit_fn)(void *args, uint16_t args_len);
+/*
+Helper descriptor, argument count and width of a helper.
+A helper with every argument 32 bit is called with the native 32 bit ABI
+(one word per argument) instead of five u64 (ten words).
+*/
+#define EBPF_HELPER_ARG64(i) (1 << (i))
+typedef struct ebpf_helper_desc {
+	u8 nargs; // 0-5
+	u8 args64; // bit i set if argument i is 64 bit
+	bool ret64; // return value is 64 bit
+} ebpf_helper_desc;
+
+#define EBPF_HELPER_DESC_U64 {5, 0x1f, true} // legacy, five u64 arguments
+
+static inline bool ebpf_helper_is_abi32(const ebpf_helper_desc *desc) {
+	return desc->args64 == 0;
+}
+
+// helpers: the helper table, only read by position independent code (jit_blob_load)
+typedef uint64_t (*ebpf_jit_fn)(void *args, uint16_t args_len, ext_func *helpers);
 
 typedef struct ebpf_helper_env {
 	ext_func *ext_funcs;
+	ebpf_helper_desc *ext_descs;
 	const char **ext_func_names;
 	int refcnt;
 } ebpf_helper_env;
@@ -26,10 +49,17 @@ typedef struct ebpf_vm {
 	struct ebpf_inst *insts;
 	u16 num_insts;
 	bool bounds_check_enabled;
+	bool jumps_checked; // set by the loader, exec refuses unchecked code
+	u16 back_edges; // backward jumps, the only places fuel is charged
+	u16 ctx_size; // ctx bytes the verifier assumed, a smaller ctx checks every access
+	u16 mem_accesses; // loads and stores
+	u16 mem_proven; // accesses the verifier proved in bounds
+	u8 *mem_safe; // bit per instruction, set if its access is proven
 	ebpf_helper_env *helper_func;
 	ebpf_jit_fn jit_func;
 	struct jit_mem *jmem;
 	bool use_jit;
+	bool jit_two_pass; // compile with a sizing pass instead of branch fixups
 } ebpf_vm;
 
 struct ebpf_vm *ebpf_create(void);
@@ -39,7 +69,7 @@ Load code
 Execute code
 */
 
-// use code reference 
+// use code reference. the vm is zeroed or was set before, its verifier result is released
 void ebpf_vm_set_inst(struct ebpf_vm *vm, const uint8_t *code, uint32_t code_len);
 
 // copy code to vm
@@ -49,6 +79,8 @@ u64 ebpf_vm_exec(const struct ebpf_vm *vm, void *mem, u32 mem_len);
 
 // register functions
 int ebpf_register(struct ebpf_vm *vm, unsigned int idx, const char *name, void *fn);
+// register a helper with its argument count and width
+int ebpf_register_typed(struct ebpf_vm *vm, unsigned int idx, const char *name, void *fn, ebpf_helper_desc desc);
 
 void init_iot_ebpf_helpers(struct ebpf_vm *vm);
 
@@ -2,6 +2,7 @@
 #define FIXED_PATCH_POINT_DEFINE_H_
 
 #include <stdio.h>
+#include <stdint.h>
 
 // #ifdef USE_FIXED_PATCH_INSTRUMENT
 
@@ -19,14 +20,46 @@
 
 // inline int fixed_patch_point_hanlder() __NAKE __USED __INLINE;
 extern int fixed_patch_point_hanlder();
+// site id is passed in r0, see AutoPatchFirstPass -emit-site-ids
+extern int fixed_site_patch_point_hanlder(uint32_t site_id);
 int ret_code;
 
+/*
+Enable bytes checked inline by the macros below, so an unpatched site costs a load
+and a branch instead of a call into the handler. Written by active_patch().
+*/
+extern volatile uint8_t fixed_patch_enable; // any lr based fixed patch is active
+extern volatile uint8_t fixed_site_enable[]; // indexed by site id
+
+/*
+One entry per trampoline, emitted by AutoPatchFirstPass into the "autopatch_sites" section.
+*/
+typedef struct autopatch_site {
+	uint32_t site_id;
+	uint32_t line; // source line, -1 if unknown
+	const void *func; // instrumented function
+} autopatch_site;
+
 /* Our approach can only patch the functions that return void or return an error code.
 */
 #define PATCH_FUNCTION_ERR_CODE \
-  ret_code = fixed_patch_point_hanlder(); 	\
-  if (ret_code != FIXED_OP_PASS) {				\
-	return ret_code;							\
+  if (__builtin_expect(fixed_patch_enable, 0)) { \
+	ret_code = fixed_patch_point_hanlder(); 	\
+	if (ret_code != FIXED_OP_PASS) {				\
+		return ret_code;							\
+	} \
+  } \
+
+
+/* Same as PATCH_FUNCTION_ERR_CODE, but the site is identified by a dense id
+instead of the lr, so the dispatcher does one indexed load.
+*/
+#define PATCH_SITE_ERR_CODE(site_id) \
+  if (__builtin_expect(fixed_site_enable[site_id], 0)) { \
+	ret_code = fixed_site_patch_point_hanlder(site_id); 	\
+	if (ret_code != FIXED_OP_PASS) {				\
+		return ret_code;							\
+	} \
   } \
 
 
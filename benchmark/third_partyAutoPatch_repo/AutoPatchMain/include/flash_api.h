@@ -4,7 +4,16 @@
 
 uint32_t flash_read_word(uint32_t faddr);
 void flash_port_read(uint32_t faddr, uint8_t *buf, int size);
+// any address and length; erases a page only when the write needs it (a bit goes 0->1)
 int flash_port_write(uint32_t faddr, uint8_t *buf, int size);
+/*
+Sequential writes (patch staging): erase whole pages once, then program
+erased flash without the checks of flash_port_write.
+faddr of program is 8 byte aligned (a multiple of every backend's write
+unit), the tail is padded with 0xff.
+*/
+int flash_port_erase(uint32_t faddr, int size);
+int flash_port_program(uint32_t faddr, const uint8_t *buf, int size);
 
 void test_flash_write_speed();
 #endif
\ No newline at end of file
@@ -33,15 +33,30 @@ void darray_set(darray *arr, int key, void *val);
 void* darray_get(darray *arr, int key);
 void darray_del(darray *arr, int key);
 
+/*
+ * lookup layouts of arraymap, keys/vals always stay sorted,
+ * the other layouts keep an extra index that is rebuilt on set/del
+ */
+typedef enum ArrayMapLayout {
+	ARRAYMAP_SORTED = 0, // binary search on keys, then load vals
+	ARRAYMAP_INTERLEAVED, // binary search on sorted <key, val> pairs
+	ARRAYMAP_EYTZINGER, // <key, val> pairs in bfs order, index[0] unused
+	ARRAYMAP_OPENADDR, // power of two table, linear probing
+	ARRAYMAP_LAYOUT_NUM,
+} ArrayMapLayout;
+
 // save pointer
 /* get O(1)
 */
 typedef struct arraymap {
 	uint16_t max_size;
 	uint16_t cur_size;
+	uint8_t layout;
+	uint8_t index_bits; // log2 of open addressing table size
 	// list_head *del; 
 	void **keys;
 	void **vals;
+	mapentry *index;
 } arraymap;
 
 arraymap *arraymap_new(int initial_size);
@@ -51,6 +66,9 @@ void* arraymap_get(arraymap *map, void * key);
 void* arraymap_iter_key(arraymap *map, int idx);
 void* arraymap_iter_val(arraymap *map, int idx);
 void arraymap_del(arraymap *map, void * key);
+// sort once and build the index, keys should be unique
+arraymap *arraymap_bulk_new(int layout, void **keys, void **vals, int n);
+const char *arraymap_layout_name(int layout);
 
 /*
  * red-black tree
@@ -4,14 +4,17 @@
 #include <stdint.h>
 // #include "patch_point.h"
 #include "hashmap.h"
+#include "patch_rcu.h"
 // #include "fixed_patch_points.h"
 
 #define MAX_DP_NUM 6 // maximum dynamic patch num
+#define MAX_FIXED_SITES 256 // maximum site id of FixedSitePatchPoint
 
 enum FilterResult {
 	FILTER_PASS = 0,
 	FILTER_DROP = 1,
-	FILTER_REDIRECT = 2,
+	FILTER_REDIRECT = 2, // resume the patched function at ret_code (absolute address)
+	FILTER_RETURN = 3, // the patched function returns ret_code to its caller
 	FILTER_UNUSED, // do not set patch
 };
 
@@ -24,7 +27,8 @@ enum PatchCASFlag {
 
 typedef enum PatchType {
 	FixedPatchPoint = 1,
-	DynamicPatchPoint
+	DynamicPatchPoint,
+	FixedSitePatchPoint, // fixed_id is the dense site id from AutoPatchFirstPass
 } PatchType;
 
 // struct FixedPatchPoints;
@@ -46,7 +50,9 @@ typedef struct fixed_patch {
 typedef struct patch_context {
 	int phid;
 	uint32_t fbits_filter; // bitmap for active filter patches
-	fixed_patch fpatch_list;
+	fixed_patch fpatch_list; // writer side, guarded by the rcu writer lock
+	patch_rcu fpatch_rcu; // published <addr, active patch> table read by dispatch
+	struct auto_patch *fsite_patches[MAX_FIXED_SITES]; // <site id, active patch>
 	//uint32_t dbits_filter_bpkt; // bloom filter for dynamic patch's bpkt address
 	//uint32_t dbits_filter_pc; // bloom filter for dynamic patch's address
 	//dynamic_patch dpatch_list; //
@@ -74,9 +80,14 @@ void show_all_patches(void);
 
 struct patch_desc;
 // void active_local_patch(struct ebpf_patch *patch);
-void notify_new_patch(struct patch_desc *desc);
+// the patch gets its own copy of the packet, the caller keeps it. code that is
+// a patch object (patch_elf.h) is loaded, the patch runs its entry
+void notify_new_patch(const struct patch_desc *pkt);
+// a patch bundle (patch_bundle.h), run from its journal record. return: patches activated, -1 invalid
+int notify_new_bundle(const uint8_t *bundle, uint32_t len);
 
 auto_patch* get_fixed_patch_by_lr(uint32_t lr);
+auto_patch* get_fixed_patch_by_site(uint32_t site_id);
 // patch inst_addr = bpkt_addr
 ebpf_patch* get_dynamic_patch_by_bpkt(uint32_t bpkt);
 // the next inst addr of the patch addr = pc_addr
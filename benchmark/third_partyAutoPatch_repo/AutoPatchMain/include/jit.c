@@ -1,72 +1,298 @@
 #include "jit.h"
 #include "ebpf_allocator.h"
 #include "ebpf_vm.h"
-// #include "jit_thumb2.c"
+#include "jit_cache.c"
+#include "jit_thumb2.c"
 
 #if defined(JIT_STATIC_MEM)
-static uint8_t jit_buffer[2048];
-static uint8_t offset_mem[1024];
+/*
+Code arena shared by all JITed programs. Blocks are laid out back to back, each
+with a small header, and allocated first fit. When no hole is big enough but
+the total free space is, the arena is compacted: the blocks no VM owns slide
+down and their owners are pointed at the new address (the generated code only
+uses pc relative branches). The code of a VM is never moved: dispatch may run
+it on another thread at any time, so it pins its block and the program that
+still does not fit is left to the interpreter.
 
-jit_mem g_jit_mem;
+The jump offsets are only needed while compiling, compilation is serialized
+so all programs share one scratch buffer, sized for JIT_MAX_INSTS instructions:
+gen_jit_code leaves longer programs to the interpreter, and those whose code
+does not fit JIT_INST_BYTES per instruction.
+*/
+#define JIT_ARENA_ALIGN 8
+
+typedef struct jit_block {
+	uint16_t size; // bytes, header included
+	uint16_t used;
+	jit_mem *owner;
+} jit_block;
+
+static uint8_t jit_arena[JIT_ARENA_SIZE] __attribute__((aligned(JIT_ARENA_ALIGN)));
+static uint8_t offset_mem[(JIT_MAX_INSTS + 1) * sizeof(uint32_t)];
+static uint8_t flag_mem[JIT_MAX_INSTS + 1];
+static jit_fixup fixup_mem[JIT_MAX_INSTS];
+static bool jit_arena_ready = false;
+static int jit_compactions = 0;
+
+static jit_block *block_at(int off) {
+	return (jit_block *) &jit_arena[off];
+}
+
+static void jit_arena_init(void) {
+	jit_block *b = block_at(0);
+	b->size = JIT_ARENA_SIZE;
+	b->used = false;
+	b->owner = NULL;
+	jit_arena_ready = true;
+}
+
+// merge every free block with the free blocks that follow it
+static void jit_arena_coalesce(void) {
+	for (int off = 0; off < JIT_ARENA_SIZE; off += block_at(off)->size) {
+		jit_block *b = block_at(off);
+		while (!b->used && off + b->size < JIT_ARENA_SIZE && !block_at(off + b->size)->used) {
+			b->size += block_at(off + b->size)->size;
+		}
+	}
+}
+
+// a vm may be running the code, its block stays where it is
+static bool jit_block_pinned(const jit_block *b) {
+	return b->owner != NULL && b->owner->vm != NULL;
+}
+
+static void jit_arena_free_at(int off, int size) {
+	jit_block *b = block_at(off);
+	b->size = size;
+	b->used = false;
+	b->owner = NULL;
+}
+
+// slide the unpinned blocks down to the start or to the pinned block before them
+static void jit_arena_compact(void) {
+	int dst = 0;
+	bool moved = false;
+	for (int off = 0; off < JIT_ARENA_SIZE;) {
+		jit_block *b = block_at(off);
+		int size = b->size;
+		if (b->used && jit_block_pinned(b)) {
+			if (dst != off) {
+				jit_arena_free_at(dst, off - dst);
+			}
+			dst = off + size;
+		} else if (b->used) {
+			if (dst != off) {
+				memmove(&jit_arena[dst], b, size);
+				block_at(dst)->owner->jit_code = &jit_arena[dst] + sizeof(jit_block);
+				moved = true;
+			}
+			dst += size;
+		}
+		off += size;
+	}
+	if (dst < JIT_ARENA_SIZE) {
+		jit_arena_free_at(dst, JIT_ARENA_SIZE - dst);
+	}
+	if (!moved) {
+		return;
+	}
+	jit_compactions++;
+#ifdef SYS_CORTEX_M4
+	__asm__("DSB");
+	__asm__("ISB");
+#endif
+}
+
+static jit_block *jit_arena_fit(int size) {
+	for (int off = 0; off < JIT_ARENA_SIZE; off += block_at(off)->size) {
+		jit_block *b = block_at(off);
+		if (!b->used && b->size >= size) {
+			if (b->size - size >= sizeof(jit_block) + JIT_ARENA_ALIGN) { // split
+				jit_block *rest = block_at(off + size);
+				rest->size = b->size - size;
+				rest->used = false;
+				rest->owner = NULL;
+				b->size = size;
+			}
+			return b;
+		}
+	}
+	return NULL;
+}
 
 jit_mem* jit_mem_allocate(int insts_num) {
-	jit_mem *mem = &g_jit_mem;
-	mem->code_size = sizeof(jit_buffer);
-	mem->jit_code = jit_buffer;
+	if (!jit_arena_ready) {
+		jit_arena_init();
+	}
+	int code_size = JIT_INST_BYTES * insts_num + JIT_CODE_EXTRA;
+	int size = (sizeof(jit_block) + code_size + JIT_ARENA_ALIGN - 1) & ~(JIT_ARENA_ALIGN - 1);
+	jit_block *b = jit_arena_fit(size);
+	if (b == NULL) {
+		jit_arena_stat st;
+		jit_mem_arena_statistic(&st);
+		if (st.free_bytes < size) {
+			DEBUG_LOG("jit arena is full: need %d free %d\n", size, st.free_bytes);
+			return NULL;
+		}
+		jit_arena_compact();
+		b = jit_arena_fit(size);
+		if (b == NULL) {
+			DEBUG_LOG("jit arena: no hole of %d bytes between the pinned programs\n", size);
+			return NULL;
+		}
+	}
+	jit_mem *mem = ebpf_calloc(1, sizeof(jit_mem));
+	if (mem == NULL) {
+		return NULL;
+	}
+	b->used = true;
+	b->owner = mem;
+	mem->jit_code = (uint8_t *) b + sizeof(jit_block);
+	mem->code_size = b->size - sizeof(jit_block);
 	mem->jmp_offsets = offset_mem;
-	memset(jit_buffer, 0, sizeof(jit_buffer));
+	mem->inst_flags = flag_mem;
+	mem->fixups = fixup_mem;
+	mem->max_fixups = sizeof(fixup_mem) / sizeof(fixup_mem[0]);
+	memset(mem->jit_code, 0, mem->code_size);
 	memset(offset_mem, 0, sizeof(offset_mem));
+	memset(flag_mem, 0, sizeof(flag_mem));
 	return mem;
 }
 
 void jit_mem_free(jit_mem *mem) {
-	mem->code_size = 0;
-	mem->jit_code = NULL;
-	mem->jmp_offsets = NULL;
+	if (mem == NULL) {
+		return;
+	}
+	jit_block *b = (jit_block *) (mem->jit_code - sizeof(jit_block));
+	b->used = false;
+	b->owner = NULL;
+	jit_arena_coalesce();
+	ebpf_free(mem);
+}
+
+void jit_mem_arena_statistic(jit_arena_stat *st) {
+	memset(st, 0, sizeof(jit_arena_stat));
+	st->arena_size = JIT_ARENA_SIZE;
+	st->compactions = jit_compactions;
+	if (!jit_arena_ready) {
+		jit_arena_init();
+	}
+	for (int off = 0; off < JIT_ARENA_SIZE; off += block_at(off)->size) {
+		jit_block *b = block_at(off);
+		if (b->used) {
+			st->programs++;
+			st->used_bytes += b->size;
+		} else {
+			st->holes++;
+			st->free_bytes += b->size;
+			if (b->size > st->largest_free) {
+				st->largest_free = b->size;
+			}
+		}
+	}
 }
 
 #else
 
 // 
 jit_mem* jit_mem_allocate(int insts_num) {
-	jit_mem *mem = ebpf_malloc(sizeof(jit_mem));
-	mem->code_size = 10 * insts_num + 16;
+	jit_mem *mem = ebpf_calloc(1, sizeof(jit_mem));
+	mem->code_size = JIT_INST_BYTES * insts_num + JIT_CODE_EXTRA;
 	mem->jit_code = ebpf_malloc(mem->code_size);
 	int offset_size = 4 * insts_num + 16;
 	mem->jmp_offsets = ebpf_malloc(offset_size);
+	mem->inst_flags = ebpf_malloc(insts_num);
+	// at most one branch per instruction, an access check counts as JIT_SFI_CHECK_INSTS
+	mem->fixups = ebpf_malloc(insts_num * sizeof(jit_fixup));
+	mem->max_fixups = insts_num;
 	memset(mem->jit_code, 0, mem->code_size);
 	memset(mem->jmp_offsets, 0, offset_size);
+	memset(mem->inst_flags, 0, insts_num);
+	return mem;
 }
 
 void jit_mem_free(jit_mem *mem) {
 	ebpf_free(mem->jit_code);
 	ebpf_free(mem->jmp_offsets);
+	ebpf_free(mem->inst_flags);
+	ebpf_free(mem->fixups);
 	ebpf_free(mem);
 }
 
+// no arena, every program has its own blocks
+void jit_mem_arena_statistic(jit_arena_stat *st) {
+	memset(st, 0, sizeof(jit_arena_stat));
+}
+
 #endif
 
 void jit_state_set_mem(jit_state *state, jit_mem *mem) {
 	state->jmem = mem;
 	state->jit_code = (uint8_t *) ((uint32_t) mem->jit_code & (~0x3));
 	state->offsets = (uint32_t *) mem->jmp_offsets;
+	state->inst_flags = mem->inst_flags;
+	state->fixups = mem->fixups;
+	state->max_fixups = mem->max_fixups;
 }
 
 void gen_jit_code(struct ebpf_vm *vm) {
+	// warm start, the code compiled before the reset runs from flash
+	const uint8_t *cached = jit_cache_lookup(vm);
+	if (cached != NULL) {
+		if (vm->jmem != NULL) {
+			jit_mem_free(vm->jmem);
+			vm->jmem = NULL;
+		}
+		vm->jit_func = (ebpf_jit_fn) ((uint32_t) cached | 0x1);
+		return;
+	}
 	if (vm->jmem != NULL) {
 		jit_mem_free(vm->jmem);
+		vm->jmem = NULL;
 	}
-	vm->jmem = jit_mem_allocate(vm->num_insts);
+#if defined(JIT_STATIC_MEM)
+	// the jump offsets and flags are indexed by instruction, up to num_insts
+	if (vm->num_insts > JIT_MAX_INSTS) {
+		DEBUG_LOG("jit: %d insts, at most %d\n", vm->num_insts, JIT_MAX_INSTS);
+		vm->jit_func = NULL;
+		return;
+	}
+#endif
+	bool use_sfi = vm->bounds_check_enabled;
+	int checks = use_sfi ? vm->mem_accesses - vm->mem_proven + 1 : 0; // + prologue and fail path
+	vm->jmem = jit_mem_allocate(vm->num_insts + checks * JIT_SFI_CHECK_INSTS);
+	if (vm->jmem == NULL) {
+		vm->jit_func = NULL;
+		return;
+	}
+	vm->jmem->vm = vm;
 	jit_state state;
+	memset(&state, 0, sizeof(state));
 	state.insts = vm->insts;
 	state.inst_num = vm->num_insts;
 	state.idx = 0;
+	state.size = vm->jmem->code_size;
 	//state.jit_code = (uint8_t *) ((uint32_t) vm->jmem->jit_code & (~0x3));
 	state.err_line = 0;
 	state.__bpf_call_base = vm->helper_func->ext_funcs;
+	state.helper_descs = vm->helper_func->ext_descs;
+	state.use_sfi = use_sfi;
+	state.mem_safe = vm->mem_safe;
+	state.ctx_size = vm->ctx_size;
+	state.two_pass = vm->jit_two_pass;
+	state.pic = false;
 	jit_state_set_mem(&state, vm->jmem);
-	// jit_compile(&state);
+	jit_compile(&state);
+	if (state.err_line != 0 || state.idx > state.size) { // the interpreter runs it
+		DEBUG_LOG("jit: compile failed, line %d, %d of %d bytes\n", state.err_line, state.idx, state.size);
+		jit_mem_free(vm->jmem);
+		vm->jmem = NULL;
+		vm->jit_func = NULL;
+		return;
+	}
+	vm->jmem->code_len = state.idx;
 	vm->jit_func = (ebpf_jit_fn) ((uint32_t) vm->jmem->jit_code | 0x1);
+	jit_cache_store(vm, state.jit_code, state.idx); // when full, the arena copy runs
 
 // #ifdef SYS_CORTEX_M4
 	__asm__("DSB");
@@ -22,16 +22,62 @@ struct ebpf_vm;
 void gen_jit_code(struct ebpf_vm *vm);
 
 #define JIT_STATIC_MEM
+#define JIT_ARENA_SIZE 8192 // code arena shared by all JIT programs
+#define JIT_SFI_CHECK_INSTS 6 // arena space of one access check, in instructions
+#define JIT_INST_BYTES 16 // code reserved per instruction, a program that needs more is interpreted
+#define JIT_CODE_EXTRA 64 // prologue, epilogue
+#define JIT_MAX_INSTS 256 // longest program compiled into the arena, sizes the shared scratch buffers
 // static mem or dynamic allocate
 typedef struct jit_mem {
     uint8_t *jit_code;
     int code_size;
+    int code_len; // bytes emitted
     uint8_t *jmp_offsets;
+    uint8_t *inst_flags; // JIT_INST_*, one byte per instruction
+    struct jit_fixup *fixups;
+    int max_fixups;
+    struct ebpf_vm *vm; // owner, it may run the code: the block is pinned, never compacted
 } jit_mem;
 
+typedef struct jit_arena_stat {
+    int arena_size;
+    int used_bytes;
+    int free_bytes;
+    int largest_free; // fragmentation = 1 - largest_free / free_bytes
+    int programs;
+    int holes;
+    int compactions;
+} jit_arena_stat;
+
 jit_mem* jit_mem_allocate(int insts_num);
 void jit_mem_free(jit_mem *mem);
 int jit_mem_statistic(struct ebpf_vm *vm);
+void jit_mem_arena_statistic(jit_arena_stat *st);
+
+#define JIT_BPF_REGS 11 // r0-r10
+// inst_flags
+#define JIT_INST_TARGET 0x1 // a jump lands here
+#define JIT_INST_CBZ 0x2 // compare with 0 emitted as CBZ/CBNZ
+
+/*
+A branch of the single pass compiler. It is emitted as a long placeholder,
+jit_relax picks the short forms once every target is known and encodes it.
+*/
+#define JIT_FIX_INSN 0 // target: start of a BPF instruction
+#define JIT_FIX_EPILOGUE 1
+#define JIT_FIX_SFI_FAIL 2
+#define JIT_FIX_BYTE 3 // target: byte offset in the code
+#define JIT_FIX_NO_CBZ 0xff
+
+typedef struct jit_fixup {
+    uint16_t pos; // byte offset of the branch
+    uint16_t target;
+    uint8_t kind; // JIT_FIX_*
+    uint8_t cond; // COND_AL: unconditional
+    uint8_t cbz_reg; // CBZ/CBNZ on this register if the target is close and after
+    uint8_t size; // 2 or 4 bytes
+    uint16_t shift; // bytes freed by the short branches before it
+} jit_fixup;
 
 struct ebpf_inst;
 typedef struct jit_state {
@@ -40,15 +86,29 @@ typedef struct jit_state {
     uint8_t *jit_code;
     int size;
     int idx;
+    int body_offset;
     int epilogue_offset;
-    bool use_sfi;
+    int sfi_fail_offset;
+    bool use_sfi; // check the accesses mem_safe does not prove
+    const uint8_t *mem_safe;
+    uint16_t ctx_size;
     int exit_off;
     int err_line;
     uint32_t *offsets;
+    uint8_t *inst_flags;
+    jit_fixup *fixups;
+    int fixup_num;
+    int max_fixups;
+    int8_t reg_map[JIT_BPF_REGS][2]; // {hi, lo}: ARM register or stack slot (< 0)
+    int regs_in_arm; // BPF registers the allocator kept in ARM registers
     void *__bpf_call_base;
+    const struct ebpf_helper_desc *helper_descs;
     jit_mem *jmem;
     // int inst_loc;
     bool needGen; // pre-pass or generate-pass
+    bool relax; // sizing pass that picks the short branches
+    bool two_pass; // size everything first instead of fixing the branches up
+    bool pic; // helpers called through the table in r2, for code compiled off the device
 } jit_state;
 
 void jit_compile(jit_state *state);
@@ -59,7 +119,7 @@ static inline void
 emit_bytes(struct jit_state *state, void *data, uint32_t len) 
 {
     // my_printf("emit_bytes: %s 0x%x\n", state->jit_code, *((uint16_t*) data));
-    if (state->needGen) {
+    if (state->needGen && state->idx + len <= state->size) { // past the end, the caller checks idx
         memcpy(state->jit_code + state->idx, data, len);
     }
     
@@ -0,0 +1,124 @@
+#include "jit_cache.h"
+#include "ebpf_vm.h"
+#include "flash_api.h"
+#include "utils.h"
+#include <string.h>
+
+#define JIT_CACHE_ALIGN 8 // flash programming unit
+#define JIT_CACHE_END (JIT_CACHE_BASE + JIT_CACHE_SIZE)
+
+// FNV-1a
+uint32_t jit_cache_hash(const void *data, int len) {
+	const uint8_t *p = data;
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+static uint32_t helper_env_hash(const struct ebpf_vm *vm) {
+	const ebpf_helper_env *env = vm->helper_func;
+	if (env == NULL) {
+		return 0;
+	}
+	uint32_t h = jit_cache_hash(env->ext_funcs, MAX_EXT_FUNCS * sizeof(ext_func));
+	return h ^ jit_cache_hash(env->ext_descs, MAX_EXT_FUNCS * sizeof(ebpf_helper_desc));
+}
+
+// the access checks depend on bounds checking and on what the verifier proved
+static uint32_t sfi_hash(const struct ebpf_vm *vm) {
+	if (!vm->bounds_check_enabled) {
+		return 0;
+	}
+	return jit_cache_hash(vm->mem_safe, vm->mem_safe != NULL ? (vm->num_insts + 7) / 8 : 0) ^ vm->ctx_size;
+}
+
+static uint32_t entry_next(const jit_cache_entry *e) {
+	uint32_t end = (uint32_t) e->code + e->code_size;
+	return (end + JIT_CACHE_ALIGN - 1) & ~(JIT_CACHE_ALIGN - 1);
+}
+
+// the entries are read in place, flash is memory mapped
+static bool entry_valid(uint32_t addr) {
+	const jit_cache_entry *e = (const jit_cache_entry *) addr;
+	return addr + sizeof(jit_cache_entry) <= JIT_CACHE_END && e->magic == JIT_CACHE_MAGIC
+		&& entry_next(e) <= JIT_CACHE_END;
+}
+
+const uint8_t *jit_cache_lookup(const struct ebpf_vm *vm) {
+	uint32_t bc_hash = jit_cache_hash(vm->insts, vm->num_insts * sizeof(struct ebpf_inst));
+	uint32_t env_hash = helper_env_hash(vm) ^ sfi_hash(vm);
+	uint32_t addr = JIT_CACHE_BASE;
+	while (entry_valid(addr)) {
+		const jit_cache_entry *e = (const jit_cache_entry *) addr;
+		if (e->version == JIT_VERSION && e->bc_hash == bc_hash && e->env_hash == env_hash
+			&& jit_cache_hash(e->code, e->code_size) == e->code_hash) {
+			return e->code;
+		}
+		addr = entry_next(e);
+	}
+	return NULL;
+}
+
+int jit_cache_store(const struct ebpf_vm *vm, const uint8_t *code, int size) {
+	if (size <= 0 || size > 0xffff) {
+		return -1;
+	}
+	uint32_t addr = JIT_CACHE_BASE;
+	while (entry_valid(addr)) {
+		addr = entry_next((const jit_cache_entry *) addr);
+	}
+	uint32_t need = (sizeof(jit_cache_entry) + size + JIT_CACHE_ALIGN - 1) & ~(JIT_CACHE_ALIGN - 1);
+	if (addr + need > JIT_CACHE_END) {
+		// full, the code stays in RAM: warm loaded patches run from the entries, none is erased
+		DEBUG_LOG("jit cache full: need %u at 0x%08x\n", need, addr);
+		return -1;
+	}
+	jit_cache_entry e;
+	e.magic = JIT_CACHE_MAGIC;
+	e.version = JIT_VERSION;
+	e.code_size = size;
+	e.bc_hash = jit_cache_hash(vm->insts, vm->num_insts * sizeof(struct ebpf_inst));
+	e.env_hash = helper_env_hash(vm) ^ sfi_hash(vm);
+	e.code_hash = jit_cache_hash(code, size);
+	// code first, the header (magic) last, a torn store is never valid
+	if (flash_port_write(addr + sizeof(e), (uint8_t *) code, size) != 0) {
+		return -1;
+	}
+	if (flash_port_write(addr, (uint8_t *) &e, sizeof(e)) != 0) {
+		return -1;
+	}
+	DEBUG_LOG("jit cache store: 0x%08x %d bytes\n", addr, size);
+	return 0;
+}
+
+// how the helpers are called, not where they are
+uint32_t jit_blob_env_hash(const struct ebpf_vm *vm) {
+	const ebpf_helper_env *env = vm->helper_func;
+	uint32_t h = env != NULL ? jit_cache_hash(env->ext_descs, MAX_EXT_FUNCS * sizeof(ebpf_helper_desc)) : 0;
+	return h ^ sfi_hash(vm);
+}
+
+int jit_blob_load(struct ebpf_vm *vm, const uint8_t *blob, int len) {
+	const jit_blob *b = (const jit_blob *) blob;
+	if (len < (int) sizeof(jit_blob) || ((uint32_t) blob & 0x3) != 0 || b->magic != JIT_BLOB_MAGIC
+		|| b->version != JIT_VERSION || (int) sizeof(jit_blob) + b->code_size > len) {
+		return -1;
+	}
+	if (b->bc_hash != jit_cache_hash(vm->insts, vm->num_insts * sizeof(struct ebpf_inst))
+		|| b->env_hash != jit_blob_env_hash(vm) || jit_cache_hash(b->code, b->code_size) != b->code_hash) {
+		return -1;
+	}
+	if (vm->jmem != NULL) {
+		jit_mem_free(vm->jmem);
+		vm->jmem = NULL;
+	}
+	vm->jit_func = (ebpf_jit_fn) ((uint32_t) b->code | 0x1);
+	return 0;
+}
+
+void jit_cache_reset(void) {
+	uint32_t erased = JIT_CACHE_ERASED;
+	flash_port_write(JIT_CACHE_BASE, (uint8_t *) &erased, sizeof(erased));
+}
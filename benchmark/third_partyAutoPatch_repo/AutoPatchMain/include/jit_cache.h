@@ -0,0 +1,58 @@
+#ifndef JIT_CACHE_H_
+#define JIT_CACHE_H_
+#include <stdint.h>
+
+/*
+Persistent JIT code cache in flash.
+
+Compiled Thumb code is appended to a flash region with a header keyed by the
+bytecode hash, the JIT version and a hash of the helper table (CALL embeds the
+helper addresses) and of the access checks (bounds checking, proven accesses). After a reset a patch whose entry is still valid runs
+directly from flash (execute in place) without compiling again. The entries are
+never dropped while patches may run from them: a full cache stores nothing more
+(the code stays in the JIT arena), it is reset only with no patch loaded.
+*/
+
+#define JIT_VERSION 3
+
+// last 32KB of the nRF52840 flash, keep it out of the image
+#define JIT_CACHE_BASE 0x000F8000
+#define JIT_CACHE_SIZE 0x8000
+#define JIT_CACHE_MAGIC 0x4354494a // "JITC"
+#define JIT_CACHE_ERASED 0xffffffff
+
+typedef struct jit_cache_entry {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t code_size;
+	uint32_t bc_hash;
+	uint32_t env_hash;
+	uint32_t code_hash;
+	uint8_t code[0]; // 4 byte aligned
+} jit_cache_entry;
+
+struct ebpf_vm;
+// code of a valid entry for this vm, or NULL
+const uint8_t *jit_cache_lookup(const struct ebpf_vm *vm);
+// -1 when the cache is full
+int jit_cache_store(const struct ebpf_vm *vm, const uint8_t *code, int size);
+// drop all entries, the next store starts at JIT_CACHE_BASE again. no vm may run a cached entry
+void jit_cache_reset(void);
+
+uint32_t jit_cache_hash(const void *data, int len);
+
+/*
+Pre-compiled patch blob, written on the host by tools/jit_cross. It has the
+header of a cache entry with its own magic. The code is position independent,
+it calls the helpers through the table passed in r2, so env_hash covers the
+helper descriptors and the access checks but no address. The blob runs where it
+is stored, no compile time and no JIT arena.
+*/
+#define JIT_BLOB_MAGIC 0x424c424a // "JBLB"
+typedef jit_cache_entry jit_blob;
+
+uint32_t jit_blob_env_hash(const struct ebpf_vm *vm);
+// 0 and vm->jit_func set if the blob was compiled from this vm's bytecode and environment
+int jit_blob_load(struct ebpf_vm *vm, const uint8_t *blob, int len);
+
+#endif
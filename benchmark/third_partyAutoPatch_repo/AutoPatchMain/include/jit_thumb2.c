@@ -1,14 +1,14 @@
 #include "jit_thumb2.h"
 #include "jit.h"
 #include "ebpf_inst.h"
+#include "ebpf_vm.h"
+#include "ebpf_verifier.h"
 #include <stdint.h>
 #include <stdbool.h>
 #include "utils.h"
 
 typedef void (*f_void)(void);
 typedef uint64_t (*f_ebpf)(void*);
-static uint8_t jit_buffer[2048];
-static uint8_t offset_mem[2048];
 
 static void first_jit_func();
 static void gen_code_for_ebpf1();
@@ -19,10 +19,12 @@ use this version:
 https://github.com/uw-unsat/jitterbug/blob/master/arch/arm/net/bpf_jit_32.c
 */
 
+#ifndef LINUX_TEST
 void jit_run_test() {
     // first_jit_func();
     gen_code_for_ebpf1();
 }
+#endif
 
 #ifdef SYS_CORTEX_M4
 
@@ -79,6 +81,8 @@ enum {
 	BPF_R4_LO,
 	BPF_R5_HI,
 	BPF_R5_LO,
+	BPF_R6_HI,
+	BPF_R6_LO,
 	BPF_R7_HI,
 	BPF_R7_LO,
 	BPF_R8_HI,
@@ -91,8 +95,7 @@ enum {
 	BPF_TC_LO,
 	BPF_AX_HI,
 	BPF_AX_LO,
-	/* Stack space for BPF_REG_2, BPF_REG_3, BPF_REG_4,
-	 * BPF_REG_5, BPF_REG_7, BPF_REG_8, BPF_REG_9,
+	/* Stack space for BPF_REG_2 - BPF_REG_9,
 	 * BPF_REG_FP and Tail call counts.
 	 */
 	BPF_JIT_SCRATCH_REGS,
@@ -114,8 +117,8 @@ enum {
 
 /*
  * Map eBPF registers to ARM 32bit registers or stack scratch space.
- * 
- *
+ * r2-r10 start on the stack, jit_alloc_regs moves the hot ones to
+ * ARM registers for each program (state->reg_map).
  */
 static const int8_t bpf2a32[][2] = {
 	/* return value from in-kernel function, and exit value from eBPF */
@@ -127,9 +130,8 @@ static const int8_t bpf2a32[][2] = {
 	[BPF_REG_3] = {STACK_OFFSET(BPF_R3_HI), STACK_OFFSET(BPF_R3_LO)},
 	[BPF_REG_4] = {STACK_OFFSET(BPF_R4_HI), STACK_OFFSET(BPF_R4_LO)},
 	[BPF_REG_5] = {STACK_OFFSET(BPF_R5_HI), STACK_OFFSET(BPF_R5_LO)},
-	/* callee saved registers that in-kernel function will preserve */
-	[BPF_REG_6] = {ARM_R5, ARM_R4},
 	/* Stored on stack scratch space */
+	[BPF_REG_6] = {STACK_OFFSET(BPF_R6_HI), STACK_OFFSET(BPF_R6_LO)},
 	[BPF_REG_7] = {STACK_OFFSET(BPF_R7_HI), STACK_OFFSET(BPF_R7_LO)},
 	[BPF_REG_8] = {STACK_OFFSET(BPF_R8_HI), STACK_OFFSET(BPF_R8_LO)},
 	[BPF_REG_9] = {STACK_OFFSET(BPF_R9_HI), STACK_OFFSET(BPF_R9_LO)},
@@ -165,6 +167,11 @@ static bool is_stacked(int8_t reg) {
 	return reg < 0;
 }
 
+/* Where a BPF register lives in this program */
+static const int8_t *jit_reg(jit_state *state, u8 reg) {
+    return reg < JIT_BPF_REGS ? state->reg_map[reg] : bpf2a32[reg];
+}
+
 /* If a BPF register is on the stack (stk is true), load it to the
  * supplied temporary register and return the temporary register
  * for subsequent operations, otherwise just use the CPU register.
@@ -218,23 +225,19 @@ static void arm_bpf_put_reg64(jit_state *state, const s8 *reg, const s8 *src) {
 
 static bool is_ldst_imm(s16 off, const u8 size) {
 	s16 off_max = 0;
-    // 0b11111
-    // imm5 or imm12
+    // imm12 up, imm8 down
 	switch (size) {
-    // 12
 	case EBPF_SIZE_B:
+	case EBPF_SIZE_H:
 	case EBPF_SIZE_W:
 		off_max = 0xfff;
 		break;
-	case EBPF_SIZE_H:
-		off_max = 0xff;
-		break;
 	case EBPF_SIZE_DW:
 		/* Need to make sure off+4 does not overflow. */
 		off_max = 0xfff - 4;
 		break;
 	}
-	return -off_max <= off && off <= off_max;
+	return -0xff <= off && off <= off_max;
 }
 
 /*
@@ -271,7 +274,7 @@ static void _emit_ldr_i(jit_state *state, const s8 Rt, const s8 Rn, s16 off) {
     //     // my_printf("imm8 _emit_ldr_i: %x\n", inst);
     //     emit4(state, inst);
     // } 
-    if (off == 0) { // imm12
+    if (off >= 0) { // imm12, a positive imm8 with P U set is LDRT
         s32 inst = 0xf8d00000 | (Rn << 16) | (Rt << 12) | (off & 0xfff);
         emit4(state, inst);
     } else {
@@ -285,16 +288,16 @@ static void _emit_ldr_i(jit_state *state, const s8 Rt, const s8 Rn, s16 off) {
 
 static void _emit_ldrb_i(jit_state *state, const s8 Rt, const s8 Rn, s16 off) {
     s16 imm5 = 0b11111, imm8 = 0xff, imm12 = 0xfff;
-    if (off <= imm5 && off >= -imm5) {
+    if (off <= imm5 && off >= 0) {
         if (Rt < 8 && Rn < 8) {
             emit2(state, _thumb16_LDRB_IMM_T1(Rt, Rn, off));
             return;
         }
     } 
-    if (off <= imm8 && off >= -imm8) {
+    if (off < 0 && off >= -imm8) {
         // DEBUG_LOG("_thumb32_LDRB_IMM_T3: %d %d %d\n", Rt, Rn, off);
         emit4(state, _thumb32_LDRB_IMM_T3(Rt, Rn, off));
-    } else if (off <= imm12 && off >= -imm12) {
+    } else if (off <= imm12 && off >= 0) { // imm12, not LDRBT
         s32 inst = 0xf8900000 | (Rn << 16) | (Rt << 12) | off;
         emit4(state, inst);
     }
@@ -302,13 +305,13 @@ static void _emit_ldrb_i(jit_state *state, const s8 Rt, const s8 Rn, s16 off) {
 
 static void _emit_ldrh_i(jit_state *state, const s8 Rt, const s8 Rn, s16 off) {
     s16 imm5 = 0b11111, imm8 = 0xff, imm12 = 0xfff;
-    if (off <= imm5 && off >= -imm5) {
-        s16 inst = 0x8800 | ((off & imm5) << 6) | (Rn << 3) | (Rt);
+    if (off >= 0 && off <= 2 * imm5 && !(off & 0x1) && Rt < 8 && Rn < 8) { // imm5 is in halfwords
+        s16 inst = 0x8800 | ((off >> 1) << 6) | (Rn << 3) | (Rt);
         emit2(state, inst);
-    } else if (off <= imm8 && off >= -imm8) {
-        s32 inst = 0xf8300000 | (Rn << 16) | (Rt << 12) | (0b1110 << 8) | (off & imm8);
+    } else if (off < 0 && off >= -imm8) {
+        s32 inst = 0xf8300000 | (Rn << 16) | (Rt << 12) | (0b1100 << 8) | (-off);
         emit4(state, inst);
-    } else if (off <= imm12 && off >= -imm12) {
+    } else if (off <= imm12 && off >= 0) { // imm12, not LDRHT
         s32 inst = 0xf8b00000 | (Rn << 16) | (Rt << 12) | (off & imm12);
         emit4(state, inst);
     }
@@ -339,15 +342,35 @@ static void test_ldr(jit_state *state) {
 
 */
 static void _emit_str_i(jit_state *state, const s8 RnSrc, const s8 Rt,  s16 off) {
-    u8 P = off != 0;
-    u8 U = off > 0, W = 0;
-    u8 imm8 = off > 0 ? off : -off;
+    if (off >= 0) { // imm12, a positive imm8 with P U set is STRT
+        emit4(state, 0xf8c00000 | (RnSrc << 16) | (Rt << 12) | (off & 0xfff));
+        return;
+    }
+    u8 P = 1; // offset addressing, P = 0 with W = 0 is undefined
+    u8 U = 0, W = 0;
+    u8 imm8 = -off;
     u8 flag = 0b1000 | (P << 2) | (U << 1) | (W);
     u32 inst = (THUMB2_STR_IMM)  | (RnSrc << 16) | (Rt << 12) | (flag << 8) | (imm8);
     emit4(state, inst);
     // my_printf("_emit_strd_i: %x rn=%d rt=%d flag: %d off: %d\n", inst, RnSrc, Rt, flag, imm8);
 }
 
+static void _emit_strb_i(jit_state *state, const s8 RnSrc, const s8 Rt, s16 off) {
+    if (off >= 0) { // imm12, not STRBT
+        emit4(state, 0xf8800000 | (RnSrc << 16) | (Rt << 12) | (off & 0xfff));
+    } else {
+        emit4(state, _thumb32_STRB_IMM_T3(RnSrc, Rt, off));
+    }
+}
+
+static void _emit_strh_i(jit_state *state, const s8 RnSrc, const s8 Rt, s16 off) {
+    if (off >= 0) { // imm12, not STRHT
+        emit4(state, 0xf8a00000 | (RnSrc << 16) | (Rt << 12) | (off & 0xfff));
+    } else {
+        emit4(state, _thumb32_STRH_IMM_T3(RnSrc, Rt, off));
+    }
+}
+
 static void _emit_strd_i(jit_state *state, const s8 RnSrc[], const s8 RtDst,  s16 off) {
     // * 4
     emit4(state, _thumb32_STRD_IMM_T1(RnSrc, RtDst, off));
@@ -453,6 +476,14 @@ static void inline _emit_cmp_reg(jit_state *state, const s8 Rn, const s8 Rm) {
 
 }
 
+static void inline _emit_tst_reg(jit_state *state, const s8 Rn, const s8 Rm) {
+    if (Rn < 8 && Rm < 8) {
+        emit2(state, _thumb16_TST_REG_T1(Rn, Rm));
+    } else {
+        emit4(state, _thumb32_TSTW_REG_T2(Rn, Rm));
+    }
+}
+
 static bool inline _use_b4(jit_state *state) {
     return state->inst_num > 20;
     // return true;
@@ -511,7 +542,7 @@ static void emit_alu32_reg(jit_state *state, const s8 dst, const s8 src,
         if (rn > 0 && rn < 8 && rd > 0 && rd < 8) {
             emit2(state, (0x4040) | (rn << 3) | (rd));
         } else {
-            emit4(state, _thumb32_EOR_REG_T2(rd, rn, rd, 0, SRTYPE_ROR, FLAG_NOS));
+            emit4(state, _thumb32_EOR_REG_T2(rd, rd, rn, 0, SRTYPE_LSL, FLAG_NOS));
         }
         break;
     case EBPF_ALU_MUL: // MUL
@@ -570,6 +601,24 @@ static void emit_alu32_imm(jit_state *state, const s8 dst, const u16 val, const
     s8 rd = arm_bpf_get_reg32(state, dst, tmp[0]);
 
     /* Do shift operation */
+    if (rd >= 8) { // no 16 bit encoding
+        switch (op) {
+        case EBPF_ALU_LSH:
+            emit4(state, _thumb32_LSLW_IMM_T2(rd, rd, val, FLAG_NOS));
+            break;
+        case EBPF_ALU_RSH:
+            emit4(state, _thumb32_LSRW_IMM_T2(rd, rd, val, FLAG_NOS));
+            break;
+        case EBPF_ALU_ARSH:
+            emit4(state, _thumb32_ASRW_IMM_T2(rd, rd, val, FLAG_NOS));
+            break;
+        case EBPF_ALU_NEG:
+            emit4(state, _thumb32_RSBW_IMM_T2(rd, rd, 0, FLAG_NOS));
+            break;
+        }
+        arm_bpf_put_reg32(state, dst, rd);
+        return;
+    }
     switch (op) {
     case EBPF_ALU_LSH:
         emit2(state, (0x0000) | (val << 6) | (rd << 3) | (rd));
@@ -588,7 +637,7 @@ static void emit_alu32_imm(jit_state *state, const s8 dst, const u16 val, const
     arm_bpf_put_reg32(state, dst, rd);
 }
 
-static void emit_u32_div_mod(jit_state *state, const s8 dst[], const s8 src[], const u16 code, const u16 imm) {
+static void emit_u32_div_mod(jit_state *state, const s8 dst[], const s8 src[], const u16 code, const u32 imm) {
     const s8 *tmp = bpf2a32[TMP_REG_1];
     const s8 *tmp2 = bpf2a32[TMP_REG_2];
     s8 rd_lo, rt;
@@ -612,7 +661,8 @@ static void emit_u32_div_mod(jit_state *state, const s8 dst[], const s8 src[], c
     } else { // MOD
         u32 inst = (0xfbb0f0f0) | (rd_lo << 16) | (ARM_IP << 8) | (rt);
         emit4(state, inst);
-        inst = (0xfb000010) | (rd_lo << 16) | (ARM_IP << 12) | (rd_lo << 8) | (rt);
+        // MLS rd = rd - ip * rt
+        inst = (0xfb000010) | (ARM_IP << 16) | (rd_lo << 12) | (rd_lo << 8) | (rt);
         emit4(state, inst);
     }
 
@@ -625,15 +675,11 @@ static void _emit_cmp_cond(jit_state *state, s8 rd, s8 rt, s8 rm, s8 rn, u8 op,
     switch (op)
     {
     case EBPF_JSET:
+        // Z is clear when a bit of the low or (if those are 0) the high halves is set
+        _emit_tst_reg(state, rt, rn);
         if (is_jmp64) {
-            // emit(ARM_AND_R(ARM_IP, rt, rn), ctx);
-            emit4(state, _thumb32_ADDW_REG_T3(ARM_IP, rt, rn, 0, SRTYPE_LSL, FLAG_NOS));
-            // emit(ARM_AND_R(ARM_LR, rd, rm), ctx);
-            emit4(state, _thumb32_ADDW_REG_T3(ARM_LR, rd, rm, 0, SRTYPE_LSL, FLAG_NOS));
-            // emit(ARM_ORRS_R(ARM_IP, ARM_LR, ARM_IP), ctx);
-            emit4(state, _thumb32_ORRW_REG_T2(ARM_IP, ARM_LR, ARM_IP, 0, SRTYPE_LSL, FLAG_S));
-        } else {
-            emit4(state, _thumb32_ADDW_REG_T3(ARM_IP, rt, rn, 0, SRTYPE_LSL, FLAG_S));
+            emit2(state, _thumb16_IT_T1(COND_EQ, IT_MASK_NONE));
+            _emit_tst_reg(state, rd, rm);
         }
         break;
     
@@ -649,7 +695,8 @@ static void _emit_cmp_cond(jit_state *state, s8 rd, s8 rt, s8 rm, s8 rn, u8 op,
             // DEBUG_LOG("_emit_cmp_reg: %d %d\n", rd, rm);
 			/* Only compare low halve if high halve are equal. */
 			// _emit(ARM_COND_EQ, ARM_CMP_R(rt, rn), ctx);
-             _emit_cmp_reg(state, rt, rn);
+            emit2(state, _thumb16_IT_T1(COND_EQ, IT_MASK_NONE));
+            _emit_cmp_reg(state, rt, rn);
 		} else {
 			// emit(ARM_CMP_R(rt, rn), ctx);
              _emit_cmp_reg(state, rt, rn);
@@ -684,59 +731,37 @@ static void _emit_cmp_cond(jit_state *state, s8 rd, s8 rt, s8 rm, s8 rn, u8 op,
     }
 }
 
-static void _emit_jump(jit_state *state, s32 jmp_off, s8 op) {
+// condition code after _emit_cmp_cond, COND_AL for no jump
+static u8 _jump_cond(u8 op) {
     switch (op)
     {
     case EBPF_JNE: // != 
     case EBPF_JSET: // &
-        // emit4()
-        _emit_b_cond(state, jmp_off, COND_NE);
-        break;
-
+        return COND_NE;
     case EBPF_JEQ:
-        // DEBUG_LOG("_emit_b_cond: %d %d\n", jmp_off, COND_EQ);
-        _emit_b_cond(state, jmp_off, COND_EQ);
-        break;
-
+        return COND_EQ;
     case EBPF_JGT:
-        _emit_b_cond(state, jmp_off, COND_HI);
-        break;
+        return COND_HI;
     case EBPF_JGE:
-		// _emit(ARM_COND_CS, ARM_B(jmp_offset), ctx);
-        _emit_b_cond(state, jmp_off, COND_CS);
-        break;
-    case EBPF_JSGT:
-        // _emit(ARM_COND_LT, ARM_B(jmp_offset), ctx);
-        // DEBUG_LOG("------>EBPF_JSGT: %d idx:%d\n", jmp_off, state->idx);
-        _emit_b_cond(state, jmp_off, COND_LT);
-        //  DEBUG_LOG("END------>EBPF_JSGT: %d idx:%d\n", jmp_off, state->idx);
-        break;
+        return COND_CS;
+    case EBPF_JSGT: // operands swapped
+        return COND_LT;
     case EBPF_JSGE:
-        // _emit(ARM_COND_GE, ARM_B(jmp_offset), ctx);
-        _emit_b_cond(state, jmp_off, COND_GE);
-        break;
+        return COND_GE;
     case EBPF_JLE:
-        // _emit(ARM_COND_LS, ARM_B(jmp_offset), ctx);
-        _emit_b_cond(state, jmp_off, COND_LS);
-        break;
+        return COND_LS;
     case EBPF_JLT:
-        // _emit(ARM_COND_CC, ARM_B(jmp_offset), ctx);
-        _emit_b_cond(state, jmp_off, COND_CC);
-        break;
+        return COND_CC;
     case EBPF_JSLT:
-        // _emit(ARM_COND_LT, ARM_B(jmp_offset), ctx);
-        _emit_b_cond(state, jmp_off, COND_LT);
-        break;
-    case EBPF_JSLE:
-        // _emit(ARM_COND_GE, ARM_B(jmp_offset), ctx);
-        _emit_b_cond(state, jmp_off, COND_GE);
-        break;
-
+        return COND_LT;
+    case EBPF_JSLE: // operands swapped
+        return COND_GE;
     default:
-        break;
+        return COND_AL;
     }
 }
 
+
 void _emit_lsh64_reg(jit_state *state, const s8 dst[], const s8 src[]) {
     const s8 *tmp = bpf2a32[TMP_REG_1];
     const s8 *tmp2 = bpf2a32[TMP_REG_2];
@@ -800,7 +825,7 @@ void _emit_lsh64_reg(jit_state *state, const s8 dst[], const s8 src[]) {
    
     // ARM_IP = ARM_IP or (rd[1] >> (32 - rt))  shift <= 0 ommit
     // 1. tmp2[0] = rd[1] >> tmp2[0] 2. ARM_IP = tmp2[0] or ARM_IP
-    inst = (THUMB2_LSLW_REG_T2) | (rd[1] << 16) | (tmp2[0] << 8) | (tmp2[0]);
+    inst = (THUMB2_LSRW_REG) | (rd[1] << 16) | (tmp2[0] << 8) | (tmp2[0]);
     emit4(state, inst);
     inst = (THUMB2_ORRW_REG) | (tmp2[0] << 16) | (ARM_IP << 8) | (ARM_IP); 
     emit4(state, inst);
@@ -827,19 +852,16 @@ void _emit_lsh64_imm(jit_state *state, const s8 dst[], const u16 val) {
     if (val < 32) {
         // emit(ARM_MOV_SI(tmp2[0], rd[0], SRTYPE_ASL, val), ctx);
         // LSLS.W tmp2[0] = rd[0] << val
-        u16 imm3 = (val & 0b11100) >> 2;
-        u16 imm2 = (val & 0b11);
-        u32 inst = (0xea5f0000) | (imm3 << 12) | (tmp2[0] << 8) | (imm2 << 4) | (rd[0]);  
-        emit4(state, inst);
+        emit4(state, _thumb32_LSLW_IMM_T2(tmp2[0], rd[0], val, FLAG_S));
         // emit(ARM_ORR_SI(rd[0], tmp2[0], rd[1], SRTYPE_LSR, 32 - val), ctx);
         // ORRS.W rd[0] = tmp2[0] or (rd[1] >> (32 -val))
-        imm3 = ((32 - val) & 0b11100) >> 2;
-        imm2 = ((32 - val) & 0b11);
-        inst = (0xea500010) | (tmp2[0] << 16) | (imm3 << 12) | (rd[0] << 8) | (imm2 << 6) | (rd[1]);
+        u16 imm3 = ((32 - val) & 0b11100) >> 2;
+        u16 imm2 = ((32 - val) & 0b11);
+        u32 inst = (0xea500010) | (tmp2[0] << 16) | (imm3 << 12) | (rd[0] << 8) | (imm2 << 6) | (rd[1]);
         emit4(state, inst);
         // emit(ARM_MOV_SI(rd[1], rd[1], SRTYPE_ASL, val), ctx);
         // lsls imm 
-        emit2(state, (0x0000) | (val << 6) | (rd[1]<< 3) | (rd[1]));
+        emit4(state, _thumb32_LSLW_IMM_T2(rd[1], rd[1], val, FLAG_NOS));
     } else {
         if (val == 32) { // 0
             // emit(ARM_MOV_R(rd[0], rd[1]), ctx); 
@@ -849,11 +871,11 @@ void _emit_lsh64_imm(jit_state *state, const s8 dst[], const u16 val) {
         } else {
             // emit(ARM_MOV_SI(rd[0], rd[1], SRTYPE_ASL, val - 32), ctx);
             // rd[0] = rd[1] << (val - 32)
-            emit2(state, (0x0000) | ((val - 32) << 6) | (rd[1] << 3) | (rd[0]));
+            emit4(state, _thumb32_LSLW_IMM_T2(rd[0], rd[1], val - 32, FLAG_NOS));
         }
         // emit(ARM_EOR_R(rd[1], rd[1], rd[1]), ctx);
-        // rd[1] = rd[1]^rd[1] = 0
-        emit2(state, (0x4040) | (rd[1] << 3) | (rd[1]));
+        // rd[1] = 0
+        emit_mov_imm(state, rd[1], 0);
     }
     arm_bpf_put_reg64(state, dst, rd);
 }
@@ -867,25 +889,24 @@ static inline void emit_a32_rsh_r64(jit_state *state, const s8 dst[], const s8 s
     /* Setup Operands */
     rt = arm_bpf_get_reg32(state, src_lo, tmp2[1]);
     rd = arm_bpf_get_reg64(state, dst, tmp);
+    if (rt == rd[0] || rt == rd[1]) { // dst >>= dst, keep the count
+        _emit_mov_reg(state, rt, tmp2[1]);
+        rt = tmp2[1];
+    }
 
-    /* Do RSH operation */
-    // emit(ARM_RSB_I(ARM_IP, rt, 32), ctx);
-    emit4(state, _thumb32_RSBW_IMM_T2(ARM_IP, rt, 32, FLAG_S));
-    // emit(ARM_SUBS_I(tmp2[0], rt, 32), ctx);
-    emit4(state, _thumb32_SUBW_IMM_T4(tmp2[0], rt, 32, FLAG_S));
-    // emit(ARM_MOV_SR(ARM_LR, rd[1], SRTYPE_LSR, rt), ctx);
-    emit4(state, _thumb32_LSRW_REG_T2(ARM_LR, rd[1], rt, FLAG_S));
-    // emit(ARM_ORR_SR(ARM_LR, ARM_LR, rd[0], SRTYPE_ASL, ARM_IP), ctx);
-    emit4(state, _thumb32_LSLW_REG_T2(rd[0], rd[0], ARM_IP, FLAG_S));
-    emit4(state, _thumb32_ORRW_REG_T2(ARM_LR, ARM_LR, rd[0], 0, SRTYPE_LSL, FLAG_S));
-    // emit(ARM_ORR_SR(ARM_LR, ARM_LR, rd[0], SRTYPE_LSR, tmp2[0]), ctx);
-    emit4(state, _thumb32_LSRW_REG_T2(rd[0], rd[0], tmp2[0], FLAG_S));
-    emit4(state, _thumb32_ORRW_REG_T2(ARM_LR, ARM_LR, rd[0], 0, SRTYPE_LSL, FLAG_S));
-    // emit(ARM_MOV_SR(ARM_IP, rd[0], SRTYPE_LSR, rt), ctx);
-    emit4(state, _thumb32_LSRW_REG_T2(ARM_IP, rd[0], rt, FLAG_S));
-
-    arm_bpf_put_reg32(state, dst_lo, ARM_LR);
-    arm_bpf_put_reg32(state, dst_hi, ARM_IP);
+    /* Do RSH operation, register shifts by 32 or more give 0 */
+    // lo = lo >> rt | hi << (32 - rt) | hi >> (rt - 32)
+    emit4(state, _thumb32_RSBW_IMM_T2(ARM_IP, rt, 32, FLAG_NOS));
+    emit4(state, _thumb32_LSRW_REG_T2(rd[1], rd[1], rt, FLAG_NOS));
+    emit4(state, _thumb32_LSLW_REG_T2(ARM_IP, rd[0], ARM_IP, FLAG_NOS));
+    emit4(state, _thumb32_ORRW_REG_T2(rd[1], rd[1], ARM_IP, 0, SRTYPE_LSL, FLAG_NOS));
+    emit4(state, _thumb32_SUBW_IMM_T4(ARM_IP, rt, 32, FLAG_NOS));
+    emit4(state, _thumb32_LSRW_REG_T2(ARM_IP, rd[0], ARM_IP, FLAG_NOS));
+    emit4(state, _thumb32_ORRW_REG_T2(rd[1], rd[1], ARM_IP, 0, SRTYPE_LSL, FLAG_NOS));
+    // hi = hi >> rt
+    emit4(state, _thumb32_LSRW_REG_T2(rd[0], rd[0], rt, FLAG_NOS));
+
+    arm_bpf_put_reg64(state, dst, rd);
 }
 
 static inline void emit_a32_rsh_i64(jit_state *state, const s8 dst[], const u16 val) {
@@ -937,29 +958,26 @@ static inline void emit_a32_arsh_r64(jit_state *state, const s8 dst[], const s8
     /* Setup Operands */
     rt = arm_bpf_get_reg32(state, src_lo, tmp2[1]);
     rd = arm_bpf_get_reg64(state, dst, tmp);
+    if (rt == rd[0] || rt == rd[1]) {
+        _emit_mov_reg(state, rt, tmp2[1]);
+        rt = tmp2[1];
+    }
 
     /* Do the ARSH operation */
-    // emit(ARM_RSB_I(ARM_IP, rt, 32), ctx);
+    // lo = lo >> rt | hi << (32 - rt), flags: LE when rt >= 32
     emit4(state, _thumb32_RSBW_IMM_T2(ARM_IP, rt, 32, FLAG_S));
-	// emit(ARM_SUBS_I(tmp2[0], rt, 32), ctx);
-    emit4(state, _thumb32_SUBW_IMM_T4(tmp2[0], rt, 32, FLAG_S));
-	// emit(ARM_MOV_SR(ARM_LR, rd[1], SRTYPE_LSR, rt), ctx);
-    emit4(state, _thumb32_LSRW_REG_T2(ARM_LR, rd[1], rt, FLAG_S));
-
-	// emit(ARM_ORR_SR(ARM_LR, ARM_LR, rd[0], SRTYPE_ASL, ARM_IP), ctx);
-    emit4(state, _thumb32_LSLW_REG_T2(rd[0], rd[0], tmp2[0], FLAG_NOS));
-    emit4(state, _thumb32_ORRW_REG_T2(ARM_LR, ARM_LR, rd[0], 0, SRTYPE_LSL, FLAG_S));
-
-	// _emit(ARM_COND_PL, ARM_ORR_SR(ARM_LR, ARM_LR, rd[0], SRTYPE_ASR, tmp2[0]), ctx);
-    emit4(state, _thumb32_ASRW_REG_T2(rd[0], rd[0], tmp2[0], FLAG_NOS));
-    emit2(state, _thumb16_IT_T1(COND_PL, IT_MASK_NONE));
-    emit4(state, _thumb32_ORRW_REG_T2(ARM_LR, ARM_LR, rd[0], 0, SRTYPE_LSL, FLAG_S));
+    emit4(state, _thumb32_LSRW_REG_T2(rd[1], rd[1], rt, FLAG_NOS));
+    emit4(state, _thumb32_LSLW_REG_T2(ARM_IP, rd[0], ARM_IP, FLAG_NOS));
+    emit4(state, _thumb32_ORRW_REG_T2(rd[1], rd[1], ARM_IP, 0, SRTYPE_LSL, FLAG_NOS));
+    // lo |= hi >> (rt - 32) (signed) only for rt >= 32, it is all sign bits below
+    emit4(state, _thumb32_SUBW_IMM_T4(ARM_IP, rt, 32, FLAG_NOS));
+    emit4(state, _thumb32_ASRW_REG_T2(ARM_IP, rd[0], ARM_IP, FLAG_NOS));
+    emit2(state, _thumb16_IT_T1(COND_LE, IT_MASK_NONE));
+    emit4(state, _thumb32_ORRW_REG_T2(rd[1], rd[1], ARM_IP, 0, SRTYPE_LSL, FLAG_NOS));
+    // hi = hi >> rt (signed)
+    emit4(state, _thumb32_ASRW_REG_T2(rd[0], rd[0], rt, FLAG_NOS));
 
-    // emit(ARM_MOV_SR(ARM_IP, rd[0], SRTYPE_ASR, rt), ctx);
-    emit4(state, _thumb32_ASRW_REG_T2(ARM_IP, rd[0], rt, FLAG_S));
-
-    arm_bpf_put_reg32(state, dst_lo, ARM_LR);
-    arm_bpf_put_reg32(state, dst_hi, ARM_IP);
+    arm_bpf_put_reg64(state, dst, rd);
 }
 
 /* dst = dst >> val (signed) */
@@ -998,7 +1016,7 @@ static inline void emit_a32_arsh_i64(jit_state *state, const s8 dst[], const u32
     arm_bpf_put_reg64(state, dst, rd);
 }
 
-/* dst = ~dst (64 bit) */
+/* dst = -dst (64 bit) */
 static inline void emit_a32_neg64(jit_state *state, const s8 dst[]){
     const s8 *tmp = bpf2a32[TMP_REG_1];
     const s8 *rd;
@@ -1010,12 +1028,13 @@ static inline void emit_a32_neg64(jit_state *state, const s8 dst[]){
     // emit(ARM_RSBS_I(rd[1], rd[1], 0), ctx);
     emit4(state, _thumb32_RSBW_IMM_T2(rd[1], rd[1], 0, FLAG_S));
 
-    // emit(ARM_RSC_I(rd[0], rd[0], 0), ctx);
-    emit4(state, _thumb32_RSBW_IMM_T2(rd[0], rd[0], 0, FLAG_S));
+    // emit(ARM_RSC_I(rd[0], rd[0], 0), ctx); no RSC in Thumb: hi - 2 * hi - borrow
+    emit4(state, _thumb32_SBCW_T2(rd[0], rd[0], rd[0], 1, SRTYPE_LSL, FLAG_NOS));
 
     arm_bpf_put_reg64(state, dst, rd);
 }
 
+/* dst = dst * src (64 bit): UMULL of the low words, MLA adds the cross products to the high word */
 static inline void emit_a32_mul_r64(jit_state *state, const s8 dst[], const s8 src[]) {
 	const s8 *tmp = bpf2a32[TMP_REG_1];
 	const s8 *tmp2 = bpf2a32[TMP_REG_2];
@@ -1026,21 +1045,28 @@ static inline void emit_a32_mul_r64(jit_state *state, const s8 dst[], const s8 s
 	rt = arm_bpf_get_reg64(state, src, tmp2);
 
 	/* Do Multiplication */
-	// emit(ARM_MUL(ARM_IP, rd[1], rt[0]), ctx);
+	// ip = lo * src_hi + hi * src_lo
     emit4(state, _thumb32_MUL_T2(ARM_IP, rd[1], rt[0]));
-	// emit(ARM_MUL(ARM_LR, rd[0], rt[1]), ctx);
-    emit4(state, _thumb32_MUL_T2(ARM_LR, rd[0], rt[1]));
-	// emit(ARM_ADD_R(ARM_LR, ARM_IP, ARM_LR), ctx);
-    emit2(state, _thumb16_ADD_REG_T2(ARM_LR, ARM_IP));
+    emit4(state, _thumb32_MLA_T1(ARM_IP, rd[0], rt[1], ARM_IP));
+	// hi:lo = lo * src_lo, hi += ip
+    emit4(state, _thumb32_UMULL_T2(rd[1], rd[0], rd[1], rt[1]));
+    emit2(state, _thumb16_ADD_REG_T2(rd[0], ARM_IP));
+
+	arm_bpf_put_reg64(state, dst, rd);
+}
 
-	// emit(ARM_UMULL(ARM_IP, rd[0], rd[1], rt[1]), ctx);
-    emit4(state, _thumb32_UMULL_T2(ARM_IP, rd[0], rd[1], rt[1]));
+/* dst = dst * imm, imm >= 0: the high word of imm is 0, one cross product */
+static inline void emit_a32_mul_i64(jit_state *state, const s8 dst[], const u32 imm) {
+	const s8 *tmp = bpf2a32[TMP_REG_1];
+	const s8 *tmp2 = bpf2a32[TMP_REG_2];
+	const s8 *rd = arm_bpf_get_reg64(state, dst, tmp);
 
-	// emit(ARM_ADD_R(rd[0], ARM_LR, rd[0]), ctx);
-     emit2(state, _thumb16_ADD_REG_T2(rd[0], ARM_LR));
+	emit_mov_imm(state, tmp2[1], imm);
+	// ip:lo = lo * imm, hi = hi * imm + ip
+    emit4(state, _thumb32_UMULL_T2(rd[1], ARM_IP, rd[1], tmp2[1]));
+    emit4(state, _thumb32_MLA_T1(rd[0], rd[0], tmp2[1], ARM_IP));
 
-	arm_bpf_put_reg32(state, dst_lo, ARM_IP);
-	arm_bpf_put_reg32(state, dst_hi, rd[0]);
+	arm_bpf_put_reg64(state, dst, rd);
 }
 
 #ifdef JIT_TEST_FUNC
@@ -1122,6 +1148,9 @@ void emit_ldx_reg(jit_state *state, const s8 dst[], const s8 src, s16 off, const
             // _emit_ldrd_i(state, rd, rm, off);
             break;
     }
+    if (sz != EBPF_SIZE_DW) { // narrow loads zero extend
+        emit_mov_imm(state, rd[0], 0);
+    }
     arm_bpf_put_reg64(state, dst, rd);
 }
 
@@ -1141,23 +1170,23 @@ static void emit_str_reg(jit_state *state, const s8 dst, const s8 src[], s16 off
     case EBPF_SIZE_B:
         /* Store a Byte */
         // emit(ARM_STRB_I(src_lo, rd, off), ctx);
-        emit4(state, _thumb32_STRB_IMM_T3(src_lo, rd, off));
+        _emit_strb_i(state, rd, src_lo, off);
         break;
     case EBPF_SIZE_H:
         /* Store a HalfWord */
         // emit(ARM_STRH_I(src_lo, rd, off), ctx);
-        emit4(state, _thumb32_STRH_IMM_T3(src_lo, rd, off));
+        _emit_strh_i(state, rd, src_lo, off);
         break;
     case EBPF_SIZE_W:
         /* Store a Word */
-        _emit_str_i(state, src_lo, rd, off);
+        _emit_str_i(state, rd, src_lo, off);
         break;
     case EBPF_SIZE_DW:
         /* Store a Double Word */
         // emit(ARM_STR_I(src_lo, rd, off), ctx);
         // emit(ARM_STR_I(src_hi, rd, off + 4), ctx);
-        _emit_str_i(state, src_lo, rd, off);
-        _emit_str_i(state, src_hi, rd, off + 4);
+        _emit_str_i(state, rd, src_lo, off);
+        _emit_str_i(state, rd, src_hi, off + 4);
         break;
     }
 }
@@ -1254,14 +1283,22 @@ static void emit_push_r64(jit_state *state, s8 src[]) {
 
     rt = arm_bpf_get_reg64(state, src, tmp2);
     // DEBUG_LOG("emit_push_r64: %d %d\n", rt[0], rt[1]);
-    reg_set = (1 << rt[1]) | (1 << rt[0]);
-    if ((rt[0] == ARM_LR || rt[0] < 8) && (rt[1] == ARM_LR || rt[1] < 8)) {
+    reg_set = (1 << rt[1]) | (1 << rt[0]); // lo < hi, the low word is pushed below
+    if (rt[0] < 8 && rt[1] < 8) {
         emit2(state, _thumb16_PUSH_T1(reg_set));
     } else {
         emit4(state, _thumb32_PUSHW_T2(reg_set));
     }
 }
 
+// load the low word of a BPF register into an ARM argument register
+static void emit_load_arg32(jit_state *state, const s8 src[], const s8 rd) {
+    s8 rt = arm_bpf_get_reg32(state, src_lo, rd);
+    if (rt != rd) {
+        _emit_mov_reg(state, rt, rd);
+    }
+}
+
 static void emit_mov_i64(jit_state *state, const s8 dst[], u64 val)
 {
     const s8 *tmp = bpf2a32[TMP_REG_1];
@@ -1282,10 +1319,32 @@ static void emit_mov_se_imm64(jit_state *state, const bool is64, const s8 dst[],
         emit_mov_i64(state, dst, val64);
         //my_printf("emit_mov_se_imm64asd\n");
     } else {
-        emit_mov_imm(state, dst[1], val);
+        s8 rd = is_stacked(dst_lo) ? bpf2a32[TMP_REG_1][1] : dst_lo;
+        emit_mov_imm(state, rd, val);
+        arm_bpf_put_reg32(state, dst_lo, rd);
     }
 }
 
+/* dst_hi = 0, after the 32 bit operations */
+static void emit_zext_hi(jit_state *state, const s8 dst[]) {
+    s8 rd = is_stacked(dst_hi) ? bpf2a32[TMP_REG_1][0] : dst_hi;
+    emit_mov_imm(state, rd, 0);
+    arm_bpf_put_reg32(state, dst_hi, rd);
+}
+
+// Thumb instructions emit_mov_imm takes
+static int mov_imm_insts(const u8 rd, u32 val) {
+    if (val <= 0xff && rd < 8) {
+        return 1;
+    }
+    return val > 0xffff ? 2 : 1;
+}
+
+// Thumb instructions emit_mov_i64 takes for a register in ARM registers
+static int mov_i64_insts(const s8 dst[], const u64 val) {
+    return mov_imm_insts(dst[1], (u32) val) + mov_imm_insts(dst[0], val >> 32);
+}
+
 static void test_mov(jit_state *state) {
     s8 dst[] = {0, 3};
     emit_mov_se_imm64(state, false, dst, 0x100);
@@ -1293,32 +1352,190 @@ static void test_mov(jit_state *state) {
     emit_a32_mov_reg(state, 0, 1);
 }
 
-// inst_delta = cmp, and other insts
-static inline int bpf2a32_offset(jit_state *state, int bpf_from, int bpf_to, int bsize) {
-    int to, from;
+// start of a branch target, offsets[i] is the end of instruction i
+static inline int branch_target(jit_state *state, u8 kind, int target) {
+    switch (kind) {
+    case JIT_FIX_INSN:
+        return target == 0 ? state->body_offset : state->offsets[target - 1];
+    case JIT_FIX_EPILOGUE:
+        return state->epilogue_offset;
+    case JIT_FIX_SFI_FAIL:
+        return state->sfi_fail_offset;
+    default:
+        return target;
+    }
+}
 
-    if (!state->needGen) {
-        return 0;
+/*
+Two pass: the offset comes from the sizing pass. Single pass: the target may not
+be emitted yet, a B.W placeholder is recorded and jit_relax encodes it at the
+end, short when the target is close enough.
+*/
+static void emit_branch(jit_state *state, u8 kind, int target, u8 cond, u8 cbz_reg) {
+    if (!state->two_pass) {
+        if (state->needGen) {
+            if (state->fixup_num >= state->max_fixups) {
+                state->err_line = __LINE__;
+            } else {
+                jit_fixup *f = &state->fixups[state->fixup_num++];
+                f->pos = state->idx;
+                f->target = target;
+                f->kind = kind;
+                f->cond = cond;
+                f->cbz_reg = cbz_reg;
+                f->size = 4;
+            }
+        }
+        emit4(state, 0);
+        return;
     }
+    s32 off = state->needGen ? branch_target(state, kind, target) - state->idx - 4 : 0;
+    if (cbz_reg != JIT_FIX_NO_CBZ) {
+        emit2(state, _thumb16_CBZ_T1(cbz_reg, off, cond == COND_NE));
+    } else if (kind == JIT_FIX_SFI_FAIL || kind == JIT_FIX_BYTE) { // sized blocks, always B.W
+        emit4(state, _thumb32_BW_T3(off, cond));
+    } else if (cond == COND_AL) {
+        _emit_b(state, off);
+    } else {
+        _emit_b_cond(state, off, cond);
+    }
+}
+
+/*
+SFI: a load or store the verifier could not prove must stay in the BPF stack or
+the ctx, otherwise the program returns -1 as the interpreter does. The ctx and
+its length are kept in the tail call slots, which are not used.
+*/
+#define SFI_CTX_BASE STACK_OFFSET(BPF_TC_LO)
+#define SFI_CTX_LEN STACK_OFFSET(BPF_TC_HI)
+
+/*
+PIC: code compiled off the device (tools/jit_cross) does not know the helper
+addresses. The caller passes the helper table in r2, the prologue keeps it in
+the blinding slot, which is not used, and CALL loads the address from it.
+*/
+#define PIC_HELPERS STACK_OFFSET(BPF_AX_LO)
+
+// address of helper imm in rd
+static void emit_helper_addr(jit_state *state, s8 rd, s32 imm) {
+    if (state->pic) {
+        _emit_ldr_i(state, rd, ARM_FP, EBPF_SCRATCH_TO_ARM_FP(PIC_HELPERS));
+        _emit_ldr_i(state, rd, rd, imm * 4);
+    } else {
+        emit_mov_imm(state, rd, *(u32 *) (state->__bpf_call_base + imm * 4));
+    }
+}
 
-    to = state->offsets[bpf_to];
-    from = state->offsets[bpf_from] - bsize;
-    // DEBUG_LOG("pc[%d->%d] from: 0x%x to: 0x%x\n", bpf_from, bpf_to, from, to);
-    // gaps
-    return to - from - 4;
+// address in tmp[1]: ctx <= addr && addr + size <= ctx + len
+static void emit_sfi_ctx_check(jit_state *state, int size, int skip) {
+    const s8 *tmp = bpf2a32[TMP_REG_1];
+    _emit_ldr_i(state, tmp[0], ARM_FP, EBPF_SCRATCH_TO_ARM_FP(SFI_CTX_BASE));
+    _emit_cmp_reg(state, tmp[1], tmp[0]);
+    emit_branch(state, JIT_FIX_SFI_FAIL, 0, COND_CC, JIT_FIX_NO_CBZ);
+    _emit_sub_reg(state, tmp[1], tmp[0], false, false);
+    _emit_add_imm(state, tmp[1], tmp[1], size);
+    _emit_ldr_i(state, tmp[0], ARM_FP, EBPF_SCRATCH_TO_ARM_FP(SFI_CTX_LEN));
+    _emit_cmp_reg(state, tmp[1], tmp[0]);
+    emit_branch(state, JIT_FIX_SFI_FAIL, 0, COND_HI, JIT_FIX_NO_CBZ);
+}
+
+// tmp[0] is the stack bottom, skip the ctx check if addr + size <= fp
+static void emit_sfi_stack_top(jit_state *state, int size, int skip) {
+    const s8 *tmp = bpf2a32[TMP_REG_1];
+    _emit_add_imm(state, tmp[0], tmp[0], STACK_SIZE - size);
+    _emit_cmp_reg(state, tmp[1], tmp[0]);
+    emit_branch(state, JIT_FIX_BYTE, state->idx + 4 + skip, COND_LS, JIT_FIX_NO_CBZ);
 }
 
-static inline int epilogue_offset(jit_state *state) {
-    int to, from;
-    /* No need for 1st dummy run */
-    if (!state->needGen) {
-        return 0;
+// bytes a block takes, nothing is written
+static int sfi_measure(jit_state *state, void (*emit)(jit_state *, int, int), int size) {
+    bool gen = state->needGen;
+    int idx = state->idx;
+    state->needGen = false;
+    emit(state, size, 0);
+    int len = state->idx - idx;
+    state->idx = idx;
+    state->needGen = gen;
+    return len;
+}
+
+// only uses tmp and the flags, emitted before the access itself
+static void emit_sfi_check(jit_state *state, const s8 base, s16 off, int size) {
+    const s8 *tmp = bpf2a32[TMP_REG_1];
+    s8 rn = arm_bpf_get_reg32(state, base, tmp[1]);
+    if (off >= 0 && off <= 4095) {
+        _emit_add_imm(state, tmp[1], rn, off);
+    } else if (off < 0 && off >= -4095) {
+        _emit_sub_imm(state, tmp[1], rn, -off);
+    } else {
+        if (rn != tmp[1]) {
+            _emit_mov_reg(state, rn, tmp[1]);
+        }
+        emit_mov_imm(state, tmp[0], (u32) (s32) off);
+        _emit_add_reg(state, tmp[1], tmp[0], false, false);
     }
-    to = state->epilogue_offset; // <---- epilogue
-    from = state->idx; // <-----
-    // DEBUG_LOG("epilogue_offset: %d %d off=%d\n", to, from, to - from + 4);
-    // 
-    return to - from - 4;
+    // BPF stack: [fp - STACK_SIZE, fp), fp = ARM_FP - SCRATCH_SIZE
+    _emit_sub_imm(state, tmp[0], ARM_FP, SCRATCH_SIZE + STACK_SIZE);
+    _emit_cmp_reg(state, tmp[1], tmp[0]);
+    int skip = sfi_measure(state, emit_sfi_stack_top, size);
+    emit_branch(state, JIT_FIX_BYTE, state->idx + 4 + skip, COND_CC, JIT_FIX_NO_CBZ);
+    emit_sfi_stack_top(state, size, sfi_measure(state, emit_sfi_ctx_check, size));
+    emit_sfi_ctx_check(state, size, 0);
+}
+
+static bool is_branch(const ebpf_inst *inst) {
+    return (inst->opcode & EBPF_CLS_MASK) == EBPF_CLS_JMP && inst->opcode != EBPF_OP_CALL
+        && inst->opcode != EBPF_OP_EXIT;
+}
+
+/*
+j<cond> +1 over a move of an immediate to an ARM register: the move is put in
+an IT block instead of being jumped over. Nothing may jump to the move.
+*/
+static bool jit_if_convert(jit_state *state, int pc) {
+    const ebpf_inst *mov = &state->insts[pc + 1];
+    if (state->insts[pc].offset != 1 || pc + 1 >= state->inst_num
+        || (state->inst_flags[pc + 1] & JIT_INST_TARGET)) {
+        return false;
+    }
+    if (mov->opcode != EBPF_OP_MOV_IMM && mov->opcode != EBPF_OP_MOV64_IMM) {
+        return false;
+    }
+    return !is_stacked(jit_reg(state, mov->dst)[1]);
+}
+
+/*
+JEQ/JNE dst, 0 to a close forward target: ORR the halves and CBZ/CBNZ, no
+immediate, compare or IT. Two pass: decided in the relax pass from the offsets
+of the pass before, branches only get shorter so the target stays in range.
+Single pass: jit_relax decides, ORRS leaves the flags for a B<c> otherwise.
+*/
+#define JIT_CBZ_RANGE 126
+
+static bool jit_use_cbz(jit_state *state, int pc) {
+    const ebpf_inst *inst = &state->insts[pc];
+    if (state->two_pass && !state->relax) {
+        return (state->inst_flags[pc] & JIT_INST_CBZ) != 0;
+    }
+    if ((inst->opcode != EBPF_OP_JEQ_IMM && inst->opcode != EBPF_OP_JNE_IMM) || inst->imm != 0
+        || inst->offset == 0 || jit_if_convert(state, pc)) {
+        return false;
+    }
+    if (!state->two_pass) {
+        return true;
+    }
+    if (inst->offset < 0 || (int) state->offsets[pc + inst->offset] - state->idx > JIT_CBZ_RANGE) {
+        return false;
+    }
+    state->inst_flags[pc] |= JIT_INST_CBZ;
+    return true;
+}
+
+static void emit_cbz(jit_state *state, const s8 dst[], bool nonzero, int target) {
+    const s8 *tmp = bpf2a32[TMP_REG_1];
+    const s8 *rd = arm_bpf_get_reg64(state, dst, tmp);
+    emit4(state, _thumb32_ORRW_REG_T2(tmp[1], rd[1], rd[0], 0, SRTYPE_LSL, FLAG_S));
+    emit_branch(state, JIT_FIX_INSN, target, nonzero ? COND_NE : COND_EQ, tmp[1]);
 }
 
 static void gen_return(jit_state *state) {
@@ -1328,8 +1545,8 @@ static void gen_return(jit_state *state) {
 }
 
 static int build_inst(jit_state *state, ebpf_inst *inst) {
-    const int8_t *dst = bpf2a32[inst->dst];
-    const int8_t *src = bpf2a32[inst->src];
+    const int8_t *dst = jit_reg(state, inst->dst);
+    const int8_t *src = jit_reg(state, inst->src);
     const int8_t *tmp = bpf2a32[TMP_REG_1];
     const int8_t *tmp2 = bpf2a32[TMP_REG_2];
     const s16 off = inst->offset;
@@ -1338,7 +1555,6 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
     uint32_t target_pc = pc + inst->offset + 1;
     const int8_t *rd, *rs;
     int8_t rd_lo, rt, rm, rn;
-    s32 jmp_offset;
     const u8 code = inst->opcode;
     const bool is64 = (BPF_CLASS(code) == EBPF_CLS_ALU64);
     // my_printf("switch code:%x\n", BPF_OP(code));
@@ -1355,9 +1571,8 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
         switch (BPF_SRC(code))
         {
         case EBPF_SRC_REG:
-            if (imm == 1) {
-                /* Special mov32 for zext */
-                emit_mov_imm(state, dst_hi, 0);
+            if (!is64 && imm == 1 && inst->src == inst->dst) {
+                /* Special mov32 for zext, dst_hi is cleared below */
                 break;
             }
             // DEBUG_LOG("emit_mov_se_imm64:%d %d %d\n", dst_lo, src_lo, pc);
@@ -1480,7 +1695,7 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
     case EBPF_OP_NEG:
         emit_alu32_imm(state, dst_lo, 0, BPF_OP(code));
         break;
-    /* dst = ~dst (64 bit) */
+    /* dst = -dst (64 bit) */
     case EBPF_OP_NEG64:
         emit_a32_neg64(state, dst);
         break;
@@ -1489,6 +1704,10 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
 	case EBPF_OP_MUL64_REG: {
         switch (BPF_SRC(code)) {
         case EBPF_SRC_IMM:
+            if (imm >= 0) {
+                emit_a32_mul_i64(state, dst, imm);
+                break;
+            }
             emit_mov_se_imm64(state, is64, tmp2, imm);
             emit_a32_mul_r64(state, dst, tmp2);
             break;
@@ -1520,6 +1739,9 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
     case EBPF_OP_LDXH:
     case EBPF_OP_LDXB:
     case EBPF_OP_LDXDW:
+        if (state->use_sfi && !ebpf_access_proven(state->mem_safe, pc)) {
+            emit_sfi_check(state, src_lo, off, ebpf_access_size(code));
+        }
         rn = arm_bpf_get_reg32(state, src_lo, tmp2[1]);
         // DEBUG_LOG("EBPF_OP_LDXDW pc=%d src:%d -> rn:%d dst:%d offset:%d\n", pc, src_lo, rn, dst_lo, off);
         emit_ldx_reg(state, dst, rn, off, BPF_SIZE(code));
@@ -1529,6 +1751,9 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
     case EBPF_OP_STH:
     case EBPF_OP_STB:
     case EBPF_OP_STDW: {
+        if (state->use_sfi && !ebpf_access_proven(state->mem_safe, pc)) {
+            emit_sfi_check(state, dst_lo, off, ebpf_access_size(code));
+        }
         switch (BPF_SIZE(code))
         {
         case EBPF_SIZE_DW:
@@ -1552,6 +1777,9 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
     case EBPF_OP_STXH:
     case EBPF_OP_STXB:
     case EBPF_OP_STXDW:
+        if (state->use_sfi && !ebpf_access_proven(state->mem_safe, pc)) {
+            emit_sfi_check(state, dst_lo, off, ebpf_access_size(code));
+        }
         rs = arm_bpf_get_reg64(state, src, tmp2);
         emit_str_reg(state, dst_lo, rs, off, BPF_SIZE(code));
         break;
@@ -1603,6 +1831,10 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
     case EBPF_OP_JSLE_IMM:
     case EBPF_OP_JSLE_REG: {
         int start_delta = state->idx;
+        if (jit_use_cbz(state, pc)) {
+            emit_cbz(state, dst, BPF_OP(code) == EBPF_JNE, target_pc);
+            break;
+        }
         if (BPF_SRC(code) == EBPF_SRC_REG) {
             rm = arm_bpf_get_reg32(state, src_hi, tmp2[0]);
             rn = arm_bpf_get_reg32(state, src_lo, tmp2[1]);
@@ -1618,14 +1850,19 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
         // CMP
         // DEBUG_LOG("rm=%d rn=%d rd[0]=%d rd[1]=%d\n", rm, rn, rd[0], rd[1]);
         _emit_cmp_cond(state, rd[0], rd[1], rm, rn, BPF_OP(code), BPF_CLASS(code) == EBPF_CLS_JMP);
-        int bsize = 4;
-        if (!_use_b4(state)) {
-            bsize = 2;
+        if (jit_if_convert(state, pc)) {
+            // no branch, the move runs on the opposite condition
+            const ebpf_inst *mov = &inst[1];
+            const s8 *rmov = jit_reg(state, mov->dst);
+            // mov32 zero extends, mov64 sign extends
+            u64 val = mov->opcode == EBPF_OP_MOV64_IMM ? (u64) (s64) mov->imm : (u32) mov->imm;
+            u8 cond = _jump_cond(BPF_OP(code)) ^ 0x1;
+            emit2(state, _thumb16_IT_T1(cond, _it_mask_then(cond, mov_i64_insts(rmov, val))));
+            emit_mov_i64(state, rmov, val);
+            return 1;
         }
         // DEBUG_LOG("JUMP %d off=%d jmp=%d %d\n", state->idx, off, jmp_offset);
-        jmp_offset = bpf2a32_offset(state, pc, pc + off, bsize);
-        // DEBUG_LOG("off set addr: %d end:0x%x to:0x%x off:%d jmp:%d start:0x%x 0x%x\n", pc, state->idx, dst, off, jmp_offset, start_delta, state->offsets[pc]);
-        _emit_jump(state, jmp_offset, BPF_OP(code));
+        emit_branch(state, JIT_FIX_INSN, target_pc, _jump_cond(BPF_OP(code)), JIT_FIX_NO_CBZ);
         // gen_return(state);
         // return -1;
         break;
@@ -1634,23 +1871,49 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
         if (off == 0)
             break;
         // DEBUG_LOG("EBPF_OP_JA End: 0x%x off=%d\n", state->idx, off);
-        jmp_offset = bpf2a32_offset(state, pc, pc + off, 2);
-        _emit_b(state, jmp_offset); // always 2 bytes
+        emit_branch(state, JIT_FIX_INSN, target_pc, COND_AL, JIT_FIX_NO_CBZ);
         break;
 
     // tail call
 
     // function call
     case EBPF_OP_CALL: {
-        const s8 *r0 = bpf2a32[BPF_REG_0];
-        const s8 *r1 = bpf2a32[BPF_REG_1];
-        const s8 *r2 = bpf2a32[BPF_REG_2];
-        const s8 *r3 = bpf2a32[BPF_REG_3];
-        const s8 *r4 = bpf2a32[BPF_REG_4];
-        const s8 *r5 = bpf2a32[BPF_REG_5];
-        const u32 func = *(u32 *) (state->__bpf_call_base + imm * 4);
-        // DEBUG_LOG("EBPF_OP_CALL: %d 0x%08x 0x%08x\n", imm, state->__bpf_call_base, func);
-       
+        const s8 *r0 = jit_reg(state, BPF_REG_0);
+        const s8 *r1 = jit_reg(state, BPF_REG_1);
+        const s8 *r2 = jit_reg(state, BPF_REG_2);
+        const s8 *r3 = jit_reg(state, BPF_REG_3);
+        const s8 *r4 = jit_reg(state, BPF_REG_4);
+        const s8 *r5 = jit_reg(state, BPF_REG_5);
+        // DEBUG_LOG("EBPF_OP_CALL: %d 0x%08x\n", imm, state->__bpf_call_base);
+
+        if (state->helper_descs != NULL && ebpf_helper_is_abi32(&state->helper_descs[imm])) {
+            const ebpf_helper_desc *desc = &state->helper_descs[imm];
+            // 32 bit ABI: low words of r1-r4 in r0-r3, r5 low word on the stack
+            // r1 lives in r3:r2, move it first, r2-r4 are stacked
+            _emit_mov_reg(state, r1[1], ARM_R0);
+            if (desc->nargs > 1) {
+                emit_load_arg32(state, r2, ARM_R1);
+            }
+            if (desc->nargs > 2) {
+                emit_load_arg32(state, r3, ARM_R2);
+            }
+            if (desc->nargs > 3) {
+                emit_load_arg32(state, r4, ARM_R3);
+            }
+            if (desc->nargs > 4) {
+                emit_push_r64(state, r5); // low word at [sp], keeps sp 8 byte aligned
+            }
+            emit_helper_addr(state, tmp[1], imm);
+            emit2(state, _thumb16_BLX_REG_T1(tmp[1]));
+            if (desc->nargs > 4) {
+                _emit_add_imm(state, ARM_SP, ARM_SP, 8);
+            }
+            if (!desc->ret64) {
+                emit_mov_imm(state, r0[0], 0);
+            }
+            break;
+        }
+
         emit_mov_reg64(state, true, r0, r1);
         emit_mov_reg64(state, true, r1, r2);
         emit_push_r64(state, r5);
@@ -1660,7 +1923,7 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
         // emit_push_r64(state, r1);
         // break;
         // emit_a32_mov_i(tmp[1], func, ctx);
-        emit_mov_imm(state, tmp[1], func);
+        emit_helper_addr(state, tmp[1], imm);
         // emit_blx_r(tmp[1], ctx);
         // mov r1, 0x8003444
         // blx r1
@@ -1675,10 +1938,8 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
         // emit2(state, 0x4770);
         if (pc == state->inst_num - 1) 
             break;
-        jmp_offset = epilogue_offset(state);
         // DEBUG_LOG("EBPF_OP_EXIT: %d %d\n", pc, jmp_offset);
-        // jmp_offset = 5;
-        _emit_b(state, jmp_offset);
+        emit_branch(state, JIT_FIX_EPILOGUE, 0, COND_AL, JIT_FIX_NO_CBZ);
         break;
 
     case 0: // NOP
@@ -1686,9 +1947,8 @@ static int build_inst(jit_state *state, ebpf_inst *inst) {
 
     default:
         DEBUG_LOG("Unsupport op: %x pc: %d\n", code, pc);
-        // state->err_line = __LINE__;
-        // return -1;
-        break;
+        state->err_line = __LINE__;
+        return -1;
 notyet:
         DEBUG_LOG("Do not implement current op: %x pc: %d\n", code, pc);
         state->err_line = __LINE__;
@@ -1696,8 +1956,12 @@ notyet:
 
 todo:
         DEBUG_LOG("TODO op: %x pc: %d\n", code, pc);
+        state->err_line = __LINE__;
         return -1;
     }
+    if (BPF_CLASS(code) == EBPF_CLS_ALU) { // 32 bit results are zero extended
+        emit_zext_hi(state, dst);
+    }
     return 0;
 }
 
@@ -1744,14 +2008,17 @@ todo:
  */
 // init eBPF stack and args
 static void build_prologue(jit_state *state) {
-    const s8 *bpf_r1 = bpf2a32[BPF_REG_1];
-	const s8 *bpf_fp = bpf2a32[BPF_REG_FP];
+    const s8 *bpf_r1 = jit_reg(state, BPF_REG_1);
+	const s8 *bpf_fp = jit_reg(state, BPF_REG_FP);
     // 1. set stack SP to r10, USE SP
     // emit(ARM_PUSH(CALLEE_PUSH_MASK), ctx);
     // emit(ARM_MOV_R(ARM_FP, ARM_SP), ctx);
     // push {r4-r9, lr} , r4-r9, lr in used. aligned -> 8 reg
     emit4(state, _thumb32_PUSHW_T2(CALLEE_PUSH_MASK));
     _emit_mov_reg(state, ARM_SP, ARM_FP);
+    if (state->pic) { // r2 is BPF r1, keep the helper table until the frame is there
+        _emit_mov_reg(state, ARM_R2, bpf2a32[TMP_REG_2][1]);
+    }
     // stack for registers
     // emit(state, ARM_SUB_I(bpf_r1_lo, ARM_SP, SCRATCH_SIZE));
     emit_mov_imm(state, bpf_r1[0], 0);
@@ -1760,6 +2027,9 @@ static void build_prologue(jit_state *state) {
     // 2. create stack space
     // emit(state, ARM_SUB_I(ARM_SP, ARM_SP, EBPF_STACK_SIZE));
     _emit_sub_imm(state, ARM_SP, ARM_SP, EBPF_STACK_SIZE);
+    if (state->pic) {
+        _emit_str_i(state, ARM_FP, bpf2a32[TMP_REG_2][1], EBPF_SCRATCH_TO_ARM_FP(PIC_HELPERS));
+    }
 
     /* Set up BPF prog stack base register */
 	// emit_a32_mov_r64(state, true, bpf_fp, bpf_r1);
@@ -1767,6 +2037,16 @@ static void build_prologue(jit_state *state) {
     // 3. mov arm_r0 to BPF_R1
     _emit_mov_reg(state, ARM_R0, bpf_r1[1]);
     emit_mov_imm(state, bpf_r1[0], 0);
+
+    if (state->use_sfi) {
+        // ctx and length for the access checks, a ctx shorter than the verifier assumed is refused
+        const s8 *tmp = bpf2a32[TMP_REG_1];
+        _emit_str_i(state, ARM_FP, ARM_R0, EBPF_SCRATCH_TO_ARM_FP(SFI_CTX_BASE));
+        _emit_str_i(state, ARM_FP, ARM_R1, EBPF_SCRATCH_TO_ARM_FP(SFI_CTX_LEN));
+        emit_mov_imm(state, tmp[0], state->ctx_size);
+        _emit_cmp_reg(state, ARM_R1, tmp[0]);
+        emit_branch(state, JIT_FIX_SFI_FAIL, 0, COND_CC, JIT_FIX_NO_CBZ);
+    }
 }
 
 static void build_body(jit_state *state) {
@@ -1778,13 +2058,13 @@ static void build_body(jit_state *state) {
         int ret = build_inst(state, inst);
         if (ret > 0) { // load value, skip
             i++;
-            if (!state->needGen) {
+            if (!state->needGen || !state->two_pass) {
                 state->offsets[i] = state->idx;
             }
             // DEBUG_LOG("ADDDDDDDDDDDDDD: %d\n", i - 1);
             continue;
         }
-        if (!state->needGen) { // offset = end
+        if (!state->needGen || !state->two_pass) { // offset = end
             state->offsets[i] = state->idx;
         }
         if (ret < 0) {
@@ -1803,6 +2083,13 @@ static void build_epilogue(jit_state *state) {
     emit4(state, _thumb32_POPW_T2(CALLEE_POP_MASK));
 }
 
+// an access check failed, return -1
+static void build_sfi_fail(jit_state *state) {
+    emit_mov_imm(state, ARM_R0, 0xffffffff);
+    emit_mov_imm(state, ARM_R1, 0xffffffff);
+    emit_branch(state, JIT_FIX_EPILOGUE, 0, COND_AL, JIT_FIX_NO_CBZ);
+}
+
 static void test_branch(jit_state *state) {
     emit_mov_imm(state, 0, 3);
     emit_mov_imm(state, 1, 0);
@@ -1811,16 +2098,305 @@ static void test_branch(jit_state *state) {
     emit_mov_imm(state, 0, 2);
 }
 
-void jit_compile(jit_state *state) {
-    // test_ldr(state);
-    // test_alu(state);
-    // return state;
-    // PrePass: clac offset
+/*
+Linear scan register allocation.
+
+r0 and r1 stay in r0-r3 where the calling convention wants them. r2-r10 get a
+live interval, from the first to the last instruction using them and stretched
+over every loop it overlaps, and a weight: the uses, x8 per loop level. The
+intervals are taken in order of their start and given a free register pair;
+when there is none the lightest of the new and the active intervals stays in
+its stack slot. BLX clobbers lr, {r10, lr} only takes an interval without a
+helper call inside.
+*/
+#define JIT_LOOP_WEIGHT 3 // log2 of the weight of a loop level
+#define JIT_MAX_LOOP_DEPTH 3
+
+typedef struct jit_interval {
+    int start;
+    int end;
+    u32 weight;
+    bool call; // a helper call inside the interval
+} jit_interval;
+
+static const s8 jit_reg_pairs[][2] = {
+    {ARM_R5, ARM_R4},
+    {ARM_LR, ARM_R10},
+};
+#define JIT_REG_PAIRS (sizeof(jit_reg_pairs) / sizeof(jit_reg_pairs[0]))
+#define JIT_PAIR_LR 1
+
+static void interval_use(jit_interval *iv, int pc, u32 weight) {
+    if (iv->start < 0 || pc < iv->start) {
+        iv->start = pc;
+    }
+    if (pc > iv->end) {
+        iv->end = pc;
+    }
+    iv->weight += weight;
+}
+
+// back-edges around pc
+static int loop_depth(jit_state *state, int pc) {
+    int depth = 0;
+    for (int j = pc; j < state->inst_num; j++) {
+        const ebpf_inst *inst = &state->insts[j];
+        if (is_branch(inst) && j + 1 + inst->offset <= pc) {
+            depth++;
+        }
+    }
+    return depth;
+}
+
+static void jit_alloc_regs(jit_state *state) {
+    jit_interval iv[JIT_BPF_REGS];
+    int n = state->inst_num;
+    memcpy(state->reg_map, bpf2a32, sizeof(state->reg_map));
+    memset(state->inst_flags, 0, n);
+    state->regs_in_arm = 0;
+    for (int r = 0; r < JIT_BPF_REGS; r++) {
+        iv[r].start = -1;
+        iv[r].end = -1;
+        iv[r].weight = 0;
+        iv[r].call = false;
+    }
+
+    // uses, weights and jump targets
+    for (int pc = 0; pc < n; pc++) {
+        const ebpf_inst *inst = &state->insts[pc];
+        u8 cls = inst->opcode & EBPF_CLS_MASK;
+        int depth = loop_depth(state, pc);
+        u32 w = 1 << (JIT_LOOP_WEIGHT * (depth < JIT_MAX_LOOP_DEPTH ? depth : JIT_MAX_LOOP_DEPTH));
+        if (inst->opcode == EBPF_OP_CALL) {
+            for (int r = BPF_REG_1; r <= BPF_REG_5; r++) {
+                interval_use(&iv[r], pc, w);
+            }
+        } else if (inst->opcode == EBPF_OP_EXIT) {
+            interval_use(&iv[BPF_REG_0], pc, w);
+        } else if (inst->opcode != EBPF_OP_JA) {
+            if (inst->dst < JIT_BPF_REGS) {
+                interval_use(&iv[inst->dst], pc, w);
+            }
+            bool reads_src = cls == EBPF_CLS_LDX || cls == EBPF_CLS_STX
+                || ((cls == EBPF_CLS_ALU || cls == EBPF_CLS_ALU64 || cls == EBPF_CLS_JMP)
+                    && BPF_SRC(inst->opcode) == EBPF_SRC_REG);
+            if (reads_src && inst->src < JIT_BPF_REGS) {
+                interval_use(&iv[inst->src], pc, w);
+            }
+        }
+        if (is_branch(inst)) {
+            state->inst_flags[pc + 1 + inst->offset] |= JIT_INST_TARGET;
+        }
+        if (inst->opcode == EBPF_OP_LDDW) {
+            pc++;
+        }
+    }
+    if (iv[BPF_REG_FP].start >= 0) {
+        iv[BPF_REG_FP].start = 0; // set by the prologue
+    }
+
+    // a value used in a loop is live in all of it
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int j = 0; j < n; j++) {
+            const ebpf_inst *inst = &state->insts[j];
+            int t = j + 1 + inst->offset;
+            if (!is_branch(inst) || t > j) {
+                continue;
+            }
+            for (int r = BPF_REG_2; r < JIT_BPF_REGS; r++) {
+                if (iv[r].start >= 0 && iv[r].start <= j && iv[r].end >= t
+                    && (iv[r].start > t || iv[r].end < j)) {
+                    iv[r].start = iv[r].start < t ? iv[r].start : t;
+                    iv[r].end = iv[r].end > j ? iv[r].end : j;
+                    changed = true;
+                }
+            }
+        }
+    }
+    for (int pc = 0; pc < n; pc++) {
+        if (state->insts[pc].opcode != EBPF_OP_CALL) {
+            continue;
+        }
+        for (int r = BPF_REG_2; r < JIT_BPF_REGS; r++) {
+            if (iv[r].start < pc && pc < iv[r].end) {
+                iv[r].call = true;
+            }
+        }
+    }
+
+    // by start
+    int order[JIT_BPF_REGS];
+    int count = 0;
+    for (int r = BPF_REG_2; r < JIT_BPF_REGS; r++) {
+        if (iv[r].start < 0) {
+            continue;
+        }
+        int i = count++;
+        while (i > 0 && iv[order[i - 1]].start > iv[r].start) {
+            order[i] = order[i - 1];
+            i--;
+        }
+        order[i] = r;
+    }
+
+    int active[JIT_REG_PAIRS];
+    for (int p = 0; p < JIT_REG_PAIRS; p++) {
+        active[p] = -1;
+    }
+    for (int i = 0; i < count; i++) {
+        int r = order[i];
+        int pair = -1;
+        for (int p = 0; p < JIT_REG_PAIRS; p++) {
+            if (active[p] >= 0 && iv[active[p]].end < iv[r].start) {
+                active[p] = -1;
+            }
+        }
+        for (int p = 0; p < JIT_REG_PAIRS && pair < 0; p++) {
+            if (active[p] < 0 && !(p == JIT_PAIR_LR && iv[r].call)) {
+                pair = p;
+            }
+        }
+        if (pair < 0) { // spill the lightest
+            u32 lightest = iv[r].weight;
+            for (int p = 0; p < JIT_REG_PAIRS; p++) {
+                if (!(p == JIT_PAIR_LR && iv[r].call) && iv[active[p]].weight < lightest) {
+                    lightest = iv[active[p]].weight;
+                    pair = p;
+                }
+            }
+            if (pair < 0) {
+                continue;
+            }
+            memcpy(state->reg_map[active[pair]], bpf2a32[active[pair]], 2);
+            state->regs_in_arm--;
+        }
+        active[pair] = r;
+        memcpy(state->reg_map[r], jit_reg_pairs[pair], 2);
+        state->regs_in_arm++;
+    }
+}
+
+/*
+Single pass branch relaxation. Every branch was emitted as a 4 byte placeholder.
+A branch whose target is close enough becomes 2 bytes, which only brings the
+other targets closer, so this is repeated until nothing changes. The code is
+then compacted once and all the branches are encoded.
+*/
+static bool fixup_fits_short(const jit_fixup *f, s32 off) {
+    if (f->cond == COND_AL) {
+        return off > -2048 && off < 2046;
+    }
+    return off >= -256 && off <= 254;
+}
+
+// bytes freed before pos, the fixups are sorted by pos
+static int fixup_shift(jit_state *state, int pos, int freed) {
+    int lo = 0, hi = state->fixup_num;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (state->fixups[mid].pos < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < state->fixup_num ? state->fixups[lo].shift : freed;
+}
+
+static void emit_fixup(jit_state *state, const jit_fixup *f, int at, s32 off) {
+    int idx = state->idx;
+    state->idx = at;
+    if (f->size == 4) {
+        emit4(state, f->cond == COND_AL ? _thumb32_BW_T4(off) : _thumb32_BW_T3(off, f->cond));
+    } else if (f->cbz_reg != JIT_FIX_NO_CBZ && off >= 0 && off <= JIT_CBZ_RANGE) {
+        emit2(state, _thumb16_CBZ_T1(f->cbz_reg, off, f->cond == COND_NE));
+    } else if (f->cond == COND_AL) {
+        emit2(state, _thumb16_B_T2(off));
+    } else {
+        emit2(state, _thumb16_B_T1(off, f->cond));
+    }
+    state->idx = idx;
+}
+
+static void jit_relax(jit_state *state) {
+    jit_fixup *fx = state->fixups;
+    int n = state->fixup_num;
+    int freed = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        freed = 0;
+        for (int i = 0; i < n; i++) {
+            fx[i].shift = freed;
+            freed += 4 - fx[i].size;
+        }
+        // shifts of this round are stale, they only overestimate the distances
+        for (int i = 0; i < n; i++) {
+            if (fx[i].size == 2) {
+                continue;
+            }
+            int to = branch_target(state, fx[i].kind, fx[i].target);
+            s32 off = to - fixup_shift(state, to, freed) - (fx[i].pos - fx[i].shift) - 4;
+            if (to > fx[i].pos) {
+                off -= 2; // the branch itself
+            }
+            if (fixup_fits_short(&fx[i], off)) {
+                fx[i].size = 2;
+                changed = true;
+            }
+        }
+    }
+    // compact
+    int from = 0;
+    for (int i = 0; i < n; i++) {
+        if (fx[i].shift != 0) {
+            memmove(&state->jit_code[from - fx[i].shift], &state->jit_code[from], fx[i].pos - from);
+        }
+        from = fx[i].pos + 4;
+    }
+    if (freed != 0) {
+        memmove(&state->jit_code[from - freed], &state->jit_code[from], state->idx - from);
+    }
+    for (int i = 0; i < n; i++) {
+        int at = fx[i].pos - fx[i].shift;
+        int to = branch_target(state, fx[i].kind, fx[i].target);
+        emit_fixup(state, &fx[i], at, to - fixup_shift(state, to, freed) - at - 4);
+    }
+    for (int i = 0; i < state->inst_num; i++) {
+        state->offsets[i] -= fixup_shift(state, state->offsets[i], freed);
+    }
+    state->body_offset -= fixup_shift(state, state->body_offset, freed);
+    state->epilogue_offset -= fixup_shift(state, state->epilogue_offset, freed);
+    state->sfi_fail_offset -= fixup_shift(state, state->sfi_fail_offset, freed);
+    state->idx -= freed;
+}
+
+// offsets of every instruction, nothing is written
+static void build_sizes(jit_state *state) {
 	state->idx = 0;
     state->needGen = false;
     build_prologue(state);
+    state->body_offset = state->idx;
     build_body(state);
     state->epilogue_offset = state->idx;
+    build_epilogue(state);
+    state->sfi_fail_offset = state->idx;
+}
+
+/*
+Two pass compilation, kept to compare with the single pass: the offsets of every
+instruction are computed first, then the code is generated.
+*/
+static void jit_compile_two_pass(jit_state *state) {
+    // PrePass: clac offset
+    state->relax = false;
+    build_sizes(state);
+    // RelaxPass: pick the short branches the PrePass offsets allow, sizes only shrink
+    state->relax = true;
+    build_sizes(state);
+    state->relax = false;
     // for (int i = 0; i < state->inst_num; i++) {
     //     DEBUG_LOG("build offset: i=%d %d\n", i, state->offsets[i]);
     // }
@@ -1834,8 +2410,38 @@ void jit_compile(jit_state *state) {
     build_body(state);
     // DEBUG_LOG("epilogue_offset PASS1:%d PASS2:%d\n", state->epilogue_offset, state->idx);
     build_epilogue(state);
+    if (state->use_sfi) {
+        build_sfi_fail(state);
+    }
+}
 
+void jit_compile(jit_state *state) {
+    // test_ldr(state);
+    // test_alu(state);
     // return state;
+    jit_alloc_regs(state);
+    state->relax = false;
+    if (state->two_pass) {
+        jit_compile_two_pass(state);
+        return;
+    }
+    // forward branches are fixed up at the end
+    state->idx = 0;
+    state->needGen = true;
+    state->fixup_num = 0;
+    build_prologue(state);
+    state->body_offset = state->idx;
+    build_body(state);
+    state->epilogue_offset = state->idx;
+    build_epilogue(state);
+    state->sfi_fail_offset = state->idx;
+    if (state->use_sfi) {
+        build_sfi_fail(state);
+    }
+    if (state->idx > state->size) { // the code did not fit, the caller checks idx
+        return;
+    }
+    jit_relax(state);
 }
 
 static void ebpf_ret(uint64_t ret) {
@@ -1862,22 +2468,31 @@ uint64_t ebpf_run_jit(jit_state *state, void *ctx) {
 }
 
 
+// tests on the target, the host tools only generate code
+#ifndef LINUX_TEST
 jit_state g_state;
 
 jit_state* init_jit_state(uint8_t *code, int code_len) {
     jit_state *state = &g_state;
     memset(&g_state, 0, sizeof(g_state));
-    memset(offset_mem, 0, sizeof(offset_mem));
     ebpf_inst *insts = (ebpf_inst *) code;
     int inst_num = code_len / sizeof(ebpf_inst);
+#if defined(JIT_STATIC_MEM)
+    if (inst_num > JIT_MAX_INSTS) {
+        return NULL;
+    }
+#endif
+    jit_mem *mem = jit_mem_allocate(inst_num);
+    if (mem == NULL) {
+        return NULL;
+    }
     // DEBUG_LOG("gen_code_for_ebpf1: %d inst size: %d\n", inst_num, sizeof(ebpf_inst));
     state->insts = insts;
     state->inst_num = inst_num;
     state->idx = 0;
-    state->jit_code = (uint8_t *) ((uint32_t) jit_buffer & (~0x3));
-    state->size = 2000;
+    state->size = mem->code_size;
     state->err_line = 0;
-    state->offsets = offset_mem;
+    jit_state_set_mem(state, mem);
     return state;
 }
 
@@ -1888,10 +2503,14 @@ void run_jit_func(uint8_t *code, int len, void *ctx) {
     // _emit_strd_i(state, )
     // emit2(state, 0x4770);
     jit_state *state = init_jit_state(code, len);
+    if (state == NULL) {
+        return;
+    }
     jit_compile(state);
     jit_dump_inst(state);
 
     ebpf_run_jit(state, ctx);
+    jit_mem_free(state->jmem);
 }
 
 /*
@@ -1925,3 +2544,4 @@ static void gen_code_for_ebpf1() {
     u32 ctx1 = 1;
     run_jit_func(code_t1, sizeof(code_t1), &ctx1);
 }
+#endif
@@ -39,6 +39,7 @@ INSTUCTIONS DEFINES
 #define THUMB2_LSLW_REG_T2 0xfa00f000
 #define THUMB2_LSRW_REG 0xfa20f000
 #define THUMB2_LSRW_IMM 0xea4f0010
+#define THUMB2_LSLW_IMM 0xea4f0000
 #define THUMB2_ORRW_REG 0xea400000
 #define THUMB2_ORR_REG 0x4300 
 #define THUMB2_EOR_REG_T2 0xea800000
@@ -78,6 +79,10 @@ INSTUCTIONS DEFINES
 #define THUMB2_BW_T4 0xf0009000
 #define THUMB2_MUL_T2 0xfb00f000
 #define THUMB2_UMULL_T2 0xfba00000
+#define THUMB2_MLA_T1 0xfb000000
+#define THUMB2_CBZ_T1 0xb100
+#define THUMB2_TST_REG_T1 0x4200
+#define THUMB2_TSTW_REG_T2 0xea100f00
 
 #define IT_MASK_NONE 0b1000
 #define COND_EQ 0b0000
@@ -123,8 +128,10 @@ wback
 // PUSH and POP are always 32-bit, and the addresses of the
 // transfers in stack operations must be aligned to 32-bit word boundaries
 */
+// r10 and lr can hold BPF registers, ip keeps the frame 8 byte aligned
 #define CALLEE_MASK	(1 << ARM_R4 | 1 << ARM_R5 | 1 << ARM_R6 | \
-			 1 << ARM_R7 | 1 << ARM_R8 | 1 << ARM_R9 | 1 << ARM_FP)
+			 1 << ARM_R7 | 1 << ARM_R8 | 1 << ARM_R9 | 1 << ARM_R10 | \
+			 1 << ARM_FP | 1 << ARM_IP)
 #define CALLEE_PUSH_MASK (CALLEE_MASK | 1 << ARM_LR)
 #define CALLEE_POP_MASK  (CALLEE_MASK | 1 << ARM_PC)
 
@@ -143,10 +150,39 @@ static inline u32 _thumb32_MUL_T2(s8 Rd, s8 Rn, s8 Rm) {
     return (THUMB2_MUL_T2) | (Rn << 16) | (Rd << 8) | (Rm);
 }
 
+// Rd = Ra + Rn * Rm
+static inline u32 _thumb32_MLA_T1(s8 Rd, s8 Rn, s8 Rm, s8 Ra) {
+    return (THUMB2_MLA_T1) | (Rn << 16) | (Ra << 12) | (Rd << 8) | (Rm);
+}
+
 static inline u16 _thumb16_IT_T1(u8 cond, u8 mask) {
     return (THUMB2_IT) | (cond << 4) | (mask);
 }
 
+// IT block of n (1-4) instructions that all execute on cond
+static inline u8 _it_mask_then(u8 cond, int n) {
+    u8 mask = 1 << (4 - n);
+    for (int k = 1; k < n; k++) {
+        mask |= (cond & 0x1) << (4 - k);
+    }
+    return mask;
+}
+
+// CBZ/CBNZ: Rn in r0-r7, forward only, offImm7 in 0-126
+static inline u16 _thumb16_CBZ_T1(s8 Rn, s32 offImm7, bool nonzero) {
+    u16 i = (offImm7 >> 6) & 0x1;
+    u16 imm5 = (offImm7 >> 1) & 0x1f;
+    return (THUMB2_CBZ_T1) | (nonzero << 11) | (i << 9) | (imm5 << 3) | (Rn);
+}
+
+static inline u16 _thumb16_TST_REG_T1(s8 Rn, s8 Rm) {
+    return (THUMB2_TST_REG_T1) | (Rm << 3) | (Rn);
+}
+
+static inline u32 _thumb32_TSTW_REG_T2(s8 Rn, s8 Rm) {
+    return (THUMB2_TSTW_REG_T2) | (Rn << 16) | (Rm);
+}
+
 static inline u32 _thumb32_RSBW_IMM_T2(s8 Rd, s8 Rn, s32 shiftImm12, u8 flagS) {
     s32 imm8 = shiftImm12 & 0xff;
     s32 imm3 = (shiftImm12 >> 8) & 0b111;
@@ -190,11 +226,11 @@ static inline u32 _thumb32_BW_T4(s32 offImm23) {
     s32 S = offImm23 < 0;
     s32 imm11 = (offImm23 >> 1) & 0x7ff;
     s32 imm10 = (offImm23 >> 12) & 0x3ff;
-    s32 I1 = (offImm23 >> 18) & 0x1;
-    s32 I2 = (offImm23 >> 19) & 0x1;
+    s32 I1 = (offImm23 >> 23) & 0x1;
+    s32 I2 = (offImm23 >> 22) & 0x1;
     s32 J1 = (~I1 ^ S) & 0x1;
     s32 J2 = (~I2 ^ S) & 0x1;
-    return (THUMB2_BW_COND_T3) | (S << 26) | (imm10 << 16) | (J1 << 13) | (J2 << 11) | (imm11);
+    return (THUMB2_BW_T4) | (S << 26) | (imm10 << 16) | (J1 << 13) | (J2 << 11) | (imm11);
 }
 
 static inline u32 _thumb32_SBCW_T2(s8 Rd, s8 Rn, s8 Rm, s32 shiftImm5, u8 srtype, u8 flagS) {
@@ -354,19 +390,19 @@ static inline u32 _thumb32_LDRD_IMM_T1(s8 Rt[], s8 Rn, s32 offImm8) {
 }
 
 static inline u32 _thumb32_STRB_IMM_T3(s8 Rn, s8 Rt, s16 offImm8) {
-    u32 P = offImm8 != 0;
+    u32 P = 1; // offset addressing, P = 0 with W = 0 is undefined
     u32 U = offImm8 > 0, W = 0;
     u32 imm8 = offImm8 > 0 ? offImm8 : -offImm8;
-    u32 flag = 0b111 | (P << 2) | (U << 1) | (W);
+    u32 flag = (P << 2) | (U << 1) | (W);
     u32 inst = (THUMB2_STRB_IMM_T3) | (Rn << 16) | (Rt << 12) | (flag << 8) | (imm8);
     return inst;
 }
 
 static inline u32 _thumb32_STRH_IMM_T3(s8 Rn, s8 Rt, s16 offImm8) {
-    u32 P = offImm8 != 0;
+    u32 P = 1; // offset addressing, P = 0 with W = 0 is undefined
     u32 U = offImm8 > 0, W = 0;
     u32 imm8 = offImm8 > 0 ? offImm8 : -offImm8;
-    u32 flag = 0b111 | (P << 2) | (U << 1) | (W);
+    u32 flag = (P << 2) | (U << 1) | (W);
     u32 inst = (THUMB2_STRH_IMM_T3) | (Rn << 16) | (Rt << 12) | (flag << 8) | (imm8);
     return inst;
 }
@@ -413,10 +449,16 @@ static inline u32 _thumb32_LSRW_IMM_T2(s8 Rd, s8 Rm, s32 shiftImm5, u8 flagS) {
     return inst;
 }
 
+static inline u32 _thumb32_LSLW_IMM_T2(s8 Rd, s8 Rm, s32 shiftImm5, u8 flagS) {
+    u32 imm3 = (shiftImm5 >> 2) & 0b111;
+    u32 imm2 = shiftImm5 & 0b11;
+    return (THUMB2_LSLW_IMM) | (flagS << 20) | (imm3 << 12) | (Rd << 8) | (imm2 << 6) | (Rm);
+}
+
 static inline u16 _thumb16_ORR_REG_T1(s8 RDn, s8 Rm) {
     u16 RDn3 = RDn & 0b111;
     u16 Rm3 = Rm & 0b111;
-    return (THUMB2_ORR_REG) | (RDn3 << 4) | (Rm3);
+    return (THUMB2_ORR_REG) | (Rm3 << 3) | (RDn3);
 }
 
 static inline u32 _thumb32_EOR_REG_T2(s8 Rd, s8 Rn, s8 Rm, s32 shiftImm5, u8 srtype, u8 flagS) {
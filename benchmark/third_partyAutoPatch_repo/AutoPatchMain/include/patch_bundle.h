@@ -0,0 +1,64 @@
+#ifndef PATCH_BUNDLE_H_
+#define PATCH_BUNDLE_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+Patch bundle, the patches of several sites in one packet that runs where it
+was received (execute in place). Layout: the header, the site table, the
+code, then the metadata (CVE names, map definitions). Everything is found by
+its offset in the bundle, so it is valid at any address.
+
+Installing a bundle gives every site a patch_desc whose handler and name
+point into the bundle, the code and the names are not copied, the map
+definitions (a few bytes) are copied after the descriptor. The RAM a patch
+takes and the time to activate it do not depend on its code size. The handler code must be position independent (Thumb, branches within
+the bundle, firmware functions by absolute address).
+
+The bundle is journaled as one record and its patches run from the record,
+whatever brought it (LOAD, LOAD_LZ, XFER): the received packet is dropped
+after, the boot restore runs it from the same record. Compaction moves the
+records, the descriptors are pointed to the new copy (the old one stays
+readable until the next compaction). A bundle that replaces another (same id)
+takes over the sites they share, the patches of the replaced one are freed
+and the sites it leaves out are disabled.
+*/
+
+#define PATCH_BUNDLE_MAGIC 0x444e4250 // "PBND"
+#define PATCH_BUNDLE_VERSION 1
+#define PATCH_BUNDLE_MAX_SITES 16
+#define PATCH_BUNDLE_TYPE 0x100 // journal record type, not a patch type
+
+typedef struct patch_bundle_head {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t sites; // entries of the site table, it follows the header
+	uint32_t len; // the whole bundle
+	uint32_t id; // a later bundle with the same id replaces it in the journal
+	uint32_t code_off; // 4 byte aligned, after the site table
+	uint32_t code_len;
+	uint32_t meta_off; // after the code
+	uint32_t meta_len;
+} patch_bundle_head;
+
+typedef struct patch_bundle_site {
+	uint16_t type; // FixedPatchPoint or FixedSitePatchPoint
+	uint16_t map_num;
+	uint32_t fixed_id;
+	uint32_t entry; // code offset of the handler, bit 0 set for Thumb
+	uint32_t cve; // metadata offset of the name, NUL terminated
+	uint32_t maps; // metadata offset of map_num ebpf_map_def, 2 byte aligned
+} patch_bundle_site;
+
+struct patch_desc;
+struct ebpf_map_def;
+
+bool patch_bundle_is(const uint8_t *pkt, uint32_t len);
+// header, site table and every offset in bounds
+bool patch_bundle_valid(const uint8_t *bundle, uint32_t len);
+// the descriptor of site i, pointing into the bundle. its maps are expected after it
+void patch_bundle_desc(const uint8_t *bundle, int i, struct patch_desc *desc);
+// the map definitions of site i, to copy after its descriptor
+const struct ebpf_map_def *patch_bundle_maps(const uint8_t *bundle, int i, uint16_t *map_num);
+
+#endif
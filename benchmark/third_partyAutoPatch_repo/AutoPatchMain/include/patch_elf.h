@@ -0,0 +1,94 @@
+#ifndef PATCH_ELF_H_
+#define PATCH_ELF_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+Loader of patch objects, the relocatable ELF files the patches are compiled to
+(src/LocalPatches/Hotpatch_CVE_*.o: ARM, Thumb, REL relocations).
+
+The object is read through a callback, a few bytes at a time, and never held
+in RAM: the loader keeps a fixed context (patch_elf) whatever the object size.
+The section headers are at the end of an object, so the source must allow
+reads at any offset: a packet staged in flash, a journal record, a file on
+the host.
+
+Two steps. patch_elf_open reads the headers and sizes the two regions: code
+(executable and read-only sections) and data (writable sections, .bss).
+patch_elf_load then lays the sections out in the regions the caller gives
+and copies them section by section through a chunk buffer, the relocations
+of a chunk applied before it is written. The code region is flash (written
+with flash_port_write, no read-modify-write of the loaded code) or RAM, the
+data region is RAM. Undefined symbols are resolved against the firmware
+symbol table, sorted by name. A call that does not reach its target (RAM to
+flash on Cortex-M) goes through a veneer placed after the code.
+
+The unwind tables (.ARM.exidx) and the sections not allocated (debug,
+attributes) are not loaded. The entry is the global function named filter_*
+(else the first global function), with the Thumb bit.
+*/
+
+// object area in flash, below the flash test area
+#define PATCH_ELF_BASE 0x000DC000
+#define PATCH_ELF_SIZE 0x4000
+#define PATCH_ELF_MAX_SECTIONS 32
+#define PATCH_ELF_CHUNK 256 // bytes copied and relocated at once
+#define PATCH_ELF_NAME_MAX 32 // longest symbol name resolved, with the NUL
+#define PATCH_ELF_VENEER 8 // ldr.w pc, [pc]; .word target
+
+// reads len bytes at off of the object, 0 on success
+typedef int (*patch_elf_read)(void *user, uint32_t off, void *buf, uint32_t len);
+
+typedef struct patch_elf_sym {
+	const char *name;
+	uint32_t addr; // functions with the Thumb bit
+} patch_elf_sym;
+
+typedef struct patch_elf_region {
+	uint32_t addr;
+	uint32_t size;
+	bool flash;
+} patch_elf_region;
+
+typedef struct patch_elf {
+	patch_elf_read read;
+	void *user;
+	uint32_t len;
+	uint32_t shoff;
+	uint16_t shnum;
+	uint32_t sym_off;
+	uint32_t sym_num;
+	uint32_t str_off; // the string table of the symbols
+	uint32_t str_size;
+	uint32_t code_size; // alignment slack and veneers included
+	uint32_t data_size;
+	uint32_t sec_addr[PATCH_ELF_MAX_SECTIONS]; // 0: not loaded
+	uint8_t sec_rel[PATCH_ELF_MAX_SECTIONS]; // its relocation section, 0: none
+	uint16_t sec_veneer[PATCH_ELF_MAX_SECTIONS]; // veneer slot of its first relocation
+	uint16_t veneers; // slots reserved, one per relocation of a loaded section
+	uint32_t veneer_base;
+	bool code_flash;
+	const patch_elf_sym *syms;
+	int nsyms;
+	// of the last load
+	uint32_t relocs;
+	uint32_t lookups;
+	uint32_t calls_veneered;
+	uint8_t buf[PATCH_ELF_CHUNK];
+	char name[PATCH_ELF_NAME_MAX];
+} patch_elf;
+
+// firmware functions a patch object may call, sorted by name
+extern const patch_elf_sym patch_elf_firmware[];
+extern const int patch_elf_firmware_num;
+
+bool patch_elf_is(const uint8_t *obj, uint32_t len);
+// headers checked, code_size and data_size set. 0 on success
+int patch_elf_open(patch_elf *elf, patch_elf_read read, void *user, uint32_t len);
+// return: the entry address, 0 on failure
+uint32_t patch_elf_load(patch_elf *elf, const patch_elf_region *code, const patch_elf_region *data,
+	const patch_elf_sym *syms, int nsyms);
+// address of a firmware symbol, 0 if it is not in syms
+uint32_t patch_elf_lookup(const patch_elf_sym *syms, int nsyms, const char *name);
+
+#endif
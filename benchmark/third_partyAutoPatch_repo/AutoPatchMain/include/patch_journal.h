@@ -0,0 +1,94 @@
+#ifndef PATCH_JOURNAL_H_
+#define PATCH_JOURNAL_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+Append-only patch journal in flash, the installed patches survive a reset.
+
+Every installed packet (patch_desc and code, or a bundle) is appended as a
+record, the header programmed after the payload and covered with it by a
+CRC32, so a record cut by a reset is not replayed. A later record of the same patch
+(type, fixed_id) replaces the earlier one. Two banks: compaction copies the
+live records to the erased bank and programs its header, with the next
+generation, last; until then the old bank stays the valid one. The old bank
+is erased by the next compaction only, a record that moved can still be read
+at its old address until then. It runs when
+the device is idle (save_patch_list_to_flash), or before an append that does
+not fit and would after it. The record the append replaces is left out only
+when the bank cannot hold both (a reset before the append then loses that
+patch); an append that would still not fit fails with no erase. At boot the live records are replayed in the order they were
+written (load_patch_list_from_flash).
+
+Records hold the descriptor as it was received, function and map pointers
+included: they are only valid for the firmware image that wrote them. A
+patch object is loaded again from its record, the firmware symbols resolved
+at each boot.
+*/
+
+// two banks below the staging area
+#define PATCH_JOURNAL_BASE 0x000E8000
+#define PATCH_JOURNAL_BANK 0x4000
+#define PATCH_JOURNAL_PAGE 4096
+#define PATCH_JOURNAL_ALIGN 8
+#define PATCH_JOURNAL_MAX_LIVE 32
+#define PATCH_JOURNAL_BANK_MAGIC 0x4e524a50 // "PJRN"
+#define PATCH_JOURNAL_REC_MAGIC 0x43455250 // "PREC"
+
+typedef struct journal_bank_head {
+	uint32_t magic;
+	uint32_t gen; // the valid bank with the highest generation is active
+} journal_bank_head;
+
+// the payload follows, the next record starts PATCH_JOURNAL_ALIGN aligned
+typedef struct journal_rec {
+	uint32_t magic;
+	uint32_t len; // payload bytes
+	uint32_t id; // fixed_id
+	uint16_t type; // patch type
+	uint16_t pad;
+	uint32_t seq;
+	uint32_t crc; // of the fields above and the payload
+} journal_rec;
+
+// the live record of one patch
+typedef struct journal_live {
+	uint32_t id;
+	uint16_t type;
+	uint32_t addr;
+} journal_live;
+
+typedef struct patch_journal {
+	bool mounted;
+	bool dirty; // bytes after the last record are not erased, compact before appending
+	uint32_t bank;
+	uint32_t gen;
+	uint32_t tail; // next record
+	uint32_t seq;
+	uint32_t dead; // bytes of replaced records
+	int num;
+	journal_live live[PATCH_JOURNAL_MAX_LIVE];
+} patch_journal;
+
+typedef void (*patch_journal_visit)(void *user, const uint8_t *pkt, uint32_t len);
+// a live record moved by compaction, from stays readable until the next one
+typedef void (*patch_journal_move)(const uint8_t *from, const uint8_t *to, uint32_t len);
+
+// find the active bank and its records, format the journal if there is none
+int patch_journal_mount(void);
+// return: 0, -1 no space or flash error
+int patch_journal_append(const uint8_t *pkt, uint32_t len, uint16_t type, uint32_t id);
+// the live records, oldest first, read in place. return: number visited
+int patch_journal_replay(patch_journal_visit visit, void *user);
+// the payload of the live record of a patch, in place. NULL: none
+const uint8_t *patch_journal_find(uint16_t type, uint32_t id, uint32_t *len);
+// called for every record compaction moves, so what runs from a record can follow it
+void patch_journal_on_move(patch_journal_move move);
+int patch_journal_compact(void);
+// compact if the replaced records take more space than the live ones. return: compacted
+bool patch_journal_idle(void);
+// erase both banks
+void patch_journal_format(void);
+const patch_journal *patch_journal_state(void);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef PATCH_LZ_H_
+#define PATCH_LZ_H_
+#include <stdint.h>
+
+/*
+Streaming LZSS decoder for compressed patch payloads. The input is fed in
+chunks of any size (as received), the output goes to a sink in
+PATCH_LZ_FLUSH byte pieces. RAM is the window and a few bytes of state, not
+the patch.
+
+Stream: a flag byte, least significant bit first, describes the next 8 items.
+1: a literal byte. 0: a match, 2 bytes little endian, distance - 1 in the low
+PATCH_LZ_WINDOW_BITS bits and length - PATCH_LZ_MIN_MATCH in the rest.
+*/
+#define PATCH_LZ_WINDOW_BITS 10
+#define PATCH_LZ_WINDOW (1 << PATCH_LZ_WINDOW_BITS)
+#define PATCH_LZ_MIN_MATCH 3
+#define PATCH_LZ_MAX_MATCH (PATCH_LZ_MIN_MATCH + (1 << (16 - PATCH_LZ_WINDOW_BITS)) - 1)
+#define PATCH_LZ_FLUSH 256 // divides the window, a flushed piece is contiguous
+
+// off: position of data in the output
+typedef int (*patch_lz_sink)(void *user, uint32_t off, const uint8_t *data, int len);
+
+typedef struct patch_lz {
+	uint8_t window[PATCH_LZ_WINDOW];
+	uint32_t out_len; // bytes decoded
+	uint8_t flags;
+	uint8_t items; // items left in flags
+	uint8_t tok_lo;
+	uint8_t has_lo; // first byte of a match received
+	patch_lz_sink sink;
+	void *user;
+} patch_lz;
+
+void patch_lz_init(patch_lz *lz, patch_lz_sink sink, void *user);
+// return: 0, -1 bad stream or the sink failed
+int patch_lz_feed(patch_lz *lz, const uint8_t *in, int len);
+// flush the last piece, -1 if the stream stops inside an item
+int patch_lz_finish(patch_lz *lz);
+
+#endif
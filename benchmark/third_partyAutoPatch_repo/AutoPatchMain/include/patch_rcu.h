@@ -0,0 +1,67 @@
+#ifndef PATCH_RCU_H_
+#define PATCH_RCU_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+Immutable versioned patch table, read copy update.
+
+Readers (the dispatcher) never block: enter a read section, load the current
+table, look up and leave. Writers are serialized, copy the current table, modify
+the copy and publish it with one atomic pointer store. The old table is freed
+after every reader that could still see it has left (two counter grace period).
+*/
+
+typedef struct patch_rcu_entry {
+	uint32_t key; // patch address (fixed_id)
+	void *val;
+} patch_rcu_entry;
+
+typedef struct patch_rcu_table {
+	uint32_t version;
+	uint32_t fbits_filter; // OR of all keys with an active patch
+	uint16_t num;
+	patch_rcu_entry entries[0]; // sorted by key
+} patch_rcu_table;
+
+typedef struct patch_rcu {
+	_Atomic(patch_rcu_table *) cur;
+	atomic_uint idx; // reader counter of new read sections
+	atomic_uint readers[2];
+	atomic_flag writer; // writers are serialized
+} patch_rcu;
+
+void patch_rcu_init(patch_rcu *rcu);
+void patch_rcu_destroy(patch_rcu *rcu);
+
+// read side, wait-free except for the counter increment
+static inline unsigned patch_rcu_read_lock(patch_rcu *rcu) {
+	unsigned idx = atomic_load(&rcu->idx) & 1;
+	atomic_fetch_add(&rcu->readers[idx], 1);
+	return idx;
+}
+
+static inline void patch_rcu_read_unlock(patch_rcu *rcu, unsigned idx) {
+	atomic_fetch_sub(&rcu->readers[idx], 1);
+}
+
+static inline const patch_rcu_table *patch_rcu_deref(patch_rcu *rcu) {
+	return atomic_load(&rcu->cur);
+}
+
+void *patch_rcu_lookup(const patch_rcu_table *table, uint32_t key);
+
+// write side, copy the current table with one entry set/removed and publish it
+bool patch_rcu_set(patch_rcu *rcu, uint32_t key, void *val);
+bool patch_rcu_del(patch_rcu *rcu, uint32_t key);
+// set num entries with one copy and one publish (boot restore)
+bool patch_rcu_set_many(patch_rcu *rcu, const patch_rcu_entry *entries, int num);
+// wait until no reader can still hold a table published before this call
+void patch_rcu_synchronize(patch_rcu *rcu);
+
+#ifdef LINUX_TEST
+void patch_rcu_stress(int readers, int seconds);
+#endif
+
+#endif
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include "patch_verify.h"
+#include "patch_lz.h"
 
 /*
 Use socket or Uart transfer patch
@@ -36,8 +38,147 @@ typedef struct __attribute__((__packed__)) patch_desc {
 	uint32_t fixed_id;
 	//uint8_t code[0];
 	uint64_t (*func) (uint32_t sp);
+	uint16_t map_num;
+	uint32_t maps; // offset from the descriptor of map_num ebpf_map_def, 2 byte aligned, created when the patch is loaded
 } patch_desc;
 
+static inline const struct ebpf_map_def *patch_desc_maps(const patch_desc *desc) {
+	return (const struct ebpf_map_def *) ((const uint8_t *) desc + desc->maps);
+}
+
+/*
+Framed protocol. Every message is a frame header and len payload bytes, little
+endian. LOAD carries sign[PATCH_SIGN_LEN] (the digest of the packet, see
+patch_verify.h) and the patch packet. The device
+answers a LOAD with an ACK (status byte), the peer sends the next LOAD after
+it, so one frame is in flight and the receive buffer is never overrun. The
+HEARTBEAT answer carries the largest frame the device accepts (u32); a bigger
+frame is drained and refused. A packet is one patch (patch_desc, its code and
+its map definitions, found by the offset in the descriptor) or a bundle of
+them (patch_bundle.h), told apart by the bundle magic.
+
+LOAD_LZ carries lz_load_head and the packet compressed (patch_lz.h). It is
+decoded while it is received, into the flash staging area, so neither the
+compressed nor the decoded packet is held in RAM. The sign is the digest of
+the decoded packet, the same as for LOAD.
+
+XFER_BEGIN / XFER_CHUNK / XFER_END move one packet in numbered chunks that
+survive a lost connection. The chunks are programmed into the transfer area
+and each one received is marked in a record in the same area, so after a
+reconnect (or a reset) XFER_BEGIN with the same id, length and sign resumes:
+the device answers BEGIN and END with xfer_state, the chunks it has, and the
+peer sends only the others. CHUNK is not answered. END with every chunk in
+checks the digest of the packet and hands it to the loader (status ACK_OK),
+otherwise the status is ACK_PENDING and the bitmap tells what to resend.
+*/
+#define PATCH_FRAME_MAGIC 0xa5
+#define PATCH_FRAME_MAX 8192
+#define PATCH_SIGN_LEN 16
+
+// staged patches are appended, below the JIT cache
+#define PATCH_STAGE_BASE 0x000F0000
+#define PATCH_STAGE_SIZE 0x4000
+#define PATCH_STAGE_PAGE 4096
+#define PATCH_STAGE_ALIGN 8
+#define PATCH_LZ_CHUNK 256 // compressed bytes per receive
+
+// resumable transfer: the record page, then the chunks of one packet
+#define PATCH_XFER_BASE (PATCH_STAGE_BASE + PATCH_STAGE_SIZE)
+#define PATCH_XFER_SIZE 0x4000
+#define PATCH_XFER_DATA (PATCH_XFER_BASE + PATCH_STAGE_PAGE)
+#define PATCH_XFER_MAX_CHUNKS 256
+#define PATCH_XFER_CHUNK_MAX 1024
+#define PATCH_XFER_MAGIC 0x52464858 // "XHFR"
+
+enum patch_frame_cmd {
+	FRAME_EXIT = 0,
+	FRAME_LOAD,
+	FRAME_HEARTBEAT,
+	FRAME_ACK,
+	FRAME_LOAD_LZ,
+	FRAME_XFER_BEGIN,
+	FRAME_XFER_CHUNK,
+	FRAME_XFER_END,
+	FRAME_XFER_STATE,
+};
+
+enum patch_ack_status {
+	ACK_OK = 0,
+	ACK_TOO_LARGE,
+	ACK_BAD_PATCH,
+	ACK_NO_MEM,
+	ACK_BAD_SIGN,
+	ACK_PENDING, // transfer incomplete, see the bitmap
+};
+
+typedef struct __attribute__((__packed__)) frame_header {
+	uint8_t magic;
+	uint8_t cmd;
+	uint16_t seq;
+	uint32_t len;
+} frame_header;
+
+typedef struct __attribute__((__packed__)) lz_load_head {
+	uint8_t sign[PATCH_SIGN_LEN];
+	uint32_t raw_len; // decoded packet
+} lz_load_head;
+
+typedef struct __attribute__((__packed__)) xfer_begin {
+	uint32_t id; // chosen by the peer, the same for every attempt of one packet
+	uint32_t len; // packet, without the sign
+	uint16_t chunk_size; // multiple of PATCH_STAGE_ALIGN, the last chunk may be shorter
+	uint8_t sign[PATCH_SIGN_LEN];
+} xfer_begin;
+
+// the chunk data follows, aligned for flash programming
+typedef struct __attribute__((__packed__)) xfer_chunk_head {
+	uint32_t id;
+	uint16_t index;
+	uint16_t pad;
+} xfer_chunk_head;
+
+typedef struct __attribute__((__packed__)) xfer_state {
+	uint32_t id;
+	uint16_t chunks;
+	uint8_t status;
+	uint8_t bitmap[PATCH_XFER_MAX_CHUNKS / 8]; // bit set: chunk received
+} xfer_state;
+
+// persisted at PATCH_XFER_BASE, every field is programmed once between erases
+typedef struct xfer_record {
+	uint32_t magic; // programmed after the rest of the header
+	uint32_t magic_pad;
+	uint32_t id;
+	uint32_t len;
+	uint16_t chunk_size;
+	uint16_t chunks;
+	uint32_t pad;
+	uint8_t sign[PATCH_SIGN_LEN];
+	uint64_t installed; // erased until the packet is handed to the loader
+	uint64_t marks[PATCH_XFER_MAX_CHUNKS]; // erased: missing, 0: received
+} xfer_record;
+
+typedef enum frame_rx_state {
+	RX_HEADER = 0,
+	RX_BODY,
+	RX_DRAIN, // refused, the body is read and dropped to keep the framing
+	RX_LZ, // compressed body, decoded into the staging area chunk by chunk
+	RX_XFER, // transfer control or chunk, received into xfer_buf
+} frame_rx_state;
+
+// receive state of one connection, recv writes straight into hdr or body
+typedef struct frame_rx {
+	frame_rx_state state;
+	frame_header hdr;
+	uint32_t pos; // bytes of the header or the body received
+	uint8_t *body; // staging buffer, handed to the patch loader when complete
+	uint8_t status; // ack status
+	patch_verify verify; // digest of the packet received so far
+	lz_load_head lz_head;
+	uint32_t stage; // flash address the LOAD_LZ packet is decoded to
+	patch_lz lz;
+} frame_rx;
+
 typedef struct __attribute__((aligned(2))) patch_payload {
 	uint8_t sign[16];
 	// uint16_t pkt_len;
@@ -47,5 +188,19 @@ typedef struct __attribute__((aligned(2))) patch_payload {
 // run in new task
 bool start_patch_service(void);
 bool query_service_alive(void);
+// digest algorithm, and whether it runs per chunk or in one pass at the end
+void patch_service_set_verify(uint8_t algo, bool pipelined);
+/*
+Device side of one connection, for transports driven by an event loop: one
+receive (ctx must be readable), a complete frame is dispatched and answered.
+return: 0, -1 the connection is closed
+*/
+void frame_rx_reset(frame_rx *rx);
+int patch_service_step(service_context *ctx, frame_rx *rx);
+// free what a connection that closed mid-frame still holds
+void patch_service_release(frame_rx *rx);
+// forget the staged packet, the area is erased again as it is reused. done after
+// every LOAD_LZ frame, a staged packet is installed or refused before the next one
+void patch_stage_reset(void);
 
 #endif
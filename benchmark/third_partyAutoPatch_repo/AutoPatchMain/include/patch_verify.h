@@ -0,0 +1,49 @@
+#ifndef PATCH_VERIFY_H_
+#define PATCH_VERIFY_H_
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+Integrity check of a received patch packet. The digest is updated with every
+chunk as it is received, so it is done when the last byte lands. sign holds
+the CRC32 (little endian, zero padded) or the SHA-256 cut to 16 bytes.
+
+Zephyr: sys/crc.h and tinycrypt (CONFIG_TINYCRYPT_SHA256). LINUX_TEST: the
+same algorithms in patch_verify.c.
+*/
+#define PATCH_VERIFY_CRC32 1
+#define PATCH_VERIFY_SHA256 2
+
+#ifndef PATCH_VERIFY_ALGO
+#define PATCH_VERIFY_ALGO PATCH_VERIFY_SHA256
+#endif
+
+#define PATCH_DIGEST_LEN 16
+
+#if defined(LINUX_TEST)
+typedef struct patch_sha256_ctx {
+	uint32_t state[8];
+	uint64_t bits;
+	uint8_t block[64];
+	uint32_t used;
+} patch_sha256_ctx;
+#else
+#include <tinycrypt/sha256.h>
+typedef struct tc_sha256_state_struct patch_sha256_ctx;
+#endif
+
+typedef struct patch_verify {
+	uint8_t algo;
+	uint32_t crc;
+	patch_sha256_ctx sha;
+} patch_verify;
+
+void patch_verify_init(patch_verify *v, uint8_t algo);
+void patch_verify_update(patch_verify *v, const uint8_t *data, size_t len);
+// true if the digest of everything passed to update is sign
+bool patch_verify_final(patch_verify *v, const uint8_t sign[PATCH_DIGEST_LEN]);
+// the sign of a packet, for the sender side
+void patch_verify_sign(uint8_t algo, const uint8_t *data, size_t len, uint8_t sign[PATCH_DIGEST_LEN]);
+
+#endif
@@ -1,16 +1,147 @@
 #include "ebpf_allocator.h"
 #include "ebpf_porting.h"
 #include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
 
 /*
-
+Size class pool allocator. Every class is a static arena of equal blocks, free
+blocks are linked through their first word, untouched blocks are handed out by
+a bump index, so alloc and free are O(1) and need no init pass. The class of a
+pointer is found from the arena address range, no block header.
 */
 
+#define POOL_LOCK() unsigned int pool_key = irq_lock()
+#define POOL_UNLOCK() irq_unlock(pool_key)
+
+static const uint16_t pool_block_size[EBPF_POOL_CLASS_NUM] = { 16, 32, 64, 128, 256, 512 };
+static const uint16_t pool_block_num[EBPF_POOL_CLASS_NUM] = {
+	EBPF_POOL_N16, EBPF_POOL_N32, EBPF_POOL_N64, EBPF_POOL_N128, EBPF_POOL_N256, EBPF_POOL_N512,
+};
+
+#define POOL_TOTAL_BLOCKS (EBPF_POOL_N16 + EBPF_POOL_N32 + EBPF_POOL_N64 + \
+	EBPF_POOL_N128 + EBPF_POOL_N256 + EBPF_POOL_N512)
+#define POOL_ARENA_SIZE (16 * EBPF_POOL_N16 + 32 * EBPF_POOL_N32 + 64 * EBPF_POOL_N64 + \
+	128 * EBPF_POOL_N128 + 256 * EBPF_POOL_N256 + 512 * EBPF_POOL_N512)
+static uint8_t pool_arena[POOL_ARENA_SIZE] __attribute__((aligned(8)));
+static uint16_t pool_req[POOL_TOTAL_BLOCKS]; // requested size per block, for fragmentation
+
+typedef struct pool_class {
+	uint8_t *start;
+	uint8_t *end;
+	void *free_list;
+	uint16_t bump;
+	uint16_t *req;
+	ebpf_pool_stat stat;
+} pool_class;
+
+static pool_class pools[EBPF_POOL_CLASS_NUM];
+static bool pool_ready = false;
+
 int mem_size = 0;
+static int os_bytes = 0;
+
+static void pool_setup(void) {
+	uint8_t *p = pool_arena;
+	uint16_t *req = pool_req;
+	for (int i = 0; i < EBPF_POOL_CLASS_NUM; i++) {
+		pools[i].start = p;
+		pools[i].end = p + pool_block_num[i] * pool_block_size[i];
+		pools[i].free_list = NULL;
+		pools[i].bump = 0;
+		pools[i].req = req;
+		pools[i].stat.block_size = pool_block_size[i];
+		pools[i].stat.blocks = pool_block_num[i];
+		p = pools[i].end;
+		req += pool_block_num[i];
+	}
+	pool_ready = true;
+}
+
+static int pool_class_of_size(size_t size) {
+	for (int i = 0; i < EBPF_POOL_CLASS_NUM; i++) {
+		if (size <= pool_block_size[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int pool_class_of_ptr(void *ptr) {
+	uint8_t *p = ptr;
+	if (p < pool_arena || p >= pool_arena + POOL_ARENA_SIZE) {
+		return -1;
+	}
+	for (int i = 0; i < EBPF_POOL_CLASS_NUM; i++) {
+		if (p >= pools[i].start && p < pools[i].end) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int pool_block_idx(pool_class *pc, void *ptr) {
+	return ((uint8_t *) ptr - pc->start) / pc->stat.block_size;
+}
+
+static void *pool_alloc(size_t size) {
+	int cls = pool_class_of_size(size);
+	if (cls < 0) {
+		return NULL;
+	}
+	void *blk = NULL;
+	POOL_LOCK();
+	if (!pool_ready) {
+		pool_setup();
+	}
+	pool_class *pc = &pools[cls];
+	if (pc->free_list != NULL) {
+		blk = pc->free_list;
+		pc->free_list = *(void **) blk;
+	} else if (pc->bump < pc->stat.blocks) {
+		blk = pc->start + pc->bump * pc->stat.block_size;
+		pc->bump++;
+	}
+	if (blk != NULL) {
+		pc->req[pool_block_idx(pc, blk)] = size;
+		pc->stat.req_bytes += size;
+		pc->stat.allocs++;
+		if (++pc->stat.in_use > pc->stat.high_water) {
+			pc->stat.high_water = pc->stat.in_use;
+		}
+	} else {
+		pc->stat.fallbacks++;
+	}
+	POOL_UNLOCK();
+	return blk;
+}
+
+// return false if ptr is not a pool block
+static bool pool_free(void *ptr) {
+	int cls = pool_class_of_ptr(ptr);
+	if (cls < 0) {
+		return false;
+	}
+	POOL_LOCK();
+	pool_class *pc = &pools[cls];
+	pc->stat.req_bytes -= pc->req[pool_block_idx(pc, ptr)];
+	pc->stat.in_use--;
+	*(void **) ptr = pc->free_list;
+	pc->free_list = ptr;
+	POOL_UNLOCK();
+	return true;
+}
 
 void* ebpf_malloc(size_t size) {
 	mem_size += size;
-	return (void *) my_os_malloc(size);
+	void *ptr = pool_alloc(size);
+	if (ptr == NULL) {
+		ptr = (void *) my_os_malloc(size);
+		if (ptr != NULL) {
+			os_bytes += size;
+		}
+	}
+	return ptr;
 }
 
 // void* ebpf_realloc(void* rmem, size_t newsize) {
@@ -27,6 +158,18 @@ void* ebpf_realloc(void *rmem, size_t orisize, size_t newsize) {
 	} else if (newsize <= orisize) {
 		return rmem;
 	} else {
+		// still fits the block of its class, no copy
+		int cls = pool_class_of_ptr(rmem);
+		if (cls >= 0 && newsize <= pool_block_size[cls]) {
+			POOL_LOCK();
+			pool_class *pc = &pools[cls];
+			int idx = pool_block_idx(pc, rmem);
+			pc->stat.req_bytes += newsize - pc->req[idx];
+			pc->req[idx] = newsize;
+			POOL_UNLOCK();
+			return rmem;
+		}
+		mem_size -= newsize; // counted again by ebpf_malloc
 		void *pnew = ebpf_malloc(newsize);
 		if (pnew != NULL) {
 //			uint8_t *xdes = pnew;
@@ -40,14 +183,44 @@ void* ebpf_realloc(void *rmem, size_t orisize, size_t newsize) {
 }
 
 void* ebpf_calloc(size_t nelem, size_t elmsize) {
-	mem_size += elmsize;
-	return (void*) my_os_calloc(nelem, elmsize);
+	void *ptr = ebpf_malloc(nelem * elmsize);
+	if (ptr != NULL) {
+		memset(ptr, 0, nelem * elmsize);
+	}
+	return ptr;
 }
 
 void ebpf_free(void* rmem) {
-	my_os_free(rmem);
+	if (rmem == NULL) {
+		return;
+	}
+	if (!pool_free(rmem)) {
+		my_os_free(rmem);
+	}
 }
 
 int get_ebpf_alloc_size() {
 	return mem_size;
 }
+
+void ebpf_pool_get_stat(int cls, ebpf_pool_stat *stat) {
+	if (!pool_ready) {
+		pool_setup();
+	}
+	*stat = pools[cls].stat;
+}
+
+int ebpf_pool_os_bytes() {
+	return os_bytes;
+}
+
+void ebpf_pool_dump(void) {
+	printf("class block blocks in_use high_water used_bytes req_bytes allocs fallbacks\n");
+	for (int i = 0; i < EBPF_POOL_CLASS_NUM; i++) {
+		ebpf_pool_stat st;
+		ebpf_pool_get_stat(i, &st);
+		printf("%5d %5d %6d %6d %10d %10d %9d %6d %9d\n", i, st.block_size, st.blocks, st.in_use,
+			st.high_water, st.in_use * st.block_size, st.req_bytes, st.allocs, st.fallbacks);
+	}
+	printf("os heap bytes (fallback): %d\n", os_bytes);
+}
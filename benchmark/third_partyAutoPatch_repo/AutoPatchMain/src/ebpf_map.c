@@ -0,0 +1,214 @@
+#include "ebpf_map.h"
+#include "ebpf_allocator.h"
+#include "ebpf_porting.h"
+#include "iotpatch.h"
+#include <string.h>
+#include <stdio.h>
+
+// patches on other threads and in the debug monitor share a map, a probe chain is changed with irqs off
+#define MAP_LOCK() unsigned int map_key = irq_lock()
+#define MAP_UNLOCK() irq_unlock(map_key)
+
+ebpf_map *ebpf_map_table[EBPF_MAX_MAPS];
+
+static uint32_t map_hash(const ebpf_map *map, uint32_t key) {
+	return (key * 2654435761u) >> (32 - map->bits);
+}
+
+static ebpf_map_def map_def_normalize(const ebpf_map_def *def) {
+	ebpf_map_def d = *def;
+	if (d.type == EBPF_MAP_SITE_COUNTER) {
+		d.value_size = sizeof(uint32_t);
+		if (d.max_entries == 0) {
+			d.max_entries = MAX_FIXED_SITES;
+		}
+	}
+	d.value_size = (d.value_size + 3) & ~3;
+	return d;
+}
+
+// one allocation per map: struct, vals, then keys and used flags for hash maps
+static ebpf_map *map_create(const ebpf_map_def *def) {
+	ebpf_map_def d = map_def_normalize(def);
+	if (d.type < EBPF_MAP_ARRAY || d.type > EBPF_MAP_SITE_COUNTER || d.value_size == 0 || d.max_entries == 0) {
+		return NULL;
+	}
+	uint8_t bits = 0;
+	while ((1u << bits) < 2u * d.max_entries) { // load factor <= 1/2
+		bits++;
+	}
+	uint32_t slots = d.type == EBPF_MAP_HASH ? 1u << bits : d.max_entries;
+	uint32_t size = sizeof(ebpf_map) + slots * d.value_size;
+	if (d.type == EBPF_MAP_HASH) {
+		size += slots * (sizeof(uint32_t) + 1);
+	}
+	ebpf_map *map = ebpf_calloc(1, size);
+	if (map == NULL) {
+		return NULL;
+	}
+	map->def = d;
+	map->bits = bits;
+	map->vals = (uint8_t *) (map + 1);
+	if (d.type == EBPF_MAP_HASH) {
+		map->keys = (uint32_t *) (map->vals + slots * d.value_size);
+		map->used = (uint8_t *) (map->keys + slots);
+	}
+	return map;
+}
+
+static bool map_def_equal(const ebpf_map_def *a, const ebpf_map_def *b) {
+	return a->type == b->type && a->max_entries == b->max_entries && a->value_size == b->value_size;
+}
+
+// a failed setup keeps none of its maps
+int ebpf_maps_setup(const ebpf_map_def *defs, int num) {
+	for (int i = 0; i < num; i++) {
+		const ebpf_map_def *def = &defs[i];
+		if (def->id >= EBPF_MAX_MAPS) {
+			printf("Warning: map id %d exceed the maximum number(%d).\n", def->id, EBPF_MAX_MAPS);
+			ebpf_maps_release(defs, i);
+			return -1;
+		}
+		ebpf_map *map = ebpf_map_table[def->id];
+		if (map == NULL) {
+			map = map_create(def);
+			if (map == NULL) {
+				printf("Warning: failed to create map %d.\n", def->id);
+				ebpf_maps_release(defs, i);
+				return -1;
+			}
+			ebpf_map_table[def->id] = map;
+		} else {
+			ebpf_map_def d = map_def_normalize(def);
+			if (!map_def_equal(&map->def, &d)) {
+				printf("Warning: map %d is declared with another definition.\n", def->id);
+				ebpf_maps_release(defs, i);
+				return -1;
+			}
+		}
+		map->refcnt++;
+	}
+	return 0;
+}
+
+void ebpf_maps_release(const ebpf_map_def *defs, int num) {
+	for (int i = 0; i < num; i++) {
+		ebpf_map *map = ebpf_map_get(defs[i].id);
+		if (map != NULL && --map->refcnt == 0) {
+			ebpf_map_table[defs[i].id] = NULL;
+			ebpf_free(map);
+		}
+	}
+}
+
+void ebpf_maps_init(void) {
+	const ebpf_map_def def = {EBPF_DEFAULT_MAP, EBPF_MAP_HASH, sizeof(uint32_t), EBPF_DEFAULT_MAP_SIZE};
+	ebpf_maps_setup(&def, 1);
+}
+
+void ebpf_maps_destroy(void) {
+	for (int i = 0; i < EBPF_MAX_MAPS; i++) {
+		if (ebpf_map_table[i] != NULL) {
+			ebpf_free(ebpf_map_table[i]);
+			ebpf_map_table[i] = NULL;
+		}
+	}
+}
+
+// slot of the key, or the empty slot that ends its probe chain
+static uint32_t hash_slot(const ebpf_map *map, uint32_t key) {
+	uint32_t mask = (1u << map->bits) - 1;
+	uint32_t h = map_hash(map, key);
+	while (map->used[h] && map->keys[h] != key) {
+		h = (h + 1) & mask; // never full, load factor <= 1/2
+	}
+	return h;
+}
+
+void *ebpf_map_lookup(ebpf_map *map, uint32_t key) {
+	if (map->def.type != EBPF_MAP_HASH) {
+		if (key >= map->def.max_entries) {
+			return NULL;
+		}
+		return map->vals + key * map->def.value_size;
+	}
+	uint32_t h = hash_slot(map, key);
+	if (!map->used[h]) {
+		return NULL;
+	}
+	return map->vals + h * map->def.value_size;
+}
+
+void *ebpf_map_lookup_or_insert(ebpf_map *map, uint32_t key) {
+	if (map->def.type != EBPF_MAP_HASH) {
+		return ebpf_map_lookup(map, key);
+	}
+	MAP_LOCK();
+	uint32_t h = hash_slot(map, key);
+	if (!map->used[h]) {
+		if (map->cur_size >= map->def.max_entries) {
+			MAP_UNLOCK();
+			return NULL;
+		}
+		memset(map->vals + h * map->def.value_size, 0, map->def.value_size);
+		map->keys[h] = key;
+		map->used[h] = 1;
+		map->cur_size++;
+	}
+	MAP_UNLOCK();
+	return map->vals + h * map->def.value_size;
+}
+
+int ebpf_map_update(ebpf_map *map, uint32_t key, const void *val) {
+	void *slot = ebpf_map_lookup_or_insert(map, key);
+	if (slot == NULL) {
+		return -1;
+	}
+	memcpy(slot, val, map->def.value_size);
+	return 0;
+}
+
+/*
+Backward shift deletion: move the following entries of the probe chain into the
+hole, so no tombstones are left and lookups stay short.
+*/
+int ebpf_map_delete(ebpf_map *map, uint32_t key) {
+	if (map->def.type != EBPF_MAP_HASH) {
+		void *slot = ebpf_map_lookup(map, key);
+		if (slot == NULL) {
+			return -1;
+		}
+		memset(slot, 0, map->def.value_size);
+		return 0;
+	}
+	uint32_t mask = (1u << map->bits) - 1;
+	MAP_LOCK();
+	uint32_t hole = hash_slot(map, key);
+	if (!map->used[hole]) {
+		MAP_UNLOCK();
+		return -1;
+	}
+	uint32_t next = (hole + 1) & mask;
+	while (map->used[next]) {
+		uint32_t home = map_hash(map, map->keys[next]);
+		// move it if its home is not in (hole, next]
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			map->keys[hole] = map->keys[next];
+			memcpy(map->vals + hole * map->def.value_size, map->vals + next * map->def.value_size, map->def.value_size);
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+	map->used[hole] = 0;
+	map->cur_size--;
+	MAP_UNLOCK();
+	return 0;
+}
+
+uint32_t ebpf_map_inc(ebpf_map *map, uint32_t key) {
+	uint32_t *cnt = ebpf_map_lookup_or_insert(map, key);
+	if (cnt == NULL) {
+		return 0;
+	}
+	return __atomic_add_fetch(cnt, 1, __ATOMIC_RELAXED);
+}
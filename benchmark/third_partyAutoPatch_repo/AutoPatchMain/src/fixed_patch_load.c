@@ -291,6 +291,7 @@ void create_patch_desc_new(int pid) {
 	printf("The location of patch is 0x%08x \n", _desc->fixed_id);
 	_desc->func = pt->func;
 	_desc->cve = pt->cve;
+	_desc->map_num = 0;
 
 	notify_new_patch(_desc);
 
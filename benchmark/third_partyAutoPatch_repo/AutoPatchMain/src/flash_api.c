@@ -1,120 +1,34 @@
-#ifdef DEV_STM32L475
-
-#include "stm32l4xx.h"
+/*
+Flash HAL. A backend gives its page size, its write unit and three
+primitives: erase a page, program whole units, and whether a programmed unit
+can be programmed again to a new value without an erase. flash_port_write and
+the staging calls are built on them below, the same for every backend.
+*/
 #include "flash_api.h"
+#include <stdbool.h>
 #include <string.h>
 #include "utils.h"
 
+#ifdef DEV_STM32L475
+
+#include "stm32l4xx.h"
+
 #define FLASH_START_ADRESS     ((uint32_t)0x08000000)
 #define FLASH_END_ADDRESS      ((uint32_t)(0x08000000 + 512 * 1024))
 #define FLASH_PAGE_NBPERBANK   128
 #define FLASH_BANK_NUMBER      2
+#define STM_SECTOR_SIZE	2048
+
+#define FLASH_HAL_START FLASH_START_ADRESS
+#define FLASH_HAL_END FLASH_END_ADDRESS
+#define FLASH_HAL_PAGE STM_SECTOR_SIZE
+#define FLASH_HAL_UNIT 8 // doubleword
+#define FLASH_HAL_TEST_ADDR 0x08030000
 
 static int flash_get_blank(uint32_t addr);
 static int write_directly(uint32_t addr, uint64_t *buf, int size);
 static int earse_page(uint32_t secid);
 
-
-uint32_t flash_read_word(uint32_t faddr) {
-	return *(volatile uint32_t*) faddr;
-}
-
-void flash_port_read(uint32_t addr, uint8_t *buf, int size) {
-	//uint8_t *buf_8 = (uint8_t *) buf;
-//	uint8_t last = *(vu8*) (addr + size - 1);
-//	buf_8[size - 1] = last;
-	for (int i = 0; i < size; i++) {
-		buf[i] = *(volatile uint8_t*) (addr + i);
-	}
-}
-
-static void flash_read32(uint32_t addr, uint32_t *buf, int size) {
-	int i = 0;
-	for (i = 0; i < size; i++) {
-		buf[i] = *(volatile uint32_t*) addr;
-		addr += 4;
-	}
-	//printf("exit: %d 0x%p 0x%p\n", i, buf + i, (void*)addr);
-}
-
-#define STM_SECTOR_SIZE	2048
-static __align(8) uint64_t STMFLASH_BUF[STM_SECTOR_SIZE / 8]; // 2k
-int flash_port_write(uint32_t faddr, uint8_t *buf, int size) {
-	int ret = 0;
-	
-	// align 8
-	uint32_t start_addr = faddr & 0xFFFFFFF8;
-	uint32_t end_addr = (faddr + size + 8) & 0xFFFFFFF8;
-	
-	if(start_addr < FLASH_START_ADRESS || end_addr > FLASH_END_ADDRESS) {
-		DEBUG_LOG("ERROR: write outrange flash size! addr is (0x%p)\n", (void*)(faddr + size));
-		return -1;
-	}
-	uint32_t offaddr   = start_addr - FLASH_START_ADRESS;
-	uint32_t secid     = offaddr / STM_SECTOR_SIZE;
-	uint32_t secoff    = (offaddr % STM_SECTOR_SIZE) / 8;
-	uint32_t sec_remain = STM_SECTOR_SIZE / 8 - secoff; // sector remain size
-	uint32_t total_dw = (end_addr - start_addr) / 8; // total double world to write
-	
-	// can write in current sector
-	uint32_t write_dw = total_dw <= sec_remain ? total_dw : sec_remain;
-	HAL_FLASH_Unlock();
-	int start_pos = secoff * 8 + (faddr - start_addr); // padding + offset
-
-	//printf("STMFLASH_BUF: (0x%p)\n", (void *)STMFLASH_BUF);
-	
-	/*
-	STMFLASH_BUF align(8)
-	buffer start at any pos with any len
-	         |       STMFLASH_BUF       |
-	         |----<---|--------|----->--|
-	left padding  |   buffer         | right padding  
-	*/
-	while (1) {
-		// copy page
-		// flash_port_read(secid * STM_SECTOR_SIZE + FLASH_START_ADRESS, (uint8_t*) STMFLASH_BUF, STM_SECTOR_SIZE);
-		flash_read32(secid * STM_SECTOR_SIZE + FLASH_START_ADRESS, (uint32_t*)STMFLASH_BUF, STM_SECTOR_SIZE / 4);
-		// left padding
-		int write_bytes = write_dw * 8 - start_pos;
-		// right padding
-		if (size < write_bytes) write_bytes = size;
-		for (int i = 0; i < write_bytes; i++) {
-			((uint8_t *)STMFLASH_BUF)[start_pos + i] = buf[i];
-		}
-		// earse
-		if (earse_page(secid) != 0) {
-			ret = -1;
-			break;
-		}
-		
-		// write back
-		if (write_directly(start_addr, STMFLASH_BUF, write_dw) != 0) {
-			ret = -1;
-			break;
-		}
-
-		if (write_dw == total_dw) {
-			// finish
-			break;
-		} else {
-			// need more sections
-			secid++;
-			start_pos = 0;
-			size -= write_bytes;
-			buf += write_bytes;
-			start_addr += write_dw * 8;
-			total_dw = (size + 8) / 8;
-			if (size > STM_SECTOR_SIZE) {
-				write_dw = STM_SECTOR_SIZE / 8;
-			} else {
-				write_dw = (size + 8) / 8;
-			}
-		}
-	}
-	HAL_FLASH_Lock();
-	return ret;
-}
-
 static int flash_get_blank(uint32_t addr) {
 	if(addr < (FLASH_BASE + FLASH_BANK_SIZE)){
 		return FLASH_BANK_1;
@@ -132,7 +46,7 @@ static int earse_page(uint32_t secid) {
 	FlashEraseInit.NbPages = 1;
 
 	__HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGSERR);
-	
+
 	//HAL_FLASH_Unlock();
 	uint32_t err;
 	int ret = 0;
@@ -160,40 +74,336 @@ static int write_directly(uint32_t addr, uint64_t *buf, int size) {
 	return ret;
 }
 
+static void flash_hal_begin(void) {
+	HAL_FLASH_Unlock();
+}
+
+static void flash_hal_end(void) {
+	HAL_FLASH_Lock();
+}
+
+static int flash_hal_erase(uint32_t page) {
+	return earse_page((page - FLASH_START_ADRESS) / STM_SECTOR_SIZE);
+}
+
+static int flash_hal_program(uint32_t addr, const uint8_t *buf, int size) {
+	for (int off = 0; off < size; off += 8) {
+		uint64_t dw;
+		memcpy(&dw, buf + off, 8);
+		if (write_directly(addr + off, &dw, 1) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// the ECC is computed once per doubleword: only an erased one can be programmed
+static bool flash_hal_in_place(const uint8_t *old, const uint8_t *new) {
+	for (int i = 0; i < FLASH_HAL_UNIT; i++) {
+		if (old[i] != 0xff) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#elif defined(CONFIG_SOC_NRF52840) && defined(CONFIG_NRFX_NVMC)
+/*
+nRF52840 NVMC backend, through nrfx. Programming is word granular and only
+clears bits, a word can be written twice (n_WRITE) before its page is erased:
+callers clear bits of a programmed word at most once (the transfer record
+marks). The NVMC is not shared with the radio here: with the BLE controller
+running use the Zephyr flash driver backend (CONFIG_NRFX_NVMC=n).
+*/
+#include <nrfx_nvmc.h>
+
+#define FLASH_HAL_START 0x00000000
+#define FLASH_HAL_END (1024 * 1024)
+#define FLASH_HAL_PAGE 4096
+#define FLASH_HAL_UNIT 4
+#define FLASH_HAL_TEST_ADDR 0x000E0000 // below the patch journal
+
+static void flash_hal_begin(void) {
+}
+
+static void flash_hal_end(void) {
+}
+
+static int flash_hal_erase(uint32_t page) {
+	if (nrfx_nvmc_page_erase(page) != NRFX_SUCCESS) {
+		DEBUG_LOG("ERROR: erase flash failed: (0x%08x)\n", page);
+		return -1;
+	}
+	return 0;
+}
+
+static int flash_hal_program(uint32_t addr, const uint8_t *buf, int size) {
+	for (int off = 0; off < size; off += 4) {
+		uint32_t word;
+		memcpy(&word, buf + off, 4);
+		nrfx_nvmc_word_write(addr + off, word);
+		while (!nrfx_nvmc_write_done_check()) {
+		}
+		if (*(volatile uint32_t *) (addr + off) != word) {
+			DEBUG_LOG("ERROR: write flash failed: (0x%08x)\n", addr + off);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static bool flash_hal_in_place(const uint8_t *old, const uint8_t *new) {
+	for (int i = 0; i < FLASH_HAL_UNIT; i++) {
+		if ((old[i] & new[i]) != new[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#elif defined(CONFIG_FLASH)
+/*
+Zephyr flash driver backend, any board with a flash controller. The write
+block size of the driver divides the unit here.
+*/
+#include <zephyr/drivers/flash.h>
+#include <zephyr/device.h>
+
+#define FLASH_HAL_START DT_REG_ADDR(DT_CHOSEN(zephyr_flash))
+#define FLASH_HAL_END (FLASH_HAL_START + DT_REG_SIZE(DT_CHOSEN(zephyr_flash)))
+#define FLASH_HAL_PAGE 4096
+#define FLASH_HAL_UNIT 8
+#define FLASH_HAL_TEST_ADDR 0x000E0000 // nRF52840, below the patch journal
+
+static const struct device *flash_dev(void) {
+	return DEVICE_DT_GET(DT_CHOSEN(zephyr_flash_controller));
+}
+
+static void flash_hal_begin(void) {
+}
+
+static void flash_hal_end(void) {
+}
+
+static int flash_hal_erase(uint32_t page) {
+	return flash_erase(flash_dev(), page, FLASH_HAL_PAGE) == 0 ? 0 : -1;
+}
+
+static int flash_hal_program(uint32_t addr, const uint8_t *buf, int size) {
+	return flash_write(flash_dev(), addr, buf, size) == 0 ? 0 : -1;
+}
+
+// nothing is known of the part, only an erased unit
+static bool flash_hal_in_place(const uint8_t *old, const uint8_t *new) {
+	for (int i = 0; i < FLASH_HAL_UNIT; i++) {
+		if (old[i] != 0xff) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif
+
+#ifdef FLASH_HAL_PAGE
+
+static uint8_t flash_page_buf[FLASH_HAL_PAGE] __attribute__((aligned(8)));
+static bool flash_erase_avoid = true; // false: every write erases its pages (test_flash_write_speed)
+static struct {
+	uint32_t erases;
+	uint32_t programmed; // units
+	uint32_t skipped; // units that already held the data
+} flash_stat;
+
+uint32_t flash_read_word(uint32_t faddr) {
+	return *(volatile uint32_t*) faddr;
+}
+
+void flash_port_read(uint32_t faddr, uint8_t *buf, int size) {
+	memcpy(buf, (const void *) faddr, size); // memory mapped
+}
+
+// program the units of [from, to) in the page whose content differs from flash_page_buf
+static int flash_page_program(uint32_t page, uint32_t from, uint32_t to) {
+	uint32_t u = from;
+	while (u < to) {
+		if (memcmp(flash_page_buf + u, (const void *) (page + u), FLASH_HAL_UNIT) == 0) {
+			flash_stat.skipped++;
+			u += FLASH_HAL_UNIT;
+			continue;
+		}
+		uint32_t run = u;
+		while (u < to && memcmp(flash_page_buf + u, (const void *) (page + u), FLASH_HAL_UNIT) != 0) {
+			u += FLASH_HAL_UNIT;
+		}
+		if (flash_hal_program(page + run, flash_page_buf + run, u - run) != 0) {
+			return -1;
+		}
+		flash_stat.programmed += (u - run) / FLASH_HAL_UNIT;
+	}
+	return 0;
+}
+
+static bool flash_page_in_place(uint32_t page, uint32_t from, uint32_t to) {
+	for (uint32_t u = from; u < to; u += FLASH_HAL_UNIT) {
+		const uint8_t *old = (const uint8_t *) (page + u);
+		if (memcmp(old, flash_page_buf + u, FLASH_HAL_UNIT) != 0 && !flash_hal_in_place(old, flash_page_buf + u)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+Appends into erased flash, and rewrites that only clear bits where the part
+allows it, are programmed in place: no erase, and only the units that change.
+Otherwise the page is read, erased and written back.
+*/
+static int flash_page_write(uint32_t page, uint32_t off, const uint8_t *buf, int n) {
+	uint32_t from = off & ~(FLASH_HAL_UNIT - 1);
+	uint32_t to = (off + n + FLASH_HAL_UNIT - 1) & ~(FLASH_HAL_UNIT - 1);
+	// the units written, as they read after the write
+	memcpy(flash_page_buf + from, (const void *) (page + from), to - from);
+	memcpy(flash_page_buf + off, buf, n);
+	if (flash_erase_avoid && flash_page_in_place(page, from, to)) {
+		return flash_page_program(page, from, to);
+	}
+	memcpy(flash_page_buf, (const void *) page, from);
+	memcpy(flash_page_buf + to, (const void *) (page + to), FLASH_HAL_PAGE - to);
+	if (flash_hal_erase(page) != 0) {
+		return -1;
+	}
+	flash_stat.erases++;
+	return flash_page_program(page, 0, FLASH_HAL_PAGE); // erased units stay as they are
+}
+
+int flash_port_write(uint32_t faddr, uint8_t *buf, int size) {
+	if (faddr < FLASH_HAL_START || faddr + size > FLASH_HAL_END) {
+		DEBUG_LOG("ERROR: write outrange flash size! addr is (0x%p)\n", (void*)(faddr + size));
+		return -1;
+	}
+	int ret = 0;
+	flash_hal_begin();
+	while (size > 0 && ret == 0) {
+		uint32_t page = faddr & ~(FLASH_HAL_PAGE - 1);
+		uint32_t off = faddr - page;
+		int n = FLASH_HAL_PAGE - off < size ? FLASH_HAL_PAGE - off : size;
+		ret = flash_page_write(page, off, buf, n);
+		faddr += n;
+		buf += n;
+		size -= n;
+	}
+	flash_hal_end();
+	return ret;
+}
+
+int flash_port_erase(uint32_t faddr, int size) {
+	int ret = 0;
+	flash_hal_begin();
+	for (uint32_t page = faddr & ~(FLASH_HAL_PAGE - 1); page < faddr + size && ret == 0; page += FLASH_HAL_PAGE) {
+		ret = flash_hal_erase(page);
+		flash_stat.erases++;
+	}
+	flash_hal_end();
+	return ret;
+}
+
+int flash_port_program(uint32_t faddr, const uint8_t *buf, int size) {
+	int body = size & ~(FLASH_HAL_UNIT - 1);
+	int ret = 0;
+	flash_hal_begin();
+	if (body > 0) {
+		ret = flash_hal_program(faddr, buf, body);
+	}
+	if (ret == 0 && body < size) {
+		uint8_t tail[FLASH_HAL_UNIT];
+		memset(tail, 0xff, sizeof(tail));
+		memcpy(tail, buf + body, size - body);
+		ret = flash_hal_program(faddr + body, tail, sizeof(tail));
+	}
+	flash_hal_end();
+	return ret;
+}
+
 #include "include/profiling.h"
 #define WRITE_BLOCK 2048
+#define WRITE_RECORD 64 // journal and JIT cache sized appends
 #define READ_TIMES 1000
 char data[WRITE_BLOCK];
+static char sram_buf[WRITE_BLOCK];
 
 static void test_sram_speed() {
-	uint32_t write_addr = 0x20002000;
 	int start = get_start_tick();
 	for (int i = 0; i < 10; i++) {
-		uint32_t addr = write_addr + i * WRITE_BLOCK;
-		memcpy((void *) addr, data, WRITE_BLOCK);
+		memcpy(sram_buf, data, WRITE_BLOCK);
 	}
 	int end = get_cur_tick();
-	
+
 	DEBUG_LOG("test_sram_speed: %f\n", cycles2us((end - start) / 10));
 }
 
-static void test_flash_speed() {
-	uint32_t write_addr = 0x08030000;
+/*
+The same writes with both strategies: blocks and records appended into
+erased flash (no erase needed), then the blocks rewritten with the bits
+inverted (an erase either way).
+*/
+static void test_flash_speed(bool avoid) {
+	const char *name = avoid ? "erase-avoiding" : "always-erase";
+	uint32_t write_addr = FLASH_HAL_TEST_ADDR;
+	flash_erase_avoid = avoid;
+
+	flash_port_erase(write_addr, 10 * WRITE_BLOCK);
+	memset(&flash_stat, 0, sizeof(flash_stat));
 	int start = get_start_tick();
 	for (int i = 0; i < 10; i++) {
 		uint32_t addr = write_addr + i * WRITE_BLOCK;
-		//memcpy((void *) addr, data, WRITE_BLOCK);
 		flash_port_write(addr, (uint8_t *) data, WRITE_BLOCK);
 	}
 	int end = get_cur_tick();
-	DEBUG_LOG("test_flash_speed: %f\n", cycles2us((end - start) / 10));
+	DEBUG_LOG("test_flash_speed (%s): block append %f us, %u erases %u units\n", name, cycles2us((end - start) / 10),
+		flash_stat.erases, flash_stat.programmed);
+
+	flash_port_erase(write_addr, FLASH_HAL_PAGE);
+	memset(&flash_stat, 0, sizeof(flash_stat));
+	int records = FLASH_HAL_PAGE / WRITE_RECORD;
+	start = get_start_tick();
+	for (int i = 0; i < records; i++) {
+		flash_port_write(write_addr + i * WRITE_RECORD, (uint8_t *) data, WRITE_RECORD);
+	}
+	end = get_cur_tick();
+	DEBUG_LOG("test_flash_speed (%s): record append %f us, %u erases %u units\n", name,
+		cycles2us((end - start) / records), flash_stat.erases, flash_stat.programmed);
+
+	for (int i = 0; i < WRITE_BLOCK; i++) {
+		data[i] = ~data[i];
+	}
+	memset(&flash_stat, 0, sizeof(flash_stat));
+	start = get_start_tick();
+	for (int i = 0; i < 10; i++) {
+		flash_port_write(write_addr + i * WRITE_BLOCK, (uint8_t *) data, WRITE_BLOCK);
+	}
+	end = get_cur_tick();
+	int bad = 0;
+	for (int i = 0; i < 10; i++) {
+		bad += memcmp((const void *) (write_addr + i * WRITE_BLOCK), data, WRITE_BLOCK) != 0;
+	}
+	for (int i = 0; i < WRITE_BLOCK; i++) {
+		data[i] = ~data[i];
+	}
+	DEBUG_LOG("test_flash_speed (%s): block rewrite %f us, %u erases %u units, %d blocks wrong\n", name,
+		cycles2us((end - start) / 10), flash_stat.erases, flash_stat.programmed, bad);
 }
 
 
 void test_flash_write_speed() {
 	profile_add_event("rw-speed");
+	for (int i = 0; i < WRITE_BLOCK; i++) {
+		data[i] = i * 31;
+	}
 	test_sram_speed();
-	test_flash_speed();
+	test_flash_speed(false);
+	test_flash_speed(true);
+	flash_erase_avoid = true;
 }
 
 #endif
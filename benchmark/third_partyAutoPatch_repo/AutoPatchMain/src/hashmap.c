@@ -31,10 +31,10 @@ static int lower_bound(void **arr, int size, uint32_t val) {
 	int start = 0;
 	int end = size; // return the tail
 	int mid = 0;
-	while (start + 1 < end) {
+	while (start < end) {
 		mid = (start + end) / 2;
-		if ((uint32_t) arr[mid] < val) { // (start, mid]
-			start = mid;
+		if ((uint32_t) arr[mid] < val) { // (mid, end]
+			start = mid + 1;
 		} else {
 			end = mid;
 		}
@@ -113,16 +113,127 @@ void darray_del(darray *arr, int key) {
 	}
 }
 
+static const char *layout_names[ARRAYMAP_LAYOUT_NUM] = {
+	"sorted", "interleaved", "eytzinger", "openaddr",
+};
+
+const char *arraymap_layout_name(int layout) {
+	if (layout < 0 || layout >= ARRAYMAP_LAYOUT_NUM) {
+		return "unknown";
+	}
+	return layout_names[layout];
+}
+
+/*
+ * shell sort on <key, val> pairs, only used when bulk building
+ */
+static void sort_entries(mapentry *e, int n) {
+	for (int gap = n / 2; gap > 0; gap /= 2) {
+		for (int i = gap; i < n; i++) {
+			mapentry tmp = e[i];
+			int j = i;
+			while (j >= gap && (uint32_t) e[j - gap].key > (uint32_t) tmp.key) {
+				e[j] = e[j - gap];
+				j -= gap;
+			}
+			e[j] = tmp;
+		}
+	}
+}
+
+static int eytzinger_fill(arraymap *map, int i, int k) {
+	if (k <= map->cur_size) {
+		i = eytzinger_fill(map, i, 2 * k);
+		map->index[k].key = map->keys[i];
+		map->index[k].val = map->vals[i];
+		i++;
+		i = eytzinger_fill(map, i, 2 * k + 1);
+	}
+	return i;
+}
+
+static inline uint32_t openaddr_hash(uint32_t key, int bits) {
+	return (key * 2654435761u) >> (32 - bits); // fibonacci hashing
+}
+
+/*
+ * build the index of map->layout from the sorted keys/vals
+ */
+static void arraymap_build_index(arraymap *map) {
+	if (map->index != NULL) {
+		ebpf_free(map->index);
+		map->index = NULL;
+	}
+	int n = map->cur_size;
+	if (map->layout == ARRAYMAP_INTERLEAVED) {
+		map->index = ebpf_malloc((n + 1) * sizeof(mapentry));
+		for (int i = 0; i < n; i++) {
+			map->index[i].key = map->keys[i];
+			map->index[i].val = map->vals[i];
+		}
+	} else if (map->layout == ARRAYMAP_EYTZINGER) {
+		map->index = ebpf_malloc((n + 1) * sizeof(mapentry));
+		map->index[0].key = map->index[0].val = NULL;
+		eytzinger_fill(map, 0, 1);
+	} else if (map->layout == ARRAYMAP_OPENADDR) {
+		// keep the load factor <= 1/2, val == NULL marks an empty slot
+		int bits = 2;
+		while ((1 << bits) < 2 * n) {
+			bits++;
+		}
+		int size = 1 << bits;
+		map->index_bits = bits;
+		map->index = ebpf_malloc(size * sizeof(mapentry));
+		memset(map->index, 0, size * sizeof(mapentry));
+		for (int i = 0; i < n; i++) {
+			if (map->vals[i] == NULL) {
+				continue;
+			}
+			uint32_t h = openaddr_hash((uint32_t) map->keys[i], bits);
+			while (map->index[h].val != NULL) {
+				h = (h + 1) & (size - 1);
+			}
+			map->index[h].key = map->keys[i];
+			map->index[h].val = map->vals[i];
+		}
+	}
+}
+
 arraymap *arraymap_new(int initial_size) {
 	arraymap *map = ebpf_malloc(sizeof(arraymap));
 	map->cur_size = 0;
 	map->max_size = initial_size;
+	map->layout = ARRAYMAP_SORTED;
+	map->index_bits = 0;
 	map->keys = ebpf_malloc(initial_size * sizeof(void *));
 	map->vals = ebpf_malloc(initial_size * sizeof(void *));
+	map->index = NULL;
+	return map;
+}
+
+arraymap *arraymap_bulk_new(int layout, void **keys, void **vals, int n) {
+	arraymap *map = arraymap_new(n > 0 ? n : 1);
+	map->layout = layout;
+	mapentry *tmp = ebpf_malloc((n + 1) * sizeof(mapentry));
+	for (int i = 0; i < n; i++) {
+		tmp[i].key = keys[i];
+		tmp[i].val = vals[i];
+	}
+	sort_entries(tmp, n);
+	for (int i = 0; i < n; i++) {
+		map->keys[i] = tmp[i].key;
+		map->vals[i] = tmp[i].val;
+	}
+	map->cur_size = n;
+	ebpf_free(tmp);
+	arraymap_build_index(map);
 	return map;
 }
 
 void arraymap_destroy(arraymap *map) {
+	if (map->index != NULL) {
+		ebpf_free(map->index);
+	}
 	ebpf_free(map->keys);
 	ebpf_free(map->vals);
 	ebpf_free(map);
@@ -136,16 +247,18 @@ int arraymap_set(arraymap *map, void *key, void *val) {
 		map->keys[0] = key;
 		map->vals[0] = val;
 		map->cur_size++;
+		arraymap_build_index(map);
 		return 0;
 	}
 	int insert = lower_bound(map->keys, map->cur_size, (uint32_t) key);
 	// printf("Inserting in %d 0x%08x \n ", insert);
 	// modify
-	if ((uint32_t)(map->keys[insert]) == (uint32_t) key) {
+	if (insert < map->cur_size && (uint32_t)(map->keys[insert]) == (uint32_t) key) {
 				// printf("b");
 
 		map->vals[insert] = val;
-		return;
+		arraymap_build_index(map);
+		return insert;
 	}
 	// insert
 	if (map->cur_size >= map->max_size) {
@@ -168,11 +281,72 @@ int arraymap_set(arraymap *map, void *key, void *val) {
 	map->keys[insert] = key;
 	map->vals[insert] = val;
 	map->cur_size++;
+	arraymap_build_index(map);
 	// printf("%u insert: %d sz: %d\n", (uint32_t) key, insert, map->cur_size);
 	return insert;
 }
 
+static void* interleaved_get(arraymap *map, uint32_t key) {
+	const mapentry *e = map->index;
+	int start = 0;
+	int end = map->cur_size - 1;
+	while (start <= end) {
+		int mid = (start + end) / 2;
+		uint32_t m = (uint32_t) e[mid].key;
+		if (m == key) {
+			return e[mid].val;
+		} else if (m > key) {
+			end = mid - 1;
+		} else {
+			start = mid + 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * branch free descent, then undo the right turns taken after the last left one
+ */
+static void* eytzinger_get(arraymap *map, uint32_t key) {
+	const mapentry *e = map->index;
+	int n = map->cur_size;
+	uint32_t k = 1;
+	while (k <= n) {
+		k = 2 * k + ((uint32_t) e[k].key < key);
+	}
+	k >>= __builtin_ffs(~k);
+	if (k != 0 && (uint32_t) e[k].key == key) {
+		return e[k].val;
+	}
+	return NULL;
+}
+
+static void* openaddr_get(arraymap *map, uint32_t key) {
+	const mapentry *e = map->index;
+	uint32_t mask = (1u << map->index_bits) - 1;
+	uint32_t h = openaddr_hash(key, map->index_bits);
+	while (e[h].val != NULL) {
+		if ((uint32_t) e[h].key == key) {
+			return e[h].val;
+		}
+		h = (h + 1) & mask;
+	}
+	return NULL;
+}
+
 void* arraymap_get(arraymap *map, void * key) {
+	if (map->index != NULL) {
+		switch (map->layout) {
+		case ARRAYMAP_INTERLEAVED:
+			return interleaved_get(map, (uint32_t) key);
+		case ARRAYMAP_EYTZINGER:
+			return eytzinger_get(map, (uint32_t) key);
+		case ARRAYMAP_OPENADDR:
+			return openaddr_get(map, (uint32_t) key);
+		default:
+			break;
+		}
+	}
 	int idx = binary_search(map->keys, map->cur_size, (uint32_t) key);
 	//printf("search: %d key: %u sz: %d %d\n", idx, key, map->cur_size);
 	if (idx != -1) {
@@ -205,6 +379,7 @@ void arraymap_del(arraymap *map, void * key) {
 		map->cur_size--;
 		map->keys[map->cur_size] = NULL;
 		map->vals[map->cur_size] = NULL;
+		arraymap_build_index(map);
 	}
 }
 
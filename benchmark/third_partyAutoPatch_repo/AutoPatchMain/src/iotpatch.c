@@ -4,15 +4,24 @@
 #include "patch_service.h"
 //#include "ebpf.h"
 #include "ebpf_allocator.h"
+#include "ebpf_verifier.h"
 #include "hashmap.c"
+#include "patch_rcu.c"
+#include "ebpf_map.c"
 //#include "cortex-m4_fbp.c"
 #include "utils.c"
+#include "patch_verify.c"
+#include "patch_journal.c"
+#include "patch_bundle.c"
+#include "patch_elf.c"
 
 #include <string.h>
 #include <stddef.h>
 // global patch context
 static bool ctx_init = false;
 patch_context pctx;
+volatile uint8_t fixed_patch_enable = 0;
+volatile uint8_t fixed_site_enable[MAX_FIXED_SITES];
 
 static void update_bits_filter() {
 	pctx.fbits_filter = 0;
@@ -26,6 +35,7 @@ static void update_bits_filter() {
 			pctx.fbits_filter |= patch->desc->fixed_id;
 		}
 	}
+	fixed_patch_enable = pctx.fbits_filter != 0;
 
 //	pctx.dbits_filter_pc = pctx.dbits_filter_bpkt = 0;
 //	dynamic_patch *dp = pctx.dpatch_list.next;
@@ -37,25 +47,42 @@ static void update_bits_filter() {
 }
 
 auto_patch *auto_patch_setup(patch_desc *desc) {
+	// preallocate the declared maps, the patch never allocates when it runs
+	if (desc->map_num > 0 && ebpf_maps_setup(patch_desc_maps(desc), desc->map_num) != 0) {
+		return NULL;
+	}
 	auto_patch *patch = ebpf_malloc(sizeof(auto_patch));
+	if (patch == NULL) {
+		ebpf_maps_release(patch_desc_maps(desc), desc->map_num);
+		return NULL;
+	}
 	patch->desc = desc;
 	patch->is_active = false;
 	return patch;
 }
 
-// should use lock
-// read copy and update
+// writers build a new table and publish it, dispatch reads pctx.fpatch_rcu only
 static void active_patch(auto_patch *patch) {
 	update_bits_filter();
 	if (patch->desc->type == FixedPatchPoint) {
 		pctx.fbits_filter |= patch->desc->fixed_id;
+		fixed_patch_enable = 1;
 		printf("Active fixed patch idx: %d %d\n", patch->desc->fixed_id , pctx.fbits_filter);
+	} else if (patch->desc->type == FixedSitePatchPoint) {
+		pctx.fsite_patches[patch->desc->fixed_id] = patch;
+		printf("Active fixed site patch: %d\n", patch->desc->fixed_id);
 	} else if (patch->desc->type == DynamicPatchPoint) {
 		// pctx.dbits_filter |= calc_bpkt_pc(patch->desc->inst_addr);
 		//add_hw_bkpt(patch->desc->inst_addr);
 	}
 	
 	patch->is_active = true;
+	if (patch->desc->type == FixedPatchPoint) {
+		patch_rcu_set(&pctx.fpatch_rcu, patch->desc->fixed_id, patch);
+	}
+	if (patch->desc->type == FixedSitePatchPoint) {
+		fixed_site_enable[patch->desc->fixed_id] = 1; // publish last, the site calls the handler from now on
+	}
 }
 
 //static dynamic_patch* add_dynamic_patch_to_ctx(ebpf_patch *patch) {
@@ -92,8 +119,22 @@ static void add_fixed_patch_to_ctx(auto_patch *patch) {
 	arraymap_set(pctx.fpatch_list.fiexed_patches, patch->desc->fixed_id, patch);
 }
 
+static bool check_site_id(uint32_t site_id) {
+	if (site_id >= MAX_FIXED_SITES) {
+		printf("Warning: site id %d exceed the maximum number(%d).\n", site_id, MAX_FIXED_SITES);
+		return false;
+	}
+	return true;
+}
+
 static auto_patch* add_ebpf_patch(patch_desc *desc) {
+	if (desc->type == FixedSitePatchPoint && !check_site_id(desc->fixed_id)) {
+		return NULL;
+	}
 	auto_patch *patch = auto_patch_setup(desc);
+	if (patch == NULL) {
+		return NULL;
+	}
 	if (desc->type == FixedPatchPoint) {
 		add_fixed_patch_to_ctx(patch);
 	} else if (desc->type == DynamicPatchPoint) {
@@ -103,6 +144,8 @@ static auto_patch* add_ebpf_patch(patch_desc *desc) {
 	return patch;
 }
 
+static void bundle_moved(const uint8_t *from, const uint8_t *to, uint32_t len);
+
 void init_patch_sys(void) {
 	if (ctx_init) {
 		return;
@@ -112,7 +155,10 @@ void init_patch_sys(void) {
 	const int init_size = 8;
 	memset(&pctx, 0, sizeof(pctx));
 	pctx.fpatch_list.fiexed_patches = arraymap_new(4);
+	patch_rcu_init(&pctx.fpatch_rcu);
+	ebpf_maps_init();
 	update_bits_filter();
+	patch_journal_on_move(bundle_moved);
 	ctx_init = true;
 }
 
@@ -122,6 +168,8 @@ void destory_patch_context() {
 		arraymap_destroy(pctx.fpatch_list.fiexed_patches);
 		pctx.fpatch_list.fiexed_patches = NULL;
 	}
+	patch_rcu_destroy(&pctx.fpatch_rcu);
+	ebpf_maps_destroy();
 //	dynamic_patch *dp = pctx.dpatch_list.next, *next = NULL;
 //	while (dp != NULL) {
 //		next = dp->next;
@@ -132,6 +180,8 @@ void destory_patch_context() {
 	// pctx.fixed_patches = NULL;
 //	pctx.dpatch_list.next = NULL;
 //	pctx.dbits_filter_bpkt = pctx.dbits_filter_pc = pctx.fbits_filter = 0;
+	fixed_patch_enable = 0;
+	memset((void *) fixed_site_enable, 0, sizeof(fixed_site_enable));
 	ctx_init = false;
 
 	// remove all hardware breakpoints
@@ -140,7 +190,11 @@ void destory_patch_context() {
 
 void destory_ebpf_patch(ebpf_patch *patch) {
 	if (patch != NULL) {
+		ebpf_maps_release(patch_desc_maps(patch->desc), patch->desc->map_num);
 		ebpf_free(patch->desc);
+		if (patch->vm != NULL) {
+			ebpf_verifier_release(patch->vm);
+		}
 		ebpf_free(patch->vm);
 		ebpf_free(patch);
 	}
@@ -157,14 +211,267 @@ void destory_ebpf_patch(ebpf_patch *patch) {
 //	printf("Fixed Patch List:\n");
 //}
 
-void notify_new_patch(struct patch_desc *desc) {
+// the packet is the descriptor, code_len bytes of code and the map definitions
+static uint32_t patch_packet_len(const patch_desc *desc) {
+	uint32_t len = sizeof(patch_desc) + desc->code_len;
+	uint32_t maps_end = desc->maps + desc->map_num * sizeof(ebpf_map_def);
+	return desc->map_num > 0 && maps_end > len ? maps_end : len;
+}
+
+// a descriptor built on the device, the map definitions copied after it
+static patch_desc *desc_alloc(const ebpf_map_def *defs, uint16_t map_num) {
+	patch_desc *desc = ebpf_malloc(sizeof(patch_desc) + map_num * sizeof(ebpf_map_def));
+	if (desc != NULL && map_num > 0) {
+		memcpy(desc + 1, defs, map_num * sizeof(ebpf_map_def));
+	}
+	return desc;
+}
+
+static uint32_t object_next = PATCH_ELF_BASE; // first free byte of the object area, from the start at boot
+static patch_elf object_elf;
+
+// the object is read in place: a received or staged packet, a journal record
+static int object_read(void *user, uint32_t off, void *buf, uint32_t len) {
+	memcpy(buf, (const uint8_t *) user + off, len);
+	return 0;
+}
+
+static bool patch_is_object(const patch_desc *desc) {
+	return patch_elf_is((const uint8_t *) (desc + 1), desc->code_len);
+}
+
+// the loader places at 32 bit addresses, 0 for RAM above them (a 64 bit host)
+static uint32_t ram_addr(void *p) {
+	return (uint32_t) (uintptr_t) p == (uintptr_t) p ? (uint32_t) (uintptr_t) p : 0;
+}
+
+/*
+The code of the packet is a patch object (patch_elf.h): it is loaded to the
+object area, or to RAM when the area is full, and the patch gets a new
+descriptor with the entry of the object as the handler. At boot the journaled
+packet is loaded again to the same place, the flash writes that change
+nothing are skipped.
+*/
+static patch_desc *object_setup(const patch_desc *pkt) {
+	patch_elf *elf = &object_elf;
+	if (patch_elf_open(elf, object_read, (void *) (pkt + 1), pkt->code_len) != 0) {
+		return NULL;
+	}
+	patch_desc *desc = desc_alloc(patch_desc_maps(pkt), pkt->map_num);
+	void *data = elf->data_size > 0 ? ebpf_malloc(elf->data_size) : NULL;
+	void *ram = NULL;
+	patch_elf_region code = {object_next, PATCH_ELF_BASE + PATCH_ELF_SIZE - object_next, true};
+	patch_elf_region dreg = {ram_addr(data), elf->data_size, false};
+	if (code.size < elf->code_size) {
+		ram = ebpf_malloc(elf->code_size);
+		code = (patch_elf_region) {ram_addr(ram), elf->code_size, false};
+	}
+	uint32_t entry = 0;
+	if (desc != NULL && code.addr != 0 && (elf->data_size == 0 || dreg.addr != 0)) {
+		entry = patch_elf_load(elf, &code, &dreg, patch_elf_firmware, patch_elf_firmware_num);
+	}
+	if (entry == 0) {
+		printf("Warning: patch object 0x%08x not loaded\n", pkt->fixed_id);
+		ebpf_free(desc);
+		ebpf_free(data);
+		ebpf_free(ram);
+		return NULL;
+	}
+	if (code.flash) {
+		object_next = (object_next + elf->code_size + 7) & ~7;
+	}
+	memcpy(desc, pkt, sizeof(patch_desc));
+	desc->code_len = 0; // the code is loaded, not after the descriptor
+	desc->maps = sizeof(patch_desc);
+	desc->func = (uint64_t (*)(uint32_t)) (uintptr_t) entry;
+	printf("Patch object: entry 0x%08x in %s, %u relocations, %u firmware symbols\n", entry,
+		code.flash ? "flash" : "RAM", elf->relocs, elf->lookups);
+	return desc;
+}
+
+// the packet may be a receive buffer or flash, destory_ebpf_patch frees the copy
+void notify_new_patch(const struct patch_desc *pkt) {
 	printf("New Patch is OK!\n");
-	// TODO: only save patch to flash
+	patch_desc *desc;
+	if (patch_is_object(pkt)) {
+		desc = object_setup(pkt);
+	} else if ((desc = ebpf_malloc(patch_packet_len(pkt))) != NULL) {
+		memcpy(desc, pkt, patch_packet_len(pkt));
+	}
+	if (desc == NULL) {
+		return;
+	}
 	auto_patch *patch = add_ebpf_patch(desc);
+	if (patch == NULL) {
+		ebpf_free(desc);
+		return;
+	}
+	// journaled before it runs, an active patch is never lost by a reset
+	if (patch_journal_append((const uint8_t *) pkt, patch_packet_len(pkt), desc->type, desc->fixed_id) != 0) {
+		printf("Warning: patch 0x%08x not journaled\n", desc->fixed_id);
+	}
 	// TODO: use lock to load to memory and active patch
 	active_patch(patch);
 }
 
+typedef struct patch_restore {
+	int num;
+	auto_patch *patches[PATCH_JOURNAL_MAX_LIVE];
+} patch_restore;
+
+/*
+Several patches at once (a bundle, the boot restore): the fixed patch table
+is published once for all of them and the sites are enabled after it.
+*/
+static void active_patches(auto_patch **patches, int num) {
+	patch_rcu_entry entries[PATCH_JOURNAL_MAX_LIVE];
+	int n = 0;
+	for (int i = 0; i < num; i++) {
+		auto_patch *patch = patches[i];
+		patch->is_active = true;
+		if (patch->desc->type == FixedPatchPoint) {
+			entries[n].key = patch->desc->fixed_id;
+			entries[n++].val = patch;
+		} else if (patch->desc->type == FixedSitePatchPoint) {
+			pctx.fsite_patches[patch->desc->fixed_id] = patch;
+		}
+	}
+	update_bits_filter();
+	patch_rcu_set_many(&pctx.fpatch_rcu, entries, n);
+	for (int i = 0; i < num; i++) {
+		if (patches[i]->desc->type == FixedSitePatchPoint) {
+			fixed_site_enable[patches[i]->desc->fixed_id] = 1;
+		}
+	}
+}
+
+// a descriptor per site and its map definitions, the handler and the name stay in the bundle
+static void bundle_setup(patch_restore *r, const uint8_t *bundle) {
+	const patch_bundle_head *head = (const patch_bundle_head *) bundle;
+	for (int i = 0; i < head->sites; i++) {
+		if (r->num == PATCH_JOURNAL_MAX_LIVE) {
+			printf("Warning: bundle %u site %d dropped, more than %d patches\n", head->id, i, PATCH_JOURNAL_MAX_LIVE);
+			return;
+		}
+		uint16_t map_num;
+		const ebpf_map_def *maps = patch_bundle_maps(bundle, i, &map_num);
+		patch_desc *desc = desc_alloc(maps, map_num);
+		if (desc == NULL) {
+			return;
+		}
+		patch_bundle_desc(bundle, i, desc);
+		auto_patch *patch = add_ebpf_patch(desc);
+		if (patch == NULL) {
+			ebpf_free(desc);
+			continue;
+		}
+		r->patches[r->num++] = patch;
+	}
+}
+
+static uintptr_t bundle_rebase(uintptr_t p, const uint8_t *from, const uint8_t *to, uint32_t len) {
+	uintptr_t off = p - (uintptr_t) from;
+	return off < len ? (uintptr_t) to + off : p;
+}
+
+static void bundle_desc_moved(auto_patch *patch, const uint8_t *from, const uint8_t *to, uint32_t len) {
+	if (patch == NULL) {
+		return;
+	}
+	patch_desc *desc = patch->desc;
+	desc->func = (uint64_t (*)(uint32_t)) bundle_rebase((uintptr_t) desc->func, from, to, len);
+	desc->cve = (const char *) bundle_rebase((uintptr_t) desc->cve, from, to, len);
+}
+
+// compaction moved a record, the bundle patches running from it follow
+static void bundle_moved(const uint8_t *from, const uint8_t *to, uint32_t len) {
+	if (!ctx_init) {
+		return;
+	}
+	for (int i = 0; i < pctx.fpatch_list.fiexed_patches->cur_size; i++) {
+		bundle_desc_moved(arraymap_iter_val(pctx.fpatch_list.fiexed_patches, i), from, to, len);
+	}
+	for (int i = 0; i < MAX_FIXED_SITES; i++) {
+		bundle_desc_moved(pctx.fsite_patches[i], from, to, len);
+	}
+}
+
+static bool bundle_runs(const auto_patch *patch, const uint8_t *bundle, uint32_t len) {
+	return patch != NULL && (uintptr_t) patch->desc->func - (uintptr_t) bundle < len;
+}
+
+// the patches running from a bundle record
+static void bundle_patches(patch_restore *r, const uint8_t *bundle, uint32_t len) {
+	for (int i = 0; i < pctx.fpatch_list.fiexed_patches->cur_size && r->num < PATCH_JOURNAL_MAX_LIVE; i++) {
+		auto_patch *patch = arraymap_iter_val(pctx.fpatch_list.fiexed_patches, i);
+		if (bundle_runs(patch, bundle, len)) {
+			r->patches[r->num++] = patch;
+		}
+	}
+	for (int i = 0; i < MAX_FIXED_SITES && r->num < PATCH_JOURNAL_MAX_LIVE; i++) {
+		if (bundle_runs(pctx.fsite_patches[i], bundle, len)) {
+			r->patches[r->num++] = pctx.fsite_patches[i];
+		}
+	}
+}
+
+// dispatch stops calling the patch, unless another one took its place
+static void deactive_patch(auto_patch *patch) {
+	patch->is_active = false;
+	uint32_t id = patch->desc->fixed_id;
+	if (patch->desc->type == FixedPatchPoint
+		&& arraymap_get(pctx.fpatch_list.fiexed_patches, (void *) (uintptr_t) id) == patch) {
+		arraymap_del(pctx.fpatch_list.fiexed_patches, (void *) (uintptr_t) id);
+		patch_rcu_del(&pctx.fpatch_rcu, id);
+		update_bits_filter();
+	} else if (patch->desc->type == FixedSitePatchPoint && pctx.fsite_patches[id] == patch) {
+		fixed_site_enable[id] = 0;
+		pctx.fsite_patches[id] = NULL;
+	}
+}
+
+/*
+The bundle runs from its journal record, the packet can be dropped after. A
+bundle that replaces another (same id) takes over the sites they share, the
+sites only the old one had are disabled: its record is dropped by the journal,
+nothing may run from it after.
+*/
+int notify_new_bundle(const uint8_t *bundle, uint32_t len) {
+	if (!patch_bundle_valid(bundle, len)) {
+		return -1;
+	}
+	init_patch_sys();
+	const patch_bundle_head *head = (const patch_bundle_head *) bundle;
+	uint32_t id = head->id;
+	uint32_t old_len = 0;
+	const uint8_t *old_bundle = patch_journal_find(PATCH_BUNDLE_TYPE, id, &old_len);
+	patch_restore old = {0};
+	if (old_bundle != NULL) {
+		bundle_patches(&old, old_bundle, old_len); // the descriptors follow a compaction in the append
+	}
+	if (patch_journal_append(bundle, len, PATCH_BUNDLE_TYPE, id) != 0
+		|| (bundle = patch_journal_find(PATCH_BUNDLE_TYPE, id, NULL)) == NULL) {
+		printf("Warning: bundle %u not journaled, not installed\n", id);
+		return -1;
+	}
+	patch_restore r = {0};
+	bundle_setup(&r, bundle);
+	active_patches(r.patches, r.num);
+	for (int i = 0; i < old.num; i++) {
+		deactive_patch(old.patches[i]);
+	}
+	if (old.num > 0) {
+		patch_rcu_synchronize(&pctx.fpatch_rcu);
+		for (int i = 0; i < old.num; i++) {
+			ebpf_maps_release(patch_desc_maps(old.patches[i]->desc), old.patches[i]->desc->map_num);
+			ebpf_free(old.patches[i]->desc);
+			ebpf_free(old.patches[i]);
+		}
+	}
+	printf("Bundle %u: %d patches, %d replaced\n", id, r.num, old.num);
+	return r.num;
+}
+
 
 // Function to get the number of patches stored in the arraymap
 int get_num_patches() {
@@ -176,20 +483,22 @@ int get_num_patches() {
 
 
 auto_patch* get_fixed_patch_by_lr(uint32_t lr) {
-			// printf("patch idx: %d %d\n", pctx.fbits_filter & lr , lr);
-
-	if ((pctx.fbits_filter & lr) != lr) {
-				// printf("why?! \n ");
+	// wait-free: the table can be replaced but not freed while we are inside
+	unsigned idx = patch_rcu_read_lock(&pctx.fpatch_rcu);
+	auto_patch *patch = patch_rcu_lookup(patch_rcu_deref(&pctx.fpatch_rcu), lr);
+	patch_rcu_read_unlock(&pctx.fpatch_rcu, idx);
+	return patch;
+}
 
+// site ids are dense, so one bounds check and one indexed load
+auto_patch* get_fixed_patch_by_site(uint32_t site_id) {
+	if (site_id >= MAX_FIXED_SITES) {
 		return NULL;
 	}
-	// printf("Patch is exist in the arraymap!\n");
-	auto_patch *patch = arraymap_get(pctx.fpatch_list.fiexed_patches, lr);
+	auto_patch *patch = pctx.fsite_patches[site_id];
 	if (patch != NULL && patch->is_active) {
-		printf("Chera?! \n ");
 		return patch;
 	}
-	printf("Chera 2?! \n ");
 	return NULL;
 }
 
@@ -237,10 +546,17 @@ auto_patch* get_fixed_patch_by_lr(uint32_t lr) {
 //}
 
 void load_local_patch_to_ctx(auto_patch *patch) {
+	if (patch->desc->map_num > 0 && ebpf_maps_setup(patch_desc_maps(patch->desc), patch->desc->map_num) != 0) {
+		return;
+	}
 	if (patch->desc->type == FixedPatchPoint) { 
 		printf("The description of patch is %s \n", patch->desc->cve);
 		add_fixed_patch_to_ctx(patch);
 		active_patch(patch);
+	} else if (patch->desc->type == FixedSitePatchPoint) {
+		if (check_site_id(patch->desc->fixed_id)) {
+			active_patch(patch);
+		}
 	} else if (patch->desc->type == DynamicPatchPoint) {
 		// the same pointer only add once
 //		dynamic_patch *dp = pctx.dpatch_list.next;
@@ -272,3 +588,45 @@ void load_local_patch_to_ctx(auto_patch *patch) {
 //		return ebpf_vm_exec(patch->vm, args, args_size);
 //	}
 //}
+
+// compaction of the journal, when the device is idle
+void save_patch_list_to_flash() {
+	patch_journal_idle();
+}
+
+// records are read in place and compaction moves them: a patch gets a copy, a bundle runs from its record
+static void restore_patch(void *user, const uint8_t *pkt, uint32_t len) {
+	patch_restore *r = user;
+	if (r->num == PATCH_JOURNAL_MAX_LIVE) {
+		return;
+	}
+	if (patch_bundle_is(pkt, len)) {
+		bundle_setup(r, pkt); // bundle_moved follows compaction
+		return;
+	}
+	patch_desc *desc;
+	if (len >= sizeof(patch_desc) && patch_is_object((const patch_desc *) pkt)) {
+		desc = object_setup((const patch_desc *) pkt); // loaded from the record, only the descriptor is new
+	} else if ((desc = ebpf_malloc(len)) != NULL) {
+		memcpy(desc, pkt, len);
+	}
+	if (desc == NULL) {
+		return;
+	}
+	auto_patch *patch = add_ebpf_patch(desc);
+	if (patch == NULL) {
+		ebpf_free(desc);
+		return;
+	}
+	r->patches[r->num++] = patch;
+}
+
+// boot: replay the journal, the patches are activated together
+void load_patch_list_from_flash() {
+	init_patch_sys();
+	object_next = PATCH_ELF_BASE;
+	patch_restore r = {0};
+	patch_journal_replay(restore_patch, &r);
+	active_patches(r.patches, r.num);
+	printf("Restored %d patches from the journal\n", r.num);
+}
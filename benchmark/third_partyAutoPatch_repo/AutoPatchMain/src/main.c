@@ -67,6 +67,7 @@
 
 #include "ebpf.h"
 #include "ebpf_test.h"
+#include "flash_api.c"
 #include "jit.c"
 #include "ebpf_vm.c"
 
@@ -113,6 +114,19 @@ __NAKE int fixed_patch_point_hanlder(void) {
 //	asm volatile("pop {r7, pc}");
 }
 
+// Trampoline for sites emitted with -emit-site-ids: the site id arrives in r0
+// and is saved at args->r0_1 by the push, so no lr based lookup is needed.
+__NAKE int fixed_site_patch_point_hanlder(uint32_t site_id) {
+	__asm volatile("PUSH {r0, lr}");
+	__asm volatile("MRS r0, CONTROL");
+	__asm volatile("TST r0, #2");
+	__asm volatile("ITE EQ");
+	__asm volatile("MRSEQ r0, MSP");
+	__asm volatile("MRSNE r0, PSP");
+	__asm volatile("BL dispatch_fixed_site_patch_point");
+	__asm volatile("POP {r0, pc}");
+}
+
 #ifndef FIXED_OP_PASS
   #define FIXED_OP_PASS 0x00010000 // set a unusual value
 #endif
@@ -195,6 +209,44 @@ typedef struct stack_frame {
 //
 //}
 
+// write the filter result back to the saved r0, the trampoline pops it as return value
+static void set_fixed_patch_result(fixed_stack_frame *args, uint64_t ret) {
+	uint32_t op = ret >> 32;
+	//printf("op code:0x%08x \n", op);
+	uint32_t ret_code = ret & 0x00000000ffffffff;
+	//printf("ret code:0x%08x \n", ret_code);
+	
+	//********//
+	//FILTER_PASS 0
+	//FILTER_DROP 1
+	//FILTER_REDIRECT 2
+	//FILTER_RETURN 3
+	
+	
+	if (op == FILTER_DROP) {
+		*(volatile uint32_t *) &(args->r0_1) = 0; 
+		//printf("FILTER_DROP\n");
+		return;
+	} else if (op == FILTER_REDIRECT) {
+		// POP {r0, pc} in the handler loads the saved lr into pc, so replacing it
+		// resumes the patched function at ret_code. Keep the thumb bit set.
+		*(volatile uint32_t *) &(args->lr) = ret_code | 0x1;
+		*(volatile uint32_t *) &(args->r0_1) = FIXED_OP_PASS;
+		//printf("FILTER_REDIRECT\n");
+		return;
+	} else if (op == FILTER_RETURN) {
+		// the guard macro returns r0 right after the handler, skipping the body
+		// (ret_code must not be FIXED_OP_PASS)
+		*(volatile uint32_t *) &(args->r0_1) = ret_code;
+		return;
+	} else { // FILTER_PASS
+		*(volatile uint32_t *) &(args->r0_1) = FIXED_OP_PASS;
+		// printf("FILTER_PASS\n");
+		return;
+	}
+
+}
+
 void dispatch_fixed_patch_point(uint32_t sp) {
 	//uint32_t lr = *(uint32_t *) (sp + offsetof(fixed_stack_frame, lr)); // r0-r3,lr
 	//uint32_t addr = (lr & ~0x1) - 4; // bl function 
@@ -262,32 +314,20 @@ void dispatch_fixed_patch_point(uint32_t sp) {
 	//profile_end(EV1);
 	//profile_dump(EV1);
 
-	
-	uint32_t op = ret >> 32;
-	//printf("op code:0x%08x \n", op);
-	uint32_t ret_code = ret & 0x00000000ffffffff;
-	//printf("ret code:0x%08x \n", ret_code);
-	
-	//********//
-	//FILTER_PASS 0
-	//FILTER_DROP 1
-	//FILTER_REDIRECT 2
-	
-	
-	if (op == FILTER_DROP) {
-		*(volatile uint32_t *) &(args->r0_1) = 0; 
-		//printf("FILTER_DROP\n");
-		return;
-	} else if (op == FILTER_REDIRECT) {
-		*(volatile uint32_t *) (args->lr) = ret_code;//I doesnot work! What is this? How can we implement for redirect part?
-		//printf("FILTER_REDIRECT\n");
-		return;
-	} else { // FILTER_PASS
+	set_fixed_patch_result(args, ret);
+}
+
+void dispatch_fixed_site_patch_point(uint32_t sp) {
+	fixed_stack_frame *args = (fixed_stack_frame *) sp;
+	uint32_t site_id = args->r0_1;
+	auto_patch *patch = get_fixed_patch_by_site(site_id);
+	if (patch == NULL) {
 		*(volatile uint32_t *) &(args->r0_1) = FIXED_OP_PASS;
-		// printf("FILTER_PASS\n");
 		return;
 	}
-
+	uint32_t sptemp = (sp + sizeof(fixed_stack_frame));
+	uint64_t ret = patch->desc->func(sptemp);
+	set_fixed_patch_result(args, ret);
 }
 
 //inline uint64_t set_return(uint64_t op, uint64_t ret_code) {
@@ -661,14 +701,10 @@ void printstr (){
 
 // Simple hash function for hexadecimal addresses
 size_t hash_function(uint64_t address) {
-    // Extract the lower 32 bits of the address
-    uint32_t lower_bits = (uint32_t)(address & 0xFFFFFFFF);
-    // XOR the lower and upper 32 bits of the address
-    uint32_t upper_bits = (uint32_t)((address >> 32) ^ lower_bits);
-    // Use the XOR of the lower and upper bits as the hash value
-    size_t hash = (size_t)(lower_bits ^ upper_bits);
-    // Modulo the hash value by the size of the hash array (64)
-    return hash % 64;
+    // thumb addresses are 2 bytes aligned, fibonacci hashing on the rest as patch_table_hash
+    uint32_t hash = (uint32_t) (address >> 1) * 2654435761u;
+    // the caller takes hash % num_buckets, fold the well mixed high bits into the low ones
+    return (size_t) (hash ^ (hash >> 16));
 }
 
 
@@ -785,6 +821,154 @@ patch_func_t search_patch_function(size_t hash, uint32_t address, hashmap_t* map
     return NULL; // Patch function not found in the hashmap
 }
 
+void hashmap_free(hashmap_t* map) {
+    for (size_t i = 0; i < map->num_buckets; i++) {
+        hashmap_entry_t* entry = map->buckets[i];
+        while (entry != NULL) {
+            hashmap_entry_t* next = (hashmap_entry_t*)entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(map->buckets);
+    free(map);
+}
+
+
+// ******************* STATIC OPEN ADDRESSING TABLE ***************  //
+// Fixed size, power of two table with linear probing. It is zeroed with .bss and
+// never calls the allocator, so it can be used before the heap is ready.
+#define PATCH_TABLE_BITS 7
+#define PATCH_TABLE_SIZE (1 << PATCH_TABLE_BITS) // keep load factor <= 1/2 for 64 patches
+#define PATCH_TABLE_MASK (PATCH_TABLE_SIZE - 1)
+#define PATCH_SLOT_EMPTY 0x0 // address 0 is the vector table, never a patch point
+#define PATCH_SLOT_TOMBSTONE 0xFFFFFFFF
+
+typedef struct {
+    uint32_t address;
+    patch_func_t patch_func;
+} patch_slot_t;
+
+typedef struct {
+    uint16_t used; // live entries
+    uint16_t tombstones;
+    patch_slot_t slots[PATCH_TABLE_SIZE];
+} patch_table_t;
+
+static patch_table_t patch_table __attribute__((section(".bss.patch_table")));
+
+static inline uint32_t patch_table_hash(uint32_t address) {
+    // thumb addresses are 2 bytes aligned, fibonacci hashing on the rest
+    return ((address >> 1) * 2654435761u) >> (32 - PATCH_TABLE_BITS);
+}
+
+// rehash in place to drop the tombstones, entries only move towards their home slot
+static void patch_table_purge(void) {
+    for (int i = 0; i < PATCH_TABLE_SIZE; i++) {
+        if (patch_table.slots[i].address == PATCH_SLOT_TOMBSTONE) {
+            patch_table.slots[i].address = PATCH_SLOT_EMPTY;
+            patch_table.slots[i].patch_func = NULL;
+        }
+    }
+    patch_table.tombstones = 0;
+    // reinsert every cluster member that is no longer reachable from its home slot
+    bool moved = true;
+    while (moved) {
+        moved = false;
+        for (int i = 0; i < PATCH_TABLE_SIZE; i++) {
+            patch_slot_t cur = patch_table.slots[i];
+            if (cur.address == PATCH_SLOT_EMPTY) {
+                continue;
+            }
+            uint32_t h = patch_table_hash(cur.address);
+            while (h != i && patch_table.slots[h].address != PATCH_SLOT_EMPTY) {
+                h = (h + 1) & PATCH_TABLE_MASK;
+            }
+            if (h != i) {
+                patch_table.slots[h] = cur;
+                patch_table.slots[i].address = PATCH_SLOT_EMPTY;
+                patch_table.slots[i].patch_func = NULL;
+                moved = true;
+            }
+        }
+    }
+}
+
+static patch_slot_t *patch_table_slot(uint32_t address) {
+    uint32_t h = patch_table_hash(address);
+    for (int i = 0; i < PATCH_TABLE_SIZE; i++) {
+        patch_slot_t *slot = &patch_table.slots[h];
+        if (slot->address == address) {
+            return slot;
+        }
+        if (slot->address == PATCH_SLOT_EMPTY) {
+            return NULL;
+        }
+        h = (h + 1) & PATCH_TABLE_MASK; // skip tombstones and collisions
+    }
+    return NULL;
+}
+
+patch_func_t patch_table_find(uint32_t address) {
+    uint32_t h = patch_table_hash(address);
+    for (int i = 0; i < PATCH_TABLE_SIZE; i++) {
+        const patch_slot_t *slot = &patch_table.slots[h];
+        if (slot->address == address) {
+            return slot->patch_func;
+        }
+        if (slot->address == PATCH_SLOT_EMPTY) {
+            return NULL;
+        }
+        h = (h + 1) & PATCH_TABLE_MASK;
+    }
+    return NULL;
+}
+
+int patch_table_insert(uint32_t address, patch_func_t patch_func) {
+    if (address == PATCH_SLOT_EMPTY || address == PATCH_SLOT_TOMBSTONE) {
+        return -1;
+    }
+    patch_slot_t *slot = patch_table_slot(address);
+    if (slot != NULL) { // modify
+        slot->patch_func = patch_func;
+        return slot - patch_table.slots;
+    }
+    if (patch_table.used + patch_table.tombstones >= PATCH_TABLE_SIZE / 2) {
+        patch_table_purge();
+        if (patch_table.used >= PATCH_TABLE_SIZE / 2) {
+            printf("Warning: patch table is full(%d).\n", patch_table.used);
+            return -1;
+        }
+    }
+    // the first empty or tombstone slot on the probe chain
+    uint32_t h = patch_table_hash(address);
+    while (patch_table.slots[h].address != PATCH_SLOT_EMPTY &&
+           patch_table.slots[h].address != PATCH_SLOT_TOMBSTONE) {
+        h = (h + 1) & PATCH_TABLE_MASK;
+    }
+    if (patch_table.slots[h].address == PATCH_SLOT_TOMBSTONE) {
+        patch_table.tombstones--;
+    }
+    patch_table.slots[h].patch_func = patch_func;
+    patch_table.slots[h].address = address;
+    patch_table.used++;
+    return h;
+}
+
+void patch_table_remove(uint32_t address) {
+    patch_slot_t *slot = patch_table_slot(address);
+    if (slot != NULL) {
+        slot->address = PATCH_SLOT_TOMBSTONE; // keep the probe chain
+        slot->patch_func = NULL;
+        patch_table.used--;
+        patch_table.tombstones++;
+    }
+}
+
+void patch_table_clear(void) {
+    memset(&patch_table, 0, sizeof(patch_table));
+}
+
 
 
 
@@ -812,7 +996,52 @@ void patch_num_eva(struct patch_list *plist, int n, int times) {
 	int cycles = get_cur_tick() - start;
 	int microseconds_per_iteration = (int)(cycles2us(cycles / times / n) * 100);
 
-  	printf("patch_numbers: %d time: %d.%02d cycles: %d\n", n, microseconds_per_iteration / 100, cycles);
+  	printf("patch_numbers: %d time: %d.%02d cycles: %d\n", n, microseconds_per_iteration / 100, microseconds_per_iteration % 100, cycles);
+
+	// the same lookups on every bulk built layout
+	void *keys[72], *vals[72];
+	for (int i = 0; i < n; i++) {
+		keys[i] = (void *) (n - 1 - i); // reversed, so the bulk build has to sort
+		vals[i] = (void *) 1;
+	}
+	for (int layout = 0; layout < ARRAYMAP_LAYOUT_NUM; layout++) {
+		arraymap *map = arraymap_bulk_new(layout, keys, vals, n);
+		start = get_cur_tick();
+		for (int t = 0; t < times; t++) {
+			for (int i = 0; i < n; i++) {
+				int val = arraymap_get(map, i);
+				(void) val;
+			}
+		}
+		cycles = get_cur_tick() - start;
+		microseconds_per_iteration = (int)(cycles2us(cycles / times / n) * 100);
+		printf("  layout: %s patch_numbers: %d time: %d.%02d cycles: %d\n", arraymap_layout_name(layout), n,
+			microseconds_per_iteration / 100, microseconds_per_iteration % 100, cycles);
+		arraymap_destroy(map);
+	}
+}
+
+// same workload as patch_num_eva, but through the dense site id table
+void site_num_eva(int n, int times) {
+	static auto_patch site_patch = { .desc = NULL, .is_active = true };
+	for (int i = 0; i < n; i++) {
+		pctx.fsite_patches[i] = &site_patch;
+	}
+	dwt_init();
+	int start = get_cur_tick();
+	for (int t = 0; t < times; t++) {
+		for (int i = 0; i < n; i++) {
+			auto_patch *val = get_fixed_patch_by_site(i);
+			(void) val;
+		}
+	}
+	int cycles = get_cur_tick() - start;
+	int microseconds_per_iteration = (int)(cycles2us(cycles / times / n) * 100);
+	for (int i = 0; i < n; i++) {
+		pctx.fsite_patches[i] = NULL;
+	}
+
+  	printf("site_numbers: %d time: %d.%02d cycles: %d\n", n, microseconds_per_iteration / 100, microseconds_per_iteration % 100, cycles);
 }
 
 void test_patch_dispatcher(){
@@ -827,10 +1056,492 @@ void test_patch_dispatcher(){
 	int TI = 100;
 	for (int i = 1; i < 65; i += 4) {
 		patch_num_eva(&plist, i, TI);
+		site_num_eva(i, TI);
 	}
 	patch_num_eva(&plist, 64, TI);
+	site_num_eva(64, TI);
 	arraymap_destroy(plist.patches);
 }
+
+// Overhead of an unpatched site: unconditional handler call vs inline enable byte
+static int __attribute__((noinline)) site_always_call(void) {
+	ret_code = fixed_patch_point_hanlder();
+	if (ret_code != FIXED_OP_PASS) {
+		return ret_code;
+	}
+	return 0;
+}
+
+static int __attribute__((noinline)) site_guard_lr(void) {
+	PATCH_FUNCTION_ERR_CODE;
+	return 0;
+}
+
+static int __attribute__((noinline)) site_guard_id(void) {
+	PATCH_SITE_ERR_CODE(0);
+	return 0;
+}
+
+void test_guard_overhead(){
+	printf("**Evaluating Unpatched Site Overhead** \n");
+	int TI = 100;
+	uint8_t lr_enable = fixed_patch_enable, id_enable = fixed_site_enable[0];
+	fixed_patch_enable = 0;
+	fixed_site_enable[0] = 0;
+	dwt_init();
+	int start = get_cur_tick();
+	for (int t = 0; t < TI; t++) {
+		site_always_call();
+	}
+	int before = get_cur_tick() - start;
+	start = get_cur_tick();
+	for (int t = 0; t < TI; t++) {
+		site_guard_lr();
+	}
+	int after_lr = get_cur_tick() - start;
+	start = get_cur_tick();
+	for (int t = 0; t < TI; t++) {
+		site_guard_id();
+	}
+	int after_id = get_cur_tick() - start;
+	fixed_patch_enable = lr_enable;
+	fixed_site_enable[0] = id_enable;
+	printf("cycles/site before(call): %d after(guard lr): %d after(guard site): %d\n",
+		before / TI, after_lr / TI, after_id / TI);
+}
+
+// Filter result paths: PASS runs the body, DROP/RETURN return from the guard,
+// REDIRECT resumes at op_eva_resume, the code after the body.
+#define OP_EVA_SITE (MAX_FIXED_SITES - 1)
+#define OP_EVA_STR(x) #x
+#define OP_EVA_XSTR(x) OP_EVA_STR(x)
+
+static int op_eva_resume(void);
+
+static uint64_t op_eva_pass(uint32_t sp) { return set_return(FILTER_PASS, 0); }
+static uint64_t op_eva_drop(uint32_t sp) { return set_return(FILTER_DROP, 0); }
+static uint64_t op_eva_return(uint32_t sp) { return set_return(FILTER_RETURN, 7); }
+static uint64_t op_eva_redirect(uint32_t sp) { return set_return(FILTER_REDIRECT, (uint32_t) op_eva_resume); }
+
+void __attribute__((noinline)) op_eva_body(void) {
+	for (volatile int i = 0; i < 32; i++) { // original body
+	}
+}
+
+// PATCH_SITE_ERR_CODE in asm: the redirect lands in this frame, whose layout
+// op_eva_resume must know
+__NAKE static int op_eva_target(void) {
+	__asm volatile("PUSH {r4, lr}");
+	__asm volatile("MOVW r0, #:lower16:fixed_site_enable");
+	__asm volatile("MOVT r0, #:upper16:fixed_site_enable");
+	__asm volatile("LDRB r0, [r0, #" OP_EVA_XSTR(OP_EVA_SITE) "]");
+	__asm volatile("CBZ r0, 1f");
+	__asm volatile("MOVS r0, #" OP_EVA_XSTR(OP_EVA_SITE));
+	__asm volatile("BL fixed_site_patch_point_hanlder");
+	__asm volatile("CMP r0, #" OP_EVA_XSTR(FIXED_OP_PASS));
+	__asm volatile("BNE 2f");
+	__asm volatile("1: BL op_eva_body");
+	__asm volatile("MOVS r0, #0");
+	__asm volatile("2: POP {r4, pc}");
+}
+
+// the rest of op_eva_target after the body, on its frame: return 0
+__NAKE static int op_eva_resume(void) {
+	__asm volatile("MOVS r0, #0");
+	__asm volatile("POP {r4, pc}");
+}
+
+void test_filter_ops(){
+	printf("**Evaluating Filter Result Paths** \n");
+	uint64_t (*filters[4])(uint32_t) = { op_eva_pass, op_eva_drop, op_eva_redirect, op_eva_return };
+	const char *names[4] = { "PASS", "DROP", "REDIRECT", "RETURN" };
+	patch_desc desc = { .cve = "op_eva", .type = FixedSitePatchPoint, .code_len = 0, .fixed_id = OP_EVA_SITE };
+	auto_patch patch = { .desc = &desc, .is_active = true };
+	int TI = 100;
+	pctx.fsite_patches[OP_EVA_SITE] = &patch;
+	fixed_site_enable[OP_EVA_SITE] = 1;
+	dwt_init();
+	for (int k = 0; k < 4; k++) {
+		desc.func = filters[k];
+		int ret = op_eva_target();
+		int start = get_cur_tick();
+		for (int t = 0; t < TI; t++) {
+			op_eva_target();
+		}
+		int cycles = get_cur_tick() - start;
+		printf("op: %s ret: %d cycles/call: %d\n", names[k], ret, cycles / TI);
+	}
+	fixed_site_enable[OP_EVA_SITE] = 0;
+	pctx.fsite_patches[OP_EVA_SITE] = NULL;
+}
+
+// Patch churn on the pool allocator: install and remove patches in rounds, then
+// report cycles per alloc/free and the per class usage and high-water marks.
+void test_alloc_churn(){
+	printf("**Evaluating Allocator under Patch Churn** \n");
+	const int rounds = 200, live = 8;
+	patch_desc *descs[8] = { NULL };
+	auto_patch *patches[8] = { NULL };
+	arraymap *map = arraymap_new(4);
+	int alloc_cycles = 0, free_cycles = 0, ops = 0;
+	dwt_init();
+	for (int r = 0; r < rounds; r++) {
+		int k = r % live;
+		int start = get_cur_tick();
+		if (patches[k] != NULL) {
+			arraymap_del(map, descs[k]->fixed_id);
+			ebpf_free(patches[k]);
+			ebpf_free(descs[k]);
+		}
+		free_cycles += get_cur_tick() - start;
+		start = get_cur_tick();
+		descs[k] = ebpf_calloc(1, sizeof(patch_desc));
+		patches[k] = ebpf_calloc(1, sizeof(auto_patch));
+		alloc_cycles += get_cur_tick() - start;
+		descs[k]->fixed_id = 0x08001000 + r * 4;
+		patches[k]->desc = descs[k];
+		arraymap_set(map, descs[k]->fixed_id, patches[k]);
+		ops += 2;
+	}
+	printf("cycles/alloc: %d cycles/free: %d\n", alloc_cycles / ops, free_cycles / (ops - 2 * live));
+	ebpf_pool_dump();
+	for (int k = 0; k < live; k++) {
+		ebpf_free(patches[k]);
+		ebpf_free(descs[k]);
+	}
+	arraymap_destroy(map);
+}
+
+// Helper call cost, legacy five u64 ABI vs typed 32 bit ABI
+static u64 bench_helper64(u64 a, u64 b, u64 c, u64 d, u64 e) {
+	return a + b;
+}
+
+static u32 bench_helper32(u32 a, u32 b) {
+	return a + b;
+}
+
+#define HELPER_BENCH_IDX (MAX_EXT_FUNCS - 1)
+#define HELPER_BENCH_LOOPS 1000
+
+static int helper_loop_cycles(struct ebpf_vm *vm, bool call) {
+	struct ebpf_inst code[] = {
+		{EBPF_OP_MOV64_IMM, 6, 0, 0, HELPER_BENCH_LOOPS},
+		{EBPF_OP_MOV64_IMM, 1, 0, 0, 1},
+		{EBPF_OP_MOV64_IMM, 2, 0, 0, 2},
+		{call ? EBPF_OP_CALL : EBPF_OP_MOV64_REG, 0, 1, 0, HELPER_BENCH_IDX},
+		{EBPF_OP_ADD64_IMM, 6, 0, 0, -1},
+		{EBPF_OP_JNE_IMM, 6, 0, -5, 0},
+		{EBPF_OP_EXIT, 0, 0, 0, 0},
+	};
+	ebpf_vm_set_inst(vm, (const uint8_t *) code, sizeof(code));
+	int start = get_cur_tick();
+	ebpf_vm_exec(vm, NULL, 0);
+	return get_cur_tick() - start;
+}
+
+void test_helper_call_cost(){
+	printf("**Evaluating eBPF Helper Call ABI** \n");
+	ebpf_vm vm = {0};
+	dwt_init();
+	int base = helper_loop_cycles(&vm, false);
+	ebpf_register(&vm, HELPER_BENCH_IDX, "bench", bench_helper64);
+	int u64_abi = helper_loop_cycles(&vm, true) - base;
+	ebpf_register_typed(&vm, HELPER_BENCH_IDX, "bench", bench_helper32, (ebpf_helper_desc) {2, 0, false});
+	int u32_abi = helper_loop_cycles(&vm, true) - base;
+	printf("cycles/call u64 abi: %d u32 abi: %d\n", u64_abi / HELPER_BENCH_LOOPS, u32_abi / HELPER_BENCH_LOOPS);
+}
+
+// JIT arena under install/remove churn: fragmentation, compactions and alloc cost
+void test_jit_arena_churn(int rounds){
+	printf("**Evaluating JIT Code Arena under Churn** \n");
+	jit_mem *progs[16] = { NULL };
+	uint32_t seed = 1;
+	int frag_sum = 0, samples = 0, fails = 0, allocs = 0, alloc_cycles = 0;
+	dwt_init();
+	for (int r = 0; r < rounds; r++) {
+		seed = seed * 1103515245 + 12345;
+		int k = (seed >> 16) % 16;
+		if (progs[k] != NULL) {
+			jit_mem_free(progs[k]);
+			progs[k] = NULL;
+		} else {
+			int insts = 8 + (seed >> 8) % 57;
+			int start = get_cur_tick();
+			progs[k] = jit_mem_allocate(insts);
+			alloc_cycles += get_cur_tick() - start;
+			allocs++;
+			fails += progs[k] == NULL;
+		}
+		jit_arena_stat st;
+		jit_mem_arena_statistic(&st);
+		if (st.free_bytes > 0) {
+			frag_sum += 100 - st.largest_free * 100 / st.free_bytes;
+			samples++;
+		}
+	}
+	jit_arena_stat st;
+	jit_mem_arena_statistic(&st);
+	printf("avg fragmentation: %d%% compactions: %d failed allocs: %d/%d cycles/alloc: %d\n",
+		samples ? frag_sum / samples : 0, st.compactions, fails, allocs, allocs ? alloc_cycles / allocs : 0);
+	printf("live programs: %d used: %d free: %d holes: %d\n", st.programs, st.used_bytes, st.free_bytes, st.holes);
+	for (int k = 0; k < 16; k++) {
+		jit_mem_free(progs[k]);
+	}
+}
+
+// Journal append latency (compaction included when a bank fills) and boot restore cost per patch
+#define JOURNAL_EVA_CODE 512
+#define JOURNAL_EVA_SITES 8
+
+void test_patch_journal_cost(int appends){
+	printf("**Evaluating Patch Journal** \n");
+	static uint8_t pkt[sizeof(patch_desc) + JOURNAL_EVA_CODE];
+	patch_desc *desc = (patch_desc *) pkt;
+	memset(pkt, 0, sizeof(pkt));
+	desc->type = FixedSitePatchPoint;
+	desc->code_len = JOURNAL_EVA_CODE;
+	patch_journal_format();
+	dwt_init();
+	int total = 0, worst = 0, fails = 0;
+	for (int i = 0; i < appends; i++) {
+		desc->fixed_id = i % JOURNAL_EVA_SITES; // replaced patches, the banks fill and are compacted
+		int start = get_cur_tick();
+		fails += patch_journal_append(pkt, sizeof(pkt), desc->type, desc->fixed_id) != 0;
+		int cycles = get_cur_tick() - start;
+		total += cycles;
+		worst = cycles > worst ? cycles : worst;
+	}
+	printf("append %d bytes: %f us avg %f us worst, failed %d/%d, generation %u\n", (int) sizeof(pkt),
+		cycles2us(total / appends), cycles2us(worst), fails, appends, patch_journal_state()->gen);
+
+	destory_patch_context();
+	int start = get_cur_tick();
+	patch_journal_mount();
+	int mount = get_cur_tick() - start;
+	start = get_cur_tick();
+	load_patch_list_from_flash();
+	int restore = get_cur_tick() - start;
+	int live = patch_journal_state()->num;
+	printf("mount: %f us restore: %f us per patch (%d patches)\n", cycles2us(mount),
+		cycles2us(live ? restore / live : 0), live);
+}
+
+// Activation time and RAM per patch: packets copied out of flash against one bundle run in place
+#define BUNDLE_EVA_SITES 4
+#define BUNDLE_EVA_MAX_CODE 1024
+
+static uint8_t bundle_eva_buf[sizeof(patch_bundle_head) + BUNDLE_EVA_SITES * (sizeof(patch_bundle_site)
+	+ BUNDLE_EVA_MAX_CODE) + 16] __aligned(8);
+
+static void bundle_eva_reset(patch_restore *r) {
+	for (int i = 0; i < r->num; i++) {
+		ebpf_free(r->patches[i]->desc);
+		ebpf_free(r->patches[i]);
+	}
+	r->num = 0;
+	destory_patch_context();
+	init_patch_sys();
+}
+
+// the bundle at PATCH_STAGE_BASE, the packets after it
+static uint32_t bundle_eva_stage(uint32_t code, uint32_t *bundle_len, uint32_t *pkt_len) {
+	uint32_t code_off = sizeof(patch_bundle_head) + BUNDLE_EVA_SITES * sizeof(patch_bundle_site);
+	patch_bundle_head *head = (patch_bundle_head *) bundle_eva_buf;
+	memset(bundle_eva_buf, 0, sizeof(bundle_eva_buf));
+	head->magic = PATCH_BUNDLE_MAGIC;
+	head->version = PATCH_BUNDLE_VERSION;
+	head->sites = BUNDLE_EVA_SITES;
+	head->code_off = code_off;
+	head->code_len = BUNDLE_EVA_SITES * code;
+	head->meta_off = code_off + head->code_len;
+	head->meta_len = 8;
+	head->len = *bundle_len = head->meta_off + head->meta_len;
+	patch_bundle_site *site = (patch_bundle_site *) (head + 1);
+	for (int s = 0; s < BUNDLE_EVA_SITES; s++) {
+		site[s].type = FixedPatchPoint;
+		site[s].fixed_id = 0x08001000 + s * 4;
+		site[s].entry = s * code | 1;
+	}
+	memcpy(bundle_eva_buf + head->meta_off, "CVE-eva", 8);
+	flash_port_erase(PATCH_STAGE_BASE, PATCH_STAGE_SIZE);
+	flash_port_program(PATCH_STAGE_BASE, bundle_eva_buf, *bundle_len);
+
+	uint32_t pkts = (PATCH_STAGE_BASE + *bundle_len + 7) & ~7;
+	*pkt_len = sizeof(patch_desc) + code;
+	for (int s = 0; s < BUNDLE_EVA_SITES; s++) {
+		patch_desc *desc = (patch_desc *) bundle_eva_buf;
+		memset(bundle_eva_buf, 0, *pkt_len);
+		desc->cve = "CVE-eva";
+		desc->type = FixedPatchPoint;
+		desc->code_len = code;
+		desc->fixed_id = 0x08001000 + s * 4;
+		flash_port_program(pkts + s * ((*pkt_len + 7) & ~7), bundle_eva_buf, *pkt_len);
+	}
+	return pkts;
+}
+
+void test_patch_bundle_cost(int rounds){
+	printf("**Evaluating Patch Bundles** \n");
+	const uint32_t codes[] = {64, 256, 1024};
+	patch_restore r = {0};
+	dwt_init();
+	for (int c = 0; c < ARRAY_SIZE(codes); c++) {
+		uint32_t bundle_len, pkt_len;
+		uint32_t pkts = bundle_eva_stage(codes[c], &bundle_len, &pkt_len);
+		int copy = 0, bundle = 0, copy_ram = 0, bundle_ram = 0;
+		for (int k = 0; k < rounds; k++) {
+			bundle_eva_reset(&r);
+			int ram = get_ebpf_alloc_size();
+			int start = get_cur_tick();
+			for (int s = 0; s < BUNDLE_EVA_SITES; s++) {
+				restore_patch(&r, (const uint8_t *) (pkts + s * ((pkt_len + 7) & ~7)), pkt_len);
+			}
+			active_patches(r.patches, r.num);
+			copy += get_cur_tick() - start;
+			copy_ram += get_ebpf_alloc_size() - ram;
+
+			bundle_eva_reset(&r);
+			ram = get_ebpf_alloc_size();
+			start = get_cur_tick();
+			if (patch_bundle_valid((const uint8_t *) PATCH_STAGE_BASE, bundle_len)) {
+				bundle_setup(&r, (const uint8_t *) PATCH_STAGE_BASE);
+				active_patches(r.patches, r.num);
+			}
+			bundle += get_cur_tick() - start;
+			bundle_ram += get_ebpf_alloc_size() - ram;
+		}
+		bundle_eva_reset(&r);
+		int n = rounds * BUNDLE_EVA_SITES;
+		printf("code %u bytes: copy %f us %d bytes per patch, bundle %f us %d bytes per patch\n", codes[c],
+			cycles2us(copy / n), copy_ram / n, cycles2us(bundle / n), bundle_ram / n);
+	}
+}
+
+// Lookup/update cost of the preallocated map types, arraymap as the old baseline
+#define MAP_EVA_ENTRIES 16
+
+static uint32_t map_eva_key(int type, int i) {
+	return type == EBPF_MAP_HASH ? 0x08001000 + i * 4 : i;
+}
+
+void test_map_cost(int times){
+	printf("**Evaluating Preallocated eBPF Maps** \n");
+	const ebpf_map_def defs[] = {
+		{1, EBPF_MAP_ARRAY, sizeof(uint32_t), MAP_EVA_ENTRIES},
+		{2, EBPF_MAP_HASH, sizeof(uint32_t), MAP_EVA_ENTRIES},
+		{3, EBPF_MAP_SITE_COUNTER, 0, MAP_EVA_ENTRIES},
+	};
+	const char *names[] = {"", "array", "hash", "site counter"};
+	init_patch_sys();
+	if (ebpf_maps_setup(defs, ARRAY_SIZE(defs)) != 0) {
+		return;
+	}
+	int ops = MAP_EVA_ENTRIES * times;
+	dwt_init();
+	for (int m = 0; m < ARRAY_SIZE(defs); m++) {
+		ebpf_map *map = ebpf_map_get(defs[m].id);
+		int type = defs[m].type;
+		int start = get_cur_tick();
+		for (int t = 0; t < times; t++) {
+			for (uint32_t i = 0; i < MAP_EVA_ENTRIES; i++) {
+				if (type == EBPF_MAP_SITE_COUNTER) {
+					ebpf_map_inc(map, i);
+				} else {
+					ebpf_map_update(map, map_eva_key(type, i), &i);
+				}
+			}
+		}
+		int update = get_cur_tick() - start;
+		start = get_cur_tick();
+		for (int t = 0; t < times; t++) {
+			for (int i = 0; i < MAP_EVA_ENTRIES; i++) {
+				ebpf_map_lookup(map, map_eva_key(type, i));
+			}
+		}
+		int lookup = get_cur_tick() - start;
+		printf("%s map cycles/lookup: %d cycles/update: %d\n", names[type], lookup / ops, update / ops);
+	}
+
+	arraymap *amap = arraymap_new(5);
+	int start = get_cur_tick();
+	for (int t = 0; t < times; t++) {
+		for (int i = 0; i < MAP_EVA_ENTRIES; i++) {
+			arraymap_set(amap, map_eva_key(EBPF_MAP_HASH, i), i);
+		}
+	}
+	int update = get_cur_tick() - start;
+	start = get_cur_tick();
+	for (int t = 0; t < times; t++) {
+		for (int i = 0; i < MAP_EVA_ENTRIES; i++) {
+			arraymap_get(amap, map_eva_key(EBPF_MAP_HASH, i));
+		}
+	}
+	int lookup = get_cur_tick() - start;
+	printf("arraymap cycles/lookup: %d cycles/update: %d\n", lookup / ops, update / ops);
+	arraymap_destroy(amap);
+	destory_patch_context();
+}
+
+// chained hashmap vs sorted array vs static open addressing table, same addresses
+static uint32_t table_eva_addr(int i) {
+	return 0x08001000 + i * 0x24; // spread like real call sites
+}
+
+void patch_table_eva(int n, int times) {
+	hashmap_t* map = hashmap_init(n);
+	hashmap_new sorted[64];
+	int num_sorted = 0;
+	patch_table_clear();
+	for (int i = 0; i < n; i++) {
+		hashmap_insert(map, table_eva_addr(i), filter);
+		insert_patch_function(sorted, &num_sorted, table_eva_addr(i), filter);
+		patch_table_insert(table_eva_addr(i), filter);
+	}
+
+	dwt_init();
+	int start = get_cur_tick();
+	for (int t = 0; t < times; t++) {
+		for (int i = 0; i < n; i++) {
+			uint32_t addr = table_eva_addr(i);
+			patch_func_t f = search_patch_function(hash_function(addr), addr, map);
+			(void) f;
+		}
+	}
+	int chained = get_cur_tick() - start;
+
+	start = get_cur_tick();
+	for (int t = 0; t < times; t++) {
+		for (int i = 0; i < n; i++) {
+			patch_func_t f = find_patch_function(sorted, num_sorted, table_eva_addr(i));
+			(void) f;
+		}
+	}
+	int binary = get_cur_tick() - start;
+
+	start = get_cur_tick();
+	for (int t = 0; t < times; t++) {
+		for (int i = 0; i < n; i++) {
+			patch_func_t f = patch_table_find(table_eva_addr(i));
+			(void) f;
+		}
+	}
+	int open = get_cur_tick() - start;
+
+	printf("patch_numbers: %d cycles/lookup chained: %d sorted: %d static_open: %d\n", n,
+		chained / times / n, binary / times / n, open / times / n);
+	hashmap_free(map);
+	patch_table_clear();
+}
+
+void test_patch_table(){
+	printf("**Evaluating Patch Table Lookup** \n");
+	int TI = 100;
+	for (int i = 1; i < 65; i += 4) {
+		patch_table_eva(i, TI);
+	}
+	patch_table_eva(64, TI);
+}
 //******** END of Dispatcher Overhead ********//
 
 
@@ -869,6 +1580,16 @@ void main(){
 	
 	// For Patch Dispatching Delay
 	// test_patch_dispatcher();
+	// test_patch_table();
+	// test_guard_overhead();
+	// test_filter_ops();
+	// test_alloc_churn();
+	// test_helper_call_cost();
+	// test_map_cost(100);
+	// test_jit_arena_churn(1000);
+	// test_patch_journal_cost(100);
+	// test_patch_bundle_cost(100);
+	// test_flash_write_speed();
 
 	
 	// Board CPU Frequency Information
@@ -2590,7 +3311,7 @@ void test_ebpf_c12() {
 void ebpf_eva(uint8_t *code, int code_len, void *args, int ags_len) {
 	bool test_jit = true;
 	// test_jit = false;
-	ebpf_vm vm;
+	ebpf_vm vm = {0};
 	ebpf_vm_set_inst(&vm, code, code_len);
 	//profile_exit();
 	//profile_add_event("ebpf");
@@ -2598,9 +3319,68 @@ void ebpf_eva(uint8_t *code, int code_len, void *args, int ags_len) {
 	//profile_start(EV0);
 	//ret1 = ebpf_vm_exec(&vm, args, ags_len);
 	//profile_end(EV0);
+	// interpreter cost, build with EBPF_METER_EVERY_INST to compare with per instruction metering
+	dwt_init();
+	int start = get_cur_tick();
+	uint64_t ret1 = ebpf_vm_exec(&vm, args, ags_len);
+	int cycles = get_cur_tick() - start;
+	printf("Interpreter: Op=%d Ret=%d cycles: %d back-edges: %d\n", (int) (ret1 >> 32), (int) (ret1 & 0xffffffff), cycles, vm.back_edges);
+	// bounds checked: every access, then only the ones the verifier could not prove
+	u8 *mem_safe = vm.mem_safe;
+	vm.bounds_check_enabled = true;
+	vm.mem_safe = NULL;
+	start = get_cur_tick();
+	ebpf_vm_exec(&vm, args, ags_len);
+	int checked_all = get_cur_tick() - start;
+	vm.mem_safe = mem_safe;
+	start = get_cur_tick();
+	ebpf_vm_exec(&vm, args, ags_len);
+	int checked_unproven = get_cur_tick() - start;
+	printf("Bounds check: accesses: %d proven: %d cycles all: %d unproven: %d\n", vm.mem_accesses, vm.mem_proven,
+		checked_all, checked_unproven);
 	// jit_compile
 	if (test_jit) {
+		// cold: compile and store to the flash cache, warm: load it back as after a reset
+		jit_cache_reset();
+		start = get_cur_tick();
+		gen_jit_code(&vm);
+		int cold = get_cur_tick() - start;
+		vm.jit_func = NULL;
+		start = get_cur_tick();
+		gen_jit_code(&vm);
+		int warm = get_cur_tick() - start;
+		printf("JIT cold compile cycles: %d warm load cycles: %d\n", cold, warm);
+		// single pass with branch fixups against a sizing pass before the generation
+		int pass_cycles[2], pass_bytes[2];
+		for (int two_pass = 0; two_pass < 2; two_pass++) {
+			jit_cache_reset();
+			vm.jit_two_pass = two_pass;
+			start = get_cur_tick();
+			gen_jit_code(&vm);
+			pass_cycles[two_pass] = get_cur_tick() - start;
+			pass_bytes[two_pass] = vm.jmem != NULL ? vm.jmem->code_len : 0;
+		}
+		vm.jit_two_pass = false;
+		printf("JIT single pass: cycles: %d code bytes: %d two pass: cycles: %d code bytes: %d\n", pass_cycles[0],
+			pass_bytes[0], pass_cycles[1], pass_bytes[1]);
+		// code size with every access checked and with the proven ones left out
+		jit_cache_reset();
+		vm.mem_safe = NULL;
+		gen_jit_code(&vm);
+		int sfi_all = vm.jmem != NULL ? vm.jmem->code_len : 0;
+		jit_cache_reset();
+		vm.mem_safe = mem_safe;
 		gen_jit_code(&vm);
+		int sfi_unproven = vm.jmem != NULL ? vm.jmem->code_len : 0;
+		printf("JIT checked code bytes all: %d unproven: %d\n", sfi_all, sfi_unproven);
+		// compiled code against the interpreter runs above, only when the backend produced some
+		if (sfi_unproven > 0 && vm.jit_func != NULL) {
+			start = get_cur_tick();
+			uint64_t ret2 = vm.jit_func(args, ags_len, vm.helper_func->ext_funcs);
+			int jit_cycles = get_cur_tick() - start;
+			printf("JIT: Op=%d Ret=%d code bytes: %d cycles: %d\n", (int) (ret2 >> 32), (int) (ret2 & 0xffffffff),
+				sfi_unproven, jit_cycles);
+		}
 		//profile_start(EV1);
 		//ret2 = vm.jit_func(args, ags_len);
 		//profile_end(EV1);
@@ -2613,8 +3393,11 @@ void ebpf_eva(uint8_t *code, int code_len, void *args, int ags_len) {
 	//profile_dump(EV0);
 	//profile_dump(EV1);
 
+	vm.bounds_check_enabled = false;
+
 	int total_mem = jit_mem_statistic(&vm) + get_ebpf_alloc_size();
 	printf("mem size: %d bytes\n", total_mem);
+	ebpf_verifier_release(&vm);
 	printf("finish----------------------------------------\n");
 }
 
@@ -0,0 +1,76 @@
+#include "patch_bundle.h"
+#include "patch_service.h"
+#include "iotpatch.h"
+#include "ebpf_map.h"
+#include "utils.h"
+#include <string.h>
+
+bool patch_bundle_is(const uint8_t *pkt, uint32_t len) {
+	return len >= sizeof(patch_bundle_head) && ((const patch_bundle_head *) pkt)->magic == PATCH_BUNDLE_MAGIC;
+}
+
+static bool bundle_site_valid(const patch_bundle_head *head, const patch_bundle_site *site, const uint8_t *meta) {
+	if (site->type != FixedPatchPoint && site->type != FixedSitePatchPoint) {
+		return false;
+	}
+	if (site->type == FixedSitePatchPoint && site->fixed_id >= MAX_FIXED_SITES) {
+		return false;
+	}
+	if ((site->entry & ~1u) >= head->code_len || site->cve >= head->meta_len
+		|| memchr(meta + site->cve, 0, head->meta_len - site->cve) == NULL) {
+		return false;
+	}
+	if (site->map_num > EBPF_MAX_MAPS) {
+		return false;
+	}
+	if (site->map_num > 0 && ((site->maps & 1) != 0 || site->maps > head->meta_len
+		|| site->map_num > (head->meta_len - site->maps) / sizeof(ebpf_map_def))) {
+		return false;
+	}
+	return true;
+}
+
+bool patch_bundle_valid(const uint8_t *bundle, uint32_t len) {
+	const patch_bundle_head *head = (const patch_bundle_head *) bundle;
+	if (!patch_bundle_is(bundle, len) || head->version != PATCH_BUNDLE_VERSION || head->len != len
+		|| head->sites == 0 || head->sites > PATCH_BUNDLE_MAX_SITES) {
+		return false;
+	}
+	uint32_t table_end = sizeof(patch_bundle_head) + head->sites * sizeof(patch_bundle_site);
+	// each offset checked against len before it is subtracted, no sum can wrap
+	if ((head->code_off & 3) != 0 || head->code_off < table_end || head->code_off > len
+		|| head->code_len > len - head->code_off || head->meta_off < head->code_off
+		|| head->meta_off - head->code_off < head->code_len || head->meta_off > len
+		|| head->meta_len > len - head->meta_off) {
+		DEBUG_LOG("bad bundle %u: layout\n", head->id);
+		return false;
+	}
+	const patch_bundle_site *sites = (const patch_bundle_site *) (head + 1);
+	for (int i = 0; i < head->sites; i++) {
+		if (!bundle_site_valid(head, &sites[i], bundle + head->meta_off)) {
+			DEBUG_LOG("bad bundle %u: site %d\n", head->id, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+void patch_bundle_desc(const uint8_t *bundle, int i, patch_desc *desc) {
+	const patch_bundle_head *head = (const patch_bundle_head *) bundle;
+	const patch_bundle_site *site = (const patch_bundle_site *) (head + 1) + i;
+	const uint8_t *meta = bundle + head->meta_off;
+	desc->cve = (const char *) (meta + site->cve);
+	desc->type = site->type;
+	desc->code_len = 0; // the code stays in the bundle, not after the descriptor
+	desc->fixed_id = site->fixed_id;
+	desc->func = (uint64_t (*)(uint32_t)) (uintptr_t) (bundle + head->code_off + site->entry);
+	desc->map_num = site->map_num;
+	desc->maps = sizeof(patch_desc); // copied by the caller
+}
+
+const ebpf_map_def *patch_bundle_maps(const uint8_t *bundle, int i, uint16_t *map_num) {
+	const patch_bundle_head *head = (const patch_bundle_head *) bundle;
+	const patch_bundle_site *site = (const patch_bundle_site *) (head + 1) + i;
+	*map_num = site->map_num;
+	return (const ebpf_map_def *) (bundle + head->meta_off + site->maps);
+}
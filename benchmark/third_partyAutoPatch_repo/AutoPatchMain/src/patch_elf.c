@@ -0,0 +1,474 @@
+#include "patch_elf.h"
+#include "flash_api.h"
+#include "utils.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// the parts of ELF32 the loader reads, little endian
+typedef struct elf32_ehdr {
+	uint8_t ident[16];
+	uint16_t type;
+	uint16_t machine;
+	uint32_t version;
+	uint32_t entry;
+	uint32_t phoff;
+	uint32_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+} elf32_ehdr;
+
+typedef struct elf32_shdr {
+	uint32_t name;
+	uint32_t type;
+	uint32_t flags;
+	uint32_t addr;
+	uint32_t offset;
+	uint32_t size;
+	uint32_t link;
+	uint32_t info;
+	uint32_t addralign;
+	uint32_t entsize;
+} elf32_shdr;
+
+typedef struct elf32_sym {
+	uint32_t name;
+	uint32_t value;
+	uint32_t size;
+	uint8_t info;
+	uint8_t other;
+	uint16_t shndx;
+} elf32_sym;
+
+typedef struct elf32_rel {
+	uint32_t offset;
+	uint32_t info; // symbol << 8 | type
+} elf32_rel;
+
+#define ELF_CLASS32 1
+#define ELF_DATA2LSB 1
+#define ELF_ET_REL 1
+#define ELF_EM_ARM 40
+#define ELF_SHT_SYMTAB 2
+#define ELF_SHT_NOBITS 8
+#define ELF_SHT_REL 9
+#define ELF_SHT_ARM_EXIDX 0x70000001
+#define ELF_SHF_WRITE 0x1
+#define ELF_SHF_ALLOC 0x2
+#define ELF_SHN_UNDEF 0
+#define ELF_SHN_ABS 0xfff1
+#define ELF_STB_GLOBAL 1
+#define ELF_STT_FUNC 2
+
+#define R_ARM_NONE 0
+#define R_ARM_ABS32 2
+#define R_ARM_REL32 3
+#define R_ARM_THM_CALL 10
+#define R_ARM_THM_JUMP24 30
+#define R_ARM_THM_MOVW_ABS_NC 47
+#define R_ARM_THM_MOVT_ABS 48
+
+#define ELF_ALIGN(v, a) (((v) + (a) - 1) & ~((a) - 1))
+
+#ifdef LINUX_TEST
+// addresses in an image, the patch code does not run on the host
+#define FIRMWARE_SYM(f, addr) { #f, addr }
+#else
+#define FIRMWARE_SYM(f, addr) { #f, (uint32_t) (f) }
+// run time ABI of the compiler, no header declares them
+extern void __aeabi_ldivmod(void);
+extern void __aeabi_memclr(void);
+extern void __aeabi_memclr4(void);
+extern void __aeabi_memcpy(void);
+extern void __aeabi_memcpy4(void);
+extern void __aeabi_memmove(void);
+extern void __aeabi_memset(void);
+extern void __aeabi_uldivmod(void);
+#endif
+
+const patch_elf_sym patch_elf_firmware[] = {
+	FIRMWARE_SYM(__aeabi_ldivmod, 0x00004c81),
+	FIRMWARE_SYM(__aeabi_memclr, 0x00005a15),
+	FIRMWARE_SYM(__aeabi_memclr4, 0x00005a1d),
+	FIRMWARE_SYM(__aeabi_memcpy, 0x00005a25),
+	FIRMWARE_SYM(__aeabi_memcpy4, 0x00005a2d),
+	FIRMWARE_SYM(__aeabi_memmove, 0x00005a35),
+	FIRMWARE_SYM(__aeabi_memset, 0x00005a3d),
+	FIRMWARE_SYM(__aeabi_uldivmod, 0x00004db1),
+	FIRMWARE_SYM(memcmp, 0x00005b01),
+	FIRMWARE_SYM(memcpy, 0x00005b2d),
+	FIRMWARE_SYM(memmove, 0x00005b49),
+	FIRMWARE_SYM(memset, 0x00005b7d),
+	FIRMWARE_SYM(printf, 0x00006e91),
+	FIRMWARE_SYM(puts, 0x00006f29),
+	FIRMWARE_SYM(snprintf, 0x00006fb5),
+	FIRMWARE_SYM(strcmp, 0x00005c09),
+	FIRMWARE_SYM(strlen, 0x00005c41),
+	FIRMWARE_SYM(strncmp, 0x00005c59),
+	FIRMWARE_SYM(strncpy, 0x00005c8d),
+};
+const int patch_elf_firmware_num = sizeof(patch_elf_firmware) / sizeof(patch_elf_firmware[0]);
+
+bool patch_elf_is(const uint8_t *obj, uint32_t len) {
+	return len >= 4 && obj[0] == 0x7f && obj[1] == 'E' && obj[2] == 'L' && obj[3] == 'F';
+}
+
+uint32_t patch_elf_lookup(const patch_elf_sym *syms, int nsyms, const char *name) {
+	int lo = 0, hi = nsyms - 1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		int c = strcmp(name, syms[mid].name);
+		if (c == 0) {
+			return syms[mid].addr;
+		}
+		if (c < 0) {
+			hi = mid - 1;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return 0;
+}
+
+static int elf_shdr(patch_elf *elf, int i, elf32_shdr *sh) {
+	return elf->read(elf->user, elf->shoff + i * sizeof(elf32_shdr), sh, sizeof(elf32_shdr));
+}
+
+// unwind tables are left out, the patches do not throw
+static bool elf_loaded(const elf32_shdr *sh) {
+	return (sh->flags & ELF_SHF_ALLOC) != 0 && sh->type != ELF_SHT_ARM_EXIDX && sh->size > 0;
+}
+
+static uint32_t elf_align(const elf32_shdr *sh) {
+	return sh->addralign > 1 ? sh->addralign : 1;
+}
+
+int patch_elf_open(patch_elf *elf, patch_elf_read read, void *user, uint32_t len) {
+	elf32_ehdr eh;
+	memset(elf, 0, offsetof(patch_elf, buf));
+	elf->read = read;
+	elf->user = user;
+	elf->len = len;
+	if (len < sizeof(eh) || read(user, 0, &eh, sizeof(eh)) != 0 || !patch_elf_is(eh.ident, sizeof(eh))
+		|| eh.ident[4] != ELF_CLASS32 || eh.ident[5] != ELF_DATA2LSB || eh.type != ELF_ET_REL
+		|| eh.machine != ELF_EM_ARM || eh.shentsize != sizeof(elf32_shdr) || eh.shnum == 0
+		|| eh.shnum > PATCH_ELF_MAX_SECTIONS || eh.shoff > len || eh.shnum * sizeof(elf32_shdr) > len - eh.shoff) {
+		DEBUG_LOG("bad object: header\n");
+		return -1;
+	}
+	elf->shoff = eh.shoff;
+	elf->shnum = eh.shnum;
+	for (int i = 1; i < elf->shnum; i++) {
+		elf32_shdr sh, target;
+		if (elf_shdr(elf, i, &sh) != 0) {
+			return -1;
+		}
+		uint32_t align = elf_align(&sh);
+		if ((sh.type != ELF_SHT_NOBITS && (sh.offset > len || sh.size > len - sh.offset)) || (align & (align - 1)) != 0) {
+			DEBUG_LOG("bad object: section %d\n", i);
+			return -1;
+		}
+		if (sh.type == ELF_SHT_SYMTAB) {
+			elf32_shdr str;
+			if (sh.entsize != sizeof(elf32_sym) || sh.link >= elf->shnum || elf_shdr(elf, sh.link, &str) != 0) {
+				DEBUG_LOG("bad object: symbol table\n");
+				return -1;
+			}
+			elf->sym_off = sh.offset;
+			elf->sym_num = sh.size / sizeof(elf32_sym);
+			elf->str_off = str.offset;
+			elf->str_size = str.size;
+		} else if (sh.type == ELF_SHT_REL && sh.info < elf->shnum) {
+			if (elf_shdr(elf, sh.info, &target) != 0) {
+				return -1;
+			}
+			if (elf_loaded(&target)) {
+				elf->sec_rel[sh.info] = i;
+				elf->sec_veneer[sh.info] = elf->veneers;
+				elf->veneers += sh.size / sizeof(elf32_rel);
+			}
+		} else if (elf_loaded(&sh)) {
+			// laid out at any address, the worst alignment padding is counted
+			if (sh.flags & ELF_SHF_WRITE) {
+				elf->data_size += sh.size + align - 1;
+			} else {
+				elf->code_size += sh.size + align - 1;
+			}
+		}
+	}
+	if (elf->sym_num == 0 || elf->str_off > len || elf->str_size > len - elf->str_off) {
+		DEBUG_LOG("bad object: no symbols\n");
+		return -1;
+	}
+	elf->code_size += elf->veneers > 0 ? 3 + elf->veneers * PATCH_ELF_VENEER : 0;
+	return 0;
+}
+
+static int elf_write(uint32_t addr, uint8_t *buf, uint32_t n, bool flash) {
+	if (flash) {
+		return flash_port_write(addr, buf, n);
+	}
+	memcpy((void *) (uintptr_t) addr, buf, n);
+	return 0;
+}
+
+// a name of the symbol string table into elf->name
+static int elf_name(patch_elf *elf, uint32_t off) {
+	if (off >= elf->str_size) {
+		return -1;
+	}
+	uint32_t n = elf->str_size - off < PATCH_ELF_NAME_MAX ? elf->str_size - off : PATCH_ELF_NAME_MAX;
+	if (elf->read(elf->user, elf->str_off + off, elf->name, n) != 0 || memchr(elf->name, 0, n) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+static int elf_symbol(patch_elf *elf, uint32_t i, uint32_t *addr) {
+	elf32_sym sym;
+	if (i >= elf->sym_num || elf->read(elf->user, elf->sym_off + i * sizeof(sym), &sym, sizeof(sym)) != 0) {
+		return -1;
+	}
+	if (sym.shndx == ELF_SHN_UNDEF) {
+		if (elf_name(elf, sym.name) != 0) {
+			return -1;
+		}
+		elf->lookups++;
+		*addr = patch_elf_lookup(elf->syms, elf->nsyms, elf->name);
+		if (*addr == 0) {
+			DEBUG_LOG("object: %s is not in the firmware\n", elf->name);
+			return -1;
+		}
+	} else if (sym.shndx == ELF_SHN_ABS) {
+		*addr = sym.value;
+	} else if (sym.shndx < elf->shnum && elf->sec_addr[sym.shndx] != 0) {
+		*addr = elf->sec_addr[sym.shndx] + sym.value;
+	} else {
+		DEBUG_LOG("object: symbol %u in a section not loaded\n", i);
+		return -1;
+	}
+	return 0;
+}
+
+// BL / B.W: S:I1:I2:imm10:imm11:0, I = NOT(J XOR S)
+static int32_t thumb_branch_get(uint16_t hi, uint16_t lo) {
+	uint32_t s = (hi >> 10) & 1;
+	uint32_t i1 = !(((lo >> 13) & 1) ^ s);
+	uint32_t i2 = !(((lo >> 11) & 1) ^ s);
+	uint32_t imm = s << 24 | i1 << 23 | i2 << 22 | (hi & 0x3ff) << 12 | (lo & 0x7ff) << 1;
+	return (int32_t) (imm << 7) >> 7;
+}
+
+static void thumb_branch_set(uint16_t *hi, uint16_t *lo, int32_t d) {
+	uint32_t s = (d >> 24) & 1;
+	uint32_t j1 = !((d >> 23) & 1) ^ s;
+	uint32_t j2 = !((d >> 22) & 1) ^ s;
+	*hi = (*hi & 0xf800) | s << 10 | ((d >> 12) & 0x3ff);
+	*lo = (*lo & 0xd000) | j1 << 13 | j2 << 11 | ((d >> 1) & 0x7ff);
+}
+
+// MOVW / MOVT: imm4:i:imm3:imm8
+static uint32_t thumb_mov_get(uint16_t hi, uint16_t lo) {
+	return (hi & 0xf) << 12 | ((hi >> 10) & 1) << 11 | ((lo >> 12) & 7) << 8 | (lo & 0xff);
+}
+
+static void thumb_mov_set(uint16_t *hi, uint16_t *lo, uint32_t v) {
+	*hi = (*hi & 0xfbf0) | ((v >> 12) & 0xf) | ((v >> 11) & 1) << 10;
+	*lo = (*lo & 0x8f00) | ((v >> 8) & 7) << 12 | (v & 0xff);
+}
+
+// ldr.w pc, [pc, #0] then the target, the slot of a relocation is rewritten with the same bytes
+static int elf_veneer(patch_elf *elf, uint32_t slot, uint32_t target) {
+	uint8_t v[PATCH_ELF_VENEER] = {0xdf, 0xf8, 0x00, 0xf0};
+	target |= 1;
+	memcpy(v + 4, &target, 4);
+	return elf_write(elf->veneer_base + slot * PATCH_ELF_VENEER, v, PATCH_ELF_VENEER, elf->code_flash);
+}
+
+// the 4 byte field at p, the addend is in it (REL)
+static int elf_reloc(patch_elf *elf, const elf32_rel *rel, uint8_t *field, uint32_t p, uint32_t slot) {
+	uint32_t type = rel->info & 0xff;
+	uint32_t s, w;
+	uint16_t hi, lo;
+	if (type == R_ARM_NONE) {
+		return 0;
+	}
+	if (elf_symbol(elf, rel->info >> 8, &s) != 0) {
+		return -1;
+	}
+	memcpy(&w, field, 4);
+	hi = w & 0xffff;
+	lo = w >> 16;
+	switch (type) {
+	case R_ARM_ABS32:
+		w += s;
+		break;
+	case R_ARM_REL32:
+		w += s - p;
+		break;
+	case R_ARM_THM_CALL:
+	case R_ARM_THM_JUMP24: {
+		int32_t a = thumb_branch_get(hi, lo);
+		int32_t d = (int32_t) ((s & ~1u) + a - p);
+		if (d < -(1 << 24) || d >= (1 << 24)) {
+			uint32_t v = elf->veneer_base + slot * PATCH_ELF_VENEER;
+			if (elf_veneer(elf, slot, s) != 0) {
+				return -1;
+			}
+			d = (int32_t) (v + a - p);
+			elf->calls_veneered++;
+		}
+		thumb_branch_set(&hi, &lo, d);
+		w = hi | (uint32_t) lo << 16;
+		break;
+	}
+	case R_ARM_THM_MOVW_ABS_NC:
+	case R_ARM_THM_MOVT_ABS: {
+		uint32_t v = s + (int16_t) thumb_mov_get(hi, lo);
+		thumb_mov_set(&hi, &lo, type == R_ARM_THM_MOVT_ABS ? v >> 16 : v);
+		w = hi | (uint32_t) lo << 16;
+		break;
+	}
+	default:
+		DEBUG_LOG("object: relocation type %u not supported\n", type);
+		return -1;
+	}
+	memcpy(field, &w, 4);
+	return 0;
+}
+
+/*
+The relocations of section sec that touch the chunk at off in elf->buf. A
+field across two chunks is read from the object and relocated for each.
+*/
+static int elf_relocate(patch_elf *elf, int sec, const elf32_shdr *sh, uint32_t off, uint32_t n) {
+	elf32_shdr rs;
+	if (elf_shdr(elf, elf->sec_rel[sec], &rs) != 0) {
+		return -1;
+	}
+	uint32_t count = rs.size / sizeof(elf32_rel);
+	for (uint32_t k = 0; k < count; k++) {
+		elf32_rel rel;
+		uint8_t field[4];
+		if (elf->read(elf->user, rs.offset + k * sizeof(rel), &rel, sizeof(rel)) != 0) {
+			return -1;
+		}
+		uint32_t at = rel.offset;
+		if (at > sh->size - 4 || sh->size < 4) {
+			DEBUG_LOG("object: relocation %u out of section %d\n", k, sec);
+			return -1;
+		}
+		if (at + 4 <= off || at >= off + n) {
+			continue;
+		}
+		if (at >= off && at + 4 <= off + n) {
+			memcpy(field, elf->buf + at - off, 4);
+		} else if (elf->read(elf->user, sh->offset + at, field, 4) != 0) {
+			return -1;
+		}
+		if (elf_reloc(elf, &rel, field, elf->sec_addr[sec] + at, elf->sec_veneer[sec] + k) != 0) {
+			return -1;
+		}
+		elf->relocs += at >= off;
+		for (uint32_t b = 0; b < 4; b++) {
+			if (at + b >= off && at + b < off + n) {
+				elf->buf[at + b - off] = field[b];
+			}
+		}
+	}
+	return 0;
+}
+
+static int elf_copy(patch_elf *elf, int sec, const elf32_shdr *sh, bool flash) {
+	uint32_t n;
+	for (uint32_t off = 0; off < sh->size; off += n) {
+		n = sh->size - off < PATCH_ELF_CHUNK ? sh->size - off : PATCH_ELF_CHUNK;
+		if (sh->type == ELF_SHT_NOBITS) {
+			memset(elf->buf, 0, n);
+		} else if (elf->read(elf->user, sh->offset + off, elf->buf, n) != 0) {
+			return -1;
+		}
+		if (elf->sec_rel[sec] != 0 && elf_relocate(elf, sec, sh, off, n) != 0) {
+			return -1;
+		}
+		if (elf_write(elf->sec_addr[sec] + off, elf->buf, n, flash) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// the global function named filter_*, else the first one
+static uint32_t elf_entry(patch_elf *elf) {
+	uint32_t first = 0;
+	for (uint32_t i = 1; i < elf->sym_num; i++) {
+		elf32_sym sym;
+		if (elf->read(elf->user, elf->sym_off + i * sizeof(sym), &sym, sizeof(sym)) != 0) {
+			return 0;
+		}
+		if (sym.info >> 4 != ELF_STB_GLOBAL || (sym.info & 0xf) != ELF_STT_FUNC || sym.shndx >= elf->shnum
+			|| elf->sec_addr[sym.shndx] == 0 || elf_name(elf, sym.name) != 0) {
+			continue;
+		}
+		uint32_t addr = elf->sec_addr[sym.shndx] + sym.value;
+		if (strncmp(elf->name, "filter_", 7) == 0) {
+			return addr;
+		}
+		first = first != 0 ? first : addr;
+	}
+	return first;
+}
+
+uint32_t patch_elf_load(patch_elf *elf, const patch_elf_region *code, const patch_elf_region *data,
+	const patch_elf_sym *syms, int nsyms) {
+	elf->syms = syms;
+	elf->nsyms = nsyms;
+	elf->code_flash = code->flash;
+	elf->relocs = 0;
+	elf->lookups = 0;
+	elf->calls_veneered = 0;
+	uint32_t code_next = code->addr, data_next = data != NULL ? data->addr : 0;
+	for (int i = 1; i < elf->shnum; i++) {
+		elf32_shdr sh;
+		if (elf_shdr(elf, i, &sh) != 0) {
+			return 0;
+		}
+		elf->sec_addr[i] = 0;
+		if (!elf_loaded(&sh)) {
+			continue;
+		}
+		if ((sh.flags & ELF_SHF_WRITE) == 0) {
+			code_next = ELF_ALIGN(code_next, elf_align(&sh));
+			elf->sec_addr[i] = code_next;
+			code_next += sh.size;
+		} else if (data != NULL) {
+			data_next = ELF_ALIGN(data_next, elf_align(&sh));
+			elf->sec_addr[i] = data_next;
+			data_next += sh.size;
+		} else {
+			DEBUG_LOG("object: writable section %d and no data region\n", i);
+			return 0;
+		}
+	}
+	elf->veneer_base = ELF_ALIGN(code_next, 4);
+	code_next = elf->veneer_base + elf->veneers * PATCH_ELF_VENEER;
+	if (code_next - code->addr > code->size || (data != NULL && data_next - data->addr > data->size)) {
+		DEBUG_LOG("object: regions too small\n");
+		return 0;
+	}
+	for (int i = 1; i < elf->shnum; i++) {
+		elf32_shdr sh;
+		if (elf->sec_addr[i] == 0) {
+			continue;
+		}
+		if (elf_shdr(elf, i, &sh) != 0 || elf_copy(elf, i, &sh, (sh.flags & ELF_SHF_WRITE) == 0 && code->flash) != 0) {
+			return 0;
+		}
+	}
+	return elf_entry(elf);
+}
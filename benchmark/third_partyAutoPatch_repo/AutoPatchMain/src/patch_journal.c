@@ -0,0 +1,287 @@
+#include "patch_journal.h"
+#include "patch_verify.h"
+#include "flash_api.h"
+#include "utils.h"
+#include <stddef.h>
+#include <string.h>
+
+#define JOURNAL_BANK_A PATCH_JOURNAL_BASE
+#define JOURNAL_BANK_B (PATCH_JOURNAL_BASE + PATCH_JOURNAL_BANK)
+#define JOURNAL_ERASED 0xffffffff
+
+static patch_journal journal;
+static patch_journal_move journal_move;
+// programmed through RAM, the source may be flash (a staged patch, a record)
+static uint8_t journal_bounce[256] __attribute__((aligned(PATCH_JOURNAL_ALIGN)));
+
+static uint32_t rec_size(uint32_t len) {
+	return (sizeof(journal_rec) + len + PATCH_JOURNAL_ALIGN - 1) & ~(PATCH_JOURNAL_ALIGN - 1);
+}
+
+static uint32_t rec_crc(const journal_rec *rec, const uint8_t *payload) {
+	patch_verify v;
+	patch_verify_init(&v, PATCH_VERIFY_CRC32);
+	patch_verify_update(&v, (const uint8_t *) rec, offsetof(journal_rec, crc));
+	patch_verify_update(&v, payload, rec->len);
+	return v.crc;
+}
+
+// a complete record at addr, in place (flash is memory mapped)
+static bool rec_valid(uint32_t bank, uint32_t addr) {
+	const journal_rec *rec = (const journal_rec *) addr;
+	uint32_t end = bank + PATCH_JOURNAL_BANK;
+	if (addr + sizeof(journal_rec) > end || rec->magic != PATCH_JOURNAL_REC_MAGIC
+		|| rec->len > end - addr - sizeof(journal_rec)) {
+		return false;
+	}
+	return rec_crc(rec, (const uint8_t *) (rec + 1)) == rec->crc;
+}
+
+static int journal_copy(uint32_t dst, const uint8_t *src, uint32_t len) {
+	for (uint32_t off = 0; off < len; off += sizeof(journal_bounce)) {
+		uint32_t n = len - off < sizeof(journal_bounce) ? len - off : sizeof(journal_bounce);
+		memcpy(journal_bounce, src + off, n);
+		if (flash_port_program(dst + off, journal_bounce, n) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static bool bank_valid(uint32_t bank) {
+	const journal_bank_head *head = (const journal_bank_head *) bank;
+	return head->magic == PATCH_JOURNAL_BANK_MAGIC && head->gen != JOURNAL_ERASED;
+}
+
+static int bank_open(uint32_t bank, uint32_t gen) {
+	journal_bank_head head = {PATCH_JOURNAL_BANK_MAGIC, gen};
+	return flash_port_program(bank, (const uint8_t *) &head, sizeof(head));
+}
+
+static journal_live *live_find(uint16_t type, uint32_t id) {
+	for (int i = 0; i < journal.num; i++) {
+		if (journal.live[i].type == type && journal.live[i].id == id) {
+			return &journal.live[i];
+		}
+	}
+	return NULL;
+}
+
+// the record at addr is the live one of its patch now
+static int live_set(const journal_rec *rec, uint32_t addr) {
+	journal_live *live = live_find(rec->type, rec->id);
+	if (live != NULL) {
+		journal.dead += rec_size(((const journal_rec *) live->addr)->len);
+		live->addr = addr;
+		return 0;
+	}
+	if (journal.num == PATCH_JOURNAL_MAX_LIVE) {
+		return -1;
+	}
+	live = &journal.live[journal.num++];
+	live->type = rec->type;
+	live->id = rec->id;
+	live->addr = addr;
+	return 0;
+}
+
+// oldest first, records are appended in order
+static void live_sort(void) {
+	for (int i = 1; i < journal.num; i++) {
+		journal_live cur = journal.live[i];
+		int j = i - 1;
+		for (; j >= 0 && journal.live[j].addr > cur.addr; j--) {
+			journal.live[j + 1] = journal.live[j];
+		}
+		journal.live[j + 1] = cur;
+	}
+}
+
+void patch_journal_format(void) {
+	flash_port_erase(PATCH_JOURNAL_BASE, 2 * PATCH_JOURNAL_BANK);
+	journal.mounted = false;
+}
+
+int patch_journal_mount(void) {
+	memset(&journal, 0, sizeof(journal));
+	bool a = bank_valid(JOURNAL_BANK_A), b = bank_valid(JOURNAL_BANK_B);
+	if (!a && !b) {
+		if (flash_port_erase(JOURNAL_BANK_A, PATCH_JOURNAL_BANK) != 0 || bank_open(JOURNAL_BANK_A, 1) != 0) {
+			return -1;
+		}
+		a = true;
+	}
+	journal.bank = JOURNAL_BANK_A;
+	if (!a || (b && ((const journal_bank_head *) JOURNAL_BANK_B)->gen > ((const journal_bank_head *) JOURNAL_BANK_A)->gen)) {
+		journal.bank = JOURNAL_BANK_B;
+	}
+	journal.gen = ((const journal_bank_head *) journal.bank)->gen;
+
+	uint32_t addr = journal.bank + sizeof(journal_bank_head);
+	while (rec_valid(journal.bank, addr)) {
+		const journal_rec *rec = (const journal_rec *) addr;
+		if (live_set(rec, addr) != 0) {
+			DEBUG_LOG("journal: more than %d patches, record %u dropped\n", PATCH_JOURNAL_MAX_LIVE, rec->seq);
+			journal.dead += rec_size(rec->len);
+		}
+		journal.seq = rec->seq + 1;
+		addr += rec_size(rec->len);
+	}
+	journal.tail = addr;
+	// a cut record (payload without header, or a bad CRC) leaves programmed bytes
+	for (; addr < journal.bank + PATCH_JOURNAL_BANK; addr += sizeof(uint32_t)) {
+		if (*(const uint32_t *) addr != JOURNAL_ERASED) {
+			journal.dirty = true;
+			break;
+		}
+	}
+	journal.mounted = true;
+	DEBUG_LOG("journal: bank 0x%08x gen %u, %d patches, %u bytes used %u replaced%s\n", journal.bank, journal.gen,
+		journal.num, journal.tail - journal.bank, journal.dead, journal.dirty ? ", dirty" : "");
+	return 0;
+}
+
+// bytes of the live records, but the one at skip
+static uint32_t live_bytes(uint32_t skip) {
+	uint32_t bytes = 0;
+	for (int i = 0; i < journal.num; i++) {
+		if (journal.live[i].addr != skip) {
+			bytes += rec_size(((const journal_rec *) journal.live[i].addr)->len);
+		}
+	}
+	return bytes;
+}
+
+/*
+The live records go to the other bank in their order, then its header makes
+it the active one. A reset before that leaves the old bank active. The record
+at skip (0: none) is left out, the append that replaces it is next.
+*/
+static int journal_compact(uint32_t skip) {
+	uint32_t bank = journal.bank == JOURNAL_BANK_A ? JOURNAL_BANK_B : JOURNAL_BANK_A;
+	if (flash_port_erase(bank, PATCH_JOURNAL_BANK) != 0) {
+		return -1;
+	}
+	live_sort();
+	uint32_t moved[PATCH_JOURNAL_MAX_LIVE]; // the live records stay in the old bank until the new one is open
+	uint32_t addr = bank + sizeof(journal_bank_head);
+	for (int i = 0; i < journal.num; i++) {
+		const journal_rec *rec = (const journal_rec *) journal.live[i].addr;
+		if (journal.live[i].addr == skip) {
+			continue;
+		}
+		if (journal_copy(addr, (const uint8_t *) rec, sizeof(journal_rec) + rec->len) != 0) {
+			return -1;
+		}
+		moved[i] = addr;
+		addr += rec_size(rec->len);
+	}
+	if (bank_open(bank, journal.gen + 1) != 0) {
+		return -1;
+	}
+	int num = 0;
+	for (int i = 0; i < journal.num; i++) {
+		const journal_rec *from = (const journal_rec *) journal.live[i].addr;
+		if (journal.live[i].addr == skip) {
+			continue;
+		}
+		journal.live[num] = journal.live[i];
+		journal.live[num++].addr = moved[i];
+		if (journal_move != NULL) {
+			journal_move((const uint8_t *) (from + 1), (const uint8_t *) moved[i] + sizeof(journal_rec), from->len);
+		}
+	}
+	journal.num = num;
+	journal.bank = bank;
+	journal.gen++;
+	journal.tail = addr;
+	journal.dead = 0;
+	journal.dirty = false;
+	return 0;
+}
+
+int patch_journal_compact(void) {
+	if (!journal.mounted && patch_journal_mount() != 0) {
+		return -1;
+	}
+	return journal_compact(0);
+}
+
+// payload first, the header commits the record
+int patch_journal_append(const uint8_t *pkt, uint32_t len, uint16_t type, uint32_t id) {
+	if (!journal.mounted && patch_journal_mount() != 0) {
+		return -1;
+	}
+	uint32_t size = rec_size(len);
+	const journal_live *replaced = live_find(type, id);
+	if (replaced == NULL && journal.num == PATCH_JOURNAL_MAX_LIVE) {
+		return -1;
+	}
+	if (journal.dirty || journal.tail + size > journal.bank + PATCH_JOURNAL_BANK) {
+		// a bank erase only if the record fits after it, the replaced record is dropped only if it must be
+		uint32_t skip = replaced != NULL ? replaced->addr : 0;
+		if (sizeof(journal_bank_head) + live_bytes(skip) + size > PATCH_JOURNAL_BANK) {
+			DEBUG_LOG("journal: no space for %u bytes, %u live\n", size, live_bytes(skip));
+			return -1;
+		}
+		if (sizeof(journal_bank_head) + live_bytes(0) + size <= PATCH_JOURNAL_BANK) {
+			skip = 0;
+		}
+		if (journal_compact(skip) != 0) {
+			return -1;
+		}
+	}
+	journal_rec rec = {PATCH_JOURNAL_REC_MAGIC, len, id, type, 0xffff, journal.seq};
+	rec.crc = rec_crc(&rec, pkt);
+	uint32_t addr = journal.tail;
+	journal.tail += size; // whatever happens, these bytes are no longer erased
+	if (journal_copy(addr + sizeof(rec), pkt, len) != 0
+		|| flash_port_program(addr, (const uint8_t *) &rec, sizeof(rec)) != 0) {
+		journal.dirty = true;
+		return -1;
+	}
+	journal.seq++;
+	return live_set(&rec, addr);
+}
+
+int patch_journal_replay(patch_journal_visit visit, void *user) {
+	if (!journal.mounted && patch_journal_mount() != 0) {
+		return 0;
+	}
+	live_sort();
+	for (int i = 0; i < journal.num; i++) {
+		const journal_rec *rec = (const journal_rec *) journal.live[i].addr;
+		visit(user, (const uint8_t *) (rec + 1), rec->len);
+	}
+	return journal.num;
+}
+
+const uint8_t *patch_journal_find(uint16_t type, uint32_t id, uint32_t *len) {
+	if (!journal.mounted && patch_journal_mount() != 0) {
+		return NULL;
+	}
+	const journal_live *live = live_find(type, id);
+	if (live == NULL) {
+		return NULL;
+	}
+	const journal_rec *rec = (const journal_rec *) live->addr;
+	if (len != NULL) {
+		*len = rec->len;
+	}
+	return (const uint8_t *) (rec + 1);
+}
+
+void patch_journal_on_move(patch_journal_move move) {
+	journal_move = move;
+}
+
+bool patch_journal_idle(void) {
+	if (!journal.mounted || (!journal.dirty && journal.dead <= journal.tail - journal.bank - journal.dead)) {
+		return false;
+	}
+	return patch_journal_compact() == 0;
+}
+
+const patch_journal *patch_journal_state(void) {
+	return &journal;
+}
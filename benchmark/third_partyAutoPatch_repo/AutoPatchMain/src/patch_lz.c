@@ -0,0 +1,75 @@
+#include "patch_lz.h"
+#include <stddef.h>
+
+void patch_lz_init(patch_lz *lz, patch_lz_sink sink, void *user) {
+	lz->out_len = 0;
+	lz->items = 0;
+	lz->has_lo = 0;
+	lz->sink = sink;
+	lz->user = user;
+}
+
+static int lz_put(patch_lz *lz, uint8_t c) {
+	uint32_t pos = lz->out_len & (PATCH_LZ_WINDOW - 1);
+	lz->window[pos] = c;
+	lz->out_len++;
+	if ((lz->out_len & (PATCH_LZ_FLUSH - 1)) == 0) {
+		uint32_t start = pos + 1 - PATCH_LZ_FLUSH;
+		return lz->sink(lz->user, lz->out_len - PATCH_LZ_FLUSH, &lz->window[start], PATCH_LZ_FLUSH);
+	}
+	return 0;
+}
+
+static int lz_match(patch_lz *lz, uint16_t tok) {
+	uint32_t dist = (tok & (PATCH_LZ_WINDOW - 1)) + 1;
+	int len = (tok >> PATCH_LZ_WINDOW_BITS) + PATCH_LZ_MIN_MATCH;
+	if (dist > lz->out_len) {
+		return -1;
+	}
+	for (int i = 0; i < len; i++) { // byte by byte, a match may overlap itself
+		uint8_t c = lz->window[(lz->out_len - dist) & (PATCH_LZ_WINDOW - 1)];
+		if (lz_put(lz, c) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int patch_lz_feed(patch_lz *lz, const uint8_t *in, int len) {
+	for (int i = 0; i < len; i++) {
+		uint8_t b = in[i];
+		if (lz->items == 0) {
+			lz->flags = b;
+			lz->items = 8;
+		} else if (lz->flags & 0x1) {
+			if (lz_put(lz, b) != 0) {
+				return -1;
+			}
+			lz->flags >>= 1;
+			lz->items--;
+		} else if (!lz->has_lo) {
+			lz->tok_lo = b;
+			lz->has_lo = 1;
+		} else {
+			lz->has_lo = 0;
+			if (lz_match(lz, lz->tok_lo | (b << 8)) != 0) {
+				return -1;
+			}
+			lz->flags >>= 1;
+			lz->items--;
+		}
+	}
+	return 0;
+}
+
+int patch_lz_finish(patch_lz *lz) {
+	if (lz->has_lo) {
+		return -1;
+	}
+	int rest = lz->out_len & (PATCH_LZ_FLUSH - 1);
+	if (rest == 0) {
+		return 0;
+	}
+	uint32_t start = (lz->out_len - rest) & (PATCH_LZ_WINDOW - 1);
+	return lz->sink(lz->user, lz->out_len - rest, &lz->window[start], rest);
+}
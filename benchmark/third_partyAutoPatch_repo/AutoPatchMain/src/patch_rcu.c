@@ -0,0 +1,280 @@
+#include "patch_rcu.h"
+#include <string.h>
+
+/*
+Build the Linux stress benchmark:
+gcc -O2 -DLINUX_TEST -DPATCH_RCU_STRESS_MAIN -Iinclude src/patch_rcu.c -lpthread
+*/
+#ifdef LINUX_TEST
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#define rcu_malloc malloc
+#define rcu_yield() sched_yield()
+// poison freed tables, so a reader still using one sees garbage
+static void rcu_free(patch_rcu_table *table) {
+	memset(table, 0xdd, sizeof(patch_rcu_table) + table->num * sizeof(patch_rcu_entry));
+	free(table);
+}
+#else
+#include "ebpf_allocator.h"
+#define rcu_malloc ebpf_malloc
+#define rcu_free ebpf_free
+// k_yield only lets threads of the same priority run, a preempted lower priority
+// reader would never leave its read section
+#define rcu_yield() k_sleep(K_TICKS(1))
+#endif
+
+static patch_rcu_table *table_alloc(int num) {
+	patch_rcu_table *table = rcu_malloc(sizeof(patch_rcu_table) + num * sizeof(patch_rcu_entry));
+	if (table != NULL) {
+		table->num = num;
+	}
+	return table;
+}
+
+void patch_rcu_init(patch_rcu *rcu) {
+	patch_rcu_table *table = table_alloc(0);
+	table->version = 0;
+	table->fbits_filter = 0;
+	atomic_init(&rcu->cur, table);
+	atomic_init(&rcu->idx, 0);
+	atomic_init(&rcu->readers[0], 0);
+	atomic_init(&rcu->readers[1], 0);
+	atomic_flag_clear(&rcu->writer);
+}
+
+void patch_rcu_destroy(patch_rcu *rcu) {
+	patch_rcu_table *table = atomic_exchange(&rcu->cur, NULL);
+	patch_rcu_synchronize(rcu);
+	if (table != NULL) {
+		rcu_free(table);
+	}
+}
+
+void *patch_rcu_lookup(const patch_rcu_table *table, uint32_t key) {
+	if (table == NULL || (table->fbits_filter & key) != key) {
+		return NULL;
+	}
+	int start = 0;
+	int end = table->num - 1;
+	while (start <= end) {
+		int mid = (start + end) / 2;
+		uint32_t m = table->entries[mid].key;
+		if (m == key) {
+			return table->entries[mid].val;
+		} else if (m > key) {
+			end = mid - 1;
+		} else {
+			start = mid + 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+A reader that loaded idx before a flip may increment the old counter after the
+writer saw it drained, so flip twice and drain both counters.
+*/
+void patch_rcu_synchronize(patch_rcu *rcu) {
+	for (int i = 0; i < 2; i++) {
+		unsigned old = atomic_fetch_add(&rcu->idx, 1) & 1;
+		while (atomic_load(&rcu->readers[old]) != 0) {
+			rcu_yield();
+		}
+	}
+}
+
+static void writer_lock(patch_rcu *rcu) {
+	while (atomic_flag_test_and_set(&rcu->writer)) {
+		rcu_yield();
+	}
+}
+
+static void writer_unlock(patch_rcu *rcu) {
+	atomic_flag_clear(&rcu->writer);
+}
+
+// publish the new table, wait for the readers of the old one and free it
+static void publish(patch_rcu *rcu, patch_rcu_table *table) {
+	table->fbits_filter = 0;
+	for (int i = 0; i < table->num; i++) {
+		table->fbits_filter |= table->entries[i].key;
+	}
+	patch_rcu_table *old = atomic_exchange(&rcu->cur, table);
+	patch_rcu_synchronize(rcu);
+	rcu_free(old);
+}
+
+bool patch_rcu_set(patch_rcu *rcu, uint32_t key, void *val) {
+	writer_lock(rcu);
+	const patch_rcu_table *old = atomic_load(&rcu->cur);
+	int pos = 0;
+	while (pos < old->num && old->entries[pos].key < key) {
+		pos++;
+	}
+	bool modify = pos < old->num && old->entries[pos].key == key;
+	patch_rcu_table *table = table_alloc(modify ? old->num : old->num + 1);
+	if (table == NULL) {
+		writer_unlock(rcu);
+		return false;
+	}
+	table->version = old->version + 1;
+	memcpy(table->entries, old->entries, pos * sizeof(patch_rcu_entry));
+	table->entries[pos].key = key;
+	table->entries[pos].val = val;
+	int rest = pos + (modify ? 1 : 0);
+	memcpy(&table->entries[pos + 1], &old->entries[rest], (old->num - rest) * sizeof(patch_rcu_entry));
+	publish(rcu, table);
+	writer_unlock(rcu);
+	return true;
+}
+
+bool patch_rcu_del(patch_rcu *rcu, uint32_t key) {
+	writer_lock(rcu);
+	const patch_rcu_table *old = atomic_load(&rcu->cur);
+	int pos = 0;
+	while (pos < old->num && old->entries[pos].key != key) {
+		pos++;
+	}
+	if (pos == old->num) {
+		writer_unlock(rcu);
+		return false;
+	}
+	patch_rcu_table *table = table_alloc(old->num - 1);
+	if (table == NULL) {
+		writer_unlock(rcu);
+		return false;
+	}
+	table->version = old->version + 1;
+	memcpy(table->entries, old->entries, pos * sizeof(patch_rcu_entry));
+	memcpy(&table->entries[pos], &old->entries[pos + 1], (old->num - pos - 1) * sizeof(patch_rcu_entry));
+	publish(rcu, table);
+	writer_unlock(rcu);
+	return true;
+}
+
+bool patch_rcu_set_many(patch_rcu *rcu, const patch_rcu_entry *entries, int num) {
+	writer_lock(rcu);
+	const patch_rcu_table *old = atomic_load(&rcu->cur);
+	patch_rcu_table *table = table_alloc(old->num + num);
+	if (table == NULL) {
+		writer_unlock(rcu);
+		return false;
+	}
+	table->version = old->version + 1;
+	memcpy(table->entries, old->entries, old->num * sizeof(patch_rcu_entry));
+	int n = old->num;
+	for (int i = 0; i < num; i++) {
+		int pos = 0;
+		while (pos < n && table->entries[pos].key < entries[i].key) {
+			pos++;
+		}
+		if (pos == n || table->entries[pos].key != entries[i].key) {
+			memmove(&table->entries[pos + 1], &table->entries[pos], (n - pos) * sizeof(patch_rcu_entry));
+			table->entries[pos].key = entries[i].key;
+			n++;
+		}
+		table->entries[pos].val = entries[i].val;
+	}
+	table->num = n;
+	publish(rcu, table);
+	writer_unlock(rcu);
+	return true;
+}
+
+/*
+Linux stress benchmark: N dispatcher threads look up patches while a writer
+keeps replacing them. Every value encodes its key, so a reader that sees a
+freed (poisoned) table or a torn entry reports an error or crashes.
+*/
+#ifdef LINUX_TEST
+#include <pthread.h>
+#include <time.h>
+
+#define STRESS_KEYS 64
+#define STRESS_VAL(key, round) ((void *) (uintptr_t) (((uint64_t) (round) << 32) | (key)))
+
+static patch_rcu stress_rcu;
+static atomic_bool stress_stop;
+static atomic_ulong stress_lookups;
+static atomic_ulong stress_errors;
+
+static uint32_t stress_key(int i) {
+	return 0x08001000 + i * 4;
+}
+
+static void *stress_reader(void *arg) {
+	unsigned long lookups = 0, errors = 0;
+	unsigned seed = (unsigned) (uintptr_t) arg;
+	while (!atomic_load_explicit(&stress_stop, memory_order_relaxed)) {
+		uint32_t key = stress_key(rand_r(&seed) % STRESS_KEYS);
+		unsigned idx = patch_rcu_read_lock(&stress_rcu);
+		const patch_rcu_table *table = patch_rcu_deref(&stress_rcu);
+		void *val = patch_rcu_lookup(table, key);
+		if (val != NULL && (uint32_t) (uintptr_t) val != key) {
+			errors++;
+		}
+		patch_rcu_read_unlock(&stress_rcu, idx);
+		lookups++;
+	}
+	atomic_fetch_add(&stress_lookups, lookups);
+	atomic_fetch_add(&stress_errors, errors);
+	return NULL;
+}
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void patch_rcu_stress(int readers, int seconds) {
+	pthread_t tids[64];
+	if (readers > 64) {
+		readers = 64;
+	}
+	patch_rcu_init(&stress_rcu);
+	atomic_store(&stress_stop, false);
+	atomic_store(&stress_lookups, 0);
+	atomic_store(&stress_errors, 0);
+	for (int i = 0; i < readers; i++) {
+		pthread_create(&tids[i], NULL, stress_reader, (void *) (uintptr_t) (i + 1));
+	}
+
+	unsigned long updates = 0;
+	double sync_time = 0;
+	double start = now_sec();
+	while (now_sec() - start < seconds) {
+		int i = updates % STRESS_KEYS;
+		double t = now_sec();
+		if ((updates / STRESS_KEYS) % 2 == 0) {
+			patch_rcu_set(&stress_rcu, stress_key(i), STRESS_VAL(stress_key(i), updates));
+		} else {
+			patch_rcu_del(&stress_rcu, stress_key(i));
+		}
+		sync_time += now_sec() - t;
+		updates++;
+	}
+	atomic_store(&stress_stop, true);
+	for (int i = 0; i < readers; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	double elapsed = now_sec() - start;
+	patch_rcu_destroy(&stress_rcu);
+
+	printf("readers: %d updates/s: %.0f lookups/s: %.0f avg update: %.2f us errors: %lu\n",
+		readers, updates / elapsed, atomic_load(&stress_lookups) / elapsed,
+		sync_time / updates * 1e6, atomic_load(&stress_errors));
+}
+
+#ifdef PATCH_RCU_STRESS_MAIN
+int main(int argc, char **argv) {
+	int seconds = argc > 1 ? atoi(argv[1]) : 2;
+	for (int readers = 1; readers <= 8; readers *= 2) {
+		patch_rcu_stress(readers, seconds);
+	}
+	return 0;
+}
+#endif
+#endif // LINUX_TEST
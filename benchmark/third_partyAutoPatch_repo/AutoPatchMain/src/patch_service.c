@@ -4,12 +4,12 @@
 #include "iotpatch.h"
 #include "ebpf_allocator.h"
 #include "ihp_config.h"
-
-enum update_protocol {
-	EXIT = 0,
-	LOAD, // load patch
-	HEARTBEAT,
-};
+#include "patch_verify.c"
+#include "patch_lz.c"
+#include "patch_bundle.c"
+#include "ebpf_map.h"
+#include "flash_api.h"
+#include <string.h>
 
 enum context_status {
 	WAIT_FOR_INIT = 0,
@@ -19,27 +19,427 @@ enum context_status {
 
 static service_context svr_ctx = {0};
 static patch_service svr = {0};
-static uint8_t buf[4] = {0};
+static uint8_t drain_buf[64];
+static uint8_t verify_algo = PATCH_VERIFY_ALGO;
+static bool verify_pipelined = true;
+static uint8_t lz_chunk[PATCH_LZ_CHUNK];
+static uint32_t stage_next = PATCH_STAGE_BASE; // first free byte of the staging area
+static uint32_t stage_erased = PATCH_STAGE_BASE; // erased up to here
+static uint8_t xfer_buf[sizeof(xfer_chunk_head) + PATCH_XFER_CHUNK_MAX] __attribute__((aligned(PATCH_STAGE_ALIGN)));
+static const uint64_t xfer_mark = 0;
+
+#define XFER_REC ((const xfer_record *) PATCH_XFER_BASE)
+
+static void dispatch_frame(service_context *ctx, frame_rx *rx);
+
+void frame_rx_reset(frame_rx *rx) {
+	rx->state = RX_HEADER;
+	rx->pos = 0;
+	rx->body = NULL;
+	rx->status = ACK_OK;
+}
 
-static void dispatch_patch_command(int cmd);
+static void frame_rx_refuse(frame_rx *rx, uint8_t status) {
+	if (rx->body != NULL) {
+		ebpf_free(rx->body);
+		rx->body = NULL;
+	}
+	rx->status = status;
+	rx->state = RX_DRAIN;
+}
 
-static void wait_for_patch() {
-	while (true) {
-		if (svr_ctx.status != RUNNING) {
-			return;
+static bool patch_desc_valid(const patch_desc *desc) {
+	if (desc->type < FixedPatchPoint || desc->type > FixedSitePatchPoint
+		|| (desc->type == FixedSitePatchPoint && desc->fixed_id >= MAX_FIXED_SITES)) {
+		DEBUG_LOG("bad patch: type %d id %u\n", desc->type, desc->fixed_id);
+		return false;
+	}
+	if (desc->map_num > EBPF_MAX_MAPS) {
+		DEBUG_LOG("bad patch: %u maps\n", desc->map_num);
+		return false;
+	}
+	return true;
+}
+
+// a packet is one patch (patch_desc and its code, or a patch object) or a bundle
+static bool packet_valid(const uint8_t *pkt, uint32_t len) {
+	if (patch_bundle_is(pkt, len)) {
+		return patch_bundle_valid(pkt, len);
+	}
+	// the loader parses an object within code_len
+	if (len < sizeof(patch_desc) || ((const patch_desc *) pkt)->code_len > len - sizeof(patch_desc)) {
+		DEBUG_LOG("bad patch: code %u of %u bytes\n", ((const patch_desc *) pkt)->code_len, len);
+		return false;
+	}
+	const patch_desc *desc = (const patch_desc *) pkt;
+	if (desc->map_num > 0 && ((desc->maps & 1) != 0 || desc->maps < sizeof(patch_desc) || desc->maps > len
+		|| desc->map_num > (len - desc->maps) / sizeof(ebpf_map_def))) {
+		DEBUG_LOG("bad patch: %u maps at %u of %u bytes\n", desc->map_num, desc->maps, len);
+		return false;
+	}
+	return patch_desc_valid(desc);
+}
+
+// a patch is copied, a bundle journaled and run from its record: the packet stays the caller's
+static void packet_install(const uint8_t *pkt, uint32_t len) {
+	if (patch_bundle_is(pkt, len)) {
+		notify_new_bundle(pkt, len);
+	} else {
+		notify_new_patch((const patch_desc *) pkt);
+	}
+}
+
+/*
+Decoding runs on every chunk as it arrives instead of after the whole body:
+the digest is updated while the chunk is still in the cache, and the patch
+header is checked as soon as it is in, a bad patch is refused before its code
+is received.
+*/
+static void frame_rx_body(frame_rx *rx, uint32_t from, uint32_t to) {
+	const uint32_t desc_end = PATCH_SIGN_LEN + sizeof(patch_desc);
+	if (verify_pipelined && rx->hdr.cmd == FRAME_LOAD && to > PATCH_SIGN_LEN) {
+		from = from > PATCH_SIGN_LEN ? from : PATCH_SIGN_LEN;
+		patch_verify_update(&rx->verify, rx->body + from, to - from);
+	}
+	if (rx->hdr.cmd != FRAME_LOAD || from >= desc_end || to < desc_end
+		|| patch_bundle_is(rx->body + PATCH_SIGN_LEN, rx->hdr.len - PATCH_SIGN_LEN)) {
+		return; // a bundle is checked when it is complete
+	}
+	if (!patch_desc_valid((patch_desc *) (rx->body + PATCH_SIGN_LEN))) {
+		frame_rx_refuse(rx, ACK_BAD_PATCH);
+	}
+}
+
+void patch_stage_reset(void) {
+	stage_next = PATCH_STAGE_BASE;
+	stage_erased = PATCH_STAGE_BASE;
+}
+
+// pages are erased as the decoder reaches them, never one still holding a patch
+static int stage_sink(void *user, uint32_t off, const uint8_t *data, int len) {
+	frame_rx *rx = user;
+	uint32_t addr = rx->stage + off;
+	if (off + len > rx->lz_head.raw_len) {
+		return -1;
+	}
+	if (addr + len > stage_erased) {
+		int size = (addr + len - stage_erased + PATCH_STAGE_PAGE - 1) & ~(PATCH_STAGE_PAGE - 1);
+		if (flash_port_erase(stage_erased, size) != 0) {
+			return -1;
 		}
+		stage_erased += size;
+	}
+	if (flash_port_program(addr, data, len) != 0) {
+		return -1;
+	}
+	// programmed bytes are not reused until the frame is done, patch_stage_reset
+	stage_next = (addr + len + PATCH_STAGE_ALIGN - 1) & ~(PATCH_STAGE_ALIGN - 1);
+	if (verify_pipelined) {
+		patch_verify_update(&rx->verify, data, len);
+	}
+	return 0;
+}
 
-		size_t sz = svr.receive_buf(&svr_ctx, buf, 1);
-		if (sz != 1) {
-			DEBUG_LOG("Update client exist: %u\n", sz);
-			svr.dis_connect(&svr_ctx);
+// head complete: reserve the staging space of the decoded packet
+static bool frame_rx_lz_start(frame_rx *rx) {
+	uint32_t raw_len = rx->lz_head.raw_len;
+	if (raw_len < sizeof(patch_desc) || raw_len > PATCH_STAGE_BASE + PATCH_STAGE_SIZE - stage_next) {
+		DEBUG_LOG("no staging space: %u free %u\n", raw_len, PATCH_STAGE_BASE + PATCH_STAGE_SIZE - stage_next);
+		return false;
+	}
+	rx->stage = stage_next;
+	patch_lz_init(&rx->lz, stage_sink, rx);
+	return true;
+}
+
+// a compressed chunk is in lz_chunk, decode it straight to flash
+static void frame_rx_lz(frame_rx *rx, uint32_t from, uint32_t n) {
+	const uint8_t *p = lz_chunk;
+	if (from < sizeof(lz_load_head)) {
+		uint32_t k = sizeof(lz_load_head) - from < n ? sizeof(lz_load_head) - from : n;
+		memcpy((uint8_t *) &rx->lz_head + from, p, k);
+		p += k;
+		n -= k;
+		if (from + k == sizeof(lz_load_head) && !frame_rx_lz_start(rx)) {
+			frame_rx_refuse(rx, ACK_NO_MEM);
 			return;
 		}
-		int cmd = byte2int(buf, 1);
-		DEBUG_LOG("recv status: %u cmd:%d\n", sz, cmd);
-		dispatch_patch_command(cmd);
 	}
-	
+	if (n > 0 && patch_lz_feed(&rx->lz, p, n) != 0) {
+		frame_rx_refuse(rx, ACK_BAD_PATCH);
+	}
+}
+
+// header complete: set up the staging buffer the body is received into
+static int frame_rx_start(frame_rx *rx) {
+	if (rx->hdr.magic != PATCH_FRAME_MAGIC) {
+		DEBUG_LOG("bad frame magic: 0x%02x\n", rx->hdr.magic);
+		return -1;
+	}
+	rx->pos = 0;
+	if (rx->hdr.len == 0) {
+		return 1;
+	}
+	if (rx->hdr.cmd == FRAME_LOAD_LZ) {
+		if (rx->hdr.len < sizeof(lz_load_head) || rx->hdr.len > PATCH_STAGE_SIZE) {
+			frame_rx_refuse(rx, ACK_TOO_LARGE);
+			return 0;
+		}
+		patch_verify_init(&rx->verify, verify_algo);
+		rx->state = RX_LZ;
+		return 0;
+	}
+	if (rx->hdr.cmd >= FRAME_XFER_BEGIN && rx->hdr.cmd <= FRAME_XFER_END) {
+		if (rx->hdr.len > sizeof(xfer_buf)) {
+			frame_rx_refuse(rx, ACK_TOO_LARGE);
+			return 0;
+		}
+		rx->state = RX_XFER;
+		return 0;
+	}
+	if (rx->hdr.cmd != FRAME_LOAD) {
+		frame_rx_refuse(rx, ACK_OK); // no payload expected, skip it
+		return 0;
+	}
+	if (rx->hdr.len > PATCH_FRAME_MAX || rx->hdr.len < PATCH_SIGN_LEN + sizeof(patch_desc)) {
+		frame_rx_refuse(rx, rx->hdr.len > PATCH_FRAME_MAX ? ACK_TOO_LARGE : ACK_BAD_PATCH);
+		return 0;
+	}
+	rx->body = ebpf_malloc(rx->hdr.len);
+	if (rx->body == NULL) {
+		frame_rx_refuse(rx, ACK_NO_MEM);
+		return 0;
+	}
+	patch_verify_init(&rx->verify, verify_algo);
+	rx->state = RX_BODY;
+	return 0;
+}
+
+static bool xfer_matches(const xfer_begin *m) {
+	const xfer_record *rec = XFER_REC;
+	return rec->magic == PATCH_XFER_MAGIC && rec->id == m->id && rec->len == m->len
+		&& rec->chunk_size == m->chunk_size && memcmp(rec->sign, m->sign, PATCH_SIGN_LEN) == 0;
+}
+
+/*
+Open a transfer. The record of the same packet is kept, so the chunks already
+programmed are not sent again. Anything else is erased with the pages the
+packet needs and a new record written, the magic last: a record cut by a reset
+is not taken for a transfer.
+*/
+static uint8_t xfer_open(const xfer_begin *m) {
+	if (m->chunk_size == 0 || m->chunk_size > PATCH_XFER_CHUNK_MAX || (m->chunk_size & (PATCH_STAGE_ALIGN - 1)) != 0
+		|| m->len < sizeof(patch_desc) || m->len > PATCH_FRAME_MAX - PATCH_SIGN_LEN) {
+		return ACK_TOO_LARGE;
+	}
+	uint32_t chunks = (m->len + m->chunk_size - 1) / m->chunk_size;
+	if (chunks > PATCH_XFER_MAX_CHUNKS) {
+		return ACK_TOO_LARGE;
+	}
+	if (xfer_matches(m)) {
+		DEBUG_LOG("resume transfer %u\n", m->id);
+		return ACK_OK;
+	}
+	uint32_t data = (m->len + PATCH_STAGE_PAGE - 1) & ~(PATCH_STAGE_PAGE - 1);
+	xfer_record head;
+	memset(&head, 0xff, offsetof(xfer_record, marks));
+	head.magic = PATCH_XFER_MAGIC;
+	head.id = m->id;
+	head.len = m->len;
+	head.chunk_size = m->chunk_size;
+	head.chunks = chunks;
+	memcpy(head.sign, m->sign, PATCH_SIGN_LEN);
+	const uint32_t from = offsetof(xfer_record, id), to = offsetof(xfer_record, installed);
+	if (flash_port_erase(PATCH_XFER_BASE, PATCH_STAGE_PAGE + data) != 0
+		|| flash_port_program(PATCH_XFER_BASE + from, (uint8_t *) &head + from, to - from) != 0
+		|| flash_port_program(PATCH_XFER_BASE, (uint8_t *) &head, from) != 0) {
+		return ACK_NO_MEM;
+	}
+	return ACK_OK;
+}
+
+// a chunk is in xfer_buf: program it, then its mark. Stale and repeated chunks are dropped
+static void xfer_chunk(uint32_t n) {
+	const xfer_chunk_head *h = (const xfer_chunk_head *) xfer_buf;
+	const xfer_record *rec = XFER_REC;
+	if (rec->magic != PATCH_XFER_MAGIC || h->id != rec->id || h->index >= rec->chunks
+		|| rec->marks[h->index] != UINT64_MAX || rec->installed != UINT64_MAX) {
+		return;
+	}
+	uint32_t off = h->index * rec->chunk_size;
+	uint32_t want = rec->len - off < rec->chunk_size ? rec->len - off : rec->chunk_size;
+	if (n != want) {
+		DEBUG_LOG("bad chunk %u: %u bytes\n", h->index, n);
+		return;
+	}
+	n = (n + PATCH_STAGE_ALIGN - 1) & ~(PATCH_STAGE_ALIGN - 1); // within chunk_size, the tail is not read
+	if (flash_port_program(PATCH_XFER_DATA + off, xfer_buf + sizeof(*h), n) != 0) {
+		return;
+	}
+	flash_port_program((uint32_t) (uintptr_t) &rec->marks[h->index], (const uint8_t *) &xfer_mark, sizeof(xfer_mark));
+}
+
+// every chunk in: check the packet in flash and load a copy, the area is reused by the next transfer
+static uint8_t xfer_finish(uint32_t id) {
+	const xfer_record *rec = XFER_REC;
+	if (rec->magic != PATCH_XFER_MAGIC || rec->id != id) {
+		return ACK_BAD_PATCH;
+	}
+	if (rec->installed != UINT64_MAX) {
+		return ACK_OK; // END repeated after a lost answer
+	}
+	for (uint32_t i = 0; i < rec->chunks; i++) {
+		if (rec->marks[i] == UINT64_MAX) {
+			return ACK_PENDING;
+		}
+	}
+	patch_verify verify;
+	patch_verify_init(&verify, verify_algo);
+	patch_verify_update(&verify, (const uint8_t *) PATCH_XFER_DATA, rec->len);
+	if (!patch_verify_final(&verify, rec->sign)) {
+		DEBUG_LOG("transfer %u sign mismatch\n", id);
+		flash_port_erase(PATCH_XFER_BASE, PATCH_STAGE_PAGE); // not resumable, the peer starts over
+		return ACK_BAD_SIGN;
+	}
+	if (!packet_valid((const uint8_t *) PATCH_XFER_DATA, rec->len)) {
+		return ACK_BAD_PATCH;
+	}
+	flash_port_program((uint32_t) (uintptr_t) &rec->installed, (const uint8_t *) &xfer_mark, sizeof(xfer_mark));
+	DEBUG_LOG("transfer %u complete: %u bytes in %u chunks\n", id, rec->len, rec->chunks);
+	packet_install((const uint8_t *) PATCH_XFER_DATA, rec->len); // copied or journaled from the transfer area
+	return ACK_OK;
+}
+
+static void xfer_state_fill(xfer_state *st, uint32_t id, uint8_t status) {
+	const xfer_record *rec = XFER_REC;
+	memset(st, 0, sizeof(*st));
+	st->id = id;
+	st->status = status;
+	if (rec->magic != PATCH_XFER_MAGIC || rec->id != id) {
+		return;
+	}
+	st->chunks = rec->chunks;
+	for (uint32_t i = 0; i < rec->chunks; i++) {
+		if (rec->marks[i] != UINT64_MAX) {
+			st->bitmap[i / 8] |= 1 << (i % 8);
+		}
+	}
+}
+
+// the digest is complete when the last byte is received, unless pipelining is off
+static bool frame_rx_verified(frame_rx *rx) {
+	if (!verify_pipelined) {
+		patch_verify_update(&rx->verify, rx->body + PATCH_SIGN_LEN, rx->hdr.len - PATCH_SIGN_LEN);
+	}
+	return patch_verify_final(&rx->verify, rx->body);
+}
+
+// the packet is complete in flash, read it there (memory mapped) if not pipelined
+static bool frame_rx_lz_done(frame_rx *rx) {
+	if (patch_lz_finish(&rx->lz) != 0 || rx->lz.out_len != rx->lz_head.raw_len) {
+		rx->status = ACK_BAD_PATCH;
+		return false;
+	}
+	if (!verify_pipelined) {
+		patch_verify_update(&rx->verify, (const uint8_t *) rx->stage, rx->lz_head.raw_len);
+	}
+	if (!patch_verify_final(&rx->verify, rx->lz_head.sign)) {
+		rx->status = ACK_BAD_SIGN;
+		return false;
+	}
+	if (!packet_valid((const uint8_t *) rx->stage, rx->lz_head.raw_len)) {
+		rx->status = ACK_BAD_PATCH;
+		return false;
+	}
+	return true;
+}
+
+/*
+One receive into the current destination, as much as the transport has, no
+more than the frame needs. Partial reads only advance pos.
+return: 1 frame complete, 0 more to receive, -1 connection lost or bad frame
+*/
+static int frame_rx_poll(frame_rx *rx, service_context *ctx) {
+	uint8_t *dst;
+	uint32_t want;
+	if (rx->state == RX_HEADER) {
+		dst = (uint8_t *) &rx->hdr + rx->pos;
+		want = sizeof(frame_header) - rx->pos;
+	} else if (rx->state == RX_BODY) {
+		dst = rx->body + rx->pos;
+		want = rx->hdr.len - rx->pos;
+	} else if (rx->state == RX_LZ) {
+		dst = lz_chunk;
+		want = rx->hdr.len - rx->pos;
+		want = want < sizeof(lz_chunk) ? want : sizeof(lz_chunk);
+	} else if (rx->state == RX_XFER) {
+		dst = xfer_buf + rx->pos;
+		want = rx->hdr.len - rx->pos;
+	} else {
+		dst = drain_buf;
+		want = rx->hdr.len - rx->pos;
+		want = want < sizeof(drain_buf) ? want : sizeof(drain_buf);
+	}
+	size_t sz = svr.receive_buf(ctx, dst, want);
+	if (sz == 0 || sz > want) { // closed or error
+		return -1;
+	}
+	uint32_t from = rx->pos;
+	rx->pos += sz;
+	if (rx->state == RX_HEADER) {
+		return rx->pos == sizeof(frame_header) ? frame_rx_start(rx) : 0;
+	}
+	if (rx->state == RX_BODY) {
+		frame_rx_body(rx, from, rx->pos);
+	} else if (rx->state == RX_LZ) {
+		frame_rx_lz(rx, from, sz);
+	}
+	return rx->pos == rx->hdr.len;
+}
+
+static int send_frame(service_context *ctx, uint8_t cmd, uint16_t seq, const void *payload, uint32_t len) {
+	uint8_t out[sizeof(frame_header) + sizeof(xfer_state)];
+	frame_header *hdr = (frame_header *) out;
+	if (len > sizeof(out) - sizeof(frame_header)) {
+		return -1;
+	}
+	hdr->magic = PATCH_FRAME_MAGIC;
+	hdr->cmd = cmd;
+	hdr->seq = seq;
+	hdr->len = len;
+	memcpy(out + sizeof(frame_header), payload, len);
+	size_t total = sizeof(frame_header) + len;
+	return svr.send_buf(ctx, out, total) == total ? 0 : -1;
+}
+
+int patch_service_step(service_context *ctx, frame_rx *rx) {
+	int ret = frame_rx_poll(rx, ctx);
+	if (ret < 0) {
+		DEBUG_LOG("Update client exist: state %d pos %u\n", rx->state, rx->pos);
+		svr.dis_connect(ctx);
+		return -1;
+	}
+	if (ret > 0) {
+		dispatch_frame(ctx, rx);
+		frame_rx_reset(rx);
+	}
+	return ctx->status == RUNNING ? 0 : -1;
+}
+
+void patch_service_release(frame_rx *rx) {
+	if (rx->body != NULL) {
+		ebpf_free(rx->body);
+		rx->body = NULL;
+	}
+	patch_stage_reset(); // a packet cut while staged
+}
+
+static void wait_for_patch() {
+	frame_rx rx;
+	frame_rx_reset(&rx);
+	while (svr_ctx.status == RUNNING && patch_service_step(&svr_ctx, &rx) == 0) {
+	}
+	patch_service_release(&rx);
 }
 
 // linux
@@ -47,36 +447,75 @@ static void debug_dump_patch(uint8_t *buf, int len) {
 
 }
 
-void dispatch_patch_command(int cmd) {
-	if (cmd == EXIT) {
+static void dispatch_frame(service_context *ctx, frame_rx *rx) {
+	uint8_t cmd = rx->hdr.cmd;
+	if (cmd == FRAME_EXIT) {
 		DEBUG_LOG("Update client exist!");
-		svr.dis_connect(&svr_ctx);
+		svr.dis_connect(ctx);
 		return;
-	} else if (cmd == LOAD) {
-		size_t sz = svr.receive_buf(&svr_ctx, buf, 2);
-		int len = byte2int(buf, 2);
-		DEBUG_LOG("recv patch: %u pkt:%d\n", sz, len);
-		patch_payload paylod;
-		int pkt_len = len - 16;
-		paylod.pkt = ebpf_malloc(pkt_len);
-		svr.receive_buf(&svr_ctx, paylod.sign, 16);
-		svr.receive_buf(&svr_ctx, paylod.pkt, pkt_len);
-		patch_desc *patch = (patch_desc*) paylod.pkt;
-		DEBUG_LOG("packet size: %d patch type:%d code_len:%d addr:0x%08x\n", pkt_len, patch->type, patch->code_len, patch->inst_addr);
-
-		notify_new_patch(patch);
-	} else if (cmd == HEARTBEAT) {
-		svr_ctx.status = RUNNING;
-		uint8_t buf[3] = {0};
-		buf[0] = HEARTBEAT;
-		int sz = svr.send_buf(&svr_ctx, buf, 1);
-		DEBUG_LOG("heartbeat packet: %u\n", sz);
-		if (sz != 1) {
-			svr.dis_connect(&svr_ctx);
+	} else if (cmd == FRAME_LOAD) {
+		if (rx->status == ACK_OK && !frame_rx_verified(rx)) {
+			DEBUG_LOG("patch sign mismatch: frame %u\n", rx->hdr.seq);
+			frame_rx_refuse(rx, ACK_BAD_SIGN);
+		}
+		if (rx->status == ACK_OK && !packet_valid(rx->body + PATCH_SIGN_LEN, rx->hdr.len - PATCH_SIGN_LEN)) {
+			frame_rx_refuse(rx, ACK_BAD_PATCH);
+		}
+		if (rx->status == ACK_OK) {
+			patch_desc *patch = (patch_desc*) (rx->body + PATCH_SIGN_LEN);
+			DEBUG_LOG("packet size: %u patch type:%d code_len:%d\n", rx->hdr.len - PATCH_SIGN_LEN, patch->type, patch->code_len);
+			packet_install((const uint8_t *) patch, rx->hdr.len - PATCH_SIGN_LEN);
+			ebpf_free(rx->body);
+			rx->body = NULL;
+		}
+		if (send_frame(ctx, FRAME_ACK, rx->hdr.seq, &rx->status, 1) != 0) {
+			svr.dis_connect(ctx);
+		}
+	} else if (cmd == FRAME_LOAD_LZ) {
+		if (rx->status == ACK_OK && frame_rx_lz_done(rx)) {
+			DEBUG_LOG("staged patch: 0x%08x %u bytes from %u\n", rx->stage, rx->lz_head.raw_len, rx->hdr.len);
+			packet_install((const uint8_t *) rx->stage, rx->lz_head.raw_len);
+		}
+		patch_stage_reset(); // copied, journaled or refused, nothing runs from the staged bytes
+		if (send_frame(ctx, FRAME_ACK, rx->hdr.seq, &rx->status, 1) != 0) {
+			svr.dis_connect(ctx);
+		}
+	} else if (cmd == FRAME_XFER_CHUNK) {
+		if (rx->status == ACK_OK && rx->hdr.len > sizeof(xfer_chunk_head)) {
+			xfer_chunk(rx->hdr.len - sizeof(xfer_chunk_head));
+		}
+	} else if (cmd == FRAME_XFER_BEGIN || cmd == FRAME_XFER_END) {
+		uint32_t id = 0;
+		uint8_t status = rx->status;
+		if (status == ACK_OK && rx->hdr.len != (cmd == FRAME_XFER_BEGIN ? sizeof(xfer_begin) : sizeof(id))) {
+			status = ACK_BAD_PATCH;
+		}
+		if (status == ACK_OK) {
+			memcpy(&id, xfer_buf, sizeof(id));
+			status = cmd == FRAME_XFER_BEGIN ? xfer_open((const xfer_begin *) xfer_buf) : xfer_finish(id);
+		}
+		xfer_state st;
+		xfer_state_fill(&st, id, status);
+		if (send_frame(ctx, FRAME_XFER_STATE, rx->hdr.seq, &st, sizeof(st)) != 0) {
+			svr.dis_connect(ctx);
+		}
+	} else if (cmd == FRAME_HEARTBEAT) {
+		ctx->status = RUNNING;
+		save_patch_list_to_flash(); // heartbeats come when no patch is being sent
+		uint32_t max_frame = PATCH_FRAME_MAX;
+		int ret = send_frame(ctx, FRAME_HEARTBEAT, rx->hdr.seq, &max_frame, sizeof(max_frame));
+		DEBUG_LOG("heartbeat packet: %d\n", ret);
+		if (ret != 0) {
+			svr.dis_connect(ctx);
 		}
 	}
 }
 
+void patch_service_set_verify(uint8_t algo, bool pipelined) {
+	verify_algo = algo;
+	verify_pipelined = pipelined;
+}
+
 /*
  socket patch service impl
 */
@@ -0,0 +1,140 @@
+#include "patch_verify.h"
+#include <string.h>
+
+#if defined(LINUX_TEST)
+// same results as crc32_ieee_update and tinycrypt, for the host tools
+static uint32_t crc32_ieee_update(uint32_t crc, const uint8_t *data, size_t len) {
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (int b = 0; b < 8; b++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(patch_sha256_ctx *s, const uint8_t *p) {
+	uint32_t w[64], t[8];
+	for (int i = 0; i < 16; i++) {
+		w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+	}
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	memcpy(t, s->state, sizeof(t));
+	for (int i = 0; i < 64; i++) {
+		uint32_t e = t[4], a = t[0];
+		uint32_t t1 = t[7] + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & t[5]) ^ (~e & t[6])) + sha256_k[i] + w[i];
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & t[1]) ^ (a & t[2]) ^ (t[1] & t[2]));
+		memmove(&t[1], &t[0], 7 * sizeof(uint32_t));
+		t[4] += t1;
+		t[0] = t1 + t2;
+	}
+	for (int i = 0; i < 8; i++) {
+		s->state[i] += t[i];
+	}
+}
+
+static void tc_sha256_init(patch_sha256_ctx *s) {
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(s->state, iv, sizeof(iv));
+	s->bits = 0;
+	s->used = 0;
+}
+
+static void tc_sha256_update(patch_sha256_ctx *s, const uint8_t *data, size_t len) {
+	s->bits += (uint64_t) len * 8;
+	while (len > 0) {
+		if (s->used == 0 && len >= sizeof(s->block)) { // whole blocks straight from the input
+			sha256_block(s, data);
+			data += sizeof(s->block);
+			len -= sizeof(s->block);
+			continue;
+		}
+		size_t n = sizeof(s->block) - s->used < len ? sizeof(s->block) - s->used : len;
+		memcpy(s->block + s->used, data, n);
+		s->used += n;
+		data += n;
+		len -= n;
+		if (s->used == sizeof(s->block)) {
+			sha256_block(s, s->block);
+			s->used = 0;
+		}
+	}
+}
+
+static void tc_sha256_final(uint8_t *digest, patch_sha256_ctx *s) {
+	uint64_t bits = s->bits;
+	uint8_t pad[72] = {0x80};
+	size_t n = (s->used < 56 ? 56 : 120) - s->used;
+	for (int i = 0; i < 8; i++) {
+		pad[n + i] = bits >> (56 - 8 * i);
+	}
+	tc_sha256_update(s, pad, n + 8);
+	for (int i = 0; i < 32; i++) {
+		digest[i] = s->state[i / 4] >> (24 - 8 * (i % 4));
+	}
+}
+#else
+#include <zephyr/sys/crc.h>
+#endif
+
+void patch_verify_init(patch_verify *v, uint8_t algo) {
+	v->algo = algo;
+	v->crc = 0;
+	if (algo == PATCH_VERIFY_SHA256) {
+		tc_sha256_init(&v->sha);
+	}
+}
+
+void patch_verify_update(patch_verify *v, const uint8_t *data, size_t len) {
+	if (v->algo == PATCH_VERIFY_CRC32) {
+		v->crc = crc32_ieee_update(v->crc, data, len);
+	} else {
+		tc_sha256_update(&v->sha, data, len);
+	}
+}
+
+static void patch_verify_digest(patch_verify *v, uint8_t out[PATCH_DIGEST_LEN]) {
+	memset(out, 0, PATCH_DIGEST_LEN);
+	if (v->algo == PATCH_VERIFY_CRC32) {
+		for (int i = 0; i < 4; i++) {
+			out[i] = v->crc >> (8 * i);
+		}
+	} else {
+		uint8_t digest[32];
+		tc_sha256_final(digest, &v->sha);
+		memcpy(out, digest, PATCH_DIGEST_LEN);
+	}
+}
+
+bool patch_verify_final(patch_verify *v, const uint8_t sign[PATCH_DIGEST_LEN]) {
+	uint8_t digest[PATCH_DIGEST_LEN];
+	patch_verify_digest(v, digest);
+	return memcmp(digest, sign, PATCH_DIGEST_LEN) == 0;
+}
+
+void patch_verify_sign(uint8_t algo, const uint8_t *data, size_t len, uint8_t sign[PATCH_DIGEST_LEN]) {
+	patch_verify v;
+	patch_verify_init(&v, algo);
+	patch_verify_update(&v, data, len);
+	patch_verify_digest(&v, sign);
+}
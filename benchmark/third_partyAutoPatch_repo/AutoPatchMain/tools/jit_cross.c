@@ -0,0 +1,1329 @@
+/*
+Cross JIT: compiles the eBPF bytecode of a patch on the host into a position
+independent Thumb-2 blob (jit_blob, see jit_cache.h). The device runs the blob
+where it is stored with jit_blob_load, no compile time and no JIT arena.
+
+build:
+	gcc -DLINUX_TEST -I../include -I../src jit_cross.c -o jit_cross
+
+usage: jit_cross [-s] [-c ctx.bin] [-o out.blob] patch.bin
+       jit_cross -t
+	-s  bounds checking, the accesses the verifier does not prove are checked
+	-c  ctx for the check, EBPF_CTX_SIZE bytes of a pattern by default
+	-o  output, patch.bin with .blob appended by default
+	-t  check the encodings of the code generator and run the corpus in the
+	    simulator, exit status 1 on any mismatch
+
+The code generator is jit_thumb2.c with state.pic set: the helpers are called
+through the table the caller passes in r2, the branches are pc relative.
+
+Every blob runs in a Thumb-2 simulator (below) and its return value and ctx are
+compared with the interpreter's; on a mismatch the blob is removed and the exit
+status is 1. The interpreter checks the accesses of a file given on the command
+line: a program that follows a pointer of its ctx stops there, and the
+simulator faults on it. Such programs are checked by -t, with the ctx and the
+buffers of their corpus entry.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "ebpf_vm.c"
+#include "utils.c"
+#include "hashmap.c"
+#include "ebpf_allocator.c"
+#include "ebpf_map.c"
+#include "jit_thumb2.c"
+#include "jit_cache.c"
+
+
+// no flash and no JIT arena on the host, jit_cache.c is here for its hashes
+int flash_port_write(uint32_t faddr, uint8_t *buf, int size) {
+	return -1;
+}
+
+void jit_mem_free(jit_mem *mem) {
+}
+
+static uint8_t *read_file(const char *path, int *len) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *buf = malloc(*len > 0 ? *len : 1);
+	if (buf != NULL && fread(buf, 1, *len, f) != (size_t) *len) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	return buf;
+}
+
+// the blob is not limited to the arena, room for the worst case of every instruction
+static int cross_compile(ebpf_vm *vm, jit_state *state) {
+	int checks = vm->bounds_check_enabled ? vm->mem_accesses - vm->mem_proven + 1 : 0;
+	int insts_num = vm->num_insts + checks * JIT_SFI_CHECK_INSTS;
+	memset(state, 0, sizeof(jit_state));
+	state->insts = vm->insts;
+	state->inst_num = vm->num_insts;
+	state->size = 32 * insts_num + 256;
+	state->jit_code = calloc(1, state->size);
+	state->offsets = calloc(vm->num_insts + 1, sizeof(uint32_t));
+	state->inst_flags = calloc(vm->num_insts + 1, 1);
+	state->fixups = calloc(insts_num, sizeof(jit_fixup));
+	state->max_fixups = insts_num;
+	state->__bpf_call_base = vm->helper_func->ext_funcs;
+	state->helper_descs = vm->helper_func->ext_descs;
+	state->use_sfi = vm->bounds_check_enabled;
+	state->mem_safe = vm->mem_safe;
+	state->ctx_size = vm->ctx_size;
+	state->pic = true;
+	if (state->jit_code == NULL || state->offsets == NULL || state->inst_flags == NULL || state->fixups == NULL) {
+		return -1;
+	}
+	jit_compile(state);
+	if (state->err_line != 0 || state->idx > state->size || state->idx > 0xffff) {
+		fprintf(stderr, "jit_cross: compile failed (line %d, %d bytes)\n", state->err_line, state->idx);
+		return -1;
+	}
+	return 0;
+}
+
+static int write_blob(const char *path, ebpf_vm *vm, const jit_state *state) {
+	jit_blob b;
+	b.magic = JIT_BLOB_MAGIC;
+	b.version = JIT_VERSION;
+	b.code_size = state->idx;
+	b.bc_hash = jit_cache_hash(vm->insts, vm->num_insts * sizeof(struct ebpf_inst));
+	b.env_hash = jit_blob_env_hash(vm);
+	b.code_hash = jit_cache_hash(state->jit_code, state->idx);
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		return -1;
+	}
+	int ok = fwrite(&b, sizeof(b), 1, f) == 1 && fwrite(state->jit_code, 1, state->idx, f) == (size_t) state->idx;
+	fclose(f);
+	return ok ? 0 : -1;
+}
+
+static u32 code_word(const jit_state *state, int off) {
+	const u16 *h = (const u16 *) (state->jit_code + off);
+	return ((u32) h[0] << 16) | h[1];
+}
+
+// shift amount and type of a register operand shifted by an immediate (imm3:imm2, type)
+static int shift_imm(u32 inst, int *type) {
+	*type = (inst >> 4) & 0x3;
+	return ((inst >> 10) & 0x1c) | ((inst >> 6) & 0x3);
+}
+
+// lsh64 of r1:r0 by 1-31: lsls.w r9, r1, #n; orrs.w r1, r9, r0, lsr #32-n; lsl.w r0, r0, #n
+static int check_lsh64_imm(void) {
+	uint8_t code[64];
+	int bad = 0;
+	for (int n = 1; n < 32; n++) {
+		jit_state state;
+		memset(&state, 0, sizeof(state));
+		state.jit_code = code;
+		state.size = sizeof(code);
+		state.needGen = true;
+		_emit_lsh64_imm(&state, bpf2a32[BPF_REG_0], n);
+		u32 lsls = code_word(&state, 0), orrs = code_word(&state, 4), lsl = code_word(&state, 8);
+		int t1, t2, t3;
+		int s1 = shift_imm(lsls, &t1), s2 = shift_imm(orrs, &t2), s3 = shift_imm(lsl, &t3);
+		if (state.idx != 12 || (lsls & 0xffff8f00) != 0xea5f0900 || (lsls & 0xf) != ARM_R1 || t1 != SRTYPE_LSL
+			|| s1 != n || (orrs & 0xffff8f00) != 0xea590100 || (orrs & 0xf) != ARM_R0 || t2 != SRTYPE_LSR
+			|| s2 != 32 - n || (lsl & 0xffff8f00) != 0xea4f0000 || (lsl & 0xf) != ARM_R0 || t3 != SRTYPE_LSL
+			|| s3 != n) {
+			fprintf(stderr, "jit_cross: lsh64 #%d: %08x %08x %08x\n", n, lsls, orrs, lsl);
+			bad++;
+		}
+	}
+	return bad;
+}
+
+/*
+Thumb-2 simulator for checking the blobs: the ARMv7-M instructions jit_thumb2.c
+emits, with the flags and IT blocks. The memory is the host's below 4 GB (an
+arena mapped with MAP_32BIT), so the interpreter and the blob see the same ctx
+and the same pointers in it. An access outside the arena, an encoding it does
+not know or a misaligned LDRD/STRD/LDM/STM stops the run.
+
+A helper table entry is a trap address: the simulator calls the host helper
+with the arguments where the ABI of its descriptor puts them, and leaves
+garbage in the other caller saved registers. The blob returns to the trap
+after the helpers, the callee saved registers and sp must be back then.
+*/
+#define SIM_ARENA_SIZE 0x30000
+#define SIM_CODE 0x00000
+#define SIM_CODE_SIZE 0x10000
+#define SIM_TRAP 0x10000 // MAX_EXT_FUNCS helpers, then the return address
+#define SIM_HELPERS 0x11000
+#define SIM_CTX 0x12000
+#define SIM_CTX_SIZE 0x1000
+#define SIM_DATA 0x13000 // buffers the ctx points to
+#define SIM_DATA_SIZE 0x1000
+#define SIM_STACK 0x20000
+#define SIM_STACK_SIZE 0x10000
+#define SIM_MAX_STEPS 4000000
+
+typedef struct sim {
+	u32 r[16];
+	bool n, z, c, v;
+	u8 it; // ITSTATE, 0 outside an IT block
+	u32 base; // of the arena
+	u32 pc; // of the instruction running
+	u32 steps;
+	const ebpf_vm *vm;
+	char err[96];
+} sim;
+
+static uint8_t *sim_arena;
+
+static u32 sim_addr(u32 off) {
+	return (u32) (uintptr_t) sim_arena + off;
+}
+
+static bool sim_fault(sim *s, const char *what, u32 val) {
+	if (s->err[0] == '\0') {
+		snprintf(s->err, sizeof(s->err), "%s 0x%08x at pc 0x%04x", what, val, s->pc - s->base);
+	}
+	return false;
+}
+
+// data accesses: the helper table, ctx, data and stack
+static bool sim_mem(const sim *s, u32 addr, int size) {
+	u32 off = addr - s->base;
+	if (off >= SIM_HELPERS && off + size <= SIM_DATA + SIM_DATA_SIZE) {
+		return true;
+	}
+	return off >= SIM_STACK && off + size <= SIM_STACK + SIM_STACK_SIZE;
+}
+
+static bool sim_load(sim *s, u32 addr, int size, u32 *val) {
+	if (!sim_mem(s, addr, size)) {
+		return sim_fault(s, "load from", addr);
+	}
+	u8 *p = (u8 *) (uintptr_t) addr;
+	*val = size == 1 ? p[0] : size == 2 ? p[0] | p[1] << 8 : p[0] | p[1] << 8 | p[2] << 16 | (u32) p[3] << 24;
+	return true;
+}
+
+static bool sim_store(sim *s, u32 addr, int size, u32 val) {
+	if (!sim_mem(s, addr, size)) {
+		return sim_fault(s, "store to", addr);
+	}
+	u8 *p = (u8 *) (uintptr_t) addr;
+	for (int i = 0; i < size; i++) {
+		p[i] = val >> (8 * i);
+	}
+	return true;
+}
+
+static bool sim_cond(const sim *s, int cond) {
+	bool ok;
+	switch (cond >> 1) {
+	case 0: ok = s->z; break;
+	case 1: ok = s->c; break;
+	case 2: ok = s->n; break;
+	case 3: ok = s->v; break;
+	case 4: ok = s->c && !s->z; break;
+	case 5: ok = s->n == s->v; break;
+	case 6: ok = s->n == s->v && !s->z; break;
+	default: return true;
+	}
+	return (cond & 1) ? !ok : ok;
+}
+
+static u32 sim_add(sim *s, u32 x, u32 y, bool carry, bool setflags) {
+	u64 u = (u64) x + y + carry;
+	s64 sg = (s64) (s32) x + (s32) y + carry;
+	u32 res = (u32) u;
+	if (setflags) {
+		s->n = res >> 31;
+		s->z = res == 0;
+		s->c = (u >> 32) != 0;
+		s->v = (s64) (s32) res != sg;
+	}
+	return res;
+}
+
+static void sim_nz(sim *s, u32 res) {
+	s->n = res >> 31;
+	s->z = res == 0;
+}
+
+// Shift_C with the amount decoded, rrx for ROR #0 of an immediate shift
+static u32 sim_shift(const sim *s, u32 val, int type, u32 amount, bool rrx, bool *carry) {
+	*carry = s->c;
+	if (rrx) {
+		*carry = val & 1;
+		return (val >> 1) | ((u32) s->c << 31);
+	}
+	if (amount == 0) {
+		return val;
+	}
+	switch (type) {
+	case SRTYPE_LSL:
+		*carry = amount <= 32 ? (val >> (32 - amount)) & 1 : 0;
+		return amount < 32 ? val << amount : 0;
+	case SRTYPE_LSR:
+		*carry = amount <= 32 ? (val >> (amount - 1)) & 1 : 0;
+		return amount < 32 ? val >> amount : 0;
+	case SRTYPE_ASR:
+		if (amount >= 32) {
+			*carry = val >> 31;
+			return (u32) ((s32) val >> 31);
+		}
+		*carry = (val >> (amount - 1)) & 1;
+		return (u32) ((s32) val >> amount);
+	default:
+		amount &= 31;
+		val = amount ? (val >> amount) | (val << (32 - amount)) : val;
+		*carry = val >> 31;
+		return val;
+	}
+}
+
+// DecodeImmShift: LSR/ASR #0 shift by 32, ROR #0 is RRX
+static u32 sim_imm_shift(const sim *s, u32 val, int type, int imm5, bool *carry) {
+	if (type == SRTYPE_ROR && imm5 == 0) {
+		return sim_shift(s, val, type, 0, true, carry);
+	}
+	if ((type == SRTYPE_LSR || type == SRTYPE_ASR) && imm5 == 0) {
+		imm5 = 32;
+	}
+	return sim_shift(s, val, type, imm5, false, carry);
+}
+
+// ThumbExpandImm_C
+static u32 sim_expand_imm(const sim *s, u32 imm12, bool *carry) {
+	u32 imm8 = imm12 & 0xff;
+	*carry = s->c;
+	if ((imm12 >> 10) == 0) {
+		switch ((imm12 >> 8) & 3) {
+		case 0: return imm8;
+		case 1: return imm8 | imm8 << 16;
+		case 2: return imm8 << 8 | imm8 << 24;
+		default: return imm8 | imm8 << 8 | imm8 << 16 | imm8 << 24;
+		}
+	}
+	u32 val = 0x80 | (imm12 & 0x7f);
+	int rot = imm12 >> 7;
+	val = (val >> rot) | (val << (32 - rot));
+	*carry = val >> 31;
+	return val;
+}
+
+static bool sim_bx(sim *s, u32 target) {
+	if (!(target & 1)) {
+		return sim_fault(s, "bx to ARM state", target);
+	}
+	s->r[15] = target & ~1u;
+	return true;
+}
+
+// the shifted register and modified immediate forms of AND ORR EOR ADD SUB ...
+static bool sim_dp(sim *s, int op, bool setflags, int rd, int rn, u32 op2, bool carry) {
+	u32 a = s->r[rn], res;
+	bool write = true;
+	switch (op) {
+	case 0: // AND, TST
+		res = a & op2;
+		write = !(rd == 15 && setflags);
+		break;
+	case 1: // BIC
+		res = a & ~op2;
+		break;
+	case 2: // ORR, MOV
+		res = rn == 15 ? op2 : a | op2;
+		break;
+	case 3: // ORN, MVN
+		res = rn == 15 ? ~op2 : a | ~op2;
+		break;
+	case 4: // EOR, TEQ
+		res = a ^ op2;
+		write = !(rd == 15 && setflags);
+		break;
+	case 8: // ADD, CMN
+		res = sim_add(s, a, op2, false, setflags);
+		write = !(rd == 15 && setflags);
+		break;
+	case 10: // ADC
+		res = sim_add(s, a, op2, s->c, setflags);
+		break;
+	case 11: // SBC
+		res = sim_add(s, a, ~op2, s->c, setflags);
+		break;
+	case 13: // SUB, CMP
+		res = sim_add(s, a, ~op2, true, setflags);
+		write = !(rd == 15 && setflags);
+		break;
+	case 14: // RSB
+		res = sim_add(s, ~a, op2, true, setflags);
+		break;
+	default:
+		return sim_fault(s, "data processing op", op);
+	}
+	if (setflags && op < 8) {
+		sim_nz(s, res);
+		s->c = carry;
+	}
+	if (write) {
+		if (rd == 15) {
+			return sim_fault(s, "data processing to pc", op);
+		}
+		s->r[rd] = res;
+	}
+	return true;
+}
+
+static bool sim_ldst(sim *s, bool load, int size, bool sign, int rt, u32 addr) {
+	if (!load) {
+		return sim_store(s, addr, size, s->r[rt]);
+	}
+	u32 val;
+	if (!sim_load(s, addr, size, &val)) {
+		return false;
+	}
+	if (sign) {
+		val = size == 1 ? (u32) (s32) (s8) val : (u32) (s32) (s16) val;
+	}
+	if (rt == 15) {
+		return sim_bx(s, val);
+	}
+	s->r[rt] = val;
+	return true;
+}
+
+static bool sim_ldm(sim *s, bool load, bool db, bool wback, int rn, u32 list) {
+	int cnt = __builtin_popcount(list);
+	u32 addr = db ? s->r[rn] - 4 * cnt : s->r[rn];
+	if (addr & 3) {
+		return sim_fault(s, "misaligned ldm/stm", addr);
+	}
+	u32 start = s->r[rn], pc = 0;
+	for (int i = 0; i < 16; i++) {
+		if (!(list & (1 << i))) {
+			continue;
+		}
+		if (!load) {
+			if (!sim_store(s, addr, 4, s->r[i])) {
+				return false;
+			}
+		} else if (!sim_load(s, addr, 4, i == 15 ? &pc : &s->r[i])) {
+			return false;
+		}
+		addr += 4;
+	}
+	if (wback) {
+		s->r[rn] = db ? start - 4 * cnt : start + 4 * cnt;
+	}
+	return load && (list & (1 << 15)) ? sim_bx(s, pc) : true;
+}
+
+static bool sim_exec16(sim *s, u16 hw, bool in_it) {
+	u32 *r = s->r, pc = s->pc;
+	bool setflags = !in_it, carry;
+	int rd = hw & 7, rn = (hw >> 3) & 7, rm = (hw >> 6) & 7;
+	if (hw < 0x1800) { // LSL LSR ASR immediate
+		r[rd] = sim_imm_shift(s, r[rn], hw >> 11, (hw >> 6) & 0x1f, &carry);
+		if (setflags) {
+			sim_nz(s, r[rd]);
+			s->c = carry;
+		}
+		return true;
+	}
+	if (hw < 0x2000) { // ADD SUB register and imm3
+		u32 op2 = (hw & 0x400) ? (u32) rm : r[rm];
+		bool sub = hw & 0x200;
+		r[rd] = sim_add(s, r[rn], sub ? ~op2 : op2, sub, setflags);
+		return true;
+	}
+	if (hw < 0x4000) { // MOV CMP ADD SUB imm8
+		int rdn = (hw >> 8) & 7;
+		u32 imm8 = hw & 0xff;
+		switch ((hw >> 11) & 3) {
+		case 0:
+			r[rdn] = imm8;
+			if (setflags) {
+				sim_nz(s, imm8);
+			}
+			break;
+		case 1:
+			sim_add(s, r[rdn], ~imm8, true, true);
+			break;
+		case 2:
+			r[rdn] = sim_add(s, r[rdn], imm8, false, setflags);
+			break;
+		default:
+			r[rdn] = sim_add(s, r[rdn], ~imm8, true, setflags);
+			break;
+		}
+		return true;
+	}
+	if ((hw & 0xfc00) == 0x4000) { // data processing
+		u32 a = r[rd], b = r[rn], res;
+		bool logical = true, write = true;
+		carry = s->c;
+		switch ((hw >> 6) & 0xf) {
+		case 0x0: res = a & b; break;
+		case 0x1: res = a ^ b; break;
+		case 0x2: res = sim_shift(s, a, SRTYPE_LSL, b & 0xff, false, &carry); break;
+		case 0x3: res = sim_shift(s, a, SRTYPE_LSR, b & 0xff, false, &carry); break;
+		case 0x4: res = sim_shift(s, a, SRTYPE_ASR, b & 0xff, false, &carry); break;
+		case 0x5: res = sim_add(s, a, b, s->c, setflags); logical = false; break;
+		case 0x6: res = sim_add(s, a, ~b, s->c, setflags); logical = false; break;
+		case 0x7: res = sim_shift(s, a, SRTYPE_ROR, b & 0xff, false, &carry); break;
+		case 0x8: res = a & b; write = false; setflags = true; break;
+		case 0x9: res = sim_add(s, ~b, 0, true, setflags); logical = false; break; // RSB #0
+		case 0xa: sim_add(s, a, ~b, true, true); return true;
+		case 0xb: sim_add(s, a, b, false, true); return true;
+		case 0xc: res = a | b; break;
+		case 0xd: res = a * b; break;
+		case 0xe: res = a & ~b; break;
+		default: res = ~b; break;
+		}
+		if (setflags && logical) {
+			sim_nz(s, res);
+			s->c = carry;
+		}
+		if (write) {
+			r[rd] = res;
+		}
+		return true;
+	}
+	if ((hw & 0xfc00) == 0x4400) { // special data processing, branch and exchange
+		int rdn = (hw & 7) | ((hw >> 4) & 8), rm4 = (hw >> 3) & 0xf;
+		u32 m = rm4 == 15 ? pc + 4 : r[rm4];
+		switch ((hw >> 8) & 3) {
+		case 0:
+			if (rdn == 15) {
+				return sim_fault(s, "add to pc", hw);
+			}
+			r[rdn] += m;
+			return true;
+		case 1:
+			sim_add(s, r[rdn], ~m, true, true);
+			return true;
+		case 2:
+			if (rdn == 15) {
+				return sim_fault(s, "mov to pc", hw);
+			}
+			r[rdn] = m;
+			return true;
+		default:
+			if (hw & 0x80) {
+				r[14] = (pc + 2) | 1;
+			}
+			return sim_bx(s, m);
+		}
+	}
+	if (hw >= 0x6000 && hw < 0x9000) { // LDR STR LDRB STRB LDRH STRH imm5
+		int kind = hw >> 11, imm5 = (hw >> 6) & 0x1f;
+		int size = kind < 0xe ? 4 : kind < 0x10 ? 1 : 2;
+		return sim_ldst(s, kind & 1, size, false, rd, r[rn] + imm5 * size);
+	}
+	if ((hw & 0xf000) == 0x9000) { // LDR STR sp relative
+		return sim_ldst(s, hw & 0x800, 4, false, (hw >> 8) & 7, r[13] + (hw & 0xff) * 4);
+	}
+	if ((hw & 0xf800) == 0xa800) { // ADD rd, sp, imm8
+		r[(hw >> 8) & 7] = r[13] + (hw & 0xff) * 4;
+		return true;
+	}
+	if ((hw & 0xff00) == 0xb000) { // ADD SUB sp, imm7
+		u32 imm = (hw & 0x7f) * 4;
+		r[13] = (hw & 0x80) ? r[13] - imm : r[13] + imm;
+		return true;
+	}
+	if ((hw & 0xf500) == 0xb100) { // CBZ CBNZ
+		if (in_it) {
+			return sim_fault(s, "cbz in an IT block", hw);
+		}
+		u32 off = ((hw >> 3) & 0x1f) << 1 | ((hw >> 9) & 1) << 6;
+		if ((r[rd] == 0) != ((hw & 0x800) != 0)) {
+			r[15] = pc + 4 + off;
+		}
+		return true;
+	}
+	if ((hw & 0xfe00) == 0xb400) { // PUSH
+		return sim_ldm(s, false, true, true, 13, (hw & 0xff) | ((hw & 0x100) << 6));
+	}
+	if ((hw & 0xfe00) == 0xbc00) { // POP
+		return sim_ldm(s, true, false, true, 13, (hw & 0xff) | ((hw & 0x100) << 7));
+	}
+	if ((hw & 0xff00) == 0xbf00) { // IT, NOP
+		if (hw & 0xf) {
+			if (in_it) {
+				return sim_fault(s, "IT in an IT block", hw);
+			}
+			s->it = hw & 0xff;
+		}
+		return true;
+	}
+	if ((hw & 0xf000) == 0xd000 && ((hw >> 8) & 0xf) < 0xe) { // B<c>
+		if (in_it) {
+			return sim_fault(s, "conditional branch in an IT block", hw);
+		}
+		if (sim_cond(s, (hw >> 8) & 0xf)) {
+			r[15] = pc + 4 + ((s32) ((u32) hw << 24) >> 23);
+		}
+		return true;
+	}
+	if ((hw & 0xf800) == 0xe000) { // B
+		r[15] = pc + 4 + ((s32) ((u32) hw << 21) >> 20);
+		return true;
+	}
+	return sim_fault(s, "16 bit instruction", hw);
+}
+
+static bool sim_exec32(sim *s, u16 hw1, u16 hw2) {
+	u32 *r = s->r, pc = s->pc, inst = (u32) hw1 << 16 | hw2;
+	int rn = hw1 & 0xf, rd = (hw2 >> 8) & 0xf, rt = hw2 >> 12, rm = hw2 & 0xf;
+	bool setflags = (hw1 >> 4) & 1, carry;
+	if ((hw1 & 0xfe40) == 0xe800) { // LDM STM
+		int op = (hw1 >> 7) & 3;
+		if (op != 1 && op != 2) {
+			return sim_fault(s, "load/store multiple", inst);
+		}
+		return sim_ldm(s, (hw1 >> 4) & 1, op == 2, (hw1 >> 5) & 1, rn, hw2);
+	}
+	if ((hw1 & 0xfe40) == 0xe840) { // LDRD STRD
+		bool p = (hw1 >> 8) & 1, u = (hw1 >> 7) & 1, w = (hw1 >> 5) & 1;
+		if (!p && !w) {
+			return sim_fault(s, "exclusive or table branch", inst);
+		}
+		u32 imm = (hw2 & 0xff) * 4;
+		u32 off_addr = u ? r[rn] + imm : r[rn] - imm;
+		u32 addr = p ? off_addr : r[rn];
+		if (addr & 3) {
+			return sim_fault(s, "misaligned ldrd/strd", addr);
+		}
+		bool load = (hw1 >> 4) & 1;
+		if (!sim_ldst(s, load, 4, false, rt, addr) || !sim_ldst(s, load, 4, false, rd, addr + 4)) {
+			return false;
+		}
+		if (w) {
+			r[rn] = off_addr;
+		}
+		return true;
+	}
+	if ((hw1 & 0xfe00) == 0xea00) { // data processing, shifted register
+		int imm5 = ((hw2 >> 10) & 0x1c) | ((hw2 >> 6) & 3);
+		u32 op2 = sim_imm_shift(s, r[rm], (hw2 >> 4) & 3, imm5, &carry);
+		return sim_dp(s, (hw1 >> 5) & 0xf, setflags, rd, rn, op2, carry);
+	}
+	if ((hw1 & 0xf800) == 0xf000 && (hw2 & 0x8000) == 0) {
+		u32 imm12 = ((hw1 >> 10) & 1) << 11 | ((hw2 >> 12) & 7) << 8 | (hw2 & 0xff);
+		if ((hw1 & 0x200) == 0) { // data processing, modified immediate
+			u32 op2 = sim_expand_imm(s, imm12, &carry);
+			return sim_dp(s, (hw1 >> 5) & 0xf, setflags, rd, rn, op2, carry);
+		}
+		switch ((hw1 >> 4) & 0x1f) { // plain binary immediate
+		case 0x00: // ADDW
+			r[rd] = r[rn] + imm12;
+			return true;
+		case 0x0a: // SUBW
+			r[rd] = r[rn] - imm12;
+			return true;
+		case 0x04: // MOVW
+			r[rd] = (hw1 & 0xf) << 12 | imm12;
+			return true;
+		case 0x0c: // MOVT
+			r[rd] = (r[rd] & 0xffff) | ((hw1 & 0xf) << 12 | imm12) << 16;
+			return true;
+		}
+		return sim_fault(s, "plain binary immediate", inst);
+	}
+	if ((hw1 & 0xf800) == 0xf000 && (hw2 & 0xd000) == 0x8000) { // B<c>.W
+		int cond = (hw1 >> 6) & 0xf;
+		if (cond >= 0xe) {
+			return sim_fault(s, "misc control", inst);
+		}
+		if ((s->it & 0xf) != 0) {
+			return sim_fault(s, "conditional branch in an IT block", inst);
+		}
+		u32 imm = ((hw1 >> 10) & 1) << 20 | ((hw2 >> 11) & 1) << 19 | ((hw2 >> 13) & 1) << 18
+			| (hw1 & 0x3f) << 12 | (hw2 & 0x7ff) << 1;
+		if (sim_cond(s, cond)) {
+			r[15] = pc + 4 + ((s32) (imm << 11) >> 11);
+		}
+		return true;
+	}
+	if ((hw1 & 0xf800) == 0xf000 && (hw2 & 0xd000) == 0x9000) { // B.W
+		u32 sgn = (hw1 >> 10) & 1;
+		u32 i1 = !(((hw2 >> 13) & 1) ^ sgn), i2 = !(((hw2 >> 11) & 1) ^ sgn);
+		u32 imm = sgn << 24 | i1 << 23 | i2 << 22 | (hw1 & 0x3ff) << 12 | (hw2 & 0x7ff) << 1;
+		r[15] = pc + 4 + ((s32) (imm << 7) >> 7);
+		return true;
+	}
+	if ((hw1 & 0xfe00) == 0xf800 && (hw1 & 0x60) != 0x60) { // load/store single
+		int size = 1 << ((hw1 >> 5) & 3);
+		bool load = (hw1 >> 4) & 1, sign = (hw1 >> 8) & 1;
+		if (rn == 15 || (!load && sign)) {
+			return sim_fault(s, "load/store", inst);
+		}
+		if (hw1 & 0x80) { // imm12
+			return sim_ldst(s, load, size, sign, rt, r[rn] + (hw2 & 0xfff));
+		}
+		if (hw2 & 0x800) { // imm8, index and writeback
+			bool p = (hw2 >> 10) & 1, u = (hw2 >> 9) & 1, w = (hw2 >> 8) & 1;
+			if ((p && u && !w) || (!p && !w)) {
+				return sim_fault(s, "load/store", inst);
+			}
+			u32 off_addr = u ? r[rn] + (hw2 & 0xff) : r[rn] - (hw2 & 0xff);
+			if (!sim_ldst(s, load, size, sign, rt, p ? off_addr : r[rn])) {
+				return false;
+			}
+			if (w) {
+				r[rn] = off_addr;
+			}
+			return true;
+		}
+		if ((hw2 & 0xfc0) == 0) { // register
+			return sim_ldst(s, load, size, sign, rt, r[rn] + (r[rm] << ((hw2 >> 4) & 3)));
+		}
+		return sim_fault(s, "load/store", inst);
+	}
+	if ((hw1 & 0xff80) == 0xfa00 && (hw2 & 0xf0f0) == 0xf000) { // LSL LSR ASR ROR register
+		r[rd] = sim_shift(s, r[rn], (hw1 >> 5) & 3, r[rm] & 0xff, false, &carry);
+		if (setflags) {
+			sim_nz(s, r[rd]);
+			s->c = carry;
+		}
+		return true;
+	}
+	if ((hw1 & 0xfff0) == 0xfb00 && (hw2 & 0xe0) == 0) { // MUL MLA MLS
+		u32 acc = rt == 15 ? 0 : r[rt];
+		r[rd] = (hw2 & 0x10) ? acc - r[rn] * r[rm] : acc + r[rn] * r[rm];
+		return true;
+	}
+	if ((hw1 & 0xff80) == 0xfb80) { // long multiply, divide
+		int op1 = (hw1 >> 4) & 7, op2 = (hw2 >> 4) & 0xf;
+		if (op1 == 2 && op2 == 0) { // UMULL
+			u64 p = (u64) r[rn] * r[rm];
+			r[rt] = (u32) p;
+			r[rd] = p >> 32;
+			return true;
+		}
+		if (op1 == 6 && op2 == 0) { // UMLAL
+			u64 p = ((u64) r[rd] << 32 | r[rt]) + (u64) r[rn] * r[rm];
+			r[rt] = (u32) p;
+			r[rd] = p >> 32;
+			return true;
+		}
+		if (op1 == 3 && op2 == 0xf) { // UDIV, x/0 is 0 with DIV_0_TRP clear
+			r[rd] = r[rm] ? r[rn] / r[rm] : 0;
+			return true;
+		}
+	}
+	return sim_fault(s, "32 bit instruction", inst);
+}
+
+// the host helper with the arguments where its ABI puts them, the result in r1:r0
+static bool sim_helper(sim *s, int idx) {
+	const ebpf_helper_desc *desc = &s->vm->helper_func->ext_descs[idx];
+	u32 *r = s->r, st[6] = {0};
+	if (s->vm->helper_func->ext_funcs[idx] == NULL) {
+		return sim_fault(s, "call of no helper", idx);
+	}
+	if (r[13] & 7) {
+		return sim_fault(s, "helper called with sp", r[13]);
+	}
+	for (int i = 0; i < 6 && sim_mem(s, r[13] + 4 * i, 4); i++) {
+		sim_load(s, r[13] + 4 * i, 4, &st[i]);
+	}
+	u64 reg[6] = {0};
+	if (ebpf_helper_is_abi32(desc)) { // a word per argument, the fifth on the stack
+		for (int i = 0; i < 4; i++) {
+			reg[i + 1] = r[i];
+		}
+		reg[5] = st[0];
+	} else { // r1:r0, r3:r2, then the stack
+		reg[1] = r[0] | ((u64) r[1] << 32);
+		reg[2] = r[2] | ((u64) r[3] << 32);
+		for (int i = 0; i < 3; i++) {
+			reg[i + 3] = st[2 * i] | ((u64) st[2 * i + 1] << 32);
+		}
+	}
+	u64 ret = call_helper(s->vm->helper_func, idx, reg);
+	for (int i = 0; i < 4; i++) {
+		r[i] = 0xdead0000 | i;
+	}
+	r[12] = 0xdead000c;
+	r[0] = (u32) ret;
+	if (!ebpf_helper_is_abi32(desc) || desc->ret64) {
+		r[1] = ret >> 32;
+	}
+	return sim_bx(s, r[14]);
+}
+
+// runs the code at SIM_CODE until it returns, r1:r0 in ret
+static bool sim_run(sim *s, u32 ctx, u32 ctx_len, u64 *ret) {
+	const ebpf_vm *vm = s->vm;
+	u32 *r = s->r, saved[16];
+	memset(s, 0, sizeof(*s));
+	s->vm = vm;
+	s->base = sim_addr(0);
+	for (int i = 0; i < 13; i++) {
+		r[i] = 0xc0de0000 | i;
+	}
+	r[0] = ctx;
+	r[1] = ctx_len;
+	r[2] = s->base + SIM_HELPERS;
+	r[13] = s->base + SIM_STACK + SIM_STACK_SIZE;
+	r[14] = (s->base + SIM_TRAP + 4 * MAX_EXT_FUNCS) | 1;
+	r[15] = s->base + SIM_CODE;
+	memcpy(saved, r, sizeof(saved));
+	while (true) {
+		u32 off = r[15] - s->base;
+		s->pc = r[15];
+		if (++s->steps > SIM_MAX_STEPS) {
+			return sim_fault(s, "no return after steps", SIM_MAX_STEPS);
+		}
+		if (off >= SIM_TRAP && off <= SIM_TRAP + 4 * MAX_EXT_FUNCS && (off & 3) == 0) {
+			if (off == SIM_TRAP + 4 * MAX_EXT_FUNCS) {
+				break;
+			}
+			if (!sim_helper(s, (off - SIM_TRAP) / 4)) {
+				return false;
+			}
+			continue;
+		}
+		if (off + 4 > SIM_CODE_SIZE) {
+			return sim_fault(s, "pc out of the code", r[15]);
+		}
+		u16 hw1 = *(u16 *) (uintptr_t) s->pc, hw2 = *(u16 *) (uintptr_t) (s->pc + 2);
+		bool wide = (hw1 >> 11) >= 0x1d;
+		bool in_it = (s->it & 0xf) != 0;
+		bool exec = !in_it || sim_cond(s, s->it >> 4);
+		u32 next = s->pc + (wide ? 4 : 2);
+		r[15] = next;
+		if (exec && !(wide ? sim_exec32(s, hw1, hw2) : sim_exec16(s, hw1, in_it))) {
+			return false;
+		}
+		if (in_it) { // ITAdvance
+			s->it = (s->it & 0x7) == 0 ? 0 : (s->it & 0xe0) | ((s->it << 1) & 0x1f);
+			if (r[15] != next && (s->it & 0xf) != 0) {
+				return sim_fault(s, "branch inside an IT block", hw1);
+			}
+		}
+	}
+	for (int i = 4; i <= 13; i++) {
+		if (i != 12 && r[i] != saved[i]) {
+			return sim_fault(s, "callee saved register changed, r", i);
+		}
+	}
+	*ret = r[0] | ((u64) r[1] << 32);
+	return true;
+}
+
+static int sim_init(void) {
+	void *p = mmap(NULL, SIM_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if (p == MAP_FAILED) {
+		return -1;
+	}
+	sim_arena = p;
+	u32 *helpers = (u32 *) (sim_arena + SIM_HELPERS);
+	for (int i = 0; i < MAX_EXT_FUNCS; i++) {
+		helpers[i] = sim_addr(SIM_TRAP + 4 * i) | 1;
+	}
+	return 0;
+}
+
+/*
+The blob against the interpreter: both start from the same ctx and data in the
+arena, the return values and the bytes of ctx and data after the run must be
+the same. vm runs in the interpreter, the blob calls the helpers of vm. quiet:
+nothing printed.
+*/
+static int sim_check(const ebpf_vm *vm, const jit_state *state, const uint8_t *ctx, int ctx_len,
+	const uint8_t *data, int data_len, bool quiet) {
+	static uint8_t after[SIM_CTX_SIZE + SIM_DATA_SIZE];
+	uint8_t *mem = sim_arena + SIM_CTX;
+	if (state->idx > SIM_CODE_SIZE || ctx_len > SIM_CTX_SIZE || data_len > SIM_DATA_SIZE) {
+		if (!quiet) {
+			fprintf(stderr, "jit_cross: check: code, ctx or data too long\n");
+		}
+		return -1;
+	}
+	memcpy(sim_arena + SIM_CODE, state->jit_code, state->idx);
+	memset(mem, 0, sizeof(after));
+	memcpy(mem, ctx, ctx_len);
+	memcpy(sim_arena + SIM_DATA, data, data_len);
+	u64 expect = ebpf_vm_exec(vm, mem, ctx_len);
+	memcpy(after, mem, sizeof(after));
+
+	memset(mem, 0, sizeof(after));
+	memcpy(mem, ctx, ctx_len);
+	memcpy(sim_arena + SIM_DATA, data, data_len);
+	sim s;
+	s.vm = vm;
+	u64 got = 0;
+	if (!sim_run(&s, sim_addr(SIM_CTX), ctx_len, &got)) {
+		if (quiet) {
+			return -1;
+		}
+		fprintf(stderr, "jit_cross: check: %s, %u steps\n", s.err, s.steps);
+		return -1;
+	}
+	bool same_mem = memcmp(after, mem, sizeof(after)) == 0;
+	if (got != expect || !same_mem) {
+		if (quiet) {
+			return -1;
+		}
+		fprintf(stderr, "jit_cross: check: jit 0x%016llx, interpreter 0x%016llx, ctx and data %s\n",
+			(unsigned long long) got, (unsigned long long) expect, same_mem ? "same" : "differ");
+		return -1;
+	}
+	if (!quiet) {
+		printf("check: 0x%016llx, %u steps, same as the interpreter\n", (unsigned long long) got, s.steps);
+	}
+	return 0;
+}
+
+/*
+Corpus of -t: the patches below, the helper call ABIs, and sweeps of the ALU,
+jump, load and store instructions over the BPF registers (those the allocator
+keeps in ARM registers and those on the stack) and over values at the word
+edges. Every program is compiled with and without bounds checking, with branch
+fixups and with the sizing pass.
+
+Not swept, the interpreter is not a reference there: DIV64/MOD64 (DIV64_REG
+divides by imm), a divisor of 0, shifts by the width or more, and the unsigned
+jumps against a negative imm (compared as u32).
+*/
+#define CHECK_HELPER64 (MAX_EXT_FUNCS - 2) // five u64 arguments
+#define CHECK_HELPER32 (MAX_EXT_FUNCS - 1) // five u32 arguments
+#define PROG_MAX 32
+#define CHECK_DIRTY 0xdeadbeefcafef00dULL
+
+typedef struct check_prog {
+	struct ebpf_inst insts[PROG_MAX];
+	int n;
+} check_prog;
+
+static int check_runs, check_fails;
+
+static u64 check_helper64(u64 a, u64 b, u64 c, u64 d, u64 e) {
+	return a * 3 + (b ^ (c << 7)) - (d >> 5) + (e | 1);
+}
+
+static u32 check_helper32(u32 a, u32 b, u32 c, u32 d, u32 e) {
+	return a + 2 * b + 3 * c + 4 * d + 5 * e;
+}
+
+static void prog_add(check_prog *p, u8 opcode, int dst, int src, s16 off, s32 imm) {
+	p->insts[p->n++] = (struct ebpf_inst) {opcode, dst, src, off, imm};
+}
+
+static void prog_lddw(check_prog *p, int dst, u64 val) {
+	prog_add(p, EBPF_OP_LDDW, dst, 0, 0, (s32) val);
+	prog_add(p, 0, 0, 0, 0, (s32) (val >> 32));
+}
+
+// a register other than a and b to hold the ctx pointer
+static int prog_spare(int a, int b) {
+	int t = 1;
+	while (t == a || t == b) {
+		t++;
+	}
+	return t;
+}
+
+static void cross_free(jit_state *state) {
+	free(state->jit_code);
+	free(state->offsets);
+	free(state->inst_flags);
+	free(state->fixups);
+}
+
+// every configuration of the code generator, the first failures are described
+static void check_code(const char *name, const void *code, int code_len, const uint8_t *ctx, int ctx_len,
+	const uint8_t *data, int data_len) {
+	for (int cfg = 0; cfg < 4; cfg++) {
+		ebpf_vm vm = {0};
+		ebpf_vm_set_inst(&vm, code, code_len);
+		vm.bounds_check_enabled = cfg & 1;
+		vm.jit_two_pass = cfg >> 1;
+		jit_state state = {0};
+		int ret = -1;
+		bool built = vm.jumps_checked && cross_compile(&vm, &state) == 0;
+		if (built) {
+			ret = sim_check(&vm, &state, ctx, ctx_len, data, data_len, true);
+		}
+		check_runs++;
+		if (ret != 0 && check_fails++ < 20) {
+			fprintf(stderr, "jit_cross: %s, %s, %s\n", name, vm.bounds_check_enabled ? "sfi" : "no sfi",
+				vm.jit_two_pass ? "two pass" : "fixups");
+			if (built) { // again, to tell why
+				sim_check(&vm, &state, ctx, ctx_len, data, data_len, false);
+			}
+		}
+		cross_free(&state);
+		ebpf_verifier_release(&vm);
+	}
+}
+
+static void check_prog_run(const char *name, const check_prog *p, const uint8_t *ctx, int ctx_len) {
+	check_code(name, p->insts, p->n * sizeof(struct ebpf_inst), ctx, ctx_len, NULL, 0);
+}
+
+// AMNESIA33 CVE-2020-17445 (code12 of main.c): ctx word 0 points to the option, word 2 is the offset in it
+static const char cve_2020_17445[] = ""
+"\x61\x12\x00\x00\x00\x00\x00\x00\x61\x13\x08\x00\x00\x00\x00\x00\x07\x03\x00\x00\x02\x00\x00\x00\x71"
+"\x21\x01\x00\x00\x00\x00\x00\x07\x02\x00\x00\x02\x00\x00\x00\x67\x01\x00\x00\x03\x00\x00\x00\x47\x01"
+"\x00\x00\x06\x00\x00\x00\x18\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x00\x00\x00\x18\x04\x00"
+"\x00\xff\xff\xff\xff\x00\x00\x00\x00\x00\x00\x00\x00\x71\x25\x01\x00\x00\x00\x00\x00\x07\x05\x00\x00"
+"\x02\x00\x00\x00\xbf\x57\x00\x00\x00\x00\x00\x00\x57\x07\x00\x00\xff\x00\x00\x00\x15\x07\x11\x00\x00"
+"\x00\x00\x00\xbf\x36\x00\x00\x00\x00\x00\x00\x0f\x76\x00\x00\x00\x00\x00\x00\xbf\x67\x00\x00\x00\x00"
+"\x00\x00\x67\x07\x00\x00\x20\x00\x00\x00\x77\x07\x00\x00\x20\x00\x00\x00\x67\x03\x00\x00\x20\x00\x00"
+"\x00\x77\x03\x00\x00\x20\x00\x00\x00\x3d\x73\x09\x00\x00\x00\x00\x00\x1f\x51\x00\x00\x00\x00\x00\x00"
+"\x57\x05\x00\x00\xff\x00\x00\x00\x0f\x52\x00\x00\x00\x00\x00\x00\xb7\x04\x00\x00\x00\x00\x00\x00\xbf"
+"\x15\x00\x00\x00\x00\x00\x00\x57\x05\x00\x00\xff\x00\x00\x00\xbf\x63\x00\x00\x00\x00\x00\x00\xb7\x00"
+"\x00\x00\x00\x00\x00\x00\x55\x05\xe6\xff\x00\x00\x00\x00\x4f\x40\x00\x00\x00\x00\x00\x00\x95\x00\x00"
+"\x00\x00\x00\x00\x00";
+
+// code_t1 of jit_thumb2.c: ctx word 1 points to a buffer with a u16 at 5, word 2 is a length
+static const char code_t1[] = ""
+"\x61\x12\x08\x00\x00\x00\x00\x00\x61\x11\x04\x00\x00\x00\x00\x00\x07\x01\x00\x00\x05\x00\x00\x00\x67"
+"\x01\x00\x00\x20\x00\x00\x00\x77\x01\x00\x00\x20\x00\x00\x00\x69\x11\x00\x00\x00\x00\x00\x00\xbf\x24"
+"\x00\x00\x00\x00\x00\x00\x0f\x14\x00\x00\x00\x00\x00\x00\x67\x04\x00\x00\x20\x00\x00\x00\x77\x04\x00"
+"\x00\x20\x00\x00\x00\x18\x00\x00\x00\xea\xff\xff\xff\x00\x00\x00\x00\x01\x00\x00\x00\x18\x03\x00\x00"
+"\xea\xff\xff\xff\x00\x00\x00\x00\x01\x00\x00\x00\x25\x04\x01\x00\xfe\xff\x00\x00\xb7\x03\x00\x00\x00"
+"\x00\x00\x00\x2d\x21\x01\x00\x00\x00\x00\x00\xbf\x30\x00\x00\x00\x00\x00\x00\x95\x00\x00\x00\x00\x00"
+"\x00\x00";
+
+static void check_patches(void) {
+	static const u8 lens[] = {0x00, 0x02, 0x06, 0xfe};
+	static const u32 offs[] = {0, 2, 4, 40};
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			u32 ctx[EBPF_CTX_SIZE / 4] = {sim_addr(SIM_DATA), 0, offs[j]};
+			uint8_t destopt[50] = {1, lens[i], -2, -2, -2, -2};
+			check_code("cve_2020_17445", cve_2020_17445, sizeof(cve_2020_17445) - 1, (uint8_t *) ctx, sizeof(ctx),
+				destopt, sizeof(destopt));
+		}
+	}
+	static const u16 vals[] = {0, 1, 0x100, 0xffff};
+	static const u32 lims[] = {0, 1, 0xfffe, 0xffffffff};
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			u32 ctx[EBPF_CTX_SIZE / 4] = {0, sim_addr(SIM_DATA), lims[j]};
+			uint8_t buf[8] = {0};
+			memcpy(buf + 5, &vals[i], sizeof(vals[i]));
+			check_code("code_t1", code_t1, sizeof(code_t1) - 1, (uint8_t *) ctx, sizeof(ctx), buf, sizeof(buf));
+		}
+	}
+}
+
+// helpers of both ABIs: arguments, results, and r6-r9 across the call
+static void check_helpers(void) {
+	static const uint8_t ctx[EBPF_CTX_SIZE];
+	for (int h = 0; h < 2; h++) {
+		int idx = h ? CHECK_HELPER32 : CHECK_HELPER64;
+		check_prog p = {.n = 0};
+		prog_add(&p, EBPF_OP_STXDW, 10, 1, -8, 0);
+		for (int i = 6; i <= 9; i++) {
+			prog_lddw(&p, i, 0x0101010101010101ULL * i ^ CHECK_DIRTY);
+		}
+		for (int i = 1; i <= 5; i++) {
+			prog_lddw(&p, i, 0x1000000010ULL * i + (i == 5 ? 0xffffffff00000000ULL : 0));
+		}
+		prog_add(&p, EBPF_OP_CALL, 0, 0, 0, idx);
+		prog_add(&p, EBPF_OP_LDXDW, 1, 10, -8, 0);
+		prog_add(&p, EBPF_OP_STXDW, 1, 6, 0, 0);
+		prog_add(&p, EBPF_OP_STXDW, 1, 7, 8, 0);
+		prog_add(&p, EBPF_OP_STXDW, 1, 8, 16, 0);
+		prog_add(&p, EBPF_OP_STXDW, 1, 9, 24, 0);
+		prog_add(&p, EBPF_OP_EXIT, 0, 0, 0, 0);
+		check_prog_run(h ? "helper abi32" : "helper abi64", &p, ctx, sizeof(ctx));
+
+		// the loop of helper_loop_cycles (main.c), every argument set
+		check_prog loop = {.n = 0};
+		prog_add(&loop, EBPF_OP_MOV64_IMM, 6, 0, 0, 1000);
+		for (int i = 1; i <= 5; i++) {
+			prog_add(&loop, EBPF_OP_MOV64_IMM, i, 0, 0, i);
+		}
+		prog_add(&loop, EBPF_OP_CALL, 0, 0, 0, idx);
+		prog_add(&loop, EBPF_OP_ADD64_IMM, 6, 0, 0, -1);
+		prog_add(&loop, EBPF_OP_JNE_IMM, 6, 0, -8, 0);
+		prog_add(&loop, EBPF_OP_EXIT, 0, 0, 0, 0);
+		check_prog_run("helper loop", &loop, ctx, sizeof(ctx));
+	}
+}
+
+static const u64 check_vals[] = {
+	0, 1, 2, 0x7f, 0x7fffffff, 0x80000000, 0xffffffff, 0x100000000ULL,
+	0x123456789abcdef0ULL, 0x8000000000000000ULL, 0xfedcba9876543210ULL, 0xffffffffffffffffULL,
+};
+static const s32 check_imms[] = {0, 1, -1, 0xff, 0x100, 0xfff, 0x1234, 0x7fffffff, INT32_MIN, -0x1235, 0x12345678};
+static const int check_shifts[] = {0, 1, 7, 16, 31, 32, 33, 48, 63};
+#define CHECK_NUM(a) ((int) (sizeof(a) / sizeof(a[0])))
+
+static bool check_shift_op(int op) {
+	return op == EBPF_ALU_LSH || op == EBPF_ALU_RSH || op == EBPF_ALU_ARSH;
+}
+
+// dst = a, src = b, dst op= src or imm; dst and src stored to ctx, dst returned
+static void check_alu_one(u8 opcode, int k, u64 a, u64 b, s32 imm) {
+	static const uint8_t ctx[EBPF_CTX_SIZE];
+	bool reg = opcode & EBPF_SRC_REG;
+	int dst = k % 10, src = (k / 10 + dst + 1) % 10;
+	int t = prog_spare(dst, src);
+	check_prog p = {.n = 0};
+	prog_add(&p, EBPF_OP_STXDW, 10, 1, -8, 0);
+	prog_lddw(&p, dst, a);
+	if (reg) {
+		prog_lddw(&p, src, b);
+	}
+	prog_add(&p, opcode, dst, src, 0, imm);
+	prog_add(&p, EBPF_OP_LDXDW, t, 10, -8, 0);
+	prog_add(&p, EBPF_OP_STXDW, t, dst, 0, 0);
+	if (reg) {
+		prog_add(&p, EBPF_OP_STXDW, t, src, 8, 0);
+	}
+	prog_add(&p, EBPF_OP_MOV64_REG, 0, dst, 0, 0);
+	prog_add(&p, EBPF_OP_EXIT, 0, 0, 0, 0);
+	char name[48];
+	snprintf(name, sizeof(name), "alu 0x%02x r%d r%d #%d", opcode, dst, src, k);
+	check_prog_run(name, &p, ctx, sizeof(ctx));
+}
+
+static void check_alu(void) {
+	static const u8 ops[] = {
+		EBPF_ALU_ADD, EBPF_ALU_SUB, EBPF_ALU_MUL, EBPF_ALU_DIV, EBPF_ALU_OR, EBPF_ALU_AND, EBPF_ALU_LSH,
+		EBPF_ALU_RSH, EBPF_ALU_NEG, 0x90, EBPF_ALU_XOR, 0xb0, EBPF_ALU_ARSH, // MOD, MOV
+	};
+	for (int cls = 0; cls < 2; cls++) {
+		bool is64 = cls == 1;
+		for (int o = 0; o < CHECK_NUM(ops); o++) {
+			int op = ops[o], width = is64 ? 64 : 32, k = 0;
+			u8 base = (is64 ? EBPF_CLS_ALU64 : EBPF_CLS_ALU) | op;
+			if (is64 && (op == EBPF_ALU_DIV || op == 0x90)) {
+				continue;
+			}
+			for (int i = 0; i < CHECK_NUM(check_vals); i++) {
+				if (op == EBPF_ALU_NEG) {
+					check_alu_one(base, k++, check_vals[i], 0, 0);
+					continue;
+				}
+				if (check_shift_op(op)) {
+					for (int j = 0; j < CHECK_NUM(check_shifts) && check_shifts[j] < width; j++) {
+						check_alu_one(base | EBPF_SRC_REG, k++, check_vals[i], check_shifts[j], 0);
+						check_alu_one(base, k++, check_vals[i], 0, check_shifts[j]);
+					}
+					continue;
+				}
+				for (int j = 0; j < CHECK_NUM(check_vals); j++) {
+					if ((op == EBPF_ALU_DIV || op == 0x90) && (u32) check_vals[j] == 0) {
+						continue;
+					}
+					check_alu_one(base | EBPF_SRC_REG, k++, check_vals[i], check_vals[j], 0);
+				}
+				for (int j = 0; j < CHECK_NUM(check_imms); j++) {
+					if ((op == EBPF_ALU_DIV || op == 0x90) && check_imms[j] == 0) {
+						continue;
+					}
+					check_alu_one(base, k++, check_vals[i], 0, check_imms[j]);
+				}
+			}
+		}
+	}
+}
+
+// dst = a, src = b, returns 1 if the jump falls through, 2 if taken
+static void check_jmp_one(u8 opcode, int k, u64 a, u64 b, s32 imm) {
+	static const uint8_t ctx[EBPF_CTX_SIZE];
+	int dst = k % 10, src = (k / 10 + dst + 1) % 10;
+	check_prog p = {.n = 0};
+	prog_lddw(&p, dst, a);
+	if (opcode & EBPF_SRC_REG) {
+		prog_lddw(&p, src, b);
+	}
+	prog_add(&p, opcode, dst, src, 2, imm);
+	prog_add(&p, EBPF_OP_MOV64_IMM, 0, 0, 0, 1);
+	prog_add(&p, EBPF_OP_EXIT, 0, 0, 0, 0);
+	prog_add(&p, EBPF_OP_MOV64_IMM, 0, 0, 0, 2);
+	prog_add(&p, EBPF_OP_EXIT, 0, 0, 0, 0);
+	char name[48];
+	snprintf(name, sizeof(name), "jmp 0x%02x r%d r%d #%d", opcode, dst, src, k);
+	check_prog_run(name, &p, ctx, sizeof(ctx));
+}
+
+static void check_jmp(void) {
+	static const u8 ops[] = {
+		EBPF_JEQ, EBPF_JGT, EBPF_JGE, EBPF_JSET, EBPF_JNE, EBPF_JSGT, EBPF_JSGE, EBPF_JLT, EBPF_JLE, EBPF_JSLT, EBPF_JSLE,
+	};
+	for (int o = 0; o < CHECK_NUM(ops); o++) {
+		bool is_unsigned = ops[o] == EBPF_JGT || ops[o] == EBPF_JGE || ops[o] == EBPF_JLT || ops[o] == EBPF_JLE;
+		int k = 0;
+		for (int i = 0; i < CHECK_NUM(check_vals); i++) {
+			for (int j = 0; j < CHECK_NUM(check_vals); j++) {
+				check_jmp_one(EBPF_CLS_JMP | EBPF_SRC_REG | ops[o], k++, check_vals[i], check_vals[j], 0);
+			}
+			for (int j = 0; j < CHECK_NUM(check_imms); j++) {
+				if (!is_unsigned || check_imms[j] >= 0) {
+					check_jmp_one(EBPF_CLS_JMP | ops[o], k++, check_vals[i], 0, check_imms[j]);
+				}
+			}
+		}
+	}
+}
+
+// loads into a dirty dst and stores of a dirty src, through ctx with small and large offsets and through r10
+static void check_ldst(void) {
+	static const u8 sizes[] = {EBPF_SIZE_B, EBPF_SIZE_H, EBPF_SIZE_W, EBPF_SIZE_DW};
+	// offset, then where it lands in ctx: imm5/imm12 up, imm8 down, and out of both
+	static const s16 offs[][2] = {{0, 0}, {3, 3}, {6, 6}, {8, 8}, {300, 5}, {4101, 5}, {-5, 4}, {-300, 8}};
+	uint8_t ctx[EBPF_CTX_SIZE];
+	for (int i = 0; i < EBPF_CTX_SIZE; i++) {
+		ctx[i] = 0x81 + i * 13;
+	}
+	for (int z = 0; z < CHECK_NUM(sizes); z++) {
+		for (int o = 0; o < CHECK_NUM(offs); o++) {
+			s16 off = offs[o][0];
+			s32 adjust = offs[o][1] - off;
+			for (int dst = 0; dst < 10; dst++) {
+				for (int src = 0; src < 10; src++) {
+					int t = prog_spare(dst, src);
+					char name[48];
+					// dst = *(src + off)
+					check_prog p = {.n = 0};
+					prog_add(&p, EBPF_OP_STXDW, 10, 1, -8, 0);
+					prog_lddw(&p, dst, CHECK_DIRTY);
+					prog_add(&p, EBPF_OP_LDXDW, src, 10, -8, 0);
+					prog_add(&p, EBPF_OP_ADD64_IMM, src, 0, 0, adjust);
+					prog_add(&p, EBPF_CLS_LDX | EBPF_MODE_MEM | sizes[z], dst, src, off, 0);
+					prog_add(&p, EBPF_OP_LDXDW, t, 10, -8, 0);
+					prog_add(&p, EBPF_OP_STXDW, t, dst, 16, 0);
+					prog_add(&p, EBPF_OP_MOV64_REG, 0, dst, 0, 0);
+					prog_add(&p, EBPF_OP_EXIT, 0, 0, 0, 0);
+					snprintf(name, sizeof(name), "ldx 0x%02x r%d [r%d%+d]", sizes[z], dst, src, off);
+					check_prog_run(name, &p, ctx, sizeof(ctx));
+					if (src == dst) {
+						continue;
+					}
+					// *(dst + off) = src, then src round trips through the stack
+					p.n = 0;
+					prog_add(&p, EBPF_OP_STXDW, 10, 1, -8, 0);
+					prog_lddw(&p, src, CHECK_DIRTY);
+					prog_add(&p, EBPF_OP_LDXDW, dst, 10, -8, 0);
+					prog_add(&p, EBPF_OP_ADD64_IMM, dst, 0, 0, adjust);
+					prog_add(&p, EBPF_CLS_STX | EBPF_MODE_MEM | sizes[z], dst, src, off, 0);
+					prog_add(&p, EBPF_CLS_ST | EBPF_MODE_MEM | sizes[z], dst, 0, off + 8, -0x1235);
+					prog_add(&p, EBPF_OP_STXDW, 10, src, -24, 0);
+					prog_add(&p, EBPF_CLS_STX | EBPF_MODE_MEM | sizes[z], 10, src, -16, 0);
+					prog_add(&p, EBPF_CLS_LDX | EBPF_MODE_MEM | sizes[z], src, 10, -16, 0);
+					prog_add(&p, EBPF_OP_MOV64_REG, 0, src, 0, 0);
+					prog_add(&p, EBPF_OP_EXIT, 0, 0, 0, 0);
+					snprintf(name, sizeof(name), "stx 0x%02x [r%d%+d] r%d", sizes[z], dst, off, src);
+					check_prog_run(name, &p, ctx, sizeof(ctx));
+				}
+			}
+		}
+	}
+}
+
+static int self_check(void) {
+	int bad = check_lsh64_imm();
+	printf("encodings: lsh64 imm 1-31 %s\n", bad == 0 ? "ok" : "wrong");
+	if (sim_init() != 0) {
+		fprintf(stderr, "jit_cross: no memory below 4 GB for the simulator\n");
+		return 1;
+	}
+	ebpf_vm vm = {0};
+	ebpf_vm_set_inst(&vm, NULL, 0);
+	ebpf_register(&vm, CHECK_HELPER64, "check64", check_helper64);
+	ebpf_register_typed(&vm, CHECK_HELPER32, "check32", check_helper32, (ebpf_helper_desc) {5, 0, false});
+	static const struct {
+		const char *name;
+		void (*run)(void);
+	} groups[] = {
+		{"patches", check_patches}, {"helpers", check_helpers}, {"alu", check_alu}, {"jmp", check_jmp},
+		{"ldx/stx", check_ldst},
+	};
+	for (int i = 0; i < CHECK_NUM(groups); i++) {
+		int runs = check_runs, fails = check_fails;
+		groups[i].run();
+		printf("simulator: %s %d runs, %d mismatches\n", groups[i].name, check_runs - runs, check_fails - fails);
+	}
+	return bad == 0 && check_fails == 0 ? 0 : 1;
+}
+
+
+int main(int argc, char **argv) {
+	bool sfi = false;
+	const char *ctx_path = NULL, *out_path = NULL, *in_path = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-t") == 0) {
+			return self_check();
+		} else if (strcmp(argv[i], "-s") == 0) {
+			sfi = true;
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			ctx_path = argv[++i];
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			out_path = argv[++i];
+		} else {
+			in_path = argv[i];
+		}
+	}
+	if (in_path == NULL) {
+		fprintf(stderr, "usage: jit_cross [-s] [-c ctx.bin] [-o out.blob] patch.bin | -t\n");
+		return 2;
+	}
+	int len;
+	uint8_t *code = read_file(in_path, &len);
+	if (code == NULL || len == 0 || len % sizeof(struct ebpf_inst) != 0) {
+		fprintf(stderr, "jit_cross: cannot read bytecode from %s\n", in_path);
+		return 1;
+	}
+	ebpf_vm vm = {0};
+	ebpf_vm_set_inst(&vm, code, len);
+	if (!vm.jumps_checked) {
+		fprintf(stderr, "jit_cross: %s: bad jump\n", in_path);
+		return 1;
+	}
+	vm.bounds_check_enabled = sfi;
+	jit_state state;
+	if (cross_compile(&vm, &state) != 0) {
+		return 1;
+	}
+	char def_out[256];
+	if (out_path == NULL) {
+		snprintf(def_out, sizeof(def_out), "%s.blob", in_path);
+		out_path = def_out;
+	}
+	if (write_blob(out_path, &vm, &state) != 0) {
+		fprintf(stderr, "jit_cross: cannot write %s\n", out_path);
+		return 1;
+	}
+	printf("%s: %d insts, %d code bytes, %d BPF regs in ARM regs, %d/%d accesses proven\n", out_path, vm.num_insts,
+		state.idx, state.regs_in_arm, vm.mem_proven, vm.mem_accesses);
+
+	uint8_t pattern[EBPF_CTX_SIZE];
+	uint8_t *ctx = pattern;
+	int ctx_len = sizeof(pattern);
+	for (int i = 0; i < ctx_len; i++) {
+		pattern[i] = i * 7 + 1;
+	}
+	if (ctx_path != NULL && (ctx = read_file(ctx_path, &ctx_len)) == NULL) {
+		fprintf(stderr, "jit_cross: cannot read ctx from %s\n", ctx_path);
+		return 1;
+	}
+	if (sim_init() != 0) {
+		fprintf(stderr, "jit_cross: no memory below 4 GB for the simulator\n");
+		return 1;
+	}
+	// a pointer in ctx may not be one, the interpreter checks its accesses
+	ebpf_vm checked = vm;
+	checked.bounds_check_enabled = true;
+	if (sim_check(&checked, &state, ctx, ctx_len, NULL, 0, false) != 0) {
+		remove(out_path);
+		return 1;
+	}
+	return 0;
+}
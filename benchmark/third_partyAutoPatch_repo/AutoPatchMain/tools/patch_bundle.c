@@ -0,0 +1,177 @@
+/*
+Patch bundles against single patch packets, with the real patch system
+(iotpatch.c) on the host. For each code size the same sites are patched:
+
+	copy    one packet per site (patch_desc then the code), read from flash
+	        and copied to RAM as the transfer area and the boot restore do,
+	        then the patches are activated together
+	bundle  one bundle holding every site, installed where it is
+
+and the RAM allocated per patch (ebpf_malloc) and the time to activate a
+patch are reported. Both leave out the journal append, the same one flash
+copy for both (see patch_journal).
+
+build:
+	gcc -O2 -DLINUX_TEST -I../include -I../src patch_bundle.c -o patch_bundle -lpthread
+
+usage: patch_bundle [-s sites] [-r rounds] [size ...]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "iotpatch.c"
+#include "ebpf_allocator.c"
+
+// no verifier on the host, the patches here have no vm
+void ebpf_verifier_release(struct ebpf_vm *vm) {
+}
+
+// no journal or object area here
+int flash_port_erase(uint32_t faddr, int size) {
+	return -1;
+}
+
+int flash_port_write(uint32_t faddr, uint8_t *buf, int size) {
+	return -1;
+}
+
+int flash_port_program(uint32_t faddr, const uint8_t *buf, int size) {
+	return -1;
+}
+
+static uint32_t site_key(int site) {
+	return 0x08001000 + site * 4;
+}
+
+static const char *bundle_name = "CVE-bundle";
+
+// sites packets of size code bytes, back to back as if staged
+static uint8_t *build_packets(int sites, uint32_t size, uint32_t *len) {
+	*len = sizeof(patch_desc) + size;
+	uint8_t *pkts = calloc(sites, *len);
+	for (int s = 0; s < sites; s++) {
+		patch_desc *desc = (patch_desc *) (pkts + s * *len);
+		desc->cve = bundle_name;
+		desc->type = FixedPatchPoint;
+		desc->code_len = size;
+		desc->fixed_id = site_key(s);
+		desc->func = (uint64_t (*)(uint32_t)) (desc + 1);
+		for (uint32_t k = 0; k < size; k++) {
+			((uint8_t *) (desc + 1))[k] = k * 31 + s;
+		}
+	}
+	return pkts;
+}
+
+static uint8_t *build_bundle(int sites, uint32_t size, uint32_t *len) {
+	uint32_t code_off = (sizeof(patch_bundle_head) + sites * sizeof(patch_bundle_site) + 3) & ~3;
+	uint32_t meta_off = code_off + sites * size;
+	uint32_t meta_len = strlen(bundle_name) + 1;
+	*len = meta_off + meta_len;
+	uint8_t *b = calloc(1, *len);
+	patch_bundle_head *head = (patch_bundle_head *) b;
+	head->magic = PATCH_BUNDLE_MAGIC;
+	head->version = PATCH_BUNDLE_VERSION;
+	head->sites = sites;
+	head->len = *len;
+	head->id = 1;
+	head->code_off = code_off;
+	head->code_len = sites * size;
+	head->meta_off = meta_off;
+	head->meta_len = meta_len;
+	patch_bundle_site *site = (patch_bundle_site *) (head + 1);
+	for (int s = 0; s < sites; s++) {
+		site[s].type = FixedPatchPoint;
+		site[s].fixed_id = site_key(s);
+		site[s].entry = s * size | 1;
+		site[s].cve = 0;
+		for (uint32_t k = 0; k < size; k++) {
+			b[code_off + s * size + k] = k * 31 + s;
+		}
+	}
+	memcpy(b + meta_off, bundle_name, meta_len);
+	return b;
+}
+
+// the patch system from scratch, the patches of the last round freed
+static void patch_sys_reset(patch_restore *r) {
+	for (int i = 0; i < r->num; i++) {
+		ebpf_free(r->patches[i]->desc);
+		ebpf_free(r->patches[i]);
+	}
+	r->num = 0;
+	destory_patch_context();
+	init_patch_sys();
+}
+
+int main(int argc, char **argv) {
+	int sites = 8, rounds = 200;
+	uint32_t sizes[16];
+	int nsizes = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			sites = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			rounds = atoi(argv[++i]);
+		} else if (nsizes < 16) {
+			sizes[nsizes++] = atoi(argv[i]);
+		}
+	}
+	if (nsizes == 0) {
+		uint32_t def[] = {64, 256, 1024, 4096, 8192};
+		memcpy(sizes, def, sizeof(def));
+		nsizes = 5;
+	}
+	if (sites > PATCH_BUNDLE_MAX_SITES) {
+		sites = PATCH_BUNDLE_MAX_SITES;
+	}
+	// the patch system logs every call, the results go to the original stdout
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+	freopen("/dev/null", "w", stdout);
+
+	fprintf(out, "%d sites, %d rounds\n", sites, rounds);
+	for (int z = 0; z < nsizes; z++) {
+		uint32_t size = sizes[z], pkt_len, bundle_len;
+		uint8_t *pkts = build_packets(sites, size, &pkt_len);
+		uint8_t *bundle = build_bundle(sites, size, &bundle_len);
+		patch_restore r = {0};
+		double copy_t = 0, bundle_t = 0;
+		long copy_ram = 0, bundle_ram = 0;
+		int bad = 0;
+		for (int k = 0; k < rounds; k++) {
+			patch_sys_reset(&r);
+			int ram = get_ebpf_alloc_size();
+			double t = now_sec();
+			for (int s = 0; s < sites; s++) {
+				restore_patch(&r, pkts + s * pkt_len, pkt_len);
+			}
+			active_patches(r.patches, r.num);
+			copy_t += now_sec() - t;
+			copy_ram += get_ebpf_alloc_size() - ram;
+			bad += r.num != sites;
+
+			patch_sys_reset(&r);
+			ram = get_ebpf_alloc_size();
+			t = now_sec();
+			if (patch_bundle_valid(bundle, bundle_len)) {
+				bundle_setup(&r, bundle);
+				active_patches(r.patches, r.num);
+			}
+			bundle_t += now_sec() - t;
+			bundle_ram += get_ebpf_alloc_size() - ram;
+			// the handlers run from the bundle
+			for (int s = 0; s < sites; s++) {
+				auto_patch *patch = get_fixed_patch_by_lr(site_key(s));
+				bad += patch == NULL || (uint8_t *) patch->desc->func != bundle + ((patch_bundle_head *) bundle)->code_off + s * size + 1;
+			}
+		}
+		patch_sys_reset(&r);
+		long n = (long) rounds * sites;
+		fprintf(out, "code %5u bytes: copy %6.2f us %6ld bytes RAM per patch, bundle %6.2f us %4ld bytes RAM per patch, "
+			"%d wrong\n", size, copy_t * 1e6 / n, copy_ram / n, bundle_t * 1e6 / n, bundle_ram / n, bad);
+		free(pkts);
+		free(bundle);
+	}
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,286 @@
+/*
+Patch feed: the peer side of the framed patch protocol (patch_service.h), used
+to measure the receive path of the LINUX_TEST socket backend on the host. It
+listens on SERVER_PORT, starts the patch service (which connects to it), sends
+signed LOAD frames, each after the ACK of the previous one, and reports the
+throughput and the install time (LOAD sent to ACK received).
+
+Two workloads: count synthetic packets of size bytes, or the patch objects
+given as files (src/LocalPatches/Hotpatch_CVE_<id>.o), each sent as a
+patch_desc followed by the object, rounds times. With -z the packets go as
+LOAD_LZ and are decoded into the staging area, a mapping at PATCH_STAGE_BASE
+stands in for the flash. The compression ratio is reported per object.
+
+build:
+	gcc -O2 -DLINUX_TEST -I../include -I../src patch_feed.c -o patch_feed -lpthread
+
+usage: patch_feed [-c] [-n] [-z] [-r rounds] [size count | patch.o ...]
+	-c  CRC32 instead of SHA-256
+	-n  verify in one pass after the last byte instead of per chunk
+	-z  compressed payloads (LOAD_LZ)
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "patch_service.c"
+#include "ebpf_allocator.c"
+#include "utils.c"
+
+static int loaded = 0;
+
+// no patch system on the host, count the patch, the service frees its buffer
+void init_patch_sys(void) {
+}
+
+void save_patch_list_to_flash() {
+}
+
+void notify_new_patch(const struct patch_desc *desc) {
+	loaded++;
+}
+
+int notify_new_bundle(const uint8_t *bundle, uint32_t len) {
+	notify_new_patch((const struct patch_desc *) bundle);
+	return 1;
+}
+
+// the staging area is RAM mapped at its flash address, erase sets 0xff
+int flash_port_erase(uint32_t faddr, int size) {
+	memset((void *) (uintptr_t) faddr, 0xff, size);
+	return 0;
+}
+
+int flash_port_program(uint32_t faddr, const uint8_t *buf, int size) {
+	memcpy((void *) (uintptr_t) faddr, buf, size);
+	return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+	for (size_t got = 0; got < len;) {
+		ssize_t n = recv(fd, (uint8_t *) buf + got, len - got, 0);
+		if (n <= 0) {
+			return -1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+static int feed_frame(int fd, uint8_t cmd, uint16_t seq, uint8_t *payload, uint32_t len) {
+	frame_header hdr = {PATCH_FRAME_MAGIC, cmd, seq, len};
+	if (send(fd, &hdr, sizeof(hdr), MSG_MORE) != sizeof(hdr)) {
+		return -1;
+	}
+	return len == 0 || send(fd, payload, len, 0) == (ssize_t) len ? 0 : -1;
+}
+
+static int feed_reply(int fd, frame_header *hdr, void *payload, uint32_t max) {
+	if (recv_all(fd, hdr, sizeof(*hdr)) != 0 || hdr->magic != PATCH_FRAME_MAGIC || hdr->len > max) {
+		return -1;
+	}
+	return recv_all(fd, payload, hdr->len);
+}
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// greedy LZSS in the format of patch_lz.h, out needs len + len / 8 + 1 bytes
+static int lz_compress(const uint8_t *in, int len, uint8_t *out) {
+	int o = 0, flag_at = 0, items = 8;
+	for (int i = 0; i < len;) {
+		if (items == 8) {
+			flag_at = o++;
+			out[flag_at] = 0;
+			items = 0;
+		}
+		int best = 0, dist = 0;
+		for (int j = i - 1; j >= 0 && i - j <= PATCH_LZ_WINDOW; j--) {
+			int n = 0;
+			while (n < PATCH_LZ_MAX_MATCH && i + n < len && in[j + n] == in[i + n]) {
+				n++;
+			}
+			if (n > best) {
+				best = n;
+				dist = i - j;
+			}
+		}
+		if (best >= PATCH_LZ_MIN_MATCH) {
+			uint16_t tok = (dist - 1) | ((best - PATCH_LZ_MIN_MATCH) << PATCH_LZ_WINDOW_BITS);
+			out[o++] = tok & 0xff;
+			out[o++] = tok >> 8;
+			i += best;
+		} else {
+			out[flag_at] |= 1 << items;
+			out[o++] = in[i++];
+		}
+		items++;
+	}
+	return o;
+}
+
+typedef struct feed_packet {
+	const char *name;
+	uint8_t *frame; // LOAD or LOAD_LZ payload
+	uint32_t len;
+	uint32_t raw_len; // sign and packet
+} feed_packet;
+
+// sign | packet, or lz_load_head | compressed packet
+static void feed_packet_build(feed_packet *p, const uint8_t *pkt, uint32_t len, uint8_t algo, bool lz) {
+	uint8_t sign[PATCH_SIGN_LEN];
+	patch_verify_sign(algo, pkt, len, sign);
+	p->raw_len = PATCH_SIGN_LEN + len;
+	if (!lz) {
+		p->frame = malloc(PATCH_SIGN_LEN + len);
+		memcpy(p->frame, sign, PATCH_SIGN_LEN);
+		memcpy(p->frame + PATCH_SIGN_LEN, pkt, len);
+		p->len = PATCH_SIGN_LEN + len;
+		return;
+	}
+	lz_load_head head;
+	memcpy(head.sign, sign, PATCH_SIGN_LEN);
+	head.raw_len = len;
+	p->frame = malloc(sizeof(head) + len + len / 8 + 1);
+	memcpy(p->frame, &head, sizeof(head));
+	p->len = sizeof(head) + lz_compress(pkt, len, p->frame + sizeof(head));
+}
+
+static uint8_t *read_file(const char *path, uint32_t *len) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *buf = malloc(*len);
+	if (fread(buf, 1, *len, f) != *len) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	return buf;
+}
+
+int main(int argc, char **argv) {
+	uint32_t size = 1024;
+	int count = 10000, num = 0, rounds = 100, files = 0;
+	uint8_t algo = PATCH_VERIFY_SHA256;
+	bool pipelined = true, lz = false;
+	feed_packet *pkts = calloc(argc, sizeof(feed_packet));
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-c") == 0) {
+			algo = PATCH_VERIFY_CRC32;
+		} else if (strcmp(argv[i], "-n") == 0) {
+			pipelined = false;
+		} else if (strcmp(argv[i], "-z") == 0) {
+			lz = true;
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			rounds = atoi(argv[++i]);
+		} else if (argv[i][0] >= '0' && argv[i][0] <= '9') {
+			if (num++ == 0) {
+				size = atoi(argv[i]);
+			} else {
+				count = atoi(argv[i]);
+			}
+		} else {
+			pkts[files++].name = argv[i];
+		}
+	}
+	patch_service_set_verify(algo, pipelined);
+	if (mmap((void *) PATCH_STAGE_BASE, PATCH_STAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *) PATCH_STAGE_BASE) {
+		perror("patch_feed: staging area");
+		return 1;
+	}
+
+	// patch_desc then the object, or a synthetic packet
+	uint32_t raw = 0, sent = 0;
+	for (int i = 0; i < (files > 0 ? files : 1); i++) {
+		uint32_t obj_len = size > PATCH_SIGN_LEN + sizeof(patch_desc) ? size - PATCH_SIGN_LEN - sizeof(patch_desc) : 0;
+		uint8_t *obj = NULL;
+		if (files > 0 && (obj = read_file(pkts[i].name, &obj_len)) == NULL) {
+			fprintf(stderr, "patch_feed: cannot read %s\n", pkts[i].name);
+			return 1;
+		}
+		uint8_t *pkt = calloc(1, sizeof(patch_desc) + obj_len);
+		patch_desc *desc = (patch_desc *) pkt;
+		desc->type = FixedPatchPoint;
+		desc->code_len = obj_len;
+		for (uint32_t k = 0; k < obj_len; k++) {
+			pkt[sizeof(patch_desc) + k] = obj != NULL ? obj[k] : k * 31;
+		}
+		feed_packet_build(&pkts[i], pkt, sizeof(patch_desc) + obj_len, algo, lz);
+		raw += pkts[i].raw_len;
+		sent += pkts[i].len;
+		if (files > 0 && lz) {
+			printf("%-40s %5u -> %5u bytes %.2f\n", pkts[i].name, pkts[i].raw_len, pkts[i].len,
+				(double) pkts[i].raw_len / pkts[i].len);
+		}
+		free(obj);
+		free(pkt);
+	}
+	if (files == 0) {
+		files = 1;
+		rounds = count;
+	}
+
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(SERVER_PORT);
+	inet_aton(SERVER_ADDR, &addr.sin_addr);
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(lfd, 1) != 0) {
+		perror("patch_feed: listen");
+		return 1;
+	}
+	start_patch_service();
+	int fd = accept(lfd, NULL, NULL);
+	if (fd < 0) {
+		perror("patch_feed: accept");
+		return 1;
+	}
+
+	frame_header hdr;
+	uint32_t max_frame = 0;
+	if (feed_frame(fd, FRAME_HEARTBEAT, 0, NULL, 0) != 0 || feed_reply(fd, &hdr, &max_frame, sizeof(max_frame)) != 0) {
+		fprintf(stderr, "patch_feed: no heartbeat\n");
+		return 1;
+	}
+	printf("device accepts frames up to %u bytes\n", max_frame);
+	for (int i = 0; i < files; i++) {
+		if (!lz && pkts[i].len > max_frame) {
+			fprintf(stderr, "patch_feed: %u byte packet, the device takes %u\n", pkts[i].len, max_frame);
+			return 1;
+		}
+	}
+
+	double start = now_sec();
+	int refused = 0, seq = 0;
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < files; i++, seq++) {
+			uint8_t status;
+			if (feed_frame(fd, lz ? FRAME_LOAD_LZ : FRAME_LOAD, seq, pkts[i].frame, pkts[i].len) != 0
+				|| feed_reply(fd, &hdr, &status, 1) != 0 || hdr.cmd != FRAME_ACK || hdr.seq != (uint16_t) seq) {
+				fprintf(stderr, "patch_feed: frame %d lost\n", seq);
+				return 1;
+			}
+			refused += status != ACK_OK;
+		}
+	}
+	double sec = now_sec() - start;
+	feed_frame(fd, FRAME_EXIT, 0, NULL, 0);
+	printf("%s %s%s, %d packets (%u bytes, %u sent, ratio %.2f) x %d in %.3f s: %.1f us per install, %.2f MB/s, "
+		"loaded %d refused %d\n", algo == PATCH_VERIFY_CRC32 ? "crc32" : "sha256",
+		pipelined ? "per chunk" : "after receive", lz ? " lz" : "", files, raw, sent, (double) raw / sent, rounds,
+		sec, sec * 1e6 / seq, (double) raw * rounds / sec / 1e6, loaded, refused);
+	close(fd);
+	close(lfd);
+	return 0;
+}
@@ -0,0 +1,458 @@
+/*
+Patch fleet: an event driven patch server and N simulated devices in one
+process, to measure a fleet wide rollout over the framed protocol
+(patch_service.h) on the host.
+
+The server thread runs one epoll loop over all device connections. It pushes
+the bundle (the patch objects given, each as a patch_desc followed by the
+object, or one synthetic patch) to every device, the next LOAD after the ACK of
+the previous one. The LOAD frames are built once and sent from the same buffer
+to every device. Any reply shows the device is alive; a device silent for a
+heartbeat period gets a HEARTBEAT, and one that has not answered the previous
+HEARTBEAT is counted as missed instead of getting another. The devices are
+spread over FLEET_HB_SLOTS ticks per period so heartbeats do not come in bursts.
+
+The device thread runs an epoll loop over the device sockets and hands each
+readable one to patch_service_step, the real receive state machine and
+dispatch_frame of patch_service.c.
+
+build:
+	gcc -O2 -DLINUX_TEST -I../include -I../src patch_fleet.c -o patch_fleet -lpthread
+
+usage: patch_fleet [-n devices] [-h heartbeat_ms] [patch.o ...]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <stdatomic.h>
+#include "patch_service.c"
+#include "ebpf_allocator.c"
+
+#define FLEET_EVENTS 256
+#define FLEET_PORT (SERVER_PORT + 1)
+#define FLEET_HB_SLOTS 10
+
+static atomic_int loaded = 0;
+
+// quiet, the service logs every frame
+void debug_log(const char *fmt, ...) {
+}
+
+void init_patch_sys(void) {
+}
+
+void save_patch_list_to_flash() {
+}
+
+void notify_new_patch(const struct patch_desc *desc) {
+	atomic_fetch_add(&loaded, 1);
+}
+
+int notify_new_bundle(const uint8_t *bundle, uint32_t len) {
+	notify_new_patch((const struct patch_desc *) bundle);
+	return 1;
+}
+
+// the staging area is not used, LOAD only
+int flash_port_erase(uint32_t faddr, int size) {
+	return -1;
+}
+
+int flash_port_program(uint32_t faddr, const uint8_t *buf, int size) {
+	return -1;
+}
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct fleet_frame {
+	uint8_t *buf; // header and payload
+	uint32_t len;
+} fleet_frame;
+
+// server side of one device
+typedef struct fleet_conn {
+	int fd;
+	int next; // bundle patch to send next
+	int acked;
+	int refused;
+	const uint8_t *cur; // frame being sent
+	uint32_t cur_len;
+	uint32_t cur_off;
+	bool load_pending;
+	bool hb_pending;
+	bool hb_wait; // sent, no answer yet
+	bool out_armed; // EPOLLOUT registered
+	uint8_t in[32]; // replies, parsed as they complete
+	int in_len;
+	double hb_sent;
+	double last_seen; // last reply of any kind
+	double done_at;
+} fleet_conn;
+
+typedef struct fleet {
+	int devices;
+	fleet_frame *bundle;
+	int bundle_num;
+	uint64_t bundle_bytes;
+	int hb_ms;
+	fleet_conn *conns;
+	int accepted;
+	int done;
+	int hb_sent;
+	int hb_replies;
+	int hb_missed;
+	double hb_rtt;
+	double t0;
+	double t_done;
+	int hb_tick;
+} fleet;
+
+static uint8_t hb_frame[sizeof(frame_header)];
+static uint8_t exit_frame[sizeof(frame_header)];
+
+static void frame_build(uint8_t *buf, uint8_t cmd, uint16_t seq, uint32_t len) {
+	frame_header hdr = {PATCH_FRAME_MAGIC, cmd, seq, len};
+	memcpy(buf, &hdr, sizeof(hdr));
+}
+
+static void conn_arm(int ep, fleet_conn *c, int idx, bool out) {
+	if (c->out_armed == out) {
+		return;
+	}
+	struct epoll_event ev = {.events = EPOLLIN | (out ? EPOLLOUT : 0), .data.u32 = idx};
+	epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+	c->out_armed = out;
+}
+
+// send what is queued, frames go out whole and in order, the rest waits for EPOLLOUT
+static void conn_flush(fleet *f, int ep, int idx) {
+	fleet_conn *c = &f->conns[idx];
+	while (true) {
+		if (c->cur == NULL) {
+			if (c->hb_pending) {
+				c->cur = hb_frame;
+				c->cur_len = sizeof(hb_frame);
+				c->hb_pending = false;
+			} else if (c->load_pending) {
+				c->cur = f->bundle[c->next].buf;
+				c->cur_len = f->bundle[c->next].len;
+				c->load_pending = false;
+			} else {
+				conn_arm(ep, c, idx, false);
+				return;
+			}
+			c->cur_off = 0;
+		}
+		ssize_t n = send(c->fd, c->cur + c->cur_off, c->cur_len - c->cur_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			conn_arm(ep, c, idx, errno == EAGAIN);
+			return;
+		}
+		c->cur_off += n;
+		if (c->cur_off == c->cur_len) {
+			c->cur = NULL;
+		}
+	}
+}
+
+static void conn_reply(fleet *f, int idx, const frame_header *hdr, const uint8_t *payload) {
+	fleet_conn *c = &f->conns[idx];
+	c->last_seen = now_sec();
+	if (hdr->cmd == FRAME_HEARTBEAT && c->hb_wait) {
+		c->hb_wait = false;
+		f->hb_replies++;
+		f->hb_rtt += c->last_seen - c->hb_sent;
+	} else if (hdr->cmd == FRAME_ACK && hdr->seq == c->next) {
+		c->acked++;
+		c->refused += payload[0] != ACK_OK;
+		if (++c->next < f->bundle_num) {
+			c->load_pending = true;
+		} else {
+			c->done_at = now_sec();
+			f->done++;
+		}
+	}
+}
+
+static int conn_read(fleet *f, int idx) {
+	fleet_conn *c = &f->conns[idx];
+	ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+	if (n <= 0) {
+		return n == 0 || errno != EAGAIN ? -1 : 0;
+	}
+	c->in_len += n;
+	int off = 0;
+	while (c->in_len - off >= (int) sizeof(frame_header)) {
+		frame_header hdr;
+		memcpy(&hdr, c->in + off, sizeof(hdr));
+		if (hdr.magic != PATCH_FRAME_MAGIC || hdr.len > sizeof(c->in) - sizeof(hdr)) {
+			return -1;
+		}
+		if (c->in_len - off < (int) (sizeof(hdr) + hdr.len)) {
+			break;
+		}
+		conn_reply(f, idx, &hdr, c->in + off + sizeof(hdr));
+		off += sizeof(hdr) + hdr.len;
+	}
+	memmove(c->in, c->in + off, c->in_len - off);
+	c->in_len -= off;
+	return 0;
+}
+
+// one slot of the devices per tick
+static void fleet_heartbeat(fleet *f, int ep) {
+	double now = now_sec();
+	for (int i = f->hb_tick++ % FLEET_HB_SLOTS; i < f->accepted; i += FLEET_HB_SLOTS) {
+		fleet_conn *c = &f->conns[i];
+		if (c->fd < 0 || now - c->last_seen < f->hb_ms / 1000.0) {
+			continue;
+		}
+		if (c->hb_wait) {
+			f->hb_missed++; // silent for a period with a heartbeat outstanding
+			continue;
+		}
+		c->hb_pending = true;
+		c->hb_wait = true;
+		c->hb_sent = now;
+		f->hb_sent++;
+		conn_flush(f, ep, i);
+	}
+}
+
+static void *fleet_server(void *arg) {
+	fleet *f = arg;
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(FLEET_PORT);
+	inet_aton(SERVER_ADDR, &addr.sin_addr);
+	if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(lfd, SOMAXCONN) != 0) {
+		perror("patch_fleet: listen");
+		exit(1);
+	}
+	int ep = epoll_create1(0);
+	struct epoll_event ev = {.events = EPOLLIN, .data.u32 = UINT32_MAX};
+	epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+	struct epoll_event events[FLEET_EVENTS];
+	double next_hb = 0;
+	while (f->done < f->devices) {
+		double now = now_sec();
+		if (f->t0 > 0 && now >= next_hb) {
+			fleet_heartbeat(f, ep);
+			next_hb = now + f->hb_ms / 1000.0 / FLEET_HB_SLOTS;
+		}
+		int timeout = f->t0 > 0 ? (int) ((next_hb - now) * 1000) + 1 : -1;
+		int n = epoll_wait(ep, events, FLEET_EVENTS, timeout);
+		for (int e = 0; e < n; e++) {
+			uint32_t idx = events[e].data.u32;
+			if (idx == UINT32_MAX) {
+				int fd = accept(lfd, NULL, NULL);
+				if (fd < 0) {
+					continue;
+				}
+				fleet_conn *c = &f->conns[f->accepted];
+				memset(c, 0, sizeof(*c));
+				c->fd = fd;
+				c->load_pending = true;
+				ev.events = EPOLLIN;
+				ev.data.u32 = f->accepted++;
+				epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+				if (f->accepted == f->devices) { // the whole fleet is up, push to everyone
+					f->t0 = now_sec();
+					for (int i = 0; i < f->accepted; i++) {
+						f->conns[i].last_seen = f->t0;
+						conn_flush(f, ep, i);
+					}
+				}
+				continue;
+			}
+			fleet_conn *c = &f->conns[idx];
+			if ((events[e].events & EPOLLIN) && conn_read(f, idx) != 0) {
+				fprintf(stderr, "patch_fleet: device %u lost\n", idx);
+				epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+				close(c->fd);
+				c->fd = -1;
+				f->done++;
+				continue;
+			}
+			if (f->t0 > 0) {
+				conn_flush(f, ep, idx);
+			}
+		}
+	}
+	f->t_done = now_sec();
+	for (int i = 0; i < f->accepted; i++) {
+		if (f->conns[i].fd >= 0) {
+			send(f->conns[i].fd, exit_frame, sizeof(exit_frame), MSG_NOSIGNAL);
+		}
+	}
+	close(lfd);
+	close(ep);
+	return NULL;
+}
+
+typedef struct fleet_device {
+	service_context ctx;
+	frame_rx rx;
+} fleet_device;
+
+// device side, the service as it runs on the device, one loop for the fleet
+static void fleet_devices(fleet *f) {
+	svr.receive_buf = linux_receive_buf;
+	svr.send_buf = linux_send_buf;
+	svr.dis_connect = linux_dis_connect;
+	fleet_device *devs = calloc(f->devices, sizeof(fleet_device));
+	int ep = epoll_create1(0);
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(FLEET_PORT);
+	inet_aton(SERVER_ADDR, &addr.sin_addr);
+	for (int i = 0; i < f->devices; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		while (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+			if (errno != ECONNREFUSED) {
+				perror("patch_fleet: connect");
+				exit(1);
+			}
+			usleep(1000); // server not listening yet
+		}
+		devs[i].ctx.sockfd = fd;
+		devs[i].ctx.status = RUNNING;
+		frame_rx_reset(&devs[i].rx);
+		struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+		epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+	}
+	struct epoll_event events[FLEET_EVENTS];
+	for (int alive = f->devices; alive > 0;) {
+		int n = epoll_wait(ep, events, FLEET_EVENTS, -1);
+		for (int e = 0; e < n; e++) {
+			fleet_device *d = &devs[events[e].data.u32];
+			int fd = d->ctx.sockfd;
+			if (patch_service_step(&d->ctx, &d->rx) != 0) { // EXIT or lost, the socket is closed
+				epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+				patch_service_release(&d->rx);
+				alive--;
+			}
+		}
+	}
+	close(ep);
+	free(devs);
+}
+
+static uint8_t *read_file(const char *path, uint32_t *len) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	*len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	uint8_t *buf = malloc(*len);
+	if (fread(buf, 1, *len, fp) != *len) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(fp);
+	return buf;
+}
+
+// header | sign | patch_desc | object
+static void bundle_add(fleet *f, const uint8_t *obj, uint32_t obj_len) {
+	uint32_t pkt_len = sizeof(patch_desc) + obj_len;
+	uint32_t len = sizeof(frame_header) + PATCH_SIGN_LEN + pkt_len;
+	uint8_t *buf = calloc(1, len);
+	uint8_t *pkt = buf + sizeof(frame_header) + PATCH_SIGN_LEN;
+	patch_desc *desc = (patch_desc *) pkt;
+	desc->type = FixedPatchPoint;
+	desc->code_len = obj_len;
+	memcpy(pkt + sizeof(patch_desc), obj, obj_len);
+	patch_verify_sign(PATCH_VERIFY_ALGO, pkt, pkt_len, buf + sizeof(frame_header));
+	frame_build(buf, FRAME_LOAD, f->bundle_num, len - sizeof(frame_header));
+	f->bundle[f->bundle_num].buf = buf;
+	f->bundle[f->bundle_num].len = len;
+	f->bundle_num++;
+	f->bundle_bytes += len;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+	fleet f = {0};
+	f.devices = 1000;
+	f.hb_ms = 1000;
+	f.bundle = calloc(argc + 1, sizeof(fleet_frame));
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			f.devices = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+			f.hb_ms = atoi(argv[++i]);
+		} else {
+			uint32_t len;
+			uint8_t *obj = read_file(argv[i], &len);
+			if (obj == NULL || sizeof(frame_header) + PATCH_SIGN_LEN + sizeof(patch_desc) + len > PATCH_FRAME_MAX) {
+				fprintf(stderr, "patch_fleet: cannot use %s\n", argv[i]);
+				return 1;
+			}
+			bundle_add(&f, obj, len);
+			free(obj);
+		}
+	}
+	if (f.bundle_num == 0) {
+		uint8_t obj[1024] = {0};
+		bundle_add(&f, obj, sizeof(obj));
+	}
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < (rlim_t) 2 * f.devices + 16) {
+		fprintf(stderr, "patch_fleet: %d devices need %d fds, the limit is %d\n", f.devices, 2 * f.devices + 16,
+			(int) rl.rlim_cur);
+		return 1;
+	}
+	f.conns = calloc(f.devices, sizeof(fleet_conn));
+	frame_build(hb_frame, FRAME_HEARTBEAT, 0, 0);
+	frame_build(exit_frame, FRAME_EXIT, 0, 0);
+
+	pthread_t server;
+	pthread_create(&server, NULL, fleet_server, &f);
+	fleet_devices(&f);
+	pthread_join(server, NULL);
+
+	double rollout = f.t_done - f.t0;
+	double *lat = malloc(f.devices * sizeof(double));
+	int refused = 0, complete = 0;
+	for (int i = 0; i < f.devices; i++) {
+		refused += f.conns[i].refused;
+		if (f.conns[i].acked == f.bundle_num) {
+			lat[complete++] = f.conns[i].done_at - f.t0;
+		}
+	}
+	qsort(lat, complete, sizeof(double), cmp_double);
+	printf("%d devices, bundle of %d patches (%llu bytes): rollout %.3f s, %d complete, loaded %d refused %d\n",
+		f.devices, f.bundle_num, (unsigned long long) f.bundle_bytes, rollout, complete, atomic_load(&loaded), refused);
+	if (complete > 0) {
+		printf("device done after: p50 %.1f ms p99 %.1f ms max %.1f ms\n", lat[complete / 2] * 1e3,
+			lat[complete * 99 / 100] * 1e3, lat[complete - 1] * 1e3);
+	}
+	printf("server: %.1f frames/s %.2f MB/s\n", (double) complete * f.bundle_num / rollout,
+		(double) complete * f.bundle_bytes / rollout / 1e6);
+	printf("heartbeats: %d sent %d answered %d missed, rtt %.2f ms\n", f.hb_sent, f.hb_replies, f.hb_missed,
+		f.hb_replies > 0 ? f.hb_rtt / f.hb_replies * 1e3 : 0.0);
+	free(lat);
+	return 0;
+}
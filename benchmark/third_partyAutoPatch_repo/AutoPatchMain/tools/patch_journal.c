@@ -0,0 +1,297 @@
+/*
+Patch journal: append, compaction and boot restore of patch_journal.c with
+the real patch system (iotpatch.c) on the host. The journal banks are a
+mapping at their flash address that behaves like NOR (programming only
+clears bits), and the erases and programmed words are counted to give the
+flash time with the nRF52840 worst case timings (FLASH_T_*).
+
+Three runs:
+	append   appends packets (a patch_desc then the object, or synthetic ones)
+	         to fixed patch points round robin, the banks fill and are compacted
+	restore  boot restore of the journal: mount and load_patch_list_from_flash
+	         (one table publish), against activating each patch on its own
+	cut      programming stops after a random number of bytes, as at a reset,
+	         then the journal is mounted again: every append that returned
+	         must be restored with its content, nothing else
+
+Packets whose code is a patch object are loaded at restore (patch_elf.h), to
+a mapping at PATCH_ELF_BASE. Their RAM must be at 32 bit addresses, hence
+-no-pie.
+
+build:
+	gcc -O2 -no-pie -DLINUX_TEST -I../include -I../src patch_journal.c -o patch_journal -lpthread
+
+usage: patch_journal [-n appends] [-s sites] [-c cuts] [size | patch.o ...]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "iotpatch.c"
+#include "ebpf_allocator.c"
+
+#define FLASH_T_WRITE_US 41.0 // per 32 bit word
+#define FLASH_T_ERASE_US 85000.0 // per page
+
+static long flash_words = 0, flash_pages = 0, reprogrammed = 0;
+static long cut_after = -1; // bytes programmed before the power goes, -1 never
+
+// no verifier on the host, the patches here have no vm
+void ebpf_verifier_release(struct ebpf_vm *vm) {
+}
+
+int flash_port_erase(uint32_t faddr, int size) {
+	memset((void *) (uintptr_t) faddr, 0xff, size);
+	flash_pages += (size + PATCH_JOURNAL_PAGE - 1) / PATCH_JOURNAL_PAGE;
+	return 0;
+}
+
+int flash_port_program(uint32_t faddr, const uint8_t *buf, int size) {
+	uint8_t *p = (uint8_t *) (uintptr_t) faddr;
+	for (int i = 0; i < size; i++) {
+		if (cut_after == 0) {
+			return -1;
+		}
+		cut_after -= cut_after > 0;
+		reprogrammed += p[i] != 0xff;
+		p[i] &= buf[i];
+	}
+	flash_words += (size + 3) / 4;
+	return 0;
+}
+
+// the object area (patch objects are loaded at restore), not counted
+int flash_port_write(uint32_t faddr, uint8_t *buf, int size) {
+	memcpy((void *) (uintptr_t) faddr, buf, size);
+	return 0;
+}
+
+static double flash_us(long words, long pages) {
+	return words * FLASH_T_WRITE_US + pages * FLASH_T_ERASE_US;
+}
+
+typedef struct journal_packet {
+	const char *name;
+	uint8_t *pkt;
+	uint32_t len;
+	bool restores; // false: a patch object that does not load
+} journal_packet;
+
+static journal_packet *pkts;
+static int npkts = 0;
+
+// fixed patch points, keyed by address as in the dispatch table
+static uint32_t site_key(int site) {
+	return 0x08001000 + site * 4;
+}
+
+// packet i as the patch of site: the key goes into the descriptor
+static const uint8_t *packet_for(int i, int site, uint32_t *len) {
+	journal_packet *p = &pkts[i % npkts];
+	patch_desc *desc = (patch_desc *) p->pkt;
+	desc->type = FixedPatchPoint;
+	desc->fixed_id = site_key(site);
+	*len = p->len;
+	return p->pkt;
+}
+
+// the patch system from scratch, as after a reset
+static void patch_sys_reset(void) {
+	destory_patch_context();
+	init_patch_sys();
+}
+
+typedef struct cut_expect {
+	uint32_t len;
+	uint8_t pkt[PATCH_FRAME_MAX];
+	bool valid;
+	bool restores;
+} cut_expect;
+
+static int restore_check(cut_expect *expect, int sites) {
+	int bad = 0;
+	for (int s = 0; s < sites; s++) {
+		auto_patch *patch = get_fixed_patch_by_lr(site_key(s));
+		if (!expect[s].valid || !expect[s].restores) {
+			bad += patch != NULL;
+			continue;
+		}
+		const patch_desc *want = (const patch_desc *) expect[s].pkt;
+		if (patch == NULL || !patch_is_object(want)) {
+			bad += patch == NULL || memcmp(patch->desc, expect[s].pkt, expect[s].len) != 0;
+			continue;
+		}
+		// a patch object runs from the object area
+		uint32_t entry = (uint32_t) (uintptr_t) patch->desc->func;
+		bad += patch->desc->fixed_id != want->fixed_id || entry < PATCH_ELF_BASE || entry >= PATCH_ELF_BASE + PATCH_ELF_SIZE;
+	}
+	return bad;
+}
+
+int main(int argc, char **argv) {
+	int appends = 200, sites = 16, cuts = 200;
+	uint32_t size = 512;
+	pkts = calloc(argc + 1, sizeof(journal_packet));
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			appends = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			sites = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			cuts = atoi(argv[++i]);
+		} else if (argv[i][0] >= '0' && argv[i][0] <= '9') {
+			size = atoi(argv[i]);
+		} else {
+			pkts[npkts++].name = argv[i];
+		}
+	}
+	if (sites > PATCH_JOURNAL_MAX_LIVE) {
+		sites = PATCH_JOURNAL_MAX_LIVE;
+	}
+	for (int i = 0; i < (npkts > 0 ? npkts : 1); i++) {
+		journal_packet *p = &pkts[i];
+		uint32_t obj_len = size;
+		FILE *f = NULL;
+		if (npkts > 0) {
+			if ((f = fopen(p->name, "rb")) == NULL) {
+				fprintf(stderr, "patch_journal: cannot read %s\n", p->name);
+				return 1;
+			}
+			fseek(f, 0, SEEK_END);
+			obj_len = ftell(f);
+			fseek(f, 0, SEEK_SET);
+		}
+		p->len = sizeof(patch_desc) + obj_len;
+		p->pkt = calloc(1, p->len);
+		if (f != NULL) {
+			fread(p->pkt + sizeof(patch_desc), 1, obj_len, f);
+			fclose(f);
+		} else {
+			for (uint32_t k = 0; k < obj_len; k++) {
+				p->pkt[sizeof(patch_desc) + k] = k * 31;
+			}
+		}
+		((patch_desc *) p->pkt)->code_len = obj_len;
+	}
+	npkts = npkts > 0 ? npkts : 1;
+	if (mmap((void *) PATCH_JOURNAL_BASE, 2 * PATCH_JOURNAL_BANK, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *) PATCH_JOURNAL_BASE) {
+		perror("patch_journal: journal banks");
+		return 1;
+	}
+	if (mmap((void *) PATCH_ELF_BASE, PATCH_ELF_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *) PATCH_ELF_BASE) {
+		perror("patch_journal: object area");
+		return 1;
+	}
+	// the patch system logs every call, the results go to the original stdout
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+	freopen("/dev/null", "w", stdout);
+	for (int i = 0; i < npkts; i++) {
+		patch_desc *desc = (patch_desc *) pkts[i].pkt, *loaded = NULL;
+		pkts[i].restores = !patch_is_object(desc) || (loaded = object_setup(desc)) != NULL;
+		ebpf_free(loaded);
+	}
+	object_next = PATCH_ELF_BASE;
+
+	// append
+	patch_journal_format();
+	patch_journal_mount();
+	double host = 0, worst = 0;
+	long words0 = flash_words, pages0 = flash_pages;
+	double worst_flash = 0;
+	uint64_t bytes = 0;
+	int fails = 0;
+	for (int i = 0; i < appends; i++) {
+		uint32_t len;
+		const uint8_t *pkt = packet_for(i, i % sites, &len);
+		long w = flash_words, pg = flash_pages;
+		double t = now_sec();
+		fails += patch_journal_append(pkt, len, FixedPatchPoint, site_key(i % sites)) != 0;
+		t = now_sec() - t;
+		host += t;
+		worst = t > worst ? t : worst;
+		double f = flash_us(flash_words - w, flash_pages - pg);
+		worst_flash = f > worst_flash ? f : worst_flash;
+		bytes += len;
+	}
+	const patch_journal *j = patch_journal_state();
+	fprintf(out, "append: %d records (%.0f bytes avg) to %d patch points, %.2f us host (worst %.2f), flash %.0f us avg "
+		"(worst %.0f), %u compactions, %d failed\n", appends, (double) bytes / appends, sites, host * 1e6 / appends,
+		worst * 1e6, flash_us(flash_words - words0, flash_pages - pages0) / appends, worst_flash, j->gen - 1, fails);
+	words0 = flash_words;
+	pages0 = flash_pages;
+	double t = now_sec();
+	bool compacted = patch_journal_compact() == 0;
+	fprintf(out, "compaction: %d live patches, %.2f us host, flash %.0f us%s\n", j->num, (now_sec() - t) * 1e6,
+		flash_us(flash_words - words0, flash_pages - pages0), compacted ? "" : " FAILED");
+
+	// restore: mount and one publish, against one publish per patch
+	const int reps = 100;
+	double mount = 0, bulk = 0, single = 0;
+	int restored = 0;
+	for (int r = 0; r < reps; r++) {
+		patch_sys_reset();
+		t = now_sec();
+		patch_journal_mount();
+		mount += now_sec() - t;
+		t = now_sec();
+		load_patch_list_from_flash();
+		bulk += now_sec() - t;
+		restored = pctx.fpatch_rcu.cur->version;
+	}
+	for (int r = 0; r < reps; r++) {
+		patch_sys_reset();
+		patch_restore rs = {0};
+		object_next = PATCH_ELF_BASE; // as at boot
+		t = now_sec();
+		patch_journal_replay(restore_patch, &rs);
+		for (int i = 0; i < rs.num; i++) {
+			active_patch(rs.patches[i]);
+		}
+		single += now_sec() - t;
+	}
+	fprintf(out, "restore: %d patches, mount %.2f us, %.2f us per patch with one publish (%d), %.2f us per patch "
+		"activated one by one\n", j->num, mount * 1e6 / reps, bulk * 1e6 / reps / j->num, restored,
+		single * 1e6 / reps / j->num);
+
+	// cut: a reset at a random point of an append or a compaction
+	static cut_expect expect[PATCH_JOURNAL_MAX_LIVE];
+	unsigned seed = 1;
+	int bad = 0, lost = 0, refused = 0;
+	for (int c = 0; c < cuts; c++) {
+		patch_journal_format();
+		patch_journal_mount();
+		memset(expect, 0, sizeof(expect));
+		int n = 1 + rand_r(&seed) % appends;
+		for (int i = 0; i < n; i++) {
+			uint32_t len;
+			const uint8_t *pkt = packet_for(i, i % sites, &len);
+			if (i == n - 1) {
+				cut_after = rand_r(&seed) % (len + 2 * sizeof(journal_rec));
+			}
+			if (patch_journal_append(pkt, len, FixedPatchPoint, site_key(i % sites)) == 0) {
+				memcpy(expect[i % sites].pkt, pkt, len);
+				expect[i % sites].len = len;
+				expect[i % sites].valid = true;
+				expect[i % sites].restores = pkts[i % npkts].restores;
+			} else {
+				lost++;
+			}
+		}
+		cut_after = -1;
+		patch_sys_reset();
+		patch_journal_mount();
+		load_patch_list_from_flash();
+		bad += restore_check(expect, sites);
+		// the next append after a cut still works, the dirty tail is compacted away
+		uint32_t len;
+		const uint8_t *pkt = packet_for(0, 0, &len);
+		refused += patch_journal_append(pkt, len, FixedPatchPoint, site_key(0)) != 0;
+	}
+	fprintf(out, "cut: %d resets, %d appends failed, %d patches wrong after restore, %d appends after it refused, "
+		"%ld bytes programmed twice\n", cuts, lost, bad, refused, reprogrammed);
+	fclose(out);
+	return 0;
+}
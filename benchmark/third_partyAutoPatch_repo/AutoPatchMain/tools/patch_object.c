@@ -0,0 +1,259 @@
+/*
+Patch object loader (patch_elf.c) on the host. The objects given
+(src/LocalPatches/Hotpatch_CVE_<id>.o) are loaded rounds times from memory,
+as from a staged packet, to a mapping at PATCH_ELF_BASE for the flash object
+area, and to a mapping in the SRAM range of a Cortex-M for the RAM placement
+(its calls to the firmware are out of BL range, they go through veneers). The firmware
+symbols are patch_elf_firmware, with the addresses of an image.
+
+Per object: its size, the bytes loaded, relocations, firmware symbols
+resolved, the load time and throughput (object bytes per second), the share
+of the load spent resolving firmware symbols (reading the symbol and its
+name, the table lookup), then the load time and veneers of the RAM placement. Every relocated field is checked
+against the symbol it names, decoded from the loaded code (BL target and
+veneer, MOVW/MOVT immediate, word). Last the cost of one lookup in the
+firmware table, binary search against a linear scan.
+
+build:
+	gcc -O2 -DLINUX_TEST -I../include -I../src patch_object.c -o patch_object
+
+usage: patch_object [-r rounds] patch.o ...
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "patch_elf.c"
+#include "utils.c"
+
+#define RAM_BASE 0x20010000 // code region of the RAM placement, data after it
+#define RAM_SIZE 0x10000
+
+static long flash_bytes = 0;
+
+// the object area is a plain mapping, the erases are not modelled here
+int flash_port_write(uint32_t faddr, uint8_t *buf, int size) {
+	if (faddr < PATCH_ELF_BASE || faddr + size > PATCH_ELF_BASE + PATCH_ELF_SIZE) {
+		return -1;
+	}
+	memcpy((void *) (uintptr_t) faddr, buf, size);
+	flash_bytes += size;
+	return 0;
+}
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int mem_read(void *user, uint32_t off, void *buf, uint32_t len) {
+	memcpy(buf, (const uint8_t *) user + off, len);
+	return 0;
+}
+
+static uint32_t linear_lookup(const char *name) {
+	for (int i = 0; i < patch_elf_firmware_num; i++) {
+		if (strcmp(name, patch_elf_firmware[i].name) == 0) {
+			return patch_elf_firmware[i].addr;
+		}
+	}
+	return 0;
+}
+
+static uint32_t rd32(uint32_t addr) {
+	uint32_t w;
+	memcpy(&w, (const void *) (uintptr_t) addr, 4);
+	return w;
+}
+
+/*
+The relocations of the loaded sections, from the whole object in memory,
+against the loaded code. Returns the fields that do not hold their symbol.
+*/
+static int check_object(patch_elf *elf, const uint8_t *obj) {
+	const elf32_ehdr *eh = (const elf32_ehdr *) obj;
+	const elf32_shdr *sh = (const elf32_shdr *) (obj + eh->shoff);
+	const elf32_sym *syms = (const elf32_sym *) (obj + elf->sym_off);
+	const char *strs = (const char *) (obj + elf->str_off);
+	int bad = 0;
+	for (int i = 1; i < eh->shnum; i++) {
+		if (sh[i].type != ELF_SHT_REL || elf->sec_addr[sh[i].info] == 0) {
+			continue;
+		}
+		const elf32_shdr *target = &sh[sh[i].info];
+		const elf32_rel *rel = (const elf32_rel *) (obj + sh[i].offset);
+		for (uint32_t k = 0; k < sh[i].size / sizeof(elf32_rel); k++) {
+			uint32_t type = rel[k].info & 0xff;
+			const elf32_sym *sym = &syms[rel[k].info >> 8];
+			uint32_t s = sym->shndx == ELF_SHN_UNDEF ? linear_lookup(strs + sym->name)
+				: elf->sec_addr[sym->shndx] + sym->value;
+			uint32_t p = elf->sec_addr[sh[i].info] + rel[k].offset, orig, now = rd32(p);
+			memcpy(&orig, obj + target->offset + rel[k].offset, 4);
+			uint16_t ohi = orig & 0xffff, olo = orig >> 16, hi = now & 0xffff, lo = now >> 16;
+			if (type == R_ARM_ABS32) {
+				bad += now != s + orig;
+			} else if (type == R_ARM_THM_CALL) {
+				uint32_t want = (s & ~1u) + thumb_branch_get(ohi, olo) + 4;
+				uint32_t to = p + 4 + thumb_branch_get(hi, lo);
+				bool veneer = to >= elf->veneer_base && to < elf->veneer_base + elf->veneers * PATCH_ELF_VENEER
+					&& rd32(to) == 0xf000f8df && rd32(to + 4) == (want | 1);
+				bad += to != want && !veneer;
+			} else if (type == R_ARM_THM_MOVW_ABS_NC || type == R_ARM_THM_MOVT_ABS) {
+				uint32_t v = s + (int16_t) thumb_mov_get(ohi, olo);
+				bad += thumb_mov_get(hi, lo) != (type == R_ARM_THM_MOVT_ABS ? v >> 16 : v & 0xffff);
+			} else if (type != R_ARM_NONE) {
+				bad++;
+			}
+		}
+	}
+	return bad;
+}
+
+// every firmware symbol resolution of the relocations, as the load does them
+static int resolve_all(patch_elf *elf, const uint8_t *obj) {
+	const elf32_ehdr *eh = (const elf32_ehdr *) obj;
+	const elf32_shdr *sh = (const elf32_shdr *) (obj + eh->shoff);
+	const elf32_sym *syms = (const elf32_sym *) (obj + elf->sym_off);
+	int n = 0;
+	uint32_t s;
+	for (int i = 1; i < eh->shnum; i++) {
+		if (sh[i].type != ELF_SHT_REL || elf->sec_addr[sh[i].info] == 0) {
+			continue;
+		}
+		const elf32_rel *rel = (const elf32_rel *) (obj + sh[i].offset);
+		for (uint32_t k = 0; k < sh[i].size / sizeof(elf32_rel); k++) {
+			if ((rel[k].info & 0xff) != R_ARM_NONE && syms[rel[k].info >> 8].shndx == ELF_SHN_UNDEF) {
+				n += elf_symbol(elf, rel[k].info >> 8, &s) == 0;
+			}
+		}
+	}
+	return n;
+}
+
+static uint8_t *read_file(const char *name, uint32_t *len) {
+	FILE *f = fopen(name, "rb");
+	if (f == NULL) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *buf = malloc(*len);
+	if (fread(buf, 1, *len, f) != *len) {
+		free(buf);
+		buf = NULL;
+	}
+	fclose(f);
+	return buf;
+}
+
+int main(int argc, char **argv) {
+	int rounds = 2000;
+	const char *names[256];
+	int nnames = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			rounds = atoi(argv[++i]);
+		} else if (nnames < 256) {
+			names[nnames++] = argv[i];
+		}
+	}
+	if (nnames == 0) {
+		fprintf(stderr, "usage: patch_object [-r rounds] patch.o ...\n");
+		return 1;
+	}
+	for (int i = 1; i < patch_elf_firmware_num; i++) {
+		if (strcmp(patch_elf_firmware[i - 1].name, patch_elf_firmware[i].name) >= 0) {
+			fprintf(stderr, "patch_object: firmware table not sorted at %s\n", patch_elf_firmware[i].name);
+			return 1;
+		}
+	}
+	if (mmap((void *) PATCH_ELF_BASE, PATCH_ELF_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *) PATCH_ELF_BASE
+		|| mmap((void *) RAM_BASE, RAM_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *) RAM_BASE) {
+		perror("patch_object: object area");
+		return 1;
+	}
+	static patch_elf elf;
+	printf("loader context %zu bytes, %d rounds\n", sizeof(patch_elf), rounds);
+	printf("%-36s %6s %6s %6s %4s %9s %8s %8s %8s %7s %5s\n", "object", "bytes", "loaded", "relocs", "syms",
+		"flash us", "MB/s", "resolve", "RAM us", "veneers", "wrong");
+	double all_t = 0, all_resolve = 0;
+	long all_bytes = 0;
+	int all_bad = 0, failed = 0;
+	for (int o = 0; o < nnames; o++) {
+		uint32_t len;
+		uint8_t *obj = read_file(names[o], &len);
+		if (obj == NULL) {
+			fprintf(stderr, "patch_object: cannot read %s\n", names[o]);
+			return 1;
+		}
+		const char *base = strrchr(names[o], '/') != NULL ? strrchr(names[o], '/') + 1 : names[o];
+		patch_elf_region flash = {PATCH_ELF_BASE, PATCH_ELF_SIZE, true};
+		patch_elf_region ram = {RAM_BASE, RAM_SIZE / 2, false};
+		patch_elf_region data = {RAM_BASE + RAM_SIZE / 2, RAM_SIZE / 2, false};
+		uint32_t entry = 0;
+		long fb = flash_bytes;
+		double t = now_sec();
+		for (int r = 0; r < rounds; r++) {
+			entry = patch_elf_open(&elf, mem_read, obj, len) == 0
+				? patch_elf_load(&elf, &flash, &data, patch_elf_firmware, patch_elf_firmware_num) : 0;
+		}
+		double flash_t = (now_sec() - t) / rounds;
+		if (entry == 0) {
+			printf("%-36s %6u not loaded\n", base, len); // no code, or a symbol not in the firmware
+			failed++;
+			free(obj);
+			continue;
+		}
+		long loaded = (flash_bytes - fb) / rounds;
+		uint32_t relocs = elf.relocs, lookups = elf.lookups;
+		int bad = check_object(&elf, obj);
+
+		// the resolutions alone, repeated enough to be timed
+		int n = 0;
+		t = now_sec();
+		for (int r = 0; r < rounds; r++) {
+			n = resolve_all(&elf, obj);
+		}
+		double resolve_t = (now_sec() - t) / rounds;
+
+		t = now_sec();
+		for (int r = 0; r < rounds; r++) {
+			entry = patch_elf_open(&elf, mem_read, obj, len) == 0
+				? patch_elf_load(&elf, &ram, &data, patch_elf_firmware, patch_elf_firmware_num) : 0;
+		}
+		double ram_t = (now_sec() - t) / rounds;
+		bad += entry == 0 ? 1 : check_object(&elf, obj);
+		printf("%-36s %6u %6ld %6u %4u %9.2f %8.1f %7.1f%% %8.2f %7u %5d\n", base, len, loaded, relocs, lookups,
+			flash_t * 1e6, len / flash_t / 1e6, n > 0 ? resolve_t * 100 / flash_t : 0.0, ram_t * 1e6,
+			elf.calls_veneered, bad);
+		all_t += flash_t;
+		all_resolve += resolve_t;
+		all_bytes += len;
+		all_bad += bad;
+		free(obj);
+	}
+	printf("%d objects (%d not loaded), %ld bytes: %.1f MB/s, %.1f%% of the load resolving firmware symbols, "
+		"%d fields wrong\n", nnames, failed, all_bytes, all_bytes / all_t / 1e6, all_resolve * 100 / all_t, all_bad);
+
+	// one lookup, every name of the table in turn
+	const int reps = 200000;
+	volatile uint32_t sink = 0;
+	double t = now_sec();
+	for (int r = 0; r < reps; r++) {
+		sink += patch_elf_lookup(patch_elf_firmware, patch_elf_firmware_num,
+			patch_elf_firmware[r % patch_elf_firmware_num].name);
+	}
+	double bin = (now_sec() - t) / reps;
+	t = now_sec();
+	for (int r = 0; r < reps; r++) {
+		sink += linear_lookup(patch_elf_firmware[r % patch_elf_firmware_num].name);
+	}
+	double lin = (now_sec() - t) / reps;
+	printf("lookup in %d firmware symbols: binary %.1f ns, linear %.1f ns\n", patch_elf_firmware_num, bin * 1e9,
+		lin * 1e9);
+	return all_bad != 0;
+}
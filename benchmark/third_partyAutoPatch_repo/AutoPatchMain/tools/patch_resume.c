@@ -0,0 +1,413 @@
+/*
+Patch resume: delivery of resumable transfers (XFER_BEGIN / CHUNK / END of
+patch_service.h) over a lossy link, on the host. Three parts in one process:
+
+	device  the patch service, connects to SERVER_PORT, and again when the
+	        connection is lost; the transfer area is a mapping at its flash
+	        address, programming checks each byte is programmed once
+	proxy   listens on SERVER_PORT, relays to the feeder on RESUME_PORT. Towards
+	        the device it drops CHUNK frames with probability loss and cuts
+	        the connection with probability cut per frame, in the middle of it
+	feeder  sends each packet (a patch_desc then the object, or a synthetic
+	        one) in chunks, then END, and resends what the bitmap of the
+	        answer misses until the device has the packet
+
+With -R the feeder does what a transfer without the bitmap would do: a lost
+connection starts the packet over under a new id, and a missing chunk means
+the whole packet is sent again.
+
+build:
+	gcc -O2 -DLINUX_TEST -I../include -I../src patch_resume.c -o patch_resume -lpthread
+
+usage: patch_resume [-R] [-l loss] [-d cut] [-s chunk_size] [-r rounds] [size count | patch.o ...]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <netinet/tcp.h>
+#include "patch_service.c"
+#include "ebpf_allocator.c"
+#include "utils.c"
+
+#define RESUME_PORT (SERVER_PORT + 2)
+
+static int loaded = 0;
+static int reprogrammed = 0; // bytes programmed twice without an erase
+static volatile bool device_stop = false;
+static double loss = 0.0, cut = 0.0;
+static int dropped = 0, cuts = 0;
+
+void init_patch_sys(void) {
+}
+
+void save_patch_list_to_flash() {
+}
+
+void notify_new_patch(const struct patch_desc *desc) {
+	loaded++;
+}
+
+int notify_new_bundle(const uint8_t *bundle, uint32_t len) {
+	notify_new_patch((const struct patch_desc *) bundle);
+	return 1;
+}
+
+int flash_port_erase(uint32_t faddr, int size) {
+	memset((void *) (uintptr_t) faddr, 0xff, size);
+	return 0;
+}
+
+// NOR: bits only go from 1 to 0
+int flash_port_program(uint32_t faddr, const uint8_t *buf, int size) {
+	uint8_t *p = (uint8_t *) (uintptr_t) faddr;
+	for (int i = 0; i < size; i++) {
+		reprogrammed += p[i] != 0xff;
+		p[i] &= buf[i];
+	}
+	return 0;
+}
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int listen_on(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_aton(SERVER_ADDR, &addr.sin_addr);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+	for (size_t got = 0; got < len;) {
+		ssize_t n = recv(fd, (uint8_t *) buf + got, len - got, 0);
+		if (n <= 0) {
+			return -1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+	return send(fd, buf, len, MSG_NOSIGNAL) == (ssize_t) len ? 0 : -1;
+}
+
+// the device reconnects until the feeder says EXIT
+static void *device_task(void *args) {
+	svr.setup_connect = linux_setup_connect;
+	svr.receive_buf = linux_receive_buf;
+	svr.send_buf = linux_send_buf;
+	svr.dis_connect = linux_dis_connect;
+	while (!device_stop) {
+		if (!svr.setup_connect(&svr_ctx)) {
+			usleep(1000);
+			continue;
+		}
+		wait_for_patch();
+	}
+	return NULL;
+}
+
+// one device connection, relayed to a new feeder connection. Frames are
+// forwarded one by one, no Nagle delay on the small ones
+static void proxy_session(int dev, unsigned *seed) {
+	int feed = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(dev, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	setsockopt(feed, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(RESUME_PORT);
+	inet_aton(SERVER_ADDR, &addr.sin_addr);
+	if (connect(feed, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		close(feed);
+		return;
+	}
+	static uint8_t frame[sizeof(frame_header) + PATCH_FRAME_MAX];
+	uint32_t have = 0;
+	struct pollfd pfd[2] = {{dev, POLLIN, 0}, {feed, POLLIN, 0}};
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			break;
+		}
+		if (pfd[0].revents) {
+			uint8_t buf[256];
+			ssize_t n = recv(dev, buf, sizeof(buf), 0);
+			if (n <= 0 || send_all(feed, buf, n) != 0) {
+				break;
+			}
+		}
+		if (!pfd[1].revents) {
+			continue;
+		}
+		ssize_t n = recv(feed, frame + have, sizeof(frame) - have, 0);
+		if (n <= 0) {
+			break;
+		}
+		have += n;
+		// forward whole frames, each may be dropped or cut
+		uint32_t at = 0;
+		bool lost = false;
+		while (have - at >= sizeof(frame_header)) {
+			frame_header *hdr = (frame_header *) (frame + at);
+			uint32_t len = sizeof(frame_header) + hdr->len;
+			if (hdr->len > PATCH_FRAME_MAX) {
+				lost = true;
+				break;
+			}
+			if (have - at < len) {
+				break;
+			}
+			if (rand_r(seed) < cut * RAND_MAX) {
+				send_all(dev, frame + at, rand_r(seed) % len);
+				cuts++;
+				lost = true;
+				break;
+			}
+			if (hdr->cmd == FRAME_XFER_CHUNK && rand_r(seed) < loss * RAND_MAX) {
+				dropped++;
+			} else if (send_all(dev, frame + at, len) != 0) {
+				lost = true;
+				break;
+			}
+			at += len;
+		}
+		if (lost) {
+			break;
+		}
+		memmove(frame, frame + at, have - at);
+		have -= at;
+	}
+	close(feed);
+}
+
+static void *proxy_task(void *args) {
+	int lfd = *(int *) args;
+	unsigned seed = 1;
+	for (;;) {
+		int dev = accept(lfd, NULL, NULL);
+		if (dev < 0) {
+			break;
+		}
+		proxy_session(dev, &seed);
+		close(dev);
+	}
+	return NULL;
+}
+
+typedef struct resume_packet {
+	const char *name;
+	uint8_t *pkt;
+	uint32_t len;
+	uint8_t sign[PATCH_SIGN_LEN];
+} resume_packet;
+
+typedef struct feeder {
+	int lfd;
+	int fd; // -1 until the proxy connects
+	uint16_t seq;
+	uint32_t next_id;
+	int reconnects;
+	uint64_t sent; // chunk payload bytes
+	bool restart; // -R
+} feeder;
+
+static int feeder_send(feeder *f, uint8_t cmd, const void *head, uint32_t head_len, const void *data, uint32_t len) {
+	frame_header hdr = {PATCH_FRAME_MAGIC, cmd, f->seq++, head_len + len};
+	if (send(f->fd, &hdr, sizeof(hdr), MSG_MORE | MSG_NOSIGNAL) != sizeof(hdr)) {
+		return -1;
+	}
+	if (head_len > 0 && send(f->fd, head, head_len, (len > 0 ? MSG_MORE : 0) | MSG_NOSIGNAL) != (ssize_t) head_len) {
+		return -1;
+	}
+	return len == 0 ? 0 : send_all(f->fd, data, len);
+}
+
+static int feeder_state(feeder *f, xfer_state *st) {
+	frame_header hdr;
+	if (recv_all(f->fd, &hdr, sizeof(hdr)) != 0 || hdr.magic != PATCH_FRAME_MAGIC
+		|| hdr.cmd != FRAME_XFER_STATE || hdr.len != sizeof(*st)) {
+		return -1;
+	}
+	return recv_all(f->fd, st, sizeof(*st));
+}
+
+/*
+BEGIN, the chunks the device does not have, END, until END is answered with
+ACK_OK. A lost connection waits for the next one and begins again.
+return: ack status, ACK_OK the device loaded the packet
+*/
+static int feeder_transfer(feeder *f, const resume_packet *p, uint16_t chunk_size) {
+	xfer_begin begin = {f->next_id++, p->len, chunk_size};
+	memcpy(begin.sign, p->sign, PATCH_SIGN_LEN);
+	uint32_t chunks = (p->len + chunk_size - 1) / chunk_size;
+	for (;;) {
+		if (f->fd < 0) {
+			f->fd = accept(f->lfd, NULL, NULL);
+			if (f->fd < 0) {
+				return ACK_NO_MEM;
+			}
+			int on = 1;
+			setsockopt(f->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}
+		xfer_state st;
+		if (feeder_send(f, FRAME_XFER_BEGIN, &begin, sizeof(begin), NULL, 0) != 0 || feeder_state(f, &st) != 0) {
+			goto lost;
+		}
+		if (st.status != ACK_OK) {
+			return st.status;
+		}
+		for (;;) {
+			for (uint32_t i = 0; i < chunks; i++) {
+				if (!f->restart && (st.bitmap[i / 8] & (1 << (i % 8)))) {
+					continue;
+				}
+				xfer_chunk_head head = {begin.id, i, 0};
+				uint32_t off = i * chunk_size;
+				uint32_t n = p->len - off < chunk_size ? p->len - off : chunk_size;
+				if (feeder_send(f, FRAME_XFER_CHUNK, &head, sizeof(head), p->pkt + off, n) != 0) {
+					goto lost;
+				}
+				f->sent += n;
+			}
+			if (feeder_send(f, FRAME_XFER_END, &begin.id, sizeof(begin.id), NULL, 0) != 0 || feeder_state(f, &st) != 0) {
+				goto lost;
+			}
+			if (st.status != ACK_PENDING) {
+				return st.status;
+			}
+		}
+lost:
+		close(f->fd);
+		f->fd = -1;
+		f->reconnects++;
+		if (f->restart) {
+			begin.id = f->next_id++; // the device erases what it has
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	uint32_t size = 1024;
+	int count = 1000, num = 0, rounds = 20, files = 0;
+	uint16_t chunk_size = 128;
+	feeder f = {0};
+	resume_packet *pkts = calloc(argc, sizeof(resume_packet));
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-R") == 0) {
+			f.restart = true;
+		} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			loss = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+			cut = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			chunk_size = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			rounds = atoi(argv[++i]);
+		} else if (argv[i][0] >= '0' && argv[i][0] <= '9') {
+			if (num++ == 0) {
+				size = atoi(argv[i]);
+			} else {
+				count = atoi(argv[i]);
+			}
+		} else {
+			pkts[files++].name = argv[i];
+		}
+	}
+	if (mmap((void *) PATCH_STAGE_BASE, PATCH_STAGE_SIZE + PATCH_XFER_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *) PATCH_STAGE_BASE) {
+		perror("patch_resume: staging area");
+		return 1;
+	}
+	memset((void *) PATCH_STAGE_BASE, 0xff, PATCH_STAGE_SIZE + PATCH_XFER_SIZE);
+
+	uint64_t raw = 0;
+	for (int i = 0; i < (files > 0 ? files : 1); i++) {
+		uint32_t obj_len = size > sizeof(patch_desc) ? size - sizeof(patch_desc) : 0;
+		FILE *fp = files > 0 ? fopen(pkts[i].name, "rb") : NULL;
+		if (files > 0) {
+			if (fp == NULL) {
+				fprintf(stderr, "patch_resume: cannot read %s\n", pkts[i].name);
+				return 1;
+			}
+			fseek(fp, 0, SEEK_END);
+			obj_len = ftell(fp);
+			fseek(fp, 0, SEEK_SET);
+		}
+		resume_packet *p = &pkts[i];
+		p->len = sizeof(patch_desc) + obj_len;
+		p->pkt = calloc(1, p->len);
+		if (p->len > PATCH_FRAME_MAX - PATCH_SIGN_LEN
+			|| (fp != NULL && fread(p->pkt + sizeof(patch_desc), 1, obj_len, fp) != obj_len)) {
+			fprintf(stderr, "patch_resume: %s too large or unreadable\n", p->name);
+			return 1;
+		}
+		if (fp != NULL) {
+			fclose(fp);
+		} else {
+			for (uint32_t k = 0; k < obj_len; k++) {
+				p->pkt[sizeof(patch_desc) + k] = k * 31;
+			}
+		}
+		patch_desc *desc = (patch_desc *) p->pkt;
+		desc->type = FixedPatchPoint;
+		desc->code_len = obj_len;
+		patch_verify_sign(PATCH_VERIFY_ALGO, p->pkt, p->len, p->sign);
+		raw += p->len;
+	}
+	if (files == 0) {
+		files = 1;
+		rounds = count;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	int plfd = listen_on(SERVER_PORT);
+	f.lfd = listen_on(RESUME_PORT);
+	if (plfd < 0 || f.lfd < 0) {
+		perror("patch_resume: listen");
+		return 1;
+	}
+	f.fd = -1;
+	f.next_id = 1;
+	pthread_t proxy, device;
+	pthread_create(&proxy, NULL, proxy_task, &plfd);
+	pthread_create(&device, NULL, device_task, NULL);
+
+	double start = now_sec(), worst = 0;
+	int failed = 0;
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < files; i++) {
+			double t = now_sec();
+			if (feeder_transfer(&f, &pkts[i], chunk_size) != ACK_OK) {
+				failed++;
+			}
+			t = now_sec() - t;
+			worst = t > worst ? t : worst;
+		}
+	}
+	double sec = now_sec() - start;
+	device_stop = true;
+	feeder_send(&f, FRAME_EXIT, NULL, 0, NULL, 0);
+	pthread_join(device, NULL);
+
+	int transfers = rounds * files;
+	printf("%s, chunk %u, loss %.3f cut %.3f: %d packets (%lu bytes) in %.3f s, %.1f us per packet (worst %.1f), "
+		"sent %.2fx, %d chunks dropped, %d cuts, %d reconnects, loaded %d failed %d, %d bytes programmed twice\n",
+		f.restart ? "restart" : "resume", chunk_size, loss, cut, transfers, raw * rounds, sec, sec * 1e6 / transfers,
+		worst * 1e6, (double) f.sent / (raw * rounds), dropped, cuts, f.reconnects, loaded, failed, reprogrammed);
+	return 0;
+}
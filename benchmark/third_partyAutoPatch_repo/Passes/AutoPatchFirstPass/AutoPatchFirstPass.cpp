@@ -14,6 +14,10 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/IR/MDBuilder.h"
 #include <cxxabi.h>
 #include <iostream>
 #include <map>
@@ -62,6 +66,23 @@ cl::opt<std::string> FuncPatchName("func-patch-name",
   cl::value_desc("function name"),
   cl::init(""));
 
+// Dense site ids: every trampoline passes its id in r0 and is recorded in the
+// "autopatch_sites" section, so the runtime can dispatch with one indexed load.
+cl::opt<bool> EmitSiteIds("emit-site-ids",
+  cl::desc("Pass a dense site id to every trampoline and emit the site table"),
+  cl::init(false));
+
+cl::opt<unsigned> SiteIdBase("site-id-base",
+  cl::desc("First site id of this module (keeps ids unique across modules)"),
+  cl::value_desc("site id"),
+  cl::init(0));
+
+// Wrap every trampoline in `if (fixed_site_enable[id])`, so unpatched sites cost
+// a byte load and a branch. Needs -emit-site-ids for the index.
+cl::opt<bool> GuardSites("guard-sites",
+  cl::desc("Call the trampoline only when its per-site enable byte is set"),
+  cl::init(false));
+
 
 
 // Demangles the function name.
@@ -124,6 +145,8 @@ namespace {
 struct AutoPatchFirstPass : public ModulePass{
   
   int trampolineNum = 0;
+  std::vector<Constant *> siteTable; // {site_id, line, func} for -emit-site-ids
+  std::vector<std::pair<CallInst *, uint32_t>> guardedCalls; // <trampoline, site id> for -guard-sites
   //FunctionCallee hookFunc;
   //Function *hook;
   static char ID;
@@ -199,6 +222,13 @@ struct AutoPatchFirstPass : public ModulePass{
       string Result = "Number of inserted Trampolines: " + to_string(trampolineNum) + "\n";
       debug << Result;
 
+      if(EmitSiteIds){
+        if(GuardSites){
+          guardTrampolines(M);
+        }
+        emitSiteTable(M);
+      }
+
       #ifdef __DEBUG__
         errs() << debug.str();
       #endif
@@ -287,10 +317,7 @@ struct AutoPatchFirstPass : public ModulePass{
             //**//
 
             IRBuilder<> IRB(BB->getFirstNonPHI());
-            auto Fn = func->getParent()->getOrInsertFunction(
-                    "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext())); 
-            IRB.CreateCall(Fn);
-            trampolineNum++;
+            insertTrampoline(IRB, M);
           }else{
             for(BasicBlock::iterator BlI = BB->begin(), BE = BB->end(); BlI != BE; ++BlI)          
             {  
@@ -321,11 +348,8 @@ struct AutoPatchFirstPass : public ModulePass{
                 //**//
 
                 IRBuilder<> IRB(BB->getFirstNonPHI());
-                auto Fn = func->getParent()->getOrInsertFunction(
-                      "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext())); 
-                IRB.CreateCall(Fn);
+                insertTrampoline(IRB, M);
                 seeNested = true;
-                trampolineNum++;
               }
             }
           }
@@ -347,10 +371,7 @@ struct AutoPatchFirstPass : public ModulePass{
             //**//
             
             IRBuilder<> IRB(BB->getFirstNonPHI());
-            auto Fn = func->getParent()->getOrInsertFunction(
-                    "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext())); 
-            IRB.CreateCall(Fn);
-            trampolineNum++;
+            insertTrampoline(IRB, M);
 
           }
         }
@@ -411,10 +432,7 @@ struct AutoPatchFirstPass : public ModulePass{
           // debug<<"Inserted inside the nested loop.\n";
           auto *BB_Header = (*li)->getHeader();
           IRBuilder<> IRB(BB_Header->getFirstNonPHI());
-          auto Fn = func->getParent()->getOrInsertFunction(
-                    "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext())); 
-          IRB.CreateCall(Fn);
-          trampolineNum++;
+          insertTrampoline(IRB, M);
 
         }
 
@@ -423,10 +441,7 @@ struct AutoPatchFirstPass : public ModulePass{
           debug<<" Going forward and inserted inside the nested loops.\n";
           auto *BB_Header = Loop->getHeader();
           IRBuilder<> IRB(BB_Header->getFirstNonPHI());
-          auto Fn = func->getParent()->getOrInsertFunction(
-                    "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext())); 
-          IRB.CreateCall(Fn);
-          trampolineNum++;
+          insertTrampoline(IRB, M);
         }
         //***********//
 
@@ -434,10 +449,7 @@ struct AutoPatchFirstPass : public ModulePass{
         if((*li)->getUniqueExitBlock() != NULL){//One Exit Basic Block
           IRBuilder<> IRB((*li)->getUniqueExitBlock());
           IRB.SetInsertPoint(((*li)->getUniqueExitBlock())->getFirstNonPHI());
-          auto Fn = func->getParent()->getOrInsertFunction(
-                    "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-          IRB.CreateCall(Fn);
-          trampolineNum++;
+          insertTrampoline(IRB, M);
 
         }
 
@@ -462,10 +474,7 @@ struct AutoPatchFirstPass : public ModulePass{
                 IRBuilder<> IRB(tempBB);
                 //debug<<"The Instruction point: " << tempBB->getFirstNonPHI() << "\n" ;
                 IRB.SetInsertPoint(tempBB->getFirstNonPHI());
-                auto Fn = func->getParent()->getOrInsertFunction(
-                    "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-                IRB.CreateCall(Fn);
-                trampolineNum++;
+                insertTrampoline(IRB, M);
 
               }else{
                 // debug<<"This is not the new Successor" << "\n" ;
@@ -476,10 +485,7 @@ struct AutoPatchFirstPass : public ModulePass{
               IRBuilder<> IRB(Block);
               // debug<<"The Instruction point: " << Block->getFirstNonPHI() << "\n" ;
               IRB.SetInsertPoint(Block->getFirstNonPHI());
-              auto Fn = func->getParent()->getOrInsertFunction(
-                    "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-              IRB.CreateCall(Fn);
-              trampolineNum++;
+              insertTrampoline(IRB, M);
 
             }
           }
@@ -517,10 +523,7 @@ struct AutoPatchFirstPass : public ModulePass{
               IRBuilder<> IRB(BB_temp2);
               //debug<<"The Instruction point: " << *(BB_temp2->getFirstNonPHI()) << "\n" ;
               IRB.SetInsertPoint(BB_temp2->getFirstNonPHI());
-              auto Fn = func->getParent()->getOrInsertFunction(
-                        "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-              IRB.CreateCall(Fn);
-              trampolineNum++;
+              insertTrampoline(IRB, M);
 
 
 
@@ -533,10 +536,7 @@ struct AutoPatchFirstPass : public ModulePass{
               if((*li)->getUniqueExitBlock() != NULL){//One Exit Basic Block
               IRBuilder<> IRB((*li)->getUniqueExitBlock());
               IRB.SetInsertPoint(((*li)->getUniqueExitBlock())->getFirstNonPHI());
-              auto Fn = func->getParent()->getOrInsertFunction(
-                        "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-              IRB.CreateCall(Fn);
-              trampolineNum++;
+              insertTrampoline(IRB, M);
             }
 
               else if((*li)->hasNoExitBlocks()){ 
@@ -560,10 +560,7 @@ struct AutoPatchFirstPass : public ModulePass{
                       IRBuilder<> IRB(tempBB);
                       //debug<<"The Instruction point: " << tempBB->getFirstNonPHI() << "\n" ;
                       IRB.SetInsertPoint(tempBB->getFirstNonPHI());
-                      auto Fn = func->getParent()->getOrInsertFunction(
-                          "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-                      IRB.CreateCall(Fn);
-                      trampolineNum++;
+                      insertTrampoline(IRB, M);
                     }else{
                       // debug<<"This is not the new Successor" << "\n" ;
                       continue;
@@ -573,10 +570,7 @@ struct AutoPatchFirstPass : public ModulePass{
                     IRBuilder<> IRB(Block);
                     // debug<<"The Instruction point: " << Block->getFirstNonPHI() << "\n" ;
                     IRB.SetInsertPoint(Block->getFirstNonPHI());
-                    auto Fn = func->getParent()->getOrInsertFunction(
-                          "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-                    IRB.CreateCall(Fn);
-                    trampolineNum++;
+                    insertTrampoline(IRB, M);
 
                   }
                 }//End iterating on exit basic blocks
@@ -592,10 +586,7 @@ struct AutoPatchFirstPass : public ModulePass{
               IRBuilder<> IRB(BB_temp1);
               // debug<<"The Instruction point: " << *(BB_temp1->getFirstNonPHI()) << "\n" ;
               IRB.SetInsertPoint(BB_temp1->getFirstNonPHI());
-              auto Fn = func->getParent()->getOrInsertFunction(
-                        "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-              IRB.CreateCall(Fn);
-              trampolineNum++;
+              insertTrampoline(IRB, M);
 
 
 
@@ -608,10 +599,7 @@ struct AutoPatchFirstPass : public ModulePass{
               if((*li)->getUniqueExitBlock() != NULL){//One Exit Basic Block
               IRBuilder<> IRB((*li)->getUniqueExitBlock());
               IRB.SetInsertPoint(((*li)->getUniqueExitBlock())->getFirstNonPHI());
-              auto Fn = func->getParent()->getOrInsertFunction(
-                        "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-              IRB.CreateCall(Fn);
-              trampolineNum++;
+              insertTrampoline(IRB, M);
 
             }
 
@@ -636,10 +624,7 @@ struct AutoPatchFirstPass : public ModulePass{
                       IRBuilder<> IRB(tempBB);
                       //debug<<"The Instruction point: " << tempBB->getFirstNonPHI() << "\n" ;
                       IRB.SetInsertPoint(tempBB->getFirstNonPHI());
-                      auto Fn = func->getParent()->getOrInsertFunction(
-                          "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-                      IRB.CreateCall(Fn);
-                      trampolineNum++;
+                      insertTrampoline(IRB, M);
 
                     }else{
                       // debug<<"This is not the new Successor" << "\n" ;
@@ -650,10 +635,7 @@ struct AutoPatchFirstPass : public ModulePass{
                     IRBuilder<> IRB(Block);
                     // debug<<"The Instruction point: " << Block->getFirstNonPHI() << "\n" ;
                     IRB.SetInsertPoint(Block->getFirstNonPHI());
-                    auto Fn = func->getParent()->getOrInsertFunction(
-                          "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-                    IRB.CreateCall(Fn);
-                    trampolineNum++;
+                    insertTrampoline(IRB, M);
 
                   }
                 }//End iterating on exit basic blocks
@@ -696,10 +678,7 @@ struct AutoPatchFirstPass : public ModulePass{
             if(hasBranch){
               auto *BB_Header = (*li)->getHeader();
               IRBuilder<> IRB(BB_Header->getFirstNonPHI());
-              auto Fn = func->getParent()->getOrInsertFunction(
-                        "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext())); 
-              IRB.CreateCall(Fn);
-              trampolineNum++;
+              insertTrampoline(IRB, M);
             }
           }
         }
@@ -731,13 +710,96 @@ struct AutoPatchFirstPass : public ModulePass{
   }
 
 
+  // Insert one trampoline call at the current insert point of IRB.
+  void insertTrampoline(IRBuilder<> &IRB, Module &M){
+    LLVMContext &Ctx = M.getContext();
+    if(!EmitSiteIds){
+      auto Fn = M.getOrInsertFunction(
+                "TRAMPOLINE_FUNCTION", Type::getVoidTy(Ctx));
+      IRB.CreateCall(Fn);
+      trampolineNum++;
+      return;
+    }
+
+    // The site id is the first argument, so it arrives in r0 (AAPCS).
+    uint32_t siteId = SiteIdBase + trampolineNum;
+    auto Fn = M.getOrInsertFunction(
+              "TRAMPOLINE_FUNCTION", Type::getVoidTy(Ctx), Type::getInt32Ty(Ctx));
+    CallInst *CI = IRB.CreateCall(Fn, {IRB.getInt32(siteId)});
+    if(GuardSites){
+      guardedCalls.push_back({CI, siteId});
+    }
+
+    int line = -1;
+    BasicBlock *BB = IRB.GetInsertBlock();
+    if(IRB.GetInsertPoint() != BB->end()){
+      line = getSourceCodeLine(&*IRB.GetInsertPoint());
+    }
+    Function *F = BB->getParent();
+    siteTable.push_back(ConstantStruct::get(getSiteEntryType(Ctx), {
+        IRB.getInt32(siteId),
+        IRB.getInt32((uint32_t) line),
+        ConstantExpr::getPointerCast(F, Type::getInt8PtrTy(Ctx))}));
+    trampolineNum++;
+  }
+
+  // Done after all trampolines are placed, splitting blocks while the
+  // instrumentation walks them would invalidate its iterators.
+  void guardTrampolines(Module &M){
+    LLVMContext &Ctx = M.getContext();
+    Type *byteTy = Type::getInt8Ty(Ctx);
+    // defined by the runtime (iotpatch.c), sized MAX_FIXED_SITES
+    GlobalVariable *enable = M.getGlobalVariable("fixed_site_enable");
+    if(!enable){
+      enable = new GlobalVariable(M, ArrayType::get(byteTy, 0), false,
+                                  GlobalValue::ExternalLinkage, nullptr,
+                                  "fixed_site_enable");
+    }
+    MDNode *unlikely = MDBuilder(Ctx).createBranchWeights(1, 2000);
+    for(auto &site : guardedCalls){
+      CallInst *CI = site.first;
+      IRBuilder<> IRB(CI);
+      Value *ptr = IRB.CreateInBoundsGEP(enable->getValueType(), enable,
+                                         {IRB.getInt32(0), IRB.getInt32(site.second)});
+      // volatile: the byte is flipped at run time, it must not be hoisted out of loops
+      LoadInst *flag = IRB.CreateLoad(byteTy, ptr, true, "site.enable");
+      Value *cond = IRB.CreateICmpNE(flag, IRB.getInt8(0));
+      Instruction *thenTerm = SplitBlockAndInsertIfThen(cond, CI, false, unlikely);
+      CI->moveBefore(thenTerm);
+    }
+    debug << "Guarded trampolines: " << guardedCalls.size() << "\n";
+    guardedCalls.clear();
+  }
+
+  // Layout must match `autopatch_site` in fixed_patch_point_def.h.
+  StructType *getSiteEntryType(LLVMContext &Ctx){
+    return StructType::get(Type::getInt32Ty(Ctx), Type::getInt32Ty(Ctx),
+                           Type::getInt8PtrTy(Ctx));
+  }
+
+  // Emit all recorded sites into the "autopatch_sites" section. The name is a
+  // C identifier, so the linker provides __start_/__stop_autopatch_sites.
+  void emitSiteTable(Module &M){
+    if(siteTable.empty()){
+      return;
+    }
+    LLVMContext &Ctx = M.getContext();
+    ArrayType *tableTy = ArrayType::get(getSiteEntryType(Ctx), siteTable.size());
+    auto *table = new GlobalVariable(M, tableTy, true, GlobalValue::InternalLinkage,
+                                     ConstantArray::get(tableTy, siteTable),
+                                     "__autopatch_site_table");
+    table->setSection("autopatch_sites");
+    table->setAlignment(Align(4));
+    appendToUsed(M, {table});
+    debug << "Emitted site table: ids " << SiteIdBase << " - "
+          << (SiteIdBase + siteTable.size() - 1) << "\n";
+  }
+
+
   virtual bool runOnFunction(BasicBlock* BB_Entry, Module &M, Function *F){
     IRBuilder<> IRB(BB_Entry);
     IRB.SetInsertPointPastAllocas(F);
-    auto Fn = F->getParent()->getOrInsertFunction(
-                    "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-    IRB.CreateCall(Fn);
-    trampolineNum++;
+    insertTrampoline(IRB, M);
 
     return true;
   }
@@ -780,10 +842,7 @@ struct AutoPatchFirstPass : public ModulePass{
 
               IRBuilder<> IRB(ins->getParent());
               IRB.SetInsertPoint(ins->getNextNode());//Add trampoline after function call
-              auto Fn = ins->getFunction()->getParent()->getOrInsertFunction(
-                      "TRAMPOLINE_FUNCTION", Type::getVoidTy(M.getContext()));
-              IRB.CreateCall(Fn);
-              trampolineNum++;
+              insertTrampoline(IRB, M);
 
             }
           }